@@ -5,10 +5,13 @@
 #include <stdbool.h>
 
 #include <emmintrin.h>
+#include <wmmintrin.h> /* AES-NI intrinsics */
 
 #include "tables.h"
 #include "debug.h" 
 #include "aes.h"
+#include "misc.h" /* test_aesni_support */
+#include "kernels.h" /* aes_kernel_active */
 
 #define AESNI 1
 
@@ -135,31 +138,70 @@ void InvMixColumns(unsigned char *state) {
 	}
 }
 
+// Forces the per-key-size kernels below to be compiled as separate, fully unrolled copies of their templates
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+__attribute__((target("aes")))
+static ALWAYS_INLINE void aesni_encrypt_block(const unsigned char *plaintext, unsigned char *ciphertext, const unsigned char *keys, const int rounds) {
+	// Whitening, rounds-1 AESENC rounds and the final AESENCLAST round.
+	// rounds is a compile-time constant in each of the wrappers below, so the loop disappears.
+	__m128i state = _mm_xor_si128(_mm_loadu_si128((const __m128i *)plaintext), _mm_loadu_si128((const __m128i *)keys));
+
+	#pragma GCC unroll 14
+	for (int round = 1; round < rounds; round++) {
+		state = _mm_aesenc_si128(state, _mm_loadu_si128((const __m128i *)(keys + round*16)));
+	}
+
+	state = _mm_aesenclast_si128(state, _mm_loadu_si128((const __m128i *)(keys + rounds*16)));
+	_mm_storeu_si128((__m128i *)ciphertext, state);
+}
+
+__attribute__((target("aes")))
+static ALWAYS_INLINE void aesni_decrypt_block(const unsigned char *ciphertext, unsigned char *plaintext, const unsigned char *keys, const int rounds) {
+	// The keys must have been through aes_prepare_decryption_keys_len (AESDEC expects InvMixColumns'd round keys)
+	__m128i state = _mm_xor_si128(_mm_loadu_si128((const __m128i *)ciphertext), _mm_loadu_si128((const __m128i *)(keys + rounds*16)));
+
+	#pragma GCC unroll 14
+	for (int round = rounds - 1; round >= 1; round--) {
+		state = _mm_aesdec_si128(state, _mm_loadu_si128((const __m128i *)(keys + round*16)));
+	}
+
+	state = _mm_aesdeclast_si128(state, _mm_loadu_si128((const __m128i *)keys));
+	_mm_storeu_si128((__m128i *)plaintext, state);
+}
+
+__attribute__((target("aes")))
 void aes_encrypt_aesni(const unsigned char *plaintext, unsigned char *state, const unsigned char *keys) {
-	asm __volatile__ (
-			"movq %[keys], %%r15;"         // keep the pointer for easy pointer arithmetic
-			"movdqa %[plaintext], %%xmm0;" // load plaintext
-			"pxor (%%r15), %%xmm0;"        // perform whitening
+	aesni_encrypt_block(plaintext, state, keys, 10);
+}
 
-			"mov $1, %%ecx;"          // initialize round counter
-			"_encrypt_roundloop:"             
-			"addq $16, %%r15;"        // move the pointer to the next round key
-			"aesenc (%%r15), %%xmm0;" // perform AES round
-			"inc %%ecx;"
-			"cmp $10, %%ecx;"
-			"jl _encrypt_roundloop;" // for (i=1; i<10; i++)
+__attribute__((target("aes")))
+void aes_encrypt_aesni_192(const unsigned char *plaintext, unsigned char *state, const unsigned char *keys) {
+	aesni_encrypt_block(plaintext, state, keys, 12);
+}
 
-			"addq $16, %%r15;"            // move the pointer one last time
-			"aesenclast (%%r15), %%xmm0;" // perform the final AES round
-			"movdqa %%xmm0, %[state];"    // move the state back to the memory address
+__attribute__((target("aes")))
+void aes_encrypt_aesni_256(const unsigned char *plaintext, unsigned char *state, const unsigned char *keys) {
+	aesni_encrypt_block(plaintext, state, keys, 14);
+}
 
-			:[state] "=m"(*state)
-			:[plaintext] "m"(*plaintext), [keys] "m"(keys)
-			:"%xmm0", "memory", "%ecx", "cc", "%r15"
-			);
+__attribute__((target("aes")))
+void aes_decrypt_aesni(const unsigned char *ciphertext, unsigned char *state, const unsigned char *keys) {
+	aesni_decrypt_block(ciphertext, state, keys, 10);
 }
 
-void aes_encrypt_c(const unsigned char *plaintext, unsigned char *state, const unsigned char *keys) {
+__attribute__((target("aes")))
+void aes_decrypt_aesni_192(const unsigned char *ciphertext, unsigned char *state, const unsigned char *keys) {
+	aesni_decrypt_block(ciphertext, state, keys, 12);
+}
+
+__attribute__((target("aes")))
+void aes_decrypt_aesni_256(const unsigned char *ciphertext, unsigned char *state, const unsigned char *keys) {
+	aesni_decrypt_block(ciphertext, state, keys, 14);
+}
+
+static ALWAYS_INLINE void aes_encrypt_c_rounds(const unsigned char *plaintext, unsigned char *state, const unsigned char *keys, const int rounds) {
+	// Like aesni_encrypt_block, a template for the per-size wrappers below, which each unroll it for their rounds
 
 	// Initialize the state
 	memcpy(state, plaintext, 16);
@@ -168,7 +210,8 @@ void aes_encrypt_c(const unsigned char *plaintext, unsigned char *state, const u
 	AddRoundKey(state, keys /*+ 0 */);
 
 	// Rounds
-	for (int round = 1; round < 10; round++) {
+	#pragma GCC unroll 14
+	for (int round = 1; round < rounds; round++) {
 		SubBytes(state);
 		ShiftRows(state, 0 /* not inverse */);
 		MixColumns(state);
@@ -178,35 +221,22 @@ void aes_encrypt_c(const unsigned char *plaintext, unsigned char *state, const u
 	// Final round	
 	SubBytes(state);
 	ShiftRows(state, 0 /* not inverse */);
-	AddRoundKey(state, keys + 10*16);
+	AddRoundKey(state, keys + rounds*16);
 }
 
-void aes_decrypt_aesni(const unsigned char *ciphertext, unsigned char *state, const unsigned char *keys) {
-	   asm __volatile__ (
-            "movq %[keys], %%r15;"         // keep the pointer for easy pointer arithmetic
-			"addq $160, %%r15;"            // move the pointer to keys + 10*16
-            "movdqa %[plaintext], %%xmm0;" // load plaintext
-            "pxor (%%r15), %%xmm0;"        // perform whitening
-
-            "mov $9, %%ecx;"          // initialize round counter
-            "_decrypt_roundloop:"
-            "subq $16, %%r15;"        // move the pointer to the "next" round key
-            "aesdec (%%r15), %%xmm0;" // perform AES round
-            "dec %%ecx;"
-            "cmp $1, %%ecx;"
-            "jge _decrypt_roundloop;" // for (i=9; i >= 1; i--)
-
-            "subq $16, %%r15;"            // move the pointer one last time
-            "aesdeclast (%%r15), %%xmm0;" // perform the final AES round
-            "movdqa %%xmm0, %[state];"    // move the state back to the memory address
-
-            :[state] "=m"(*state)
-            :[plaintext] "m"(*ciphertext), [keys] "m"(keys)
-            :"%xmm0", "memory", "%ecx", "cc", "%r15"
-            );
+void aes_encrypt_c(const unsigned char *plaintext, unsigned char *state, const unsigned char *keys) {
+	aes_encrypt_c_rounds(plaintext, state, keys, 10);
 }
 
-void aes_decrypt_c(const unsigned char *ciphertext, unsigned char *state, const unsigned char *keys) {
+void aes_encrypt_c_192(const unsigned char *plaintext, unsigned char *state, const unsigned char *keys) {
+	aes_encrypt_c_rounds(plaintext, state, keys, 12);
+}
+
+void aes_encrypt_c_256(const unsigned char *plaintext, unsigned char *state, const unsigned char *keys) {
+	aes_encrypt_c_rounds(plaintext, state, keys, 14);
+}
+
+static ALWAYS_INLINE void aes_decrypt_c_rounds(const unsigned char *ciphertext, unsigned char *state, const unsigned char *keys, const int rounds) {
 	//
 	// This function implement the AES Equivalent Inverse cipher described in the AES specification.
 	//
@@ -215,10 +245,11 @@ void aes_decrypt_c(const unsigned char *ciphertext, unsigned char *state, const
 	memcpy(state, ciphertext, 16);
 
 	// Initial round
-	AddRoundKey(state, keys + 10*16);
+	AddRoundKey(state, keys + rounds*16);
 
 	// Rounds
-	for (int round = 9 /* Nr - 1 */; round >= 1; round--) {
+	#pragma GCC unroll 14
+	for (int round = rounds - 1 /* Nr - 1 */; round >= 1; round--) {
 		InvSubBytes(state);
 		InvShiftRows(state);
 		InvMixColumns(state);
@@ -230,3 +261,191 @@ void aes_decrypt_c(const unsigned char *ciphertext, unsigned char *state, const
 	InvShiftRows(state);
 	AddRoundKey(state, keys + 0);
 }
+
+void aes_decrypt_c(const unsigned char *ciphertext, unsigned char *state, const unsigned char *keys) {
+	aes_decrypt_c_rounds(ciphertext, state, keys, 10);
+}
+
+void aes_decrypt_c_192(const unsigned char *ciphertext, unsigned char *state, const unsigned char *keys) {
+	aes_decrypt_c_rounds(ciphertext, state, keys, 12);
+}
+
+void aes_decrypt_c_256(const unsigned char *ciphertext, unsigned char *state, const unsigned char *keys) {
+	aes_decrypt_c_rounds(ciphertext, state, keys, 14);
+}
+
+static int key_size_index(int key_len) {
+	// 0, 1, 2 for AES-128, -192, -256 (for indexing the kernel tables below); -1 for anything else
+	switch (key_len) {
+		case 16: return 0;
+		case 24: return 1;
+		case 32: return 2;
+		default: return -1;
+	}
+}
+
+aes_block_func aes_select_encrypt(int key_len) {
+	// AES-NI if we have it; otherwise the SSSE3 vector permute version, which needs no tables;
+	// the byte-at-a-time C version is the last resort.
+	static const aes_block_func aesni[3] = { aes_encrypt_aesni, aes_encrypt_aesni_192, aes_encrypt_aesni_256 };
+	static const aes_block_func vperm[3] = { aes_encrypt_vperm, aes_encrypt_vperm_192, aes_encrypt_vperm_256 };
+	static const aes_block_func c[3] = { aes_encrypt_c, aes_encrypt_c_192, aes_encrypt_c_256 };
+
+	int i = key_size_index(key_len);
+	if (i < 0)
+		return NULL;
+
+	if (test_aesni_support())
+		return aesni[i];
+	else if (test_ssse3_support())
+		return vperm[i];
+	else
+		return c[i];
+}
+
+aes_block_func aes_select_decrypt(int key_len) {
+	// Same order as aes_select_encrypt; all three expect keys prepared by aes_prepare_decryption_keys_len
+	static const aes_block_func aesni[3] = { aes_decrypt_aesni, aes_decrypt_aesni_192, aes_decrypt_aesni_256 };
+	static const aes_block_func vperm[3] = { aes_decrypt_vperm, aes_decrypt_vperm_192, aes_decrypt_vperm_256 };
+	static const aes_block_func c[3] = { aes_decrypt_c, aes_decrypt_c_192, aes_decrypt_c_256 };
+
+	int i = key_size_index(key_len);
+	if (i < 0)
+		return NULL;
+
+	if (test_aesni_support())
+		return aesni[i];
+	else if (test_ssse3_support())
+		return vperm[i];
+	else
+		return c[i];
+}
+
+aes_ctr_func aes_select_ctr(int key_len) {
+	// Whichever kernel the registry settled on at load time: by default the widest one the CPU supports
+	// (VAES, then the interleaved AES-NI kernel, then the constant-time bitsliced one), unless $AES_KERNEL says otherwise
+	int i = key_size_index(key_len);
+	if (i < 0)
+		return NULL;
+
+	return aes_kernel_active()->ctr[i];
+}
+
+void aes_ctr_c(const unsigned char *in, unsigned char *out, size_t blocks, uint64_t *counter, const unsigned char *keys) {
+	// CTR keystream + XOR for CPUs without AES-NI; one block at a time, since aes_encrypt_c
+	// is nowhere near fast enough for interleaving to matter.
+	// (AES-128 only; it's the reference the other kernels are tested against.)
+	unsigned char keystream[16];
+
+	for (size_t i = 0; i < blocks; i++) {
+		aes_encrypt_c((unsigned char *)counter, keystream, keys);
+		counter[1]++;
+		for (int j = 0; j < 16; j++) {
+			out[i*16 + j] = in[i*16 + j] ^ keystream[j];
+		}
+	}
+}
+
+__attribute__((target("aes")))
+static ALWAYS_INLINE void aesni_ctr(const unsigned char *in, unsigned char *out, size_t blocks, uint64_t *counter, const unsigned char *keys, const int rounds) {
+	//
+	// Bulk CTR mode: encrypts counter blocks and XORs the keystream straight into out.
+	// counter is the usual nonce || block number pair; counter[1] is advanced by the number of blocks processed,
+	// so consecutive calls continue where the last one stopped.
+	// in and out may be the same buffer, and neither needs to be aligned.
+	//
+	// AESENC has a latency of several cycles but can start a new instruction every cycle (or two),
+	// so a single block leaves the pipeline mostly idle. We therefore run 8 independent counter blocks
+	// through each round. The round keys are loaded once, outside of the loop; the compiler keeps as many
+	// of them in xmm registers as it can (the rest are folded into AESENC as L1-resident memory operands).
+	// There's one fully unrolled copy of this per key size (aes_ctr_aesni, aes_ctr_aesni_192, aes_ctr_aesni_256).
+	//
+
+	__m128i rk[15];
+	#pragma GCC unroll 15
+	for (int i = 0; i <= rounds; i++) {
+		rk[i] = _mm_loadu_si128((const __m128i *)(keys + i*16));
+	}
+
+	// Since the block number lives in the upper 64 bits (as a native little-endian integer),
+	// incrementing the counter is a single PADDQ.
+	__m128i ctr = _mm_loadu_si128((const __m128i *)counter);
+	const __m128i one = _mm_set_epi64x(1, 0);
+	const __m128i eight = _mm_set_epi64x(8, 0);
+
+	size_t i = 0;
+	for (; i + 8 <= blocks; i += 8) {
+		__m128i b0 = ctr;
+		__m128i b1 = _mm_add_epi64(b0, one);
+		__m128i b2 = _mm_add_epi64(b1, one);
+		__m128i b3 = _mm_add_epi64(b2, one);
+		__m128i b4 = _mm_add_epi64(b3, one);
+		__m128i b5 = _mm_add_epi64(b4, one);
+		__m128i b6 = _mm_add_epi64(b5, one);
+		__m128i b7 = _mm_add_epi64(b6, one);
+		ctr = _mm_add_epi64(ctr, eight);
+
+		// Whitening
+		b0 = _mm_xor_si128(b0, rk[0]); b1 = _mm_xor_si128(b1, rk[0]);
+		b2 = _mm_xor_si128(b2, rk[0]); b3 = _mm_xor_si128(b3, rk[0]);
+		b4 = _mm_xor_si128(b4, rk[0]); b5 = _mm_xor_si128(b5, rk[0]);
+		b6 = _mm_xor_si128(b6, rk[0]); b7 = _mm_xor_si128(b7, rk[0]);
+
+		#pragma GCC unroll 14
+		for (int round = 1; round < rounds; round++) {
+			b0 = _mm_aesenc_si128(b0, rk[round]); b1 = _mm_aesenc_si128(b1, rk[round]);
+			b2 = _mm_aesenc_si128(b2, rk[round]); b3 = _mm_aesenc_si128(b3, rk[round]);
+			b4 = _mm_aesenc_si128(b4, rk[round]); b5 = _mm_aesenc_si128(b5, rk[round]);
+			b6 = _mm_aesenc_si128(b6, rk[round]); b7 = _mm_aesenc_si128(b7, rk[round]);
+		}
+
+		b0 = _mm_aesenclast_si128(b0, rk[rounds]); b1 = _mm_aesenclast_si128(b1, rk[rounds]);
+		b2 = _mm_aesenclast_si128(b2, rk[rounds]); b3 = _mm_aesenclast_si128(b3, rk[rounds]);
+		b4 = _mm_aesenclast_si128(b4, rk[rounds]); b5 = _mm_aesenclast_si128(b5, rk[rounds]);
+		b6 = _mm_aesenclast_si128(b6, rk[rounds]); b7 = _mm_aesenclast_si128(b7, rk[rounds]);
+
+		// XOR the keystream into the data
+		const __m128i *src = (const __m128i *)(in + i*16);
+		__m128i *dst = (__m128i *)(out + i*16);
+		_mm_storeu_si128(dst + 0, _mm_xor_si128(b0, _mm_loadu_si128(src + 0)));
+		_mm_storeu_si128(dst + 1, _mm_xor_si128(b1, _mm_loadu_si128(src + 1)));
+		_mm_storeu_si128(dst + 2, _mm_xor_si128(b2, _mm_loadu_si128(src + 2)));
+		_mm_storeu_si128(dst + 3, _mm_xor_si128(b3, _mm_loadu_si128(src + 3)));
+		_mm_storeu_si128(dst + 4, _mm_xor_si128(b4, _mm_loadu_si128(src + 4)));
+		_mm_storeu_si128(dst + 5, _mm_xor_si128(b5, _mm_loadu_si128(src + 5)));
+		_mm_storeu_si128(dst + 6, _mm_xor_si128(b6, _mm_loadu_si128(src + 6)));
+		_mm_storeu_si128(dst + 7, _mm_xor_si128(b7, _mm_loadu_si128(src + 7)));
+	}
+
+	// Whatever is left (0 - 7 blocks) is done one block at a time
+	for (; i < blocks; i++) {
+		__m128i b0 = _mm_xor_si128(ctr, rk[0]);
+		ctr = _mm_add_epi64(ctr, one);
+
+		#pragma GCC unroll 14
+		for (int round = 1; round < rounds; round++) {
+			b0 = _mm_aesenc_si128(b0, rk[round]);
+		}
+		b0 = _mm_aesenclast_si128(b0, rk[rounds]);
+
+		__m128i data = _mm_loadu_si128((const __m128i *)(in + i*16));
+		_mm_storeu_si128((__m128i *)(out + i*16), _mm_xor_si128(b0, data));
+	}
+
+	counter[1] += blocks;
+}
+
+__attribute__((target("aes")))
+void aes_ctr_aesni(const unsigned char *in, unsigned char *out, size_t blocks, uint64_t *counter, const unsigned char *keys) {
+	aesni_ctr(in, out, blocks, counter, keys, 10);
+}
+
+__attribute__((target("aes")))
+void aes_ctr_aesni_192(const unsigned char *in, unsigned char *out, size_t blocks, uint64_t *counter, const unsigned char *keys) {
+	aesni_ctr(in, out, blocks, counter, keys, 12);
+}
+
+__attribute__((target("aes")))
+void aes_ctr_aesni_256(const unsigned char *in, unsigned char *out, size_t blocks, uint64_t *counter, const unsigned char *keys) {
+	aesni_ctr(in, out, blocks, counter, keys, 14);
+}
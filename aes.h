@@ -1,15 +1,63 @@
+#ifndef _AES_H
+#define _AES_H
+
 #include <unistd.h>
 #include <stdint.h>
 #include <stdbool.h>
 
 void AddRoundKey(unsigned char *state, const unsigned char *keys);
 void SubBytes(unsigned char *state);
+
+// Single-block kernels. The unsuffixed versions are AES-128; _192 and _256 are the other key sizes.
 void aes_encrypt_aesni(const unsigned char *plaintext, unsigned char *ciphertext, const unsigned char *keys);
+void aes_encrypt_aesni_192(const unsigned char *plaintext, unsigned char *ciphertext, const unsigned char *keys);
+void aes_encrypt_aesni_256(const unsigned char *plaintext, unsigned char *ciphertext, const unsigned char *keys);
 void aes_encrypt_c(const unsigned char *plaintext, unsigned char *ciphertext, const unsigned char *keys);
+void aes_encrypt_c_192(const unsigned char *plaintext, unsigned char *ciphertext, const unsigned char *keys);
+void aes_encrypt_c_256(const unsigned char *plaintext, unsigned char *ciphertext, const unsigned char *keys);
 void aes_decrypt_aesni(const unsigned char *ciphertext, unsigned char *plaintext, const unsigned char *keys);
+void aes_decrypt_aesni_192(const unsigned char *ciphertext, unsigned char *plaintext, const unsigned char *keys);
+void aes_decrypt_aesni_256(const unsigned char *ciphertext, unsigned char *plaintext, const unsigned char *keys);
 void aes_decrypt_c(const unsigned char *ciphertext, unsigned char *plaintext, const unsigned char *keys);
+void aes_decrypt_c_192(const unsigned char *ciphertext, unsigned char *plaintext, const unsigned char *keys);
+void aes_decrypt_c_256(const unsigned char *ciphertext, unsigned char *plaintext, const unsigned char *keys);
+void aes_encrypt_vperm(const unsigned char *plaintext, unsigned char *ciphertext, const unsigned char *keys);
+void aes_encrypt_vperm_192(const unsigned char *plaintext, unsigned char *ciphertext, const unsigned char *keys);
+void aes_encrypt_vperm_256(const unsigned char *plaintext, unsigned char *ciphertext, const unsigned char *keys);
+void aes_decrypt_vperm(const unsigned char *ciphertext, unsigned char *plaintext, const unsigned char *keys);
+void aes_decrypt_vperm_192(const unsigned char *ciphertext, unsigned char *plaintext, const unsigned char *keys);
+void aes_decrypt_vperm_256(const unsigned char *ciphertext, unsigned char *plaintext, const unsigned char *keys);
+void aes_inv_mix_columns_vperm(unsigned char *state);
+int aes_expand_key_vperm(const unsigned char *in_key, int key_len, unsigned char *out_keys);
+
+// aes_select_* return the fastest kernel this CPU supports for the given key length (16, 24 or 32 bytes),
+// or NULL for an invalid key length. aes_select_ctr returns the kernel picked by the registry (kernels.h).
+typedef void (*aes_block_func)(const unsigned char *in, unsigned char *out, const unsigned char *keys);
+aes_block_func aes_select_encrypt(int key_len);
+aes_block_func aes_select_decrypt(int key_len);
+
+// CTR kernels: XOR blocks*16 bytes of keystream into out, advancing counter[1] by blocks
+typedef void (*aes_ctr_func)(const unsigned char *in, unsigned char *out, size_t blocks, uint64_t *counter, const unsigned char *keys);
+aes_ctr_func aes_select_ctr(int key_len);
+void aes_ctr_aesni(const unsigned char *in, unsigned char *out, size_t blocks, uint64_t *counter, const unsigned char *keys);
+void aes_ctr_aesni_192(const unsigned char *in, unsigned char *out, size_t blocks, uint64_t *counter, const unsigned char *keys);
+void aes_ctr_aesni_256(const unsigned char *in, unsigned char *out, size_t blocks, uint64_t *counter, const unsigned char *keys);
+void aes_ctr_c(const unsigned char *in, unsigned char *out, size_t blocks, uint64_t *counter, const unsigned char *keys);
+void aes_ctr_bitslice(const unsigned char *in, unsigned char *out, size_t blocks, uint64_t *counter, const unsigned char *keys);
+void aes_ctr_bitslice_192(const unsigned char *in, unsigned char *out, size_t blocks, uint64_t *counter, const unsigned char *keys);
+void aes_ctr_bitslice_256(const unsigned char *in, unsigned char *out, size_t blocks, uint64_t *counter, const unsigned char *keys);
+// VAES (vaes.c): 2 blocks per ymm register with AVX2, 4 per zmm register with AVX-512
+void aes_ctr_vaes_avx2(const unsigned char *in, unsigned char *out, size_t blocks, uint64_t *counter, const unsigned char *keys);
+void aes_ctr_vaes_avx2_192(const unsigned char *in, unsigned char *out, size_t blocks, uint64_t *counter, const unsigned char *keys);
+void aes_ctr_vaes_avx2_256(const unsigned char *in, unsigned char *out, size_t blocks, uint64_t *counter, const unsigned char *keys);
+void aes_ctr_vaes_avx512(const unsigned char *in, unsigned char *out, size_t blocks, uint64_t *counter, const unsigned char *keys);
+void aes_ctr_vaes_avx512_192(const unsigned char *in, unsigned char *out, size_t blocks, uint64_t *counter, const unsigned char *keys);
+void aes_ctr_vaes_avx512_256(const unsigned char *in, unsigned char *out, size_t blocks, uint64_t *counter, const unsigned char *keys);
+
 void ShiftRows(unsigned char *state, bool inverse);
 void InvSubBytes(unsigned char *state);
 #define InvShiftRows(state) ShiftRows(state, 1)
 void InvMixColumns(unsigned char *state);
 void MixColumns(unsigned char *state);
+
+#endif
@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdlib.h> /* posix_memalign, exit */
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+
+/*
+ * A handful of big buffers, handed out again and again. Buffers below HUGE_PAGE come from posix_memalign; bigger
+ * ones are mapped at a 2 MiB boundary, from the explicit huge page pool (MAP_HUGETLB) if the administrator has set one
+ * up, and otherwise with MADV_HUGEPAGE so that transparent huge pages back them. Either way a 4 MiB chunk takes two
+ * TLB entries instead of a thousand.
+ *
+ * Every buffer is recorded in bufs[], in use or not; a freed one is reused for any request between half its size and
+ * its size. Up to ARENA_CACHE bytes of free buffers are kept; past that (or if bufs[] is full) they're released.
+ */
+
+#define PAGE 4096
+#define HUGE_PAGE (2 << 20)
+#define ARENA_BUFS 64
+#define ARENA_CACHE (256 << 20)
+
+#define CHUNK_MIN (64 << 10)
+#define CHUNK_MAX (4 << 20)
+
+struct arena_buf {
+	unsigned char *ptr;
+	size_t size;      // what the caller can use
+	size_t map_size;  // for munmap; 0 if it came from posix_memalign
+	bool in_use;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	struct arena_buf bufs[ARENA_BUFS];
+	size_t cached; // bytes in free buffers
+	bool no_hugetlb; // MAP_HUGETLB failed once; don't keep trying
+} arena = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static size_t round_up(size_t size, size_t to) {
+	return (size + to - 1) & ~(to - 1);
+}
+
+static bool map_huge(struct arena_buf *buf, size_t size) {
+	// Explicit huge pages first: whole pages only, and already aligned
+	if (!arena.no_hugetlb) {
+		size_t len = round_up(size, HUGE_PAGE);
+		void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED) {
+			buf->ptr = p;
+			buf->map_size = len;
+			return true;
+		}
+		arena.no_hugetlb = true;
+	}
+
+	// Otherwise map a little more than needed and trim it to a 2 MiB boundary, so that THP can use whole huge pages
+	size_t len = round_up(size, PAGE);
+	unsigned char *p = mmap(NULL, len + HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return false;
+	unsigned char *aligned = (unsigned char *)round_up((uintptr_t)p, HUGE_PAGE);
+	if (aligned > p)
+		munmap(p, aligned - p);
+	munmap(aligned + len, (p + len + HUGE_PAGE) - (aligned + len));
+	madvise(aligned, len, MADV_HUGEPAGE);
+
+	buf->ptr = aligned;
+	buf->map_size = len;
+	return true;
+}
+
+static void release(struct arena_buf *buf) {
+	if (buf->map_size)
+		munmap(buf->ptr, buf->map_size);
+	else
+		free(buf->ptr);
+	buf->ptr = NULL;
+}
+
+void *arena_alloc(size_t size) {
+	if (size == 0)
+		size = 1;
+
+	pthread_mutex_lock(&arena.lock);
+
+	// The smallest free buffer that fits, if it isn't more than twice the size
+	struct arena_buf *best = NULL, *empty = NULL;
+	for (int i = 0; i < ARENA_BUFS; i++) {
+		struct arena_buf *buf = &arena.bufs[i];
+		if (buf->ptr == NULL) {
+			if (empty == NULL)
+				empty = buf;
+		}
+		else if (!buf->in_use && buf->size >= size && buf->size / 2 <= size && (best == NULL || buf->size < best->size))
+			best = buf;
+	}
+	if (best != NULL) {
+		best->in_use = true;
+		arena.cached -= best->size;
+		pthread_mutex_unlock(&arena.lock);
+		return best->ptr;
+	}
+
+	struct arena_buf buf = { .size = size, .in_use = true };
+	bool ok;
+	if (size >= HUGE_PAGE && empty != NULL)
+		ok = map_huge(&buf, size);
+	else {
+		// Untracked buffers (bufs[] full) come from here too, since arena_free can only munmap what it knows about
+		ok = posix_memalign((void **)&buf.ptr, PAGE, round_up(size, PAGE)) == 0;
+	}
+	if (ok && empty != NULL)
+		*empty = buf;
+	pthread_mutex_unlock(&arena.lock);
+
+	if (!ok) {
+		fprintf(stderr, "Failed to allocate memory!\n");
+		exit(1);
+	}
+	return buf.ptr;
+}
+
+void arena_free(void *ptr) {
+	if (ptr == NULL)
+		return;
+
+	pthread_mutex_lock(&arena.lock);
+	for (int i = 0; i < ARENA_BUFS; i++) {
+		struct arena_buf *buf = &arena.bufs[i];
+		if (buf->ptr != ptr)
+			continue;
+
+		if (arena.cached + buf->size > ARENA_CACHE)
+			release(buf);
+		else {
+			buf->in_use = false;
+			arena.cached += buf->size;
+		}
+		pthread_mutex_unlock(&arena.lock);
+		return;
+	}
+	pthread_mutex_unlock(&arena.lock);
+
+	free(ptr);
+}
+
+static size_t chunk_max(void) {
+	// Big enough that the read/write system calls don't matter, small enough to still be in the L2 cache (or at least
+	// the L3 slice) by the time the chunk is written out: twice the L2 size, within CHUNK_MIN..CHUNK_MAX
+	static size_t max;
+	if (max == 0) {
+		long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+		size_t size = (l2 > 0) ? round_up(2 * (size_t)l2, PAGE) : CHUNK_MAX;
+		max = (size < CHUNK_MIN) ? CHUNK_MIN : (size > CHUNK_MAX) ? CHUNK_MAX : size;
+	}
+	return max;
+}
+
+size_t arena_chunk_size(off_t input_size) {
+	size_t max = chunk_max();
+	if (input_size < 0 || (uint64_t)input_size >= max)
+		return max;
+
+	// One chunk for the whole file; the extra byte makes sure the read that finds the end is a short one
+	return round_up(input_size + 1, PAGE);
+}
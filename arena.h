@@ -0,0 +1,20 @@
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// I/O buffers for bin/ctr. Every buffer is page aligned (so, for the kernels' aligned loads, 16- and 64-byte aligned
+// at every multiple of 16 into it), and those of 2 MiB and up are backed by huge pages where the system has them.
+// arena_free keeps a buffer for the next arena_alloc of about the same size, from any thread, so a process that
+// handles many files doesn't go back to the kernel (and page-fault the buffers in again) for each one.
+// arena_alloc exits if there's no memory.
+void *arena_alloc(size_t size);
+void arena_free(void *buf);
+
+// The chunk size to read, encrypt and write a file in: a multiple of 4096, big enough to amortise the system calls
+// and small enough that a chunk is still in the cache when it's written out; and no bigger than the file itself
+// (plus one page), so that small files don't allocate megabytes. input_size is -1 if it isn't known (pipes).
+size_t arena_chunk_size(off_t input_size);
+
+#endif
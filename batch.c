@@ -0,0 +1,467 @@
+#define _GNU_SOURCE /* nftw */
+#include <stdio.h>
+#include <stdlib.h> /* exit, realpath */
+#include <string.h> /* strerror */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ftw.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "batch.h"
+#include "ctr.h" /* struct ctr_options, get_nonce */
+#include "aes.h"
+#include "keyschedule.h"
+#include "arena.h"
+#include "steal.h"
+#include "v2.h"
+
+/*
+ * --batch: one process for a whole tree of files, instead of one bin/ctr per file.
+ *
+ * The main thread lists the files (nftw over a directory, or lines of a list) and submits one task per file to a
+ * work-stealing pool (steal.c). The task opens the file and plans its v2 layout, which for a regular file of known
+ * size is fixed up front: chunk i goes at v2_chunk_offset(i) with counter 1 + i * chunk_size/16, whoever encrypts it.
+ * A small file is then encrypted right there; a big one is cut into ranges of RANGE_CHUNKS chunks, which go onto the
+ * worker's own deque as sub-tasks, for idle workers to steal. Each range reads and writes its chunks with
+ * pread/pwrite, and whichever range finishes last writes the header, index and footer, and renames the file from
+ * its temporary name into place. So a file is either complete under its name, or (after a failure) not there at all.
+ *
+ * Memory and descriptors in flight are bounded: each worker has one chunk buffer, the producer stops listing files
+ * once MAX_QUEUED are waiting, and a worker only opens another file when no range of an open one is left to run or
+ * steal (the pool runs submitted tasks after all spawned ones). So at most one file per worker is open at a time.
+ *
+ * Unlike the rest of bin/ctr, nothing here exits on a bad file: the error goes to stderr with the file's name,
+ * the file is counted as failed, and the batch carries on.
+ */
+
+#define RANGE_CHUNKS 16 // chunks per sub-task; with 4 MiB chunks, files above 64 MiB are split up
+#define MAX_QUEUED 1024
+#define PARTIAL_SUFFIX ".ctr-partial"
+
+struct batch {
+	aes_ctr_func aes_ctr;
+	unsigned char expanded_keys[AES_MAX_EXPANDED_KEY];
+	int key_len;
+	unsigned char **bufs; // one chunk buffer per worker, allocated when first needed
+
+	pthread_mutex_t lock; // for the totals, and to keep error messages whole
+	uint64_t files, failed, bytes;
+};
+
+struct batch_file {
+	char *inpath, *outpath, *tmppath;
+	int infd, outfd;
+	uint64_t size;
+	uint32_t chunk_size;
+	uint64_t chunks;
+	uint64_t nonce;
+	int ranges_left; // atomic
+	int failed;      // atomic; the first failure sets error
+	char error[256];
+};
+
+enum task_kind { TASK_OPEN, TASK_RANGE };
+
+struct batch_task {
+	enum task_kind kind;
+	struct batch_file *file;
+	uint64_t first, end; // TASK_RANGE: chunks first..end-1
+};
+
+static void fail(struct batch_file *f, const char *format, ...) {
+	if (__atomic_exchange_n(&f->failed, 1, __ATOMIC_SEQ_CST))
+		return;
+	va_list args;
+	va_start(args, format);
+	vsnprintf(f->error, sizeof(f->error), format, args);
+	va_end(args);
+}
+
+static void report(struct batch *b, const char *path, const char *error, uint64_t bytes) {
+	pthread_mutex_lock(&b->lock);
+	b->files++;
+	if (error) {
+		b->failed++;
+		fprintf(stderr, "FAILED %s: %s\n", path, error);
+	}
+	else
+		b->bytes += bytes;
+	pthread_mutex_unlock(&b->lock);
+}
+
+static bool pread_all(int fd, unsigned char *buf, size_t len, off_t offset) {
+	// false on errors and on end of file, which for a file we've planned the layout of means it has shrunk
+	while (len > 0) {
+		ssize_t r = pread(fd, buf, len, offset);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			if (r == 0)
+				errno = 0;
+			return false;
+		}
+		buf += r;
+		len -= r;
+		offset += r;
+	}
+	return true;
+}
+
+static bool pwrite_all(int fd, const unsigned char *buf, size_t len, off_t offset) {
+	while (len > 0) {
+		ssize_t w = pwrite(fd, buf, len, offset);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			return false;
+		buf += w;
+		len -= w;
+		offset += w;
+	}
+	return true;
+}
+
+static bool make_parents(char *path) {
+	// mkdir -p for everything before the last '/'; other workers may be creating the same directories
+	for (char *p = strchr(path + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+		*p = '\0';
+		bool ok = mkdir(path, 0777) == 0 || errno == EEXIST;
+		*p = '/';
+		if (!ok)
+			return false;
+	}
+	return true;
+}
+
+static char *join(const char *dir, const char *name) {
+	char *path = malloc(strlen(dir) + strlen(name) + sizeof(PARTIAL_SUFFIX) + 2);
+	if (path == NULL) {
+		fprintf(stderr, "Failed to allocate memory!\n");
+		exit(1);
+	}
+	sprintf(path, "%s/%s", dir, name);
+	return path;
+}
+
+static uint32_t chunk_length(const struct batch_file *f, uint64_t chunk) {
+	return (chunk == f->chunks - 1) ? f->size - chunk * f->chunk_size : f->chunk_size;
+}
+
+static void free_file(struct batch_file *f) {
+	free(f->inpath);
+	free(f->outpath);
+	free(f->tmppath);
+	free(f);
+}
+
+static void finish_file(struct batch *b, struct batch_file *f) {
+	// Called once every range is done: the header, index and footer, then into place
+	unsigned char page[V2_PAGE] = {0};
+	struct v2_header header = { .version = 2, .key_bits = b->key_len * 8, .chunk_size = f->chunk_size, .nonce = f->nonce };
+	memcpy(header.magic, V2_MAGIC, 8);
+	memcpy(page, &header, sizeof(header));
+
+	uint64_t last = chunk_length(f, f->chunks - 1);
+	off_t index_offset = v2_chunk_offset(f->chunk_size, f->chunks - 1) + V2_PAGE + v2_page_align(last);
+	size_t index_len = f->chunks * sizeof(struct v2_chunk) + sizeof(struct v2_footer);
+	unsigned char *index = malloc(index_len);
+	if (index == NULL) {
+		fprintf(stderr, "Failed to allocate memory!\n");
+		exit(1);
+	}
+	for (uint64_t i = 0; i < f->chunks; i++) {
+		struct v2_chunk chunk = { .index = i, .nonce = f->nonce, .counter_base = 1 + i * (f->chunk_size / 16),
+			.length = chunk_length(f, i), .flags = (i == f->chunks - 1) ? V2_CHUNK_LAST : 0 };
+		memcpy(index + i * sizeof(chunk), &chunk, sizeof(chunk));
+	}
+	struct v2_footer footer = { .chunks = f->chunks, .plain_size = f->size, .index_offset = index_offset };
+	memcpy(footer.magic, V2_INDEX_MAGIC, 8);
+	memcpy(index + f->chunks * sizeof(struct v2_chunk), &footer, sizeof(footer));
+
+	struct stat st;
+	if (!__atomic_load_n(&f->failed, __ATOMIC_SEQ_CST)) {
+		if (!pwrite_all(f->outfd, page, V2_PAGE, 0) || !pwrite_all(f->outfd, index, index_len, index_offset))
+			fail(f, "%s: %s", f->tmppath, strerror(errno));
+		else if (fstat(f->infd, &st) != 0 || (uint64_t)st.st_size != f->size)
+			fail(f, "the file changed size while it was being encrypted");
+	}
+	free(index);
+
+	close(f->infd);
+	if (close(f->outfd) != 0)
+		fail(f, "%s: %s", f->tmppath, strerror(errno));
+	if (!__atomic_load_n(&f->failed, __ATOMIC_SEQ_CST) && rename(f->tmppath, f->outpath) != 0)
+		fail(f, "%s: %s", f->outpath, strerror(errno));
+	if (__atomic_load_n(&f->failed, __ATOMIC_SEQ_CST))
+		unlink(f->tmppath);
+
+	report(b, f->inpath, f->failed ? f->error : NULL, f->size);
+	free_file(f);
+}
+
+static void encrypt_range(struct batch *b, int worker, struct batch_file *f, uint64_t first, uint64_t end) {
+	if (b->bufs[worker] == NULL)
+		b->bufs[worker] = arena_alloc(V2_PAGE + V2_CHUNK_SIZE);
+	unsigned char *buf = b->bufs[worker], *data = buf + V2_PAGE;
+
+	for (uint64_t i = first; i < end && !__atomic_load_n(&f->failed, __ATOMIC_RELAXED); i++) {
+		uint32_t len = chunk_length(f, i);
+		if (!pread_all(f->infd, data, len, (off_t)i * f->chunk_size)) {
+			if (errno == 0)
+				fail(f, "the file shrank while it was being encrypted");
+			else
+				fail(f, "%s", strerror(errno));
+			break;
+		}
+
+		struct v2_chunk chunk = { .index = i, .nonce = f->nonce, .counter_base = 1 + i * (f->chunk_size / 16),
+			.length = len, .flags = (i == f->chunks - 1) ? V2_CHUNK_LAST : 0 };
+		memset(buf, 0, V2_PAGE);
+		memcpy(buf, V2_CHUNK_MAGIC, 8);
+		memcpy(buf + 8, &chunk, sizeof(chunk));
+
+		// As in v2_encrypt_file: the partial last block is encrypted whole, then the keystream past the data is zeroed
+		size_t padded = v2_page_align(len);
+		uint64_t counter[2] = { chunk.nonce, chunk.counter_base };
+		memset(data + len, 0, padded - len);
+		b->aes_ctr(data, data, (len + 15) / 16, counter, b->expanded_keys);
+		memset(data + len, 0, padded - len);
+
+		if (!pwrite_all(f->outfd, buf, V2_PAGE + padded, v2_chunk_offset(f->chunk_size, i))) {
+			fail(f, "%s: %s", f->tmppath, strerror(errno));
+			break;
+		}
+	}
+}
+
+static bool open_file(struct batch_file *f) {
+	// Plans the layout: the same chunk size bin/ctr -e would pick, so the output is the same but for the nonce
+	f->infd = open(f->inpath, O_RDONLY | O_CLOEXEC);
+	if (f->infd < 0) {
+		fail(f, "%s", strerror(errno));
+		return false;
+	}
+	struct stat st;
+	if (fstat(f->infd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		fail(f, "%s", (errno != 0) ? strerror(errno) : "not a regular file");
+		close(f->infd);
+		return false;
+	}
+	posix_fadvise(f->infd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	f->tmppath = malloc(strlen(f->outpath) + sizeof(PARTIAL_SUFFIX));
+	if (f->tmppath == NULL) {
+		fprintf(stderr, "Failed to allocate memory!\n");
+		exit(1);
+	}
+	sprintf(f->tmppath, "%s%s", f->outpath, PARTIAL_SUFFIX);
+	if (!make_parents(f->tmppath) || (f->outfd = open(f->tmppath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) < 0) {
+		fail(f, "%s: %s", f->tmppath, strerror(errno));
+		close(f->infd);
+		return false;
+	}
+
+	f->size = st.st_size;
+	size_t chunk_size = arena_chunk_size(st.st_size);
+	f->chunk_size = (chunk_size > V2_CHUNK_SIZE) ? V2_CHUNK_SIZE : chunk_size;
+	f->chunks = f->size / f->chunk_size + 1; // the last one is short, or empty
+	f->nonce = get_nonce();
+	return true;
+}
+
+static void range_done(struct batch *b, struct batch_file *f) {
+	if (__atomic_sub_fetch(&f->ranges_left, 1, __ATOMIC_SEQ_CST) == 0)
+		finish_file(b, f);
+}
+
+static void run_task(struct steal_pool *pool, int worker, void *arg_task, void *arg) {
+	struct batch *b = arg;
+	struct batch_task *task = arg_task;
+	struct batch_file *f = task->file;
+
+	if (task->kind == TASK_RANGE) {
+		encrypt_range(b, worker, f, task->first, task->end);
+		free(task);
+		range_done(b, f);
+		return;
+	}
+	free(task);
+
+	errno = 0;
+	if (!open_file(f)) {
+		report(b, f->inpath, f->error, 0);
+		free_file(f);
+		return;
+	}
+
+	// Range 0 is done here; the rest go on this worker's deque, last first, so that this worker carries on with
+	// range 1 while the others steal from the far end of the file. Nobody opens another file until they're all taken.
+	uint64_t ranges = (f->chunks + RANGE_CHUNKS - 1) / RANGE_CHUNKS;
+	f->ranges_left = ranges;
+	for (uint64_t r = ranges - 1; r >= 1; r--) {
+		struct batch_task *sub = malloc(sizeof(*sub));
+		if (sub == NULL) {
+			fprintf(stderr, "Failed to allocate memory!\n");
+			exit(1);
+		}
+		uint64_t end = (r + 1) * RANGE_CHUNKS;
+		*sub = (struct batch_task){ .kind = TASK_RANGE, .file = f, .first = r * RANGE_CHUNKS,
+			.end = (end > f->chunks) ? f->chunks : end };
+		steal_pool_spawn(pool, worker, sub);
+	}
+	encrypt_range(b, worker, f, 0, (f->chunks < RANGE_CHUNKS) ? f->chunks : RANGE_CHUNKS);
+	range_done(b, f);
+}
+
+// The producer's state, for nftw's callback
+static struct {
+	struct batch *batch;
+	struct steal_pool *pool;
+	const char *outdir;
+	size_t root_len;
+	uint64_t skipped;
+} walk;
+
+static void submit_file(const char *inpath, const char *relative) {
+	struct batch_file *f = calloc(1, sizeof(*f));
+	struct batch_task *task = malloc(sizeof(*task));
+	if (f == NULL || task == NULL || (f->inpath = strdup(inpath)) == NULL) {
+		fprintf(stderr, "Failed to allocate memory!\n");
+		exit(1);
+	}
+	f->outpath = join(walk.outdir, relative);
+	*task = (struct batch_task){ .kind = TASK_OPEN, .file = f };
+	steal_pool_submit(walk.pool, task);
+}
+
+static int visit(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+	(void)ftw;
+	if (type == FTW_F && S_ISREG(st->st_mode)) {
+		const char *relative = path + walk.root_len;
+		while (*relative == '/')
+			relative++;
+		submit_file(path, relative);
+	}
+	else if (type == FTW_DNR || type == FTW_NS)
+		report(walk.batch, path, (type == FTW_DNR) ? "can't read the directory" : "can't stat", 0);
+	else if (type != FTW_D && type != FTW_DP)
+		walk.skipped++; // symlinks (not followed), devices, sockets, fifos
+	return 0;
+}
+
+static bool safe_relative(const char *path) {
+	// A listed path ends up under outdir; one with a ".." in it could end up anywhere
+	for (const char *p = path; *p; ) {
+		const char *slash = strchr(p, '/');
+		size_t len = slash ? (size_t)(slash - p) : strlen(p);
+		if (len == 2 && p[0] == '.' && p[1] == '.')
+			return false;
+		p += len + (slash != NULL);
+	}
+	return true;
+}
+
+static void submit_list(const char *listpath) {
+	FILE *list = (strcmp(listpath, "-") == 0) ? stdin : fopen(listpath, "r");
+	if (list == NULL) {
+		perror(listpath);
+		exit(1);
+	}
+	char *line = NULL;
+	size_t capacity = 0;
+	ssize_t len;
+	while ((len = getline(&line, &capacity, list)) != -1) {
+		if (len > 0 && line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (len == 0)
+			continue;
+		const char *relative = line;
+		while (*relative == '/')
+			relative++;
+		if (*relative == '\0' || !safe_relative(relative)) {
+			report(walk.batch, line, "paths with \"..\" in them aren't allowed in a list", 0);
+			continue;
+		}
+		submit_file(line, relative);
+	}
+	free(line);
+	if (list != stdin)
+		fclose(list);
+}
+
+static void check_outdir(const char *source, const char *outdir, bool tree) {
+	// The output directory has to exist (it's created if need be), and mustn't be inside the tree being encrypted,
+	// or the walk would find what it has just written
+	char *copy = join(outdir, "x");
+	if (!make_parents(copy)) {
+		perror(outdir);
+		exit(1);
+	}
+	free(copy);
+	if (!tree)
+		return;
+
+	char *src = realpath(source, NULL), *out = realpath(outdir, NULL);
+	if (src == NULL || out == NULL) {
+		perror(src ? outdir : source);
+		exit(1);
+	}
+	size_t n = strlen(src);
+	if (strncmp(src, out, n) == 0 && (out[n] == '/' || out[n] == '\0' || n == 1)) {
+		fprintf(stderr, "The output directory can't be inside the directory being encrypted.\n");
+		exit(1);
+	}
+	free(src);
+	free(out);
+}
+
+int batch_encrypt(const char *source, const char *outdir, const unsigned char *key, const struct ctr_options *opts) {
+	struct stat st;
+	bool tree = strcmp(source, "-") != 0 && stat(source, &st) == 0 && S_ISDIR(st.st_mode);
+	check_outdir(source, outdir, tree);
+
+	struct batch b = { .aes_ctr = aes_select_ctr(opts->key_len), .key_len = opts->key_len };
+	aes_expand_key_len(key, opts->key_len, b.expanded_keys);
+	pthread_mutex_init(&b.lock, NULL);
+	b.bufs = calloc(opts->threads, sizeof(*b.bufs));
+	if (b.bufs == NULL) {
+		fprintf(stderr, "Failed to allocate memory!\n");
+		exit(1);
+	}
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	walk.batch = &b;
+	walk.outdir = outdir;
+	walk.pool = steal_pool_create(opts->threads, MAX_QUEUED, run_task, &b);
+	if (tree) {
+		walk.root_len = strlen(source);
+		if (nftw(source, visit, 64, FTW_PHYS) != 0)
+			report(&b, source, strerror(errno), 0);
+	}
+	else
+		submit_list(source);
+	steal_pool_finish(walk.pool);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	fprintf(stderr, "%llu files, %.1f MiB in %.2f s: %.1f MiB/s, %.0f files/s", (unsigned long long)b.files,
+			b.bytes / 1048576.0, seconds, b.bytes / 1048576.0 / seconds, b.files / seconds);
+	if (walk.skipped)
+		fprintf(stderr, "; %llu skipped (not regular files)", (unsigned long long)walk.skipped);
+	fprintf(stderr, "; %llu failed\n", (unsigned long long)b.failed);
+
+	for (int i = 0; i < opts->threads; i++) {
+		arena_free(b.bufs[i]);
+	}
+	free(b.bufs);
+	pthread_mutex_destroy(&b.lock);
+	memset(b.expanded_keys, 0, sizeof(b.expanded_keys));
+	return b.failed;
+}
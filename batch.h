@@ -0,0 +1,12 @@
+#ifndef _BATCH_H
+#define _BATCH_H
+
+struct ctr_options; // ctr.h
+
+// --batch: encrypts many files in one process, into v2 files under outdir (see batch.c). source is a directory, whose
+// tree is mirrored under outdir, or a file (or "-" for stdin) listing one path per line. opts->threads workers share
+// the files; a file that can't be read or written is reported and skipped, and the rest carry on.
+// Returns the number of files that failed; only problems with outdir itself (or the listing) exit.
+int batch_encrypt(const char *source, const char *outdir, const unsigned char *key, const struct ctr_options *opts);
+
+#endif
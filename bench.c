@@ -1,26 +1,822 @@
 #include <stdio.h>
 #include <stdlib.h> /* exit */
 #include <string.h> /* memcmp */
-#include <assert.h>
+#include <stdbool.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <x86intrin.h> /* __rdtsc */
 #include "keyschedule.h"
 #include "debug.h"
 #include "aes.h"
+#include "misc.h"
+#include "mb.h"
+#include "cbc.h"
+#include "gcm.h"
+#include "xts.h"
+#include "ctx.h"
+#include "pool.h"
+#include "kernels.h"
+#include "keystream.h"
 
-int main() {
-	uint64_t text[2] = {0};
-	unsigned char *plaintext_ptr = (unsigned char *)text;
-	const unsigned char key[] = {0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f};
-	unsigned char expanded_key[176] = {0};
-	unsigned char ciphertext[16] = {0};
+/*
+ * The benchmark suite: every mode x kernel x key size x buffer size (16 bytes to 1 GiB, in steps of 4x) x thread count,
+ * plus small-message latency, key expansion and bin/ctr end to end on tmpfs.
+ *
+ * Each case is warmed up first, then timed as a number of samples (each long enough that the clock's resolution
+ * doesn't matter); it reports the median rate with the 10th and 90th percentiles, and the median cycles per byte.
+ * Cycles are rdtsc ticks, i.e. at the TSC's nominal frequency, not the core's actual clock.
+ *
+ * A series stops growing once a single call would take longer than max_call seconds, so the slow kernels
+ * don't spend minutes on the big buffers.
+ *
+ * --json writes the results, one per line, for --compare to read back: keep a run of a known-good build
+ * (bin/bench --quick --json baseline.json), and a later run on the same machine lists every case that got slower
+ * than that by more than --threshold percent, and exits with 1 if any did. Baselines don't carry over between
+ * machines, and a VM with busy neighbours may need a higher threshold.
+ */
 
-	aes_expand_key(key, expanded_key);
+static struct {
+	bool quick;
+	const char *filter;    // only cases whose id contains this
+	const char *json;
+	const char *compare;
+	double threshold;      // percent
+	int threads[8];
+	int num_threads;
+	size_t max_bytes;
+	int samples;
+	double budget;         // seconds of samples per case (at least MIN_SAMPLES are always taken)
+	double warmup;
+	double max_call;
+} cfg;
 
-#define NUM_LOOPS 10000000
-	for (int i=0; i < NUM_LOOPS; i++) {
-		text[1]++;
-		aes_encrypt_aesni(plaintext_ptr, ciphertext, expanded_key);
-//		print_hex(ciphertext, 16);
+#define MIN_SAMPLES 3
+#define MAX_SAMPLES 64
+#define SAMPLE_SECONDS 0.001
+
+struct bench_case {
+	const char *mode;
+	const char *kernel;
+	int key_bits;
+	const char *variant; // extra parameter (XTS sector size), or ""
+	size_t bytes;        // buffer, message or record size
+	int threads;
+	bool keys;           // units are key expansions rather than bytes
+	double units;        // bytes (or keys) per call
+};
+
+struct bench_result {
+	char id[128];
+	struct bench_case c;
+	char variant[16];        // c.variant may point into a caller's stack frame
+	int samples;
+	double median, p10, p90; // bytes (or keys) per second
+	double cycles;           // median rdtsc ticks per byte (or key)
+	double call_seconds;     // median time for one call
+};
+
+static struct bench_result *results;
+static size_t num_results, results_size;
+
+static double seconds(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, int n, double p) {
+	// Linear interpolation between the closest ranks
+	double pos = p / 100 * (n - 1);
+	int i = (int)pos;
+	if (i + 1 >= n)
+		return sorted[n - 1];
+	return sorted[i] + (pos - i) * (sorted[i + 1] - sorted[i]);
+}
+
+typedef void (*bench_op)(void *arg);
+
+static const struct bench_result *measure(const struct bench_case *c, bench_op op, void *arg) {
+	struct bench_result r = { .c = *c };
+	snprintf(r.id, sizeof(r.id), "%s/%s/aes%d%s%s/%zu/t%d", c->mode, c->kernel, c->key_bits,
+			c->variant[0] ? "/" : "", c->variant, c->bytes, c->threads);
+	if (cfg.filter != NULL && strstr(r.id, cfg.filter) == NULL)
+		return NULL;
+	snprintf(r.variant, sizeof(r.variant), "%s", c->variant);
+	r.c.variant = NULL;
+
+	// Warm up (caches, page faults, the CPU's clock) for at least one call; that also tells us how long a call takes
+	size_t calls = 0;
+	double start = seconds(), elapsed;
+	do {
+		op(arg);
+		calls++;
+		elapsed = seconds() - start;
+	} while (elapsed < cfg.warmup);
+	size_t reps = (elapsed / calls >= SAMPLE_SECONDS) ? 1 : (size_t)(SAMPLE_SECONDS / (elapsed / calls)) + 1;
+
+	double rates[MAX_SAMPLES], cycles[MAX_SAMPLES];
+	int n = 0;
+	start = seconds();
+	while (n < cfg.samples && (n < MIN_SAMPLES || seconds() - start < cfg.budget)) {
+		double s0 = seconds();
+		uint64_t t0 = __rdtsc();
+		for (size_t i = 0; i < reps; i++) {
+			op(arg);
+		}
+		uint64_t ticks = __rdtsc() - t0;
+		double s = seconds() - s0;
+
+		rates[n] = reps * c->units / s;
+		cycles[n] = ticks / (reps * c->units);
+		n++;
+	}
+
+	qsort(rates, n, sizeof(double), compare_doubles);
+	qsort(cycles, n, sizeof(double), compare_doubles);
+	r.samples = n;
+	r.median = percentile(rates, n, 50);
+	r.p10 = percentile(rates, n, 10);
+	r.p90 = percentile(rates, n, 90);
+	r.cycles = percentile(cycles, n, 50);
+	r.call_seconds = c->units / r.median;
+
+	if (c->keys)
+		printf("%-48s %9.3fM keys/s (p10 %.3f, p90 %.3f) %8.1f cycles/key\n", r.id, r.median / 1e6, r.p10 / 1e6, r.p90 / 1e6, r.cycles);
+	else
+		printf("%-48s %9.3f GB/s (p10 %.3f, p90 %.3f) %8.2f cycles/byte\n", r.id, r.median / 1e9, r.p10 / 1e9, r.p90 / 1e9, r.cycles);
+	fflush(stdout);
+
+	if (num_results == results_size) {
+		results_size = results_size ? 2 * results_size : 256;
+		results = realloc(results, results_size * sizeof(*results));
+		if (results == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	results[num_results] = r;
+	return &results[num_results++];
+}
+
+static bool series_continues(const struct bench_result *last, size_t next_bytes) {
+	// Whether the next (bigger) size is still worth measuring; filtered-out cases don't stop anything
+	return last == NULL || last->call_seconds * next_bytes / last->c.bytes <= cfg.max_call;
+}
+
+// Everything the operations below need; each one uses its own few fields
+struct job {
+	unsigned char *buf;
+	size_t bytes;
+	int key_len;
+	const unsigned char *keys, *dec_keys;
+	uint64_t counter[2];
+	aes_ctr_func ctr;
+	aes_block_func block;
+	struct ctr_pool *pool;
+	struct aes_xts_key *xts;
+	size_t sector;
+	bool portable;
+	struct aes_ctx *ctx;
+	struct aes_mb_job *records;
+	size_t count;
+	unsigned char *batch_keys, *enc_keys;
+	char **argv;
+};
+
+static void op_block(void *arg) {
+	// ECB over the buffer; the single-block kernels on their own
+	struct job *j = arg;
+	for (size_t i = 0; i < j->bytes / 16; i++) {
+		j->block(j->buf + i*16, j->buf + i*16, j->keys);
+	}
+}
+
+static void op_ctr(void *arg) {
+	struct job *j = arg;
+	if (j->pool != NULL)
+		ctr_pool_xor(j->pool, j->ctr, j->buf, j->buf, j->bytes / 16, j->counter, j->keys);
+	else
+		j->ctr(j->buf, j->buf, j->bytes / 16, j->counter, j->keys);
+}
+
+static void op_cbc_encrypt(void *arg) {
+	struct job *j = arg;
+	unsigned char iv[16] = {0};
+	aes_cbc_encrypt(j->buf, j->buf, j->bytes / 16, iv, j->keys, j->key_len);
+}
+
+static void op_cbc_decrypt(void *arg) {
+	struct job *j = arg;
+	unsigned char iv[16] = {0};
+	aes_cbc_decrypt(j->buf, j->buf, j->bytes / 16, iv, j->dec_keys, j->key_len);
+}
+
+static void op_gcm(void *arg, bool decrypt) {
+	// One whole message: init (which computes H), the data, the tag
+	struct job *j = arg;
+	const unsigned char iv[12] = {0};
+	unsigned char tag[16];
+	struct aes_gcm ctx;
+	aes_gcm_init(&ctx, j->keys, j->key_len, iv, 12);
+	if (j->portable)
+		ctx.clmul = false;
+	if (decrypt)
+		aes_gcm_decrypt(&ctx, j->buf, j->buf, j->bytes);
+	else
+		aes_gcm_encrypt(&ctx, j->buf, j->buf, j->bytes);
+	aes_gcm_final(&ctx, tag);
+}
+
+static void op_gcm_encrypt(void *arg) {
+	op_gcm(arg, false);
+}
+
+static void op_gcm_decrypt(void *arg) {
+	op_gcm(arg, true);
+}
+
+static void op_xts_encrypt(void *arg) {
+	struct job *j = arg;
+	aes_xts_encrypt_sectors(j->xts, j->pool, 0, j->buf, j->buf, j->sector, j->bytes / j->sector);
+}
+
+static void op_xts_decrypt(void *arg) {
+	struct job *j = arg;
+	aes_xts_decrypt_sectors(j->xts, j->pool, 0, j->buf, j->buf, j->sector, j->bytes / j->sector);
+}
+
+static void op_ctx(void *arg) {
+	struct job *j = arg;
+	aes_ctx_ctr_xor(j->ctx, j->counter, j->buf, j->buf, j->bytes);
+}
+
+static void op_records_block(void *arg) {
+	// Small records, each with its own key: one single-block call per block...
+	struct job *j = arg;
+	for (size_t i = 0; i < j->count; i++) {
+		struct aes_mb_job *rec = &j->records[i];
+		for (size_t pos = 0; pos < rec->len; pos += 16) {
+			unsigned char keystream[16];
+			j->block((unsigned char *)rec->counter, keystream, rec->keys);
+			rec->counter[1]++;
+			for (size_t k = pos; k < pos + 16 && k < rec->len; k++) {
+				rec->out[k] ^= keystream[k - pos];
+			}
+		}
+	}
+}
+
+static void op_records_ctr(void *arg) {
+	// ... one CTR kernel call per record (plus a single block for a partial one)...
+	struct job *j = arg;
+	for (size_t i = 0; i < j->count; i++) {
+		struct aes_mb_job *rec = &j->records[i];
+		j->ctr(rec->in, rec->out, rec->len / 16, rec->counter, rec->keys);
+		if (rec->len % 16) {
+			unsigned char keystream[16];
+			j->block((unsigned char *)rec->counter, keystream, rec->keys);
+			rec->counter[1]++;
+			for (size_t k = 0; k < rec->len % 16; k++) {
+				rec->out[rec->len / 16 * 16 + k] ^= keystream[k];
+			}
+		}
+	}
+}
+
+static void op_records_mb(void *arg) {
+	// ... or all of them at once, interleaved across records
+	struct job *j = arg;
+	aes_mb_ctr(j->records, j->count, j->key_len);
+}
+
+#define KEY_BATCH 1024
+static void op_keyexp_c(void *arg) {
+	struct job *j = arg;
+	for (int i = 0; i < KEY_BATCH; i++) {
+		aes_expand_key_c(j->batch_keys + i*j->key_len, j->key_len, j->enc_keys + i*AES_SCHEDULE_SIZE(j->key_len));
+	}
+}
+
+static void op_keyexp_batch(void *arg) {
+	// The batch API; on AES-NI CPUs this produces the decryption keys, too
+	struct job *j = arg;
+	aes_expand_keys(j->batch_keys, j->key_len, KEY_BATCH, j->enc_keys, j->enc_keys + KEY_BATCH*AES_MAX_EXPANDED_KEY);
+}
+
+static void op_file(void *arg) {
+	// One run of bin/ctr, fork to exit
+	struct job *j = arg;
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(1);
+	}
+	if (pid == 0) {
+		execv(j->argv[0], j->argv);
+		perror(j->argv[0]);
+		_exit(127);
+	}
+
+	int status;
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "%s failed\n", j->argv[0]);
+		exit(1);
+	}
+}
+
+static const char *cbc_kernel(void) {
+	return test_aesni_support() ? "aesni" : "generic";
+}
+
+static void bench_memory(unsigned char *buf, const unsigned char *key) {
+	unsigned char enc_keys[AES_MAX_EXPANDED_KEY], dec_keys[AES_MAX_EXPANDED_KEY];
+	size_t num_kernels;
+	const struct aes_kernel *kernels = aes_kernel_list(&num_kernels);
+
+	for (int key_len = 16; key_len <= 32; key_len += 8) {
+		aes_expand_keys(key, key_len, 1, enc_keys, dec_keys);
+		struct job j = { .buf = buf, .key_len = key_len, .keys = enc_keys, .dec_keys = dec_keys, .counter = {0, 1} };
+		struct bench_case c = { .key_bits = key_len * 8, .variant = "", .threads = 1 };
+		const struct bench_result *last;
+
+		// Single-block kernels
+		struct { const char *name; aes_block_func block; bool supported; } blocks[] = {
+			{ "aesni", key_len == 16 ? aes_encrypt_aesni : key_len == 24 ? aes_encrypt_aesni_192 : aes_encrypt_aesni_256, test_aesni_support() },
+			{ "vperm", key_len == 16 ? aes_encrypt_vperm : key_len == 24 ? aes_encrypt_vperm_192 : aes_encrypt_vperm_256, test_ssse3_support() },
+			{ "c", key_len == 16 ? aes_encrypt_c : key_len == 24 ? aes_encrypt_c_192 : aes_encrypt_c_256, true },
+		};
+		for (int k = 0; k < 3; k++) {
+			if (!blocks[k].supported)
+				continue;
+			c.mode = "block";
+			c.kernel = blocks[k].name;
+			j.block = blocks[k].block;
+			last = NULL;
+			for (size_t bytes = 16; bytes <= cfg.max_bytes && series_continues(last, bytes); bytes *= 4) {
+				c.bytes = c.units = j.bytes = bytes;
+				last = measure(&c, op_block, &j);
+			}
+		}
+
+		// CTR: every kernel in the registry, and the pool for buffers big enough to split
+		for (size_t k = 0; k < num_kernels; k++) {
+			if (!aes_kernel_supported(&kernels[k]))
+				continue;
+			for (int t = 0; t < cfg.num_threads; t++) {
+				c.mode = "ctr";
+				c.kernel = kernels[k].name;
+				c.threads = cfg.threads[t];
+				j.ctr = kernels[k].ctr[(key_len - 16) / 8];
+				j.pool = (c.threads > 1) ? ctr_pool_create(c.threads) : NULL;
+				last = NULL;
+				for (size_t bytes = (c.threads > 1) ? 65536 : 16; bytes <= cfg.max_bytes && series_continues(last, bytes); bytes *= 4) {
+					c.bytes = c.units = j.bytes = bytes;
+					last = measure(&c, op_ctr, &j);
+				}
+				if (j.pool != NULL)
+					ctr_pool_destroy(j.pool);
+				j.pool = NULL;
+			}
+		}
+		c.threads = 1;
+
+		// CBC, and the embedding API (CTR through aes_ctx_ctr_xor, one call per message)
+		struct aes_ctx ctx;
+		aes_ctx_init(&ctx, key, key_len);
+		j.ctx = &ctx;
+		struct { const char *mode; const char *kernel; bench_op op; } whole[] = {
+			{ "cbc-enc", cbc_kernel(), op_cbc_encrypt },
+			{ "cbc-dec", cbc_kernel(), op_cbc_decrypt },
+			{ "ctx-ctr", aes_kernel_active()->name, op_ctx },
+		};
+		for (int m = 0; m < 3; m++) {
+			c.mode = whole[m].mode;
+			c.kernel = whole[m].kernel;
+			last = NULL;
+			for (size_t bytes = 16; bytes <= cfg.max_bytes && series_continues(last, bytes); bytes *= 4) {
+				c.bytes = c.units = j.bytes = bytes;
+				last = measure(&c, whole[m].op, &j);
+			}
+		}
+		aes_ctx_clear(&ctx);
+
+		// GCM: the stitched AES-NI + PCLMULQDQ kernel and the portable path, one whole message per call
+		bool clmul = test_aesni_support() && test_pclmul_support() && test_ssse3_support();
+		for (int portable = clmul ? 0 : 1; portable <= 1; portable++) {
+			for (int decrypt = 0; decrypt <= 1; decrypt++) {
+				c.mode = decrypt ? "gcm-dec" : "gcm-enc";
+				c.kernel = portable ? "portable" : "clmul";
+				j.portable = portable;
+				last = NULL;
+				for (size_t bytes = 16; bytes <= cfg.max_bytes && series_continues(last, bytes); bytes *= 4) {
+					c.bytes = c.units = j.bytes = bytes;
+					last = measure(&c, decrypt ? op_gcm_decrypt : op_gcm_encrypt, &j);
+				}
+			}
+		}
+
+		// XTS (two keys of key_len bytes; XTS-AES-192 isn't standard, but xts.c supports it) with 512 and 4096-byte
+		// sectors, on the pool as well
+		struct aes_xts_key xts;
+		unsigned char xts_key[64];
+		memcpy(xts_key, key, 32);
+		memcpy(xts_key + 32, key, 32);
+		xts_key[32] ^= 1;
+		aes_xts_init(&xts, xts_key, key_len);
+		j.xts = &xts;
+		for (size_t sector = 512; sector <= 4096; sector *= 8) {
+			char variant[16];
+			snprintf(variant, sizeof(variant), "s%zu", sector);
+			for (int t = 0; t < cfg.num_threads; t++) {
+				for (int decrypt = 0; decrypt <= 1; decrypt++) {
+					c.mode = decrypt ? "xts-dec" : "xts-enc";
+					c.kernel = cbc_kernel();
+					c.variant = variant;
+					c.threads = cfg.threads[t];
+					j.sector = sector;
+					j.pool = (c.threads > 1) ? ctr_pool_create(c.threads) : NULL;
+					last = NULL;
+					for (size_t bytes = (c.threads > 1) ? 65536 : 16; bytes <= cfg.max_bytes && series_continues(last, bytes); bytes *= 4) {
+						if (bytes < sector)
+							continue;
+						c.bytes = c.units = j.bytes = bytes;
+						last = measure(&c, decrypt ? op_xts_decrypt : op_xts_encrypt, &j);
+					}
+					if (j.pool != NULL)
+						ctr_pool_destroy(j.pool);
+					j.pool = NULL;
+				}
+			}
+		}
+		c.variant = "";
+		c.threads = 1;
+	}
+}
+
+#define RECORDS 1024
+static void bench_records(const unsigned char *key) {
+	// Small records (each with its own key) of record_max/4 to record_max bytes: per block, per record, and aes_mb_ctr
+	for (int key_len = 16; key_len <= 32; key_len += 8) {
+		for (size_t record_max = 16; record_max <= 4096; record_max *= 4) {
+			struct aes_mb_job *records = malloc(RECORDS * sizeof(*records));
+			unsigned char *data = calloc(RECORDS, record_max);
+			unsigned char *schedules = malloc(RECORDS * AES_SCHEDULE_SIZE(key_len));
+			if (records == NULL || data == NULL || schedules == NULL) {
+				perror("malloc");
+				exit(1);
+			}
+			size_t total = 0;
+			for (int i = 0; i < RECORDS; i++) {
+				unsigned char record_key[32] = {i & 0xff, i >> 8};
+				aes_expand_key_len(record_key, key_len, schedules + i*AES_SCHEDULE_SIZE(key_len));
+				size_t len = record_max / 4 + (i * 2654435761u) % (record_max - record_max/4 + 1);
+				records[i] = (struct aes_mb_job){ .keys = schedules + i*AES_SCHEDULE_SIZE(key_len), .counter = {i, 1},
+				                                  .in = data + i*record_max, .out = data + i*record_max, .len = len };
+				total += len;
+			}
+
+			struct job j = { .key_len = key_len, .records = records, .count = RECORDS,
+			                 .ctr = aes_select_ctr(key_len), .block = aes_select_encrypt(key_len) };
+			struct bench_case c = { .mode = "records", .key_bits = key_len * 8, .variant = "", .bytes = record_max,
+			                        .threads = 1, .units = total };
+			c.kernel = "per-block";
+			measure(&c, op_records_block, &j);
+			c.kernel = "per-record";
+			measure(&c, op_records_ctr, &j);
+			c.kernel = "mb";
+			measure(&c, op_records_mb, &j);
+
+			free(records);
+			free(data);
+			free(schedules);
+		}
+	}
+}
+
+#define LATENCY_MESSAGES 2000
+static void bench_latency(const unsigned char *key) {
+	// Per-message latency of small CTR messages, with an idle gap after each one (as on a request path, rather than
+	// in a loop): aes_ctx_ctr_xor against the keystream ring, which uses the gaps to precompute. These are percentiles
+	// of single calls, not rates, so they're printed but not part of --json/--compare.
+	struct aes_ctx ctx;
+	aes_ctx_init(&ctx, key, 16);
+	static unsigned char msg[4096];
+	static double latency[LATENCY_MESSAGES];
+	struct timespec gap = { 0, 20000 };
+
+	for (size_t bytes = 64; bytes <= 4096; bytes *= 4) {
+		for (int ring = 0; ring <= 1; ring++) {
+			char id[128];
+			snprintf(id, sizeof(id), "latency/%s/aes128/%zu/t1", ring ? "keystream-ring" : "ctx-ctr", bytes);
+			if (cfg.filter != NULL && strstr(id, cfg.filter) == NULL)
+				continue;
+
+			uint64_t counter[2] = {0, 1};
+			struct aes_keystream *ks = ring ? aes_keystream_create(&ctx, counter, bytes, 16) : NULL;
+			if (ring && ks == NULL) {
+				perror("aes_keystream_create");
+				exit(1);
+			}
+			int messages = cfg.quick ? LATENCY_MESSAGES / 4 : LATENCY_MESSAGES;
+			for (int i = 0; i < messages; i++) {
+				nanosleep(&gap, NULL);
+				double start = seconds();
+				if (ring)
+					aes_keystream_xor(ks, msg, msg, bytes, counter);
+				else
+					aes_ctx_ctr_xor(&ctx, counter, msg, msg, bytes);
+				latency[i] = seconds() - start;
+			}
+
+			qsort(latency, messages, sizeof(double), compare_doubles);
+			printf("%-48s p50 %7.0f ns, p99 %7.0f ns", id, percentile(latency, messages, 50) * 1e9,
+					percentile(latency, messages, 99) * 1e9);
+			if (ring) {
+				uint64_t hits, misses;
+				aes_keystream_counts(ks, &hits, &misses);
+				printf(" (%llu of %d from the ring)", (unsigned long long)hits, messages);
+				aes_keystream_destroy(ks);
+			}
+			printf("\n");
+			fflush(stdout);
+		}
+	}
+	aes_ctx_clear(&ctx);
+}
+
+static void bench_keys(void) {
+	unsigned char *batch_keys = malloc(KEY_BATCH * 32);
+	unsigned char *enc_keys = malloc(2 * KEY_BATCH * AES_MAX_EXPANDED_KEY);
+	if (batch_keys == NULL || enc_keys == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	for (int i = 0; i < KEY_BATCH * 32; i++) {
+		batch_keys[i] = (unsigned char)i;
+	}
+
+	for (int key_len = 16; key_len <= 32; key_len += 8) {
+		struct job j = { .key_len = key_len, .batch_keys = batch_keys, .enc_keys = enc_keys };
+		struct bench_case c = { .mode = "keyexp", .key_bits = key_len * 8, .variant = "", .bytes = KEY_BATCH,
+		                        .threads = 1, .keys = true, .units = KEY_BATCH };
+		c.kernel = "c";
+		measure(&c, op_keyexp_c, &j);
+		c.kernel = test_aesni_support() ? "batch-aesni" : "batch";
+		measure(&c, op_keyexp_batch, &j);
+	}
+
+	free(batch_keys);
+	free(enc_keys);
+}
+
+static void bench_files(void) {
+	// bin/ctr -e and -d on tmpfs, so that the disk isn't what's being measured; the page cache copies are included
+	char ctr_path[4096];
+	ssize_t len = readlink("/proc/self/exe", ctr_path, sizeof(ctr_path) - 8);
+	if (len < 0) {
+		perror("readlink");
+		return;
+	}
+	ctr_path[len] = 0;
+	strcpy(strrchr(ctr_path, '/') + 1, "ctr");
+	if (access(ctr_path, X_OK) != 0) {
+		printf("(skipping the file benchmarks: %s not found; make ctr)\n", ctr_path);
+		return;
+	}
+
+	struct stat st;
+	const char *dir = (stat("/dev/shm", &st) == 0 && S_ISDIR(st.st_mode)) ? "/dev/shm" : "/tmp";
+	char plain[256], encrypted[256], decrypted[256];
+	snprintf(plain, sizeof(plain), "%s/aesbench_%d_plain", dir, (int)getpid());
+	snprintf(encrypted, sizeof(encrypted), "%s/aesbench_%d_encrypted", dir, (int)getpid());
+	snprintf(decrypted, sizeof(decrypted), "%s/aesbench_%d_decrypted", dir, (int)getpid());
+
+	// Written 1 MiB at a time, so that the big buffer (1 GiB) doesn't have to exist next to the files
+	unsigned char *block = malloc(1024*1024);
+	if (block == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	for (size_t i = 0; i < 1024*1024; i++) {
+		block[i] = (unsigned char)(i * 7);
 	}
 
+	for (size_t bytes = 1024*1024; bytes <= cfg.max_bytes; bytes *= 4) {
+		int fd = open(plain, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		for (size_t done = 0; fd >= 0 && done < bytes; done += 1024*1024) {
+			if (write(fd, block, 1024*1024) != 1024*1024) {
+				close(fd);
+				fd = -1;
+			}
+		}
+		if (fd < 0 || close(fd) != 0) {
+			perror(plain);
+			exit(1);
+		}
+
+		for (int t = 0; t < cfg.num_threads; t++) {
+			char threads[16];
+			snprintf(threads, sizeof(threads), "%d", cfg.threads[t]);
+			char *encrypt_argv[] = { ctr_path, "-e", plain, "-o", encrypted, "-j", threads, NULL };
+			char *decrypt_argv[] = { ctr_path, "-d", encrypted, "-o", decrypted, "-j", threads, NULL };
+			struct job j = { .argv = encrypt_argv };
+			struct bench_case c = { .mode = "file-enc", .kernel = aes_kernel_active()->name, .key_bits = 128, .variant = "",
+			                        .bytes = bytes, .threads = cfg.threads[t], .units = bytes };
+			// The encrypted file has to exist for -d, whether or not file-enc was filtered out
+			if (measure(&c, op_file, &j) == NULL)
+				op_file(&j);
+			j.argv = decrypt_argv;
+			c.mode = "file-dec";
+			measure(&c, op_file, &j);
+		}
+	}
+	unlink(plain);
+	unlink(encrypted);
+	unlink(decrypted);
+	free(block);
+}
+
+static void write_json(const char *path, const char *cpu) {
+	FILE *f = fopen(path, "w");
+	if (f == NULL) {
+		perror(path);
+		exit(1);
+	}
+
+	char date[32];
+	time_t now = time(NULL);
+	strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+	fprintf(f, "{\n  \"date\": \"%s\",\n  \"cpu\": \"%s\",\n  \"active_kernel\": \"%s\",\n  \"quick\": %s,\n  \"results\": [\n",
+			date, cpu, aes_kernel_active()->name, cfg.quick ? "true" : "false");
+	for (size_t i = 0; i < num_results; i++) {
+		const struct bench_result *r = &results[i];
+		fprintf(f, "    {\"id\": \"%s\", \"mode\": \"%s\", \"kernel\": \"%s\", \"key_bits\": %d, \"variant\": \"%s\", "
+				"\"bytes\": %zu, \"threads\": %d, \"unit\": \"%s\", \"samples\": %d, \"median\": %.6g, \"p10\": %.6g, \"p90\": %.6g, ",
+				r->id, r->c.mode, r->c.kernel, r->c.key_bits, r->variant, r->c.bytes, r->c.threads,
+				r->c.keys ? "keys" : "bytes", r->samples, r->median, r->p10, r->p90);
+		if (r->c.keys)
+			fprintf(f, "\"keys_per_s\": %.6g, \"cycles_per_key\": %.4g}", r->median, r->cycles);
+		else
+			fprintf(f, "\"gb_per_s\": %.6g, \"cycles_per_byte\": %.4g}", r->median / 1e9, r->cycles);
+		fprintf(f, "%s\n", (i + 1 < num_results) ? "," : "");
+	}
+	fprintf(f, "  ]\n}\n");
+
+	if (fclose(f) != 0) {
+		perror(path);
+		exit(1);
+	}
+}
+
+static int compare_baseline(const char *path) {
+	// Only reads files that write_json wrote: one result per line, with "id", "median" and "p10" on it.
+	// A case only counts as a regression if its median dropped by more than the threshold and even its 90th
+	// percentile is below the baseline's 10th, so that a few unlucky samples don't flag it.
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		perror(path);
+		exit(1);
+	}
+
+	int regressions = 0, improvements = 0, matched = 0;
+	char line[1024];
+	while (fgets(line, sizeof(line), f) != NULL) {
+		char *id = strstr(line, "\"id\": \"");
+		char *median = strstr(line, "\"median\": ");
+		char *p10 = strstr(line, "\"p10\": ");
+		if (id == NULL || median == NULL || p10 == NULL)
+			continue;
+		id += strlen("\"id\": \"");
+		*strchr(id, '"') = 0;
+		double base = strtod(median + strlen("\"median\": "), NULL);
+		double base_p10 = strtod(p10 + strlen("\"p10\": "), NULL);
+
+		for (size_t i = 0; i < num_results; i++) {
+			if (strcmp(results[i].id, id) != 0)
+				continue;
+
+			double change = (results[i].median - base) / base * 100;
+			matched++;
+			if (change < -cfg.threshold && results[i].p90 < base_p10) {
+				printf("REGRESSION: %-48s %+.1f%% (baseline %.6g, now %.6g)\n", id, change, base, results[i].median);
+				regressions++;
+			}
+			else if (change > cfg.threshold) {
+				printf("faster:     %-48s %+.1f%%\n", id, change);
+				improvements++;
+			}
+			break;
+		}
+	}
+	fclose(f);
+
+	printf("Compared %d of %zu cases against %s (threshold %.1f%%): %d slower, %d faster\n",
+			matched, num_results, path, cfg.threshold, regressions, improvements);
+	return regressions ? 1 : 0;
+}
+
+static void usage(void) {
+	fprintf(stderr, "Usage: bench [options]\n");
+	fprintf(stderr, "  --quick            buffers up to 16 MiB, fewer and shorter samples (about a minute in all)\n");
+	fprintf(stderr, "  --filter <text>    only run the cases whose id (mode/kernel/aesNNN/bytes/tN) contains text\n");
+	fprintf(stderr, "  --threads <list>   thread counts for the pool, e.g. 1,2,4 (default: 1 and the number of CPUs)\n");
+	fprintf(stderr, "  --json <file>      write the results to file\n");
+	fprintf(stderr, "  --compare <file>   compare against a --json file from an earlier run; exits with 1 on regressions\n");
+	fprintf(stderr, "  --threshold <pct>  how much slower counts as a regression (default 10)\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	const unsigned char key[] = {0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+	                             0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f};
+
+	cfg.threshold = 10;
+	static const struct option long_options[] = {
+		{ "quick", no_argument, NULL, 'q' },
+		{ "filter", required_argument, NULL, 'f' },
+		{ "threads", required_argument, NULL, 't' },
+		{ "json", required_argument, NULL, 'J' },
+		{ "compare", required_argument, NULL, 'C' },
+		{ "threshold", required_argument, NULL, 'T' },
+		{ NULL, 0, NULL, 0 }
+	};
+	int opt;
+	while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+		switch (opt) {
+			case 'q': cfg.quick = true; break;
+			case 'f': cfg.filter = optarg; break;
+			case 'J': cfg.json = optarg; break;
+			case 'C': cfg.compare = optarg; break;
+			case 'T': cfg.threshold = atof(optarg); break;
+			case 't':
+				for (char *p = strtok(optarg, ","); p != NULL && cfg.num_threads < 8; p = strtok(NULL, ",")) {
+					int n = atoi(p);
+					if (n < 1)
+						usage();
+					cfg.threads[cfg.num_threads++] = n;
+				}
+				break;
+			default: usage();
+		}
+	}
+	if (optind != argc)
+		usage();
+
+	if (cfg.num_threads == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		cfg.threads[cfg.num_threads++] = 1;
+		if (cpus > 1)
+			cfg.threads[cfg.num_threads++] = (cpus < 64) ? cpus : 64;
+	}
+	cfg.max_bytes = cfg.quick ? 16*1024*1024 : 1024*1024*1024;
+	cfg.samples = cfg.quick ? 9 : 21;
+	cfg.budget = cfg.quick ? 0.05 : 0.25;
+	cfg.warmup = cfg.quick ? 0.005 : 0.02;
+	cfg.max_call = cfg.quick ? 0.05 : 0.5;
+
+	char cpu[256] = "unknown";
+	FILE *cpuinfo = fopen("/proc/cpuinfo", "r");
+	if (cpuinfo != NULL) {
+		char line[512];
+		while (fgets(line, sizeof(line), cpuinfo) != NULL) {
+			if (strncmp(line, "model name", 10) == 0 && strchr(line, ':') != NULL) {
+				snprintf(cpu, sizeof(cpu), "%s", strchr(line, ':') + 2);
+				cpu[strcspn(cpu, "\n\"\\")] = 0;
+				break;
+			}
+		}
+		fclose(cpuinfo);
+	}
+	printf("CPU: %s; active CTR kernel: %s\n", cpu, aes_kernel_active()->name);
+
+	unsigned char *buf = malloc(cfg.max_bytes);
+	if (buf == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	for (size_t i = 0; i < cfg.max_bytes; i++) {
+		buf[i] = (unsigned char)(i * 7);
+	}
+
+	bench_memory(buf, key);
+	bench_records(key);
+	bench_latency(key);
+	bench_keys();
+	free(buf);
+	bench_files();
+
+	if (cfg.json != NULL)
+		write_json(cfg.json, cpu);
+	if (cfg.compare != NULL)
+		return compare_baseline(cfg.compare);
 	return 0;
 }
@@ -0,0 +1,385 @@
+#include <stdint.h>
+#include <string.h> /* memcpy */
+
+#include <emmintrin.h>
+
+#include "aes.h"
+
+/*
+ * Constant-time bitsliced AES for CPUs without AES-NI.
+ *
+ * aes_encrypt_c looks up every byte of the state in sbox and gmul2/gmul3, so its timing depends on the key
+ * and data (through the cache), and it's slow. Here, 8 blocks are encrypted at once: the 1024 bits of state are
+ * "orthogonalized" into 8 SSE2 registers, so that register i holds bit i of every byte of every block.
+ * SubBytes then becomes a fixed circuit of 113 XOR/AND/NOT operations (Boyar and Peralta's), and ShiftRows and
+ * MixColumns become shifts, masks and rotations; no table lookups, no data-dependent branches.
+ *
+ * The layout is the well-known "ct64" one: each 64-bit lane holds bit i of the bytes of 4 blocks, and an
+ * xmm register simply holds two such lanes side by side (blocks 0-3 in the low lane, 4-7 in the high lane).
+ * Every operation below works on 64-bit lanes independently, so nothing ever crosses between the halves.
+ */
+
+typedef __m128i bs_t;
+
+#define XOR(a, b) _mm_xor_si128((a), (b))
+#define AND(a, b) _mm_and_si128((a), (b))
+#define OR(a, b)  _mm_or_si128((a), (b))
+#define XNOR(a, b) _mm_xor_si128(_mm_xor_si128((a), (b)), _mm_set1_epi32(-1))
+#define MASK(m)   _mm_set1_epi64x((int64_t)(m))
+#define SHL(a, n) _mm_slli_epi64((a), (n))
+#define SHR(a, n) _mm_srli_epi64((a), (n))
+
+static inline void bs_swap(bs_t *x, bs_t *y, uint64_t cl, uint64_t ch, int s) {
+	bs_t a = *x, b = *y;
+	*x = OR(AND(a, MASK(cl)), SHL(AND(b, MASK(cl)), s));
+	*y = OR(SHR(AND(a, MASK(ch)), s), AND(b, MASK(ch)));
+}
+
+static inline void bs_ortho(bs_t *q) {
+	// Transposes the 8x8 bit matrices spread across q[0..7]; its own inverse.
+	bs_swap(&q[0], &q[1], 0x5555555555555555ULL, 0xAAAAAAAAAAAAAAAAULL, 1);
+	bs_swap(&q[2], &q[3], 0x5555555555555555ULL, 0xAAAAAAAAAAAAAAAAULL, 1);
+	bs_swap(&q[4], &q[5], 0x5555555555555555ULL, 0xAAAAAAAAAAAAAAAAULL, 1);
+	bs_swap(&q[6], &q[7], 0x5555555555555555ULL, 0xAAAAAAAAAAAAAAAAULL, 1);
+
+	bs_swap(&q[0], &q[2], 0x3333333333333333ULL, 0xCCCCCCCCCCCCCCCCULL, 2);
+	bs_swap(&q[1], &q[3], 0x3333333333333333ULL, 0xCCCCCCCCCCCCCCCCULL, 2);
+	bs_swap(&q[4], &q[6], 0x3333333333333333ULL, 0xCCCCCCCCCCCCCCCCULL, 2);
+	bs_swap(&q[5], &q[7], 0x3333333333333333ULL, 0xCCCCCCCCCCCCCCCCULL, 2);
+
+	bs_swap(&q[0], &q[4], 0x0F0F0F0F0F0F0F0FULL, 0xF0F0F0F0F0F0F0F0ULL, 4);
+	bs_swap(&q[1], &q[5], 0x0F0F0F0F0F0F0F0FULL, 0xF0F0F0F0F0F0F0F0ULL, 4);
+	bs_swap(&q[2], &q[6], 0x0F0F0F0F0F0F0F0FULL, 0xF0F0F0F0F0F0F0F0ULL, 4);
+	bs_swap(&q[3], &q[7], 0x0F0F0F0F0F0F0F0FULL, 0xF0F0F0F0F0F0F0F0ULL, 4);
+}
+
+static inline void bs_interleave_in(bs_t *q0, bs_t *q1, const unsigned char *lo, const unsigned char *hi) {
+	// Spreads the 32-bit words of block lo (low lanes) and block hi (high lanes) over two registers,
+	// so that the bytes that end up in the same bit plane are the ones ortho expects.
+	uint32_t a[4], b[4];
+	memcpy(a, lo, 16);
+	memcpy(b, hi, 16);
+
+	bs_t x0 = _mm_set_epi64x(b[0], a[0]);
+	bs_t x1 = _mm_set_epi64x(b[1], a[1]);
+	bs_t x2 = _mm_set_epi64x(b[2], a[2]);
+	bs_t x3 = _mm_set_epi64x(b[3], a[3]);
+
+	x0 = AND(OR(x0, SHL(x0, 16)), MASK(0x0000FFFF0000FFFFULL));
+	x1 = AND(OR(x1, SHL(x1, 16)), MASK(0x0000FFFF0000FFFFULL));
+	x2 = AND(OR(x2, SHL(x2, 16)), MASK(0x0000FFFF0000FFFFULL));
+	x3 = AND(OR(x3, SHL(x3, 16)), MASK(0x0000FFFF0000FFFFULL));
+	x0 = AND(OR(x0, SHL(x0, 8)), MASK(0x00FF00FF00FF00FFULL));
+	x1 = AND(OR(x1, SHL(x1, 8)), MASK(0x00FF00FF00FF00FFULL));
+	x2 = AND(OR(x2, SHL(x2, 8)), MASK(0x00FF00FF00FF00FFULL));
+	x3 = AND(OR(x3, SHL(x3, 8)), MASK(0x00FF00FF00FF00FFULL));
+
+	*q0 = OR(x0, SHL(x2, 8));
+	*q1 = OR(x1, SHL(x3, 8));
+}
+
+static inline void bs_interleave_out(unsigned char *lo, unsigned char *hi, bs_t q0, bs_t q1) {
+	// The inverse of bs_interleave_in
+	bs_t x0 = AND(q0, MASK(0x00FF00FF00FF00FFULL));
+	bs_t x1 = AND(q1, MASK(0x00FF00FF00FF00FFULL));
+	bs_t x2 = AND(SHR(q0, 8), MASK(0x00FF00FF00FF00FFULL));
+	bs_t x3 = AND(SHR(q1, 8), MASK(0x00FF00FF00FF00FFULL));
+	x0 = AND(OR(x0, SHR(x0, 8)), MASK(0x0000FFFF0000FFFFULL));
+	x1 = AND(OR(x1, SHR(x1, 8)), MASK(0x0000FFFF0000FFFFULL));
+	x2 = AND(OR(x2, SHR(x2, 8)), MASK(0x0000FFFF0000FFFFULL));
+	x3 = AND(OR(x3, SHR(x3, 8)), MASK(0x0000FFFF0000FFFFULL));
+	x0 = OR(x0, SHR(x0, 16));
+	x1 = OR(x1, SHR(x1, 16));
+	x2 = OR(x2, SHR(x2, 16));
+	x3 = OR(x3, SHR(x3, 16));
+
+	// The low 32 bits of each lane now hold one word of the block
+	uint64_t w0[2], w1[2], w2[2], w3[2];
+	_mm_storeu_si128((__m128i *)w0, x0);
+	_mm_storeu_si128((__m128i *)w1, x1);
+	_mm_storeu_si128((__m128i *)w2, x2);
+	_mm_storeu_si128((__m128i *)w3, x3);
+
+	uint32_t a[4] = { (uint32_t)w0[0], (uint32_t)w1[0], (uint32_t)w2[0], (uint32_t)w3[0] };
+	uint32_t b[4] = { (uint32_t)w0[1], (uint32_t)w1[1], (uint32_t)w2[1], (uint32_t)w3[1] };
+	memcpy(lo, a, 16);
+	memcpy(hi, b, 16);
+}
+
+static inline void bs_load(bs_t *q, const unsigned char *blocks) {
+	// 8 consecutive 16-byte blocks -> bitsliced state
+	for (int i = 0; i < 4; i++) {
+		bs_interleave_in(&q[i], &q[i + 4], blocks + i*16, blocks + (i + 4)*16);
+	}
+	bs_ortho(q);
+}
+
+static inline void bs_store(unsigned char *blocks, bs_t *q) {
+	bs_ortho(q);
+	for (int i = 0; i < 4; i++) {
+		bs_interleave_out(blocks + i*16, blocks + (i + 4)*16, q[i], q[i + 4]);
+	}
+}
+
+static inline void bs_sbox(bs_t *q) {
+	//
+	// SubBytes on all 128 bytes at once, using the Boyar-Peralta circuit
+	// ("A depth-16 circuit for the AES S-box"). q[7] is the most significant bit.
+	//
+	bs_t x0, x1, x2, x3, x4, x5, x6, x7;
+	bs_t y1, y2, y3, y4, y5, y6, y7, y8, y9;
+	bs_t y10, y11, y12, y13, y14, y15, y16, y17, y18, y19;
+	bs_t y20, y21;
+	bs_t z0, z1, z2, z3, z4, z5, z6, z7, z8, z9;
+	bs_t z10, z11, z12, z13, z14, z15, z16, z17;
+	bs_t t0, t1, t2, t3, t4, t5, t6, t7, t8, t9;
+	bs_t t10, t11, t12, t13, t14, t15, t16, t17, t18, t19;
+	bs_t t20, t21, t22, t23, t24, t25, t26, t27, t28, t29;
+	bs_t t30, t31, t32, t33, t34, t35, t36, t37, t38, t39;
+	bs_t t40, t41, t42, t43, t44, t45, t46, t47, t48, t49;
+	bs_t t50, t51, t52, t53, t54, t55, t56, t57, t58, t59;
+	bs_t t60, t61, t62, t63, t64, t65, t66, t67;
+	bs_t s0, s1, s2, s3, s4, s5, s6, s7;
+
+	x0 = q[7]; x1 = q[6]; x2 = q[5]; x3 = q[4];
+	x4 = q[3]; x5 = q[2]; x6 = q[1]; x7 = q[0];
+
+	// Top linear transformation
+	y14 = XOR(x3, x5);
+	y13 = XOR(x0, x6);
+	y9 = XOR(x0, x3);
+	y8 = XOR(x0, x5);
+	t0 = XOR(x1, x2);
+	y1 = XOR(t0, x7);
+	y4 = XOR(y1, x3);
+	y12 = XOR(y13, y14);
+	y2 = XOR(y1, x0);
+	y5 = XOR(y1, x6);
+	y3 = XOR(y5, y8);
+	t1 = XOR(x4, y12);
+	y15 = XOR(t1, x5);
+	y20 = XOR(t1, x1);
+	y6 = XOR(y15, x7);
+	y10 = XOR(y15, t0);
+	y11 = XOR(y20, y9);
+	y7 = XOR(x7, y11);
+	y17 = XOR(y10, y11);
+	y19 = XOR(y10, y8);
+	y16 = XOR(t0, y11);
+	y21 = XOR(y13, y16);
+	y18 = XOR(x0, y16);
+
+	// Non-linear section
+	t2 = AND(y12, y15);
+	t3 = AND(y3, y6);
+	t4 = XOR(t3, t2);
+	t5 = AND(y4, x7);
+	t6 = XOR(t5, t2);
+	t7 = AND(y13, y16);
+	t8 = AND(y5, y1);
+	t9 = XOR(t8, t7);
+	t10 = AND(y2, y7);
+	t11 = XOR(t10, t7);
+	t12 = AND(y9, y11);
+	t13 = AND(y14, y17);
+	t14 = XOR(t13, t12);
+	t15 = AND(y8, y10);
+	t16 = XOR(t15, t12);
+	t17 = XOR(t4, t14);
+	t18 = XOR(t6, t16);
+	t19 = XOR(t9, t14);
+	t20 = XOR(t11, t16);
+	t21 = XOR(t17, y20);
+	t22 = XOR(t18, y19);
+	t23 = XOR(t19, y21);
+	t24 = XOR(t20, y18);
+
+	t25 = XOR(t21, t22);
+	t26 = AND(t21, t23);
+	t27 = XOR(t24, t26);
+	t28 = AND(t25, t27);
+	t29 = XOR(t28, t22);
+	t30 = XOR(t23, t24);
+	t31 = XOR(t22, t26);
+	t32 = AND(t31, t30);
+	t33 = XOR(t32, t24);
+	t34 = XOR(t23, t33);
+	t35 = XOR(t27, t33);
+	t36 = AND(t24, t35);
+	t37 = XOR(t36, t34);
+	t38 = XOR(t27, t36);
+	t39 = AND(t29, t38);
+	t40 = XOR(t25, t39);
+
+	t41 = XOR(t40, t37);
+	t42 = XOR(t29, t33);
+	t43 = XOR(t29, t40);
+	t44 = XOR(t33, t37);
+	t45 = XOR(t42, t41);
+	z0 = AND(t44, y15);
+	z1 = AND(t37, y6);
+	z2 = AND(t33, x7);
+	z3 = AND(t43, y16);
+	z4 = AND(t40, y1);
+	z5 = AND(t29, y7);
+	z6 = AND(t42, y11);
+	z7 = AND(t45, y17);
+	z8 = AND(t41, y10);
+	z9 = AND(t44, y12);
+	z10 = AND(t37, y3);
+	z11 = AND(t33, y4);
+	z12 = AND(t43, y13);
+	z13 = AND(t40, y5);
+	z14 = AND(t29, y2);
+	z15 = AND(t42, y9);
+	z16 = AND(t45, y14);
+	z17 = AND(t41, y8);
+
+	// Bottom linear transformation
+	t46 = XOR(z15, z16);
+	t47 = XOR(z10, z11);
+	t48 = XOR(z5, z13);
+	t49 = XOR(z9, z10);
+	t50 = XOR(z2, z12);
+	t51 = XOR(z2, z5);
+	t52 = XOR(z7, z8);
+	t53 = XOR(z0, z3);
+	t54 = XOR(z6, z7);
+	t55 = XOR(z16, z17);
+	t56 = XOR(z12, t48);
+	t57 = XOR(t50, t53);
+	t58 = XOR(z4, t46);
+	t59 = XOR(z3, t54);
+	t60 = XOR(t46, t57);
+	t61 = XOR(z14, t57);
+	t62 = XOR(t52, t58);
+	t63 = XOR(t49, t58);
+	t64 = XOR(z4, t59);
+	t65 = XOR(t61, t62);
+	t66 = XOR(z1, t63);
+	s0 = XOR(t59, t63);
+	s6 = XNOR(t56, t62);
+	s7 = XNOR(t48, t60);
+	t67 = XOR(t64, t65);
+	s3 = XOR(t53, t66);
+	s4 = XOR(t51, t66);
+	s5 = XOR(t47, t65);
+	s1 = XNOR(t64, s3);
+	s2 = XNOR(t55, t67);
+
+	q[7] = s0; q[6] = s1; q[5] = s2; q[4] = s3;
+	q[3] = s4; q[2] = s5; q[1] = s6; q[0] = s7;
+}
+
+static inline void bs_shift_rows(bs_t *q) {
+	for (int i = 0; i < 8; i++) {
+		bs_t x = q[i];
+		q[i] = OR(OR(OR(AND(x, MASK(0x000000000000FFFFULL)),
+		                SHR(AND(x, MASK(0x00000000FFF00000ULL)), 4)),
+		             OR(SHL(AND(x, MASK(0x00000000000F0000ULL)), 12),
+		                SHR(AND(x, MASK(0x0000FF0000000000ULL)), 8))),
+		          OR(OR(SHL(AND(x, MASK(0x000000FF00000000ULL)), 8),
+		                SHR(AND(x, MASK(0xF000000000000000ULL)), 12)),
+		             SHL(AND(x, MASK(0x0FFF000000000000ULL)), 4)));
+	}
+}
+
+static inline bs_t bs_rotr32(bs_t x) {
+	// Swap the 32-bit halves of each 64-bit lane
+	return _mm_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1));
+}
+
+static inline bs_t bs_rotr16(bs_t x) {
+	return OR(SHR(x, 16), SHL(x, 48));
+}
+
+static inline void bs_mix_columns(bs_t *q) {
+	bs_t q0 = q[0], q1 = q[1], q2 = q[2], q3 = q[3];
+	bs_t q4 = q[4], q5 = q[5], q6 = q[6], q7 = q[7];
+	bs_t r0 = bs_rotr16(q0), r1 = bs_rotr16(q1), r2 = bs_rotr16(q2), r3 = bs_rotr16(q3);
+	bs_t r4 = bs_rotr16(q4), r5 = bs_rotr16(q5), r6 = bs_rotr16(q6), r7 = bs_rotr16(q7);
+
+	q[0] = XOR(XOR(q7, r7), XOR(r0, bs_rotr32(XOR(q0, r0))));
+	q[1] = XOR(XOR(XOR(q0, r0), XOR(q7, r7)), XOR(r1, bs_rotr32(XOR(q1, r1))));
+	q[2] = XOR(XOR(q1, r1), XOR(r2, bs_rotr32(XOR(q2, r2))));
+	q[3] = XOR(XOR(XOR(q2, r2), XOR(q7, r7)), XOR(r3, bs_rotr32(XOR(q3, r3))));
+	q[4] = XOR(XOR(XOR(q3, r3), XOR(q7, r7)), XOR(r4, bs_rotr32(XOR(q4, r4))));
+	q[5] = XOR(XOR(q4, r4), XOR(r5, bs_rotr32(XOR(q5, r5))));
+	q[6] = XOR(XOR(q5, r5), XOR(r6, bs_rotr32(XOR(q6, r6))));
+	q[7] = XOR(XOR(q6, r6), XOR(r7, bs_rotr32(XOR(q7, r7))));
+}
+
+static inline void bs_add_round_key(bs_t *q, const bs_t *sk) {
+	for (int i = 0; i < 8; i++) {
+		q[i] = XOR(q[i], sk[i]);
+	}
+}
+
+static void bs_key_schedule(bs_t *sk, const unsigned char *keys, int rounds) {
+	// Bitslices each round key, as if it were the state of 8 blocks that all hold that key
+	for (int round = 0; round <= rounds; round++) {
+		bs_t *q = sk + round*8;
+		for (int i = 0; i < 4; i++) {
+			bs_interleave_in(&q[i], &q[i + 4], keys + round*16, keys + round*16);
+		}
+		bs_ortho(q);
+	}
+}
+
+static inline __attribute__((always_inline)) void bs_encrypt(bs_t *q, const bs_t *sk, const int rounds) {
+	bs_add_round_key(q, sk);
+	for (int round = 1; round < rounds; round++) {
+		bs_sbox(q);
+		bs_shift_rows(q);
+		bs_mix_columns(q);
+		bs_add_round_key(q, sk + round*8);
+	}
+	bs_sbox(q);
+	bs_shift_rows(q);
+	bs_add_round_key(q, sk + rounds*8);
+}
+
+static inline __attribute__((always_inline)) void bs_ctr(const unsigned char *in, unsigned char *out, size_t blocks, uint64_t *counter, const unsigned char *keys, const int rounds) {
+	//
+	// Same contract as aes_ctr_aesni, but constant-time and without AES-NI.
+	// 8 counter blocks are encrypted per iteration; the last iteration may use only some of its keystream.
+	//
+	bs_t sk[15 * 8];
+	bs_key_schedule(sk, keys, rounds);
+
+	for (size_t i = 0; i < blocks; i += 8) {
+		uint64_t ctr_blocks[16];
+		for (int j = 0; j < 8; j++) {
+			ctr_blocks[2*j] = counter[0];
+			ctr_blocks[2*j + 1] = counter[1] + i + j;
+		}
+
+		bs_t q[8];
+		bs_load(q, (unsigned char *)ctr_blocks);
+		bs_encrypt(q, sk, rounds);
+
+		unsigned char keystream[8 * 16];
+		bs_store(keystream, q);
+
+		size_t n = (blocks - i < 8) ? blocks - i : 8;
+		for (size_t j = 0; j < n; j++) {
+			__m128i ks = _mm_loadu_si128((const __m128i *)(keystream + j*16));
+			__m128i data = _mm_loadu_si128((const __m128i *)(in + (i + j)*16));
+			_mm_storeu_si128((__m128i *)(out + (i + j)*16), _mm_xor_si128(ks, data));
+		}
+	}
+
+	counter[1] += blocks;
+}
+
+void aes_ctr_bitslice(const unsigned char *in, unsigned char *out, size_t blocks, uint64_t *counter, const unsigned char *keys) {
+	bs_ctr(in, out, blocks, counter, keys, 10);
+}
+
+void aes_ctr_bitslice_192(const unsigned char *in, unsigned char *out, size_t blocks, uint64_t *counter, const unsigned char *keys) {
+	bs_ctr(in, out, blocks, counter, keys, 12);
+}
+
+void aes_ctr_bitslice_256(const unsigned char *in, unsigned char *out, size_t blocks, uint64_t *counter, const unsigned char *keys) {
+	bs_ctr(in, out, blocks, counter, keys, 14);
+}
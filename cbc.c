@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <string.h> /* memcpy */
+#include <wmmintrin.h> /* AES-NI intrinsics */
+
+#include "cbc.h"
+#include "aes.h"
+#include "keyschedule.h" /* aes_rounds */
+#include "misc.h" /* test_aesni_support */
+
+//
+// CBC mode. Encryption is inherently serial (each block needs the previous ciphertext block), so the best we can
+// do there is keep the round keys in registers. Decryption has no such dependency: every plaintext block is
+// D(C[i]) ^ C[i-1], and all the ciphertext is known up front, so 8 blocks go through AESDEC side by side,
+// like the CTR kernel does with AESENC.
+//
+
+#define AESNI __attribute__((target("aes")))
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+AESNI static ALWAYS_INLINE void aesni_cbc_encrypt(const unsigned char *in, unsigned char *out, size_t blocks, unsigned char *iv, const unsigned char *keys, const int rounds) {
+	__m128i rk[15];
+	#pragma GCC unroll 15
+	for (int i = 0; i <= rounds; i++) {
+		rk[i] = _mm_loadu_si128((const __m128i *)(keys + i*16));
+	}
+
+	__m128i prev = _mm_loadu_si128((const __m128i *)iv);
+	for (size_t i = 0; i < blocks; i++) {
+		__m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(in + i*16)), prev);
+		b = _mm_xor_si128(b, rk[0]);
+		#pragma GCC unroll 14
+		for (int round = 1; round < rounds; round++) {
+			b = _mm_aesenc_si128(b, rk[round]);
+		}
+		prev = _mm_aesenclast_si128(b, rk[rounds]);
+		_mm_storeu_si128((__m128i *)(out + i*16), prev);
+	}
+	_mm_storeu_si128((__m128i *)iv, prev);
+}
+
+AESNI static ALWAYS_INLINE void aesni_cbc_decrypt(const unsigned char *in, unsigned char *out, size_t blocks, unsigned char *iv, const unsigned char *keys, const int rounds) {
+	__m128i rk[15];
+	#pragma GCC unroll 15
+	for (int i = 0; i <= rounds; i++) {
+		rk[i] = _mm_loadu_si128((const __m128i *)(keys + i*16));
+	}
+
+	__m128i prev = _mm_loadu_si128((const __m128i *)iv);
+	size_t i = 0;
+	for (; i + 8 <= blocks; i += 8) {
+		// All 8 ciphertext blocks are loaded before anything is stored, which keeps in == out working
+		__m128i c[8], b[8];
+		#pragma GCC unroll 8
+		for (int j = 0; j < 8; j++) {
+			c[j] = _mm_loadu_si128((const __m128i *)(in + (i+j)*16));
+			b[j] = _mm_xor_si128(c[j], rk[rounds]);
+		}
+		#pragma GCC unroll 14
+		for (int round = rounds - 1; round >= 1; round--) {
+			#pragma GCC unroll 8
+			for (int j = 0; j < 8; j++) {
+				b[j] = _mm_aesdec_si128(b[j], rk[round]);
+			}
+		}
+		#pragma GCC unroll 8
+		for (int j = 0; j < 8; j++) {
+			b[j] = _mm_aesdeclast_si128(b[j], rk[0]);
+		}
+
+		_mm_storeu_si128((__m128i *)(out + i*16), _mm_xor_si128(b[0], prev));
+		#pragma GCC unroll 7
+		for (int j = 1; j < 8; j++) {
+			_mm_storeu_si128((__m128i *)(out + (i+j)*16), _mm_xor_si128(b[j], c[j-1]));
+		}
+		prev = c[7];
+	}
+
+	for (; i < blocks; i++) {
+		__m128i c = _mm_loadu_si128((const __m128i *)(in + i*16));
+		__m128i b = _mm_xor_si128(c, rk[rounds]);
+		#pragma GCC unroll 14
+		for (int round = rounds - 1; round >= 1; round--) {
+			b = _mm_aesdec_si128(b, rk[round]);
+		}
+		b = _mm_aesdeclast_si128(b, rk[0]);
+		_mm_storeu_si128((__m128i *)(out + i*16), _mm_xor_si128(b, prev));
+		prev = c;
+	}
+	_mm_storeu_si128((__m128i *)iv, prev);
+}
+
+static void cbc_encrypt_generic(const unsigned char *in, unsigned char *out, size_t blocks, unsigned char *iv, const unsigned char *keys, aes_block_func encrypt) {
+	// One block at a time with whichever single-block kernel aes_select_encrypt picked
+	for (size_t i = 0; i < blocks; i++) {
+		unsigned char block[16];
+		for (int j = 0; j < 16; j++) {
+			block[j] = in[i*16 + j] ^ iv[j];
+		}
+		encrypt(block, out + i*16, keys);
+		memcpy(iv, out + i*16, 16);
+	}
+}
+
+static void cbc_decrypt_generic(const unsigned char *in, unsigned char *out, size_t blocks, unsigned char *iv, const unsigned char *keys, aes_block_func decrypt) {
+	for (size_t i = 0; i < blocks; i++) {
+		unsigned char ciphertext[16], block[16];
+		memcpy(ciphertext, in + i*16, 16); // in case in == out
+		decrypt(ciphertext, block, keys);
+		for (int j = 0; j < 16; j++) {
+			out[i*16 + j] = block[j] ^ iv[j];
+		}
+		memcpy(iv, ciphertext, 16);
+	}
+}
+
+AESNI static void aesni_cbc_encrypt_128(const unsigned char *in, unsigned char *out, size_t blocks, unsigned char *iv, const unsigned char *keys) {
+	aesni_cbc_encrypt(in, out, blocks, iv, keys, 10);
+}
+
+AESNI static void aesni_cbc_encrypt_192(const unsigned char *in, unsigned char *out, size_t blocks, unsigned char *iv, const unsigned char *keys) {
+	aesni_cbc_encrypt(in, out, blocks, iv, keys, 12);
+}
+
+AESNI static void aesni_cbc_encrypt_256(const unsigned char *in, unsigned char *out, size_t blocks, unsigned char *iv, const unsigned char *keys) {
+	aesni_cbc_encrypt(in, out, blocks, iv, keys, 14);
+}
+
+AESNI static void aesni_cbc_decrypt_128(const unsigned char *in, unsigned char *out, size_t blocks, unsigned char *iv, const unsigned char *keys) {
+	aesni_cbc_decrypt(in, out, blocks, iv, keys, 10);
+}
+
+AESNI static void aesni_cbc_decrypt_192(const unsigned char *in, unsigned char *out, size_t blocks, unsigned char *iv, const unsigned char *keys) {
+	aesni_cbc_decrypt(in, out, blocks, iv, keys, 12);
+}
+
+AESNI static void aesni_cbc_decrypt_256(const unsigned char *in, unsigned char *out, size_t blocks, unsigned char *iv, const unsigned char *keys) {
+	aesni_cbc_decrypt(in, out, blocks, iv, keys, 14);
+}
+
+int aes_cbc_encrypt(const unsigned char *in, unsigned char *out, size_t blocks, unsigned char *iv, const unsigned char *keys, int key_len) {
+	if (aes_rounds(key_len) < 0)
+		return -1;
+
+	if (!test_aesni_support())
+		cbc_encrypt_generic(in, out, blocks, iv, keys, aes_select_encrypt(key_len));
+	else if (key_len == 16)
+		aesni_cbc_encrypt_128(in, out, blocks, iv, keys);
+	else if (key_len == 24)
+		aesni_cbc_encrypt_192(in, out, blocks, iv, keys);
+	else
+		aesni_cbc_encrypt_256(in, out, blocks, iv, keys);
+
+	return 0;
+}
+
+int aes_cbc_decrypt(const unsigned char *in, unsigned char *out, size_t blocks, unsigned char *iv, const unsigned char *keys, int key_len) {
+	if (aes_rounds(key_len) < 0)
+		return -1;
+
+	if (!test_aesni_support())
+		cbc_decrypt_generic(in, out, blocks, iv, keys, aes_select_decrypt(key_len));
+	else if (key_len == 16)
+		aesni_cbc_decrypt_128(in, out, blocks, iv, keys);
+	else if (key_len == 24)
+		aesni_cbc_decrypt_192(in, out, blocks, iv, keys);
+	else
+		aesni_cbc_decrypt_256(in, out, blocks, iv, keys);
+
+	return 0;
+}
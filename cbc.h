@@ -0,0 +1,12 @@
+#ifndef _CBC_H
+#define _CBC_H
+
+#include <stddef.h>
+
+// CBC over whole blocks. iv is updated to the last ciphertext block, so a long message can be done in several calls.
+// aes_cbc_decrypt wants the keys prepared by aes_prepare_decryption_keys_len. in and out may be the same buffer.
+// Both return -1 for an invalid key length (16, 24 or 32 bytes).
+int aes_cbc_encrypt(const unsigned char *in, unsigned char *out, size_t blocks, unsigned char *iv, const unsigned char *keys, int key_len);
+int aes_cbc_decrypt(const unsigned char *in, unsigned char *out, size_t blocks, unsigned char *iv, const unsigned char *keys, int key_len);
+
+#endif
@@ -1,40 +1,61 @@
+#define _GNU_SOURCE /* fallocate */
 #include <stdio.h>
 #include <stdlib.h> /* exit */
 #include <string.h> /* memcmp */
 #include <assert.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <errno.h>
+#include <getopt.h>
 
+#include "ctr.h"
 #include "keyschedule.h"
 #include "aes.h"
 #include "debug.h"
-#include "misc.h" /* test_aesni_support */
+#include "pool.h"
+#include "pipeline.h"
+#include "uring.h"
+#include "cbc.h"
+#include "gcm.h"
+#include "stats.h"
+#include "arena.h"
+#include "direct.h"
+#include "v2.h"
+#include "batch.h"
 
-#define BUFSIZE 4 * (1 << 20) // 4 MiB
-//#define BUFSIZE 1024
 
 /*
- * The file structure used by this program is quite simple:
+ * The original (v1) file structure used by this program is quite simple:
  * [nonce, 8 bytes]
+ * [padding byte, 1 byte]
  * [ciphertext block #1], 16 bytes
  * [ciphertext block #2], 16 bytes
  * [ciphertext block #n], 16 bytes
- * [padding byte, 1 byte]
- * The value of the last byte (0 - 15) indicates how many bytes of the last ciphertext block are padding bytes
+ * The value of the padding byte (0 - 15) indicates how many bytes of the last ciphertext block are padding bytes
  * (and should be discarded after decryption).
  *
+ * When encrypting from a pipe, the size (and thus the padding) isn't known until we reach the end of the input.
+ * In that case the header padding byte is PADDING_IN_TRAILER, and the real padding byte is appended after the
+ * last ciphertext block instead.
+ *
  * The counter starts at 1 and increases by one for each block that is read.
  */
 
-off_t file_size(const char *path) {
-	// Returns an integer-type variable containing the file size, in bytes.
-	struct stat st;
-	if (stat(path, &st) != 0) {
-		perror(path);
+#define PADDING_IN_TRAILER 0xff
+
+static void get_random_bytes(unsigned char *buf, size_t len) {
+	// Fills buf with len bytes of pseudorandom data from /dev/urandom
+	FILE *urandom = fopen("/dev/urandom", "r");
+	if (!urandom) {
+		perror(NULL);
 		exit(1);
 	}
-
-	return (st.st_size);
+	if (fread(buf, len, 1, urandom) != 1) {
+		perror(NULL);
+		exit(1);
+	}
+	fclose(urandom);
 }
 
 uint64_t get_nonce(void) {
@@ -42,289 +63,1731 @@ uint64_t get_nonce(void) {
 	// returns it as a 64-bit integer.
 
 	uint64_t nonce;
-	FILE *urandom = fopen("/dev/urandom", "r");
-	if (!urandom) {
-		perror(NULL);
+	get_random_bytes((unsigned char *)&nonce, 8);
+
+	return nonce;
+}
+
+static void timed_xor(struct ctr_pool *pool, aes_ctr_func aes_ctr, const unsigned char *in, unsigned char *out, size_t blocks,
+		uint64_t *counter, const unsigned char *expanded_keys) {
+	// ctr_pool_xor for the loops that don't go through pipeline_run/uring_run (which time the callback themselves)
+	STATS_START(mark);
+	ctr_pool_xor(pool, aes_ctr, in, out, blocks, counter, expanded_keys);
+	STATS_STOP(mark, STATS_CRYPT, blocks * 16);
+}
+
+static size_t input_chunk(const struct stat *st) {
+	// The pipeline's chunk size for an input file (or pipe); see arena_chunk_size
+	return arena_chunk_size(S_ISREG(st->st_mode) ? st->st_size : -1);
+}
+
+static bool is_regular_file(const char *path, bool must_exist) {
+	// Returns true if path is a regular file (and thus can be mapped).
+	// A path that doesn't exist yet counts as one if must_exist is false, since we'll create it.
+	if (strcmp(path, "-") == 0)
+		return false;
+
+	struct stat st;
+	if (stat(path, &st) != 0)
+		return (!must_exist && errno == ENOENT);
+
+	return S_ISREG(st.st_mode);
+}
+
+static unsigned char *map_output(const char *outpath, size_t out_size) {
+	// Creates (or truncates) outpath, sizes it to out_size bytes and maps it writable.
+	int fd = open(outpath, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		perror(outpath);
 		exit(1);
 	}
-	if (fread(&nonce, 8, 1, urandom) != 1) {
-		perror(NULL);
+
+	// Reserve the blocks up front, so that we don't get a SIGBUS halfway through on a full disk;
+	// not all file systems support this, in which case the ftruncate below has to do.
+	if (fallocate(fd, 0, 0, out_size) != 0 && errno != EOPNOTSUPP) {
+		perror(outpath);
+		unlink(outpath);
+		exit(1);
+	}
+	if (ftruncate(fd, out_size) != 0) {
+		perror(outpath);
+		unlink(outpath);
 		exit(1);
 	}
 
-	return nonce;
+	unsigned char *out = mmap(NULL, out_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (out == MAP_FAILED) {
+		perror(outpath);
+		unlink(outpath);
+		exit(1);
+	}
+	if (madvise(out, out_size, MADV_SEQUENTIAL) != 0) // only a hint, like the ones in map_input
+		perror("madvise(MADV_SEQUENTIAL)");
+	close(fd); // the mapping keeps the file alive
+
+	return out;
 }
 
-void encrypt_file(const char *inpath, const char *outpath, const unsigned char *key) {
-	// Create a pointer to the correct function to use for this CPU
-	void (*aes_encrypt)(const unsigned char *, unsigned char *, const unsigned char *);
-	if (test_aesni_support()) {
-		aes_encrypt = aes_encrypt_aesni;
+static const unsigned char *map_input(const char *inpath, size_t size) {
+	// Maps the first size bytes of inpath read-only.
+	int fd = open(inpath, O_RDONLY);
+	if (fd < 0) {
+		perror(inpath);
+		exit(1);
 	}
-	else {
-		aes_encrypt = aes_encrypt_c;
+
+	unsigned char *in = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (in == MAP_FAILED) {
+		perror(inpath);
+		exit(1);
 	}
+	// Two calls: madvise takes one piece of advice at a time, not a mask. Both are only hints, so a kernel that
+	// refuses one is reported, but the mapping still works without it.
+	if (madvise(in, size, MADV_SEQUENTIAL) != 0)
+		perror("madvise(MADV_SEQUENTIAL)");
+	if (madvise(in, size, MADV_WILLNEED) != 0)
+		perror("madvise(MADV_WILLNEED)");
+	close(fd);
 
-	// Expand the keys; AES-128 uses 11 keys (11*16 = 176 bytes) for encryption/decryption, one per round plus one before the rounds
-	unsigned char expanded_keys[176] = {0};
-	aes_expand_key(key, expanded_keys);
+	return in;
+}
+
+static bool encrypt_mmap(const char *inpath, const char *outpath, off_t size, uint8_t padding,
+		aes_ctr_func aes_ctr, const unsigned char *expanded_keys, const struct ctr_options *opts) {
+	//
+	// Zero-copy version of the encrypt_file main loop: the input is mapped read-only, the output is created
+	// at its final size (which we know from the padding math) and mapped writable, and the CTR kernel reads
+	// from one mapping and writes to the other. No stdio buffers, and no heap buffers.
+	// Returns false without touching anything if one of the files can't be mapped (pipes, devices, ...),
+	// in which case the caller should use the buffered path instead.
+	//
+	if (!is_regular_file(inpath, true) || !is_regular_file(outpath, false))
+		return false;
+
+	size_t out_size = 8 + 1 + size + padding;
+	const unsigned char *in = map_input(inpath, size);
+	unsigned char *out = map_output(outpath, out_size);
+
+	uint64_t counter[2];
+	counter[0] = get_nonce();
+	counter[1] = 1;
+
+	// Same header as the buffered path: nonce, then padding byte
+	memcpy(out, &counter[0], 8);
+	out[8] = padding;
+	unsigned char *data = out + 9;
 
-	// Sanity check: don't try to encrypt nothingness (or weird errors stemming from the signed type)
-	off_t size = file_size(inpath);
-	if (size <= 0) {
+	struct ctr_pool *pool = ctr_pool_create(opts->threads);
+
+	// Still work in chunks, so that the kernel's output stays in cache until it's written back
+	size_t whole_blocks = size/16, step = arena_chunk_size(size) / 16;
+	for (size_t block = 0; block < whole_blocks; block += step) {
+		size_t n = whole_blocks - block;
+		if (n > step)
+			n = step;
+		timed_xor(pool, aes_ctr, in + block*16, data + block*16, n, counter, expanded_keys);
+	}
+
+	if (padding != 0) {
+		// Pad + encrypt the last block; see encrypt_file
+		unsigned char block[16];
+		memcpy(block, in + whole_blocks*16, 16-padding);
+		memset(block + (16-padding), 'A', padding);
+		aes_ctr(block, data + whole_blocks*16, 1, counter, expanded_keys);
+	}
+
+	ctr_pool_destroy(pool);
+	munmap((void *)in, size);
+	if (munmap(out, out_size) != 0) {
+		perror(outpath);
+		exit(1);
+	}
+
+	return true;
+}
+
+static bool decrypt_mmap(const char *inpath, const char *outpath, off_t size,
+		aes_ctr_func aes_ctr, const unsigned char *expanded_keys, const struct ctr_options *opts) {
+	// The decryption counterpart of encrypt_mmap; size is the (already validated) ciphertext file size.
+	if (!is_regular_file(inpath, true) || !is_regular_file(outpath, false))
+		return false;
+
+	const unsigned char *in = map_input(inpath, size);
+
+	uint64_t counter[2];
+	memcpy(&counter[0], in, 8);
+	counter[1] = 1;
+
+	uint8_t padding = in[8];
+	if (padding > 15) {
+		fprintf(stderr, "Invalid padding byte; file is either not encrypted by this program, or corrupt.\n");
+		exit(1);
+	}
+
+	const unsigned char *data = in + 9;
+	size_t blocks = (size - 9) / 16;
+	size_t out_size = blocks*16 - padding;
+	unsigned char *out = map_output(outpath, out_size);
+
+	struct ctr_pool *pool = ctr_pool_create(opts->threads);
+
+	// All blocks but the last one can be decrypted straight into the output mapping;
+	// the last one may be padded, and there's no room for the padding in the output.
+	size_t step = arena_chunk_size(size) / 16;
+	for (size_t block = 0; block < blocks - 1; block += step) {
+		size_t n = blocks - 1 - block;
+		if (n > step)
+			n = step;
+		timed_xor(pool, aes_ctr, data + block*16, out + block*16, n, counter, expanded_keys);
+	}
+
+	unsigned char last[16];
+	aes_ctr(data + (blocks-1)*16, last, 1, counter, expanded_keys);
+	memcpy(out + (blocks-1)*16, last, 16 - padding);
+
+	ctr_pool_destroy(pool);
+	munmap((void *)in, size);
+	if (munmap(out, out_size) != 0) {
+		perror(outpath);
+		exit(1);
+	}
+
+	return true;
+}
+
+static int open_input(const char *inpath) {
+	// "-" means stdin
+	if (strcmp(inpath, "-") == 0)
+		return STDIN_FILENO;
+
+	int fd = open(inpath, O_RDONLY);
+	if (fd < 0) {
+		perror(inpath);
+		exit(1);
+	}
+	return fd;
+}
+
+static int open_output(const char *outpath) {
+	// "-" means stdout
+	if (strcmp(outpath, "-") == 0)
+		return STDOUT_FILENO;
+
+	int fd = open(outpath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		perror(outpath);
+		exit(1);
+	}
+	return fd;
+}
+
+// State shared between encrypt_file/decrypt_file and their pipeline callbacks
+struct ctr_stream {
+	aes_ctr_func aes_ctr;
+	const unsigned char *expanded_keys;
+	struct ctr_pool *pool;
+	uint64_t counter[2];
+	uint8_t padding;   // from the header; PADDING_IN_TRAILER if it comes after the data
+	uint64_t total_in; // bytes seen so far
+};
+
+static size_t encrypt_chunk(void *arg, unsigned char *buf, size_t len, bool final) {
+	struct ctr_stream *st = arg;
+	st->total_in += len;
+
+	// Encrypt all the "whole" blocks in this chunk in one go; if there's a partial block at the end
+	// (only possible in the last chunk), we take care of that below.
+	size_t whole_blocks = len/16;
+	ctr_pool_xor(st->pool, st->aes_ctr, buf, buf, whole_blocks, st->counter, st->expanded_keys);
+
+	size_t outsize = whole_blocks*16;
+	if (!final)
+		return outsize;
+
+	if (st->total_in == 0) {
 		fprintf(stderr, "Cannot encrypt a file of size zero!\n");
 		exit(1);
 	}
 
-	// Since we can only encrypt full 16-byte blocks, we need to add padding to the last block
-	// if its length isn't divisble by 16. This calculates how many padding bytes are needed
-	// (in the range 0 - 15).
-	uint8_t padding = 16 - (size % 16);
+	uint8_t padding = 16 - (len % 16);
 	if (padding == 16)
 		padding = 0;
 
-	FILE *infile = fopen(inpath, "r");
-	if (!infile) {
-		perror(inpath);
+	if (st->padding != PADDING_IN_TRAILER && padding != st->padding) {
+		fprintf(stderr, "Input file changed size during encryption! Aborting!\n");
+		exit(1);
+	}
+
+	if (padding != 0) {
+		// Pad + encrypt the last block; the buffer has room for it
+		// TODO: use random bytes here; since the padding byte is unencrypted, info about the last block leaks out,
+		// namely that the last *padding* bytes are 'A' characters.
+		// Using urandom bytes should help in all cases where the attacked can't control urandom.
+		// The BEST solution is probably to encrypt the padding byte, though!
+		memset(buf + len, 'A', padding);
+		st->aes_ctr(buf + outsize, buf + outsize, 1, st->counter, st->expanded_keys);
+		outsize += 16; // make sure to write the padded block out, too
+	}
+
+	if (st->padding == PADDING_IN_TRAILER)
+		buf[outsize++] = padding;
+
+	return outsize;
+}
+
+static size_t decrypt_chunk(void *arg, unsigned char *buf, size_t len, bool final) {
+	struct ctr_stream *st = arg;
+	uint8_t padding = st->padding;
+
+	if (final && padding == PADDING_IN_TRAILER) {
+		// The real padding byte is the very last byte of the file
+		if (len == 0) {
+			fprintf(stderr, "Invalid file; file is either not encrypted by this program, or corrupt.\n");
+			exit(1);
+		}
+		padding = buf[--len];
+	}
+
+	st->total_in += len;
+	if (final && (len % 16 != 0 || st->total_in < 16 || padding > 15)) {
+		fprintf(stderr, "Invalid file size; file is either not encrypted by this program, or corrupt.\n");
 		exit(1);
 	}
 
-	FILE *outfile = fopen(outpath, "w");
-	if (!outfile) {
+	// Decrypt the whole chunk in one go; the padding (if any) ends up at the end of the last chunk,
+	// and is simply not written out.
+	ctr_pool_xor(st->pool, st->aes_ctr, buf, buf, len/16, st->counter, st->expanded_keys);
+
+	return final ? len - padding : len;
+}
+
+// The v2 format is described in v2.h
+
+static void v2_fail(const char *outpath, const char *message) {
+	// outpath is NULL for stdout; anything else is deleted, since it's incomplete
+	fprintf(stderr, "%s\n", message);
+	if (outpath)
+		unlink(outpath);
+	exit(1);
+}
+
+// State shared between v2_encrypt_file/v2_decrypt_file and their pipeline/io_uring callbacks
+struct v2_stream {
+	aes_ctr_func aes_ctr;
+	const unsigned char *expanded_keys;
+	struct ctr_pool *pool;
+	const char *created;     // the output file, deleted if anything goes wrong; NULL for stdout
+	uint32_t chunk_size;
+	uint64_t nonce, counter; // encryption: the counter the next chunk starts at
+	struct v2_chunk *index;  // encryption: every chunk so far
+	uint64_t chunks, plain_size;
+	off_t offset;            // encryption: bytes written so far, which is where the index goes
+	bool last_seen;          // decryption: the last chunk is done; what follows is the index and footer
+	uint64_t trailer_len;
+	unsigned char footer[sizeof(struct v2_footer)]; // decryption: the last bytes of the trailer so far
+};
+
+static size_t v2_encrypt_chunk(void *arg, unsigned char *data, size_t len, bool final, unsigned char **out) {
+	// One chunk per call: len is chunk_size for all but the last, which is short (or empty). The chunk header goes
+	// in the page in front of the data, and the data is zero filled to the next page, so the output is whole pages.
+	struct v2_stream *st = arg;
+	unsigned char *page = data - V2_PAGE;
+
+	struct v2_chunk chunk = { .index = st->chunks, .nonce = st->nonce, .counter_base = st->counter, .length = len,
+		.flags = final ? V2_CHUNK_LAST : 0 };
+	memset(page, 0, V2_PAGE);
+	memcpy(page, V2_CHUNK_MAGIC, 8);
+	memcpy(page + 8, &chunk, sizeof(chunk));
+
+	// The partial last block is encrypted whole; then everything past the data is zeroed again,
+	// which also gets rid of the unused keystream
+	size_t padded = v2_page_align(len);
+	uint64_t counter[2] = { st->nonce, st->counter };
+	memset(data + len, 0, padded - len);
+	ctr_pool_xor(st->pool, st->aes_ctr, data, data, (len + 15) / 16, counter, st->expanded_keys);
+	memset(data + len, 0, padded - len);
+	st->counter = counter[1];
+
+	if (st->chunks % 1024 == 0) {
+		st->index = realloc(st->index, (st->chunks + 1024) * sizeof(struct v2_chunk));
+		if (st->index == NULL) {
+			fprintf(stderr, "Failed to allocate memory!\n");
+			exit(1);
+		}
+	}
+	st->index[st->chunks++] = chunk;
+	st->plain_size += len;
+	st->offset += V2_PAGE + padded;
+
+	*out = page;
+	return V2_PAGE + padded;
+}
+
+static bool v2_encrypt_mmap(const char *inpath, const char *outpath, off_t size, uint32_t chunk_size, uint64_t nonce,
+		aes_ctr_func aes_ctr, const unsigned char *expanded_keys, const struct ctr_options *opts) {
+	// For a regular file the layout is known up front (as in batch.c), so the output can be created at its final
+	// size, and every chunk encrypted from one mapping into the other. Returns false, having done nothing, for
+	// anything that can't be mapped; empty files included, since there's nothing to map.
+	if (size == 0 || !is_regular_file(inpath, true) || !is_regular_file(outpath, false))
+		return false;
+
+	uint64_t chunks = size / chunk_size + 1; // the last one is short, or empty
+	size_t last = size - (chunks - 1) * chunk_size;
+	off_t index_offset = v2_chunk_offset(chunk_size, chunks - 1) + V2_PAGE + v2_page_align(last);
+	size_t out_size = index_offset + chunks * sizeof(struct v2_chunk) + sizeof(struct v2_footer);
+	const unsigned char *in = map_input(inpath, size);
+	unsigned char *out = map_output(outpath, out_size); // all zeroes to begin with
+
+	struct v2_header header = { .version = 2, .key_bits = opts->key_len * 8, .chunk_size = chunk_size, .nonce = nonce };
+	memcpy(header.magic, V2_MAGIC, 8);
+	memcpy(out, &header, sizeof(header));
+
+	struct ctr_pool *pool = ctr_pool_create(opts->threads);
+	for (uint64_t i = 0; i < chunks; i++) {
+		size_t len = (i == chunks - 1) ? last : chunk_size;
+		struct v2_chunk chunk = { .index = i, .nonce = nonce, .counter_base = 1 + i * (chunk_size / 16), .length = len,
+			.flags = (i == chunks - 1) ? V2_CHUNK_LAST : 0 };
+		unsigned char *dst = out + v2_chunk_offset(chunk_size, i);
+		memcpy(dst, V2_CHUNK_MAGIC, 8);
+		memcpy(dst + 8, &chunk, sizeof(chunk));
+		memcpy(out + index_offset + i * sizeof(chunk), &chunk, sizeof(chunk));
+
+		const unsigned char *src = in + i * chunk_size;
+		uint64_t counter[2] = { nonce, chunk.counter_base };
+		timed_xor(pool, aes_ctr, src, dst + V2_PAGE, len / 16, counter, expanded_keys);
+		if (len % 16 != 0) {
+			// The partial last block, through a block of its own; only its data goes into the output
+			size_t whole = len & ~(size_t)15;
+			unsigned char block[16] = {0};
+			memcpy(block, src + whole, len - whole);
+			aes_ctr(block, block, 1, counter, expanded_keys);
+			memcpy(dst + V2_PAGE + whole, block, len - whole);
+		}
+	}
+
+	struct v2_footer footer = { .chunks = chunks, .plain_size = size, .index_offset = index_offset };
+	memcpy(footer.magic, V2_INDEX_MAGIC, 8);
+	memcpy(out + index_offset + chunks * sizeof(struct v2_chunk), &footer, sizeof(footer));
+
+	ctr_pool_destroy(pool);
+	munmap((void *)in, size);
+	if (munmap(out, out_size) != 0) {
 		perror(outpath);
 		exit(1);
 	}
 
-	// The plaintext block
-	unsigned char block[16] = {0};
+	return true;
+}
 
-	// Where we store the ciphertext
-	unsigned char enc_block[16] = {0};
+static void v2_encrypt_file(const char *inpath, const char *outpath, aes_ctr_func aes_ctr, const unsigned char *expanded_keys,
+		const struct ctr_options *opts) {
+	// Everything up to the index is whole pages, in page-aligned buffers, so --direct can use O_DIRECT for all of it
+	struct direct_file in, out;
+	direct_open_input(&in, inpath, opts->direct);
 
-	// The counter (since this is CTR mode)
-	// The layout is simple: the first 64 bits is the nonce, and the second 64 bits is a simple counter.
-	// This should work for a maximum 2^64-1 blocks, which is 256 exabytes, so there's no need for a 128-bit counter.
-	uint64_t counter[2];
-	counter[0] = get_nonce();
-	counter[1] = 1;
+	struct stat st;
+	bool regular = fstat(in.fd, &st) == 0 && S_ISREG(st.st_mode);
+	size_t chunk_size = arena_chunk_size(regular ? st.st_size : -1);
+	if (chunk_size > V2_CHUNK_SIZE)
+		chunk_size = V2_CHUNK_SIZE;
+	uint64_t nonce = get_nonce();
 
-	// Prepend the nonce to the output file; it's needed for decryption, and doesn't need to be a secret
-	fwrite((void *)&(counter[0]), 8, 1, outfile);
-	// Also prepend the padding byte, so that EOF is the end of data
-	fputc(padding, outfile);
+	if (opts->use_mmap && regular &&
+			v2_encrypt_mmap(inpath, outpath, st.st_size, chunk_size, nonce, aes_ctr, expanded_keys, opts)) {
+		direct_close(&in);
+		return;
+	}
+
+	direct_open_output(&out, outpath, opts->direct);
+	struct v2_stream stream = { .aes_ctr = aes_ctr, .expanded_keys = expanded_keys, .chunk_size = chunk_size,
+		.created = (out.fd == STDOUT_FILENO) ? NULL : outpath, .nonce = nonce, .counter = 1, .offset = V2_PAGE };
+
+	struct v2_header header = { .version = 2, .key_bits = opts->key_len * 8, .chunk_size = chunk_size, .nonce = nonce };
+	memcpy(header.magic, V2_MAGIC, 8);
+	unsigned char *page = arena_alloc(V2_PAGE);
+	memset(page, 0, V2_PAGE);
+	memcpy(page, &header, sizeof(header));
+	direct_write(&out, page, V2_PAGE);
+	arena_free(page);
+
+	stream.pool = ctr_pool_create(opts->threads);
+	struct pipeline_framing framing = { .headroom = V2_PAGE, .tailroom = V2_PAGE, .process = v2_encrypt_chunk, .arg = &stream };
+
+	if (opts->direct) {
+		// O_DIRECT reads and writes are done one chunk at a time, in one buffer: header page, then data.
+		// A short read means end of input, so that's the last chunk; if the input is a whole number of chunks,
+		// the last chunk is an empty one.
+		unsigned char *buf = arena_alloc(V2_PAGE + chunk_size + V2_PAGE);
+		bool final;
+		do {
+			size_t len = direct_read(&in, buf + V2_PAGE, chunk_size);
+			if (len == (size_t)-1) {
+				perror(inpath);
+				v2_fail(stream.created, "Read error; aborting.");
+			}
+			final = len < chunk_size;
+
+			unsigned char *chunk;
+			STATS_START(mark);
+			size_t n = v2_encrypt_chunk(&stream, buf + V2_PAGE, len, final, &chunk);
+			STATS_STOP(mark, STATS_CRYPT, len);
+			direct_write(&out, chunk, n);
+		} while (!final);
+		arena_free(buf);
+	}
+	else if (opts->use_uring && regular && uring_run_framed(in.fd, 0, st.st_size, out.fd, V2_PAGE, chunk_size, &framing)) {
+		// io_uring writes at fixed offsets, and leaves the file position where the header left it
+		if (lseek(out.fd, stream.offset, SEEK_SET) != stream.offset) {
+			perror(outpath);
+			v2_fail(stream.created, "Write error; aborting.");
+		}
+	}
+	else
+		pipeline_run_framed(in.fd, out.fd, stream.created, chunk_size, &framing);
+
+	struct v2_footer footer = { .chunks = stream.chunks, .plain_size = stream.plain_size, .index_offset = stream.offset };
+	memcpy(footer.magic, V2_INDEX_MAGIC, 8);
+	direct_write(&out, (unsigned char *)stream.index, stream.chunks * sizeof(struct v2_chunk));
+	direct_write(&out, (unsigned char *)&footer, sizeof(footer));
+
+	ctr_pool_destroy(stream.pool);
+	free(stream.index);
+	direct_close(&in);
+	direct_close(&out);
+}
+
+static void v2_check_chunk(const struct v2_stream *st, const unsigned char *page, struct v2_chunk *chunk) {
+	// Reads the chunk header in page, and fails unless it's the next chunk and its length fits
+	memcpy(chunk, page + 8, sizeof(*chunk));
+	if (memcmp(page, V2_CHUNK_MAGIC, 8) != 0 || chunk->index != st->chunks || chunk->length > st->chunk_size ||
+			(!(chunk->flags & V2_CHUNK_LAST) && chunk->length != st->chunk_size))
+		v2_fail(st->created, "Invalid file; corrupt chunk header.");
+}
+
+static void v2_check_footer(const struct v2_stream *st, const unsigned char *footer_bytes, uint64_t trailer_len) {
+	// A streaming reader has no use for the index, but the footer after it confirms that nothing went missing
+	struct v2_footer footer;
+	memcpy(&footer, footer_bytes, sizeof(footer));
+	if (trailer_len != st->chunks * sizeof(struct v2_chunk) + sizeof(footer) || memcmp(footer.magic, V2_INDEX_MAGIC, 8) != 0 ||
+			footer.chunks != st->chunks || footer.plain_size != st->plain_size)
+		v2_fail(st->created, "Invalid file; the footer doesn't match the chunks.");
+}
+
+static size_t v2_decrypt_chunk(void *arg, unsigned char *buf, size_t len, bool final, unsigned char **out) {
+	//
+	// The input comes in pieces of V2_PAGE + chunk_size bytes, which is exactly one chunk (header page and data)
+	// until the last one; so every piece starts with a chunk header, up to the last chunk. Whatever follows that
+	// is the index and footer, which may run on into the next piece. The output is the chunk's data.
+	//
+	struct v2_stream *st = arg;
+	size_t pos = 0, out_len = 0;
+
+	if (!st->last_seen) {
+		struct v2_chunk chunk;
+		if (len < V2_PAGE)
+			v2_fail(st->created, "Invalid file; truncated (chunk header missing).");
+		v2_check_chunk(st, buf, &chunk);
+
+		size_t padded = v2_page_align(chunk.length);
+		if (len - V2_PAGE < padded)
+			v2_fail(st->created, "Invalid file; truncated (chunk data missing).");
+
+		uint64_t counter[2] = { chunk.nonce, chunk.counter_base };
+		ctr_pool_xor(st->pool, st->aes_ctr, buf + V2_PAGE, buf + V2_PAGE, (chunk.length + 15) / 16, counter, st->expanded_keys);
+		*out = buf + V2_PAGE;
+		out_len = chunk.length;
+
+		st->chunks++;
+		st->plain_size += chunk.length;
+		st->last_seen = chunk.flags & V2_CHUNK_LAST;
+		pos = V2_PAGE + padded;
+	}
+
+	if (st->last_seen) {
+		// Keep the last sizeof(footer) bytes of the trailer, wherever the pieces end
+		size_t n = len - pos, keep = sizeof(st->footer);
+		if (n >= keep)
+			memcpy(st->footer, buf + len - keep, keep);
+		else {
+			memmove(st->footer, st->footer + n, keep - n);
+			memcpy(st->footer + keep - n, buf + pos, n);
+		}
+		st->trailer_len += n;
+	}
+
+	if (final) {
+		if (!st->last_seen)
+			v2_fail(st->created, "Invalid file; truncated (chunk header missing).");
+		v2_check_footer(st, st->footer, st->trailer_len);
+	}
+
+	return out_len;
+}
+
+static bool v2_decrypt_mmap(const char *inpath, const char *outpath, off_t size, struct v2_stream *st, const struct ctr_options *opts) {
+	// Goes through the chunks the same way the streaming reader does, from one mapping into the other; the output
+	// size comes from the footer (and is checked against the chunks). Returns false, having done nothing, for
+	// anything that can't be mapped, including an empty output.
+	if (!is_regular_file(inpath, true) || !is_regular_file(outpath, false))
+		return false;
+	if ((size_t)size < 2*V2_PAGE + sizeof(struct v2_chunk) + sizeof(struct v2_footer))
+		v2_fail(NULL, "Invalid file; truncated.");
+
+	const unsigned char *in = map_input(inpath, size);
+	struct v2_footer footer;
+	memcpy(&footer, in + size - sizeof(footer), sizeof(footer));
+	if (footer.plain_size == 0) {
+		munmap((void *)in, size);
+		return false;
+	}
+	if (memcmp(footer.magic, V2_INDEX_MAGIC, 8) != 0 || footer.index_offset < 2*V2_PAGE || footer.index_offset > (uint64_t)size ||
+			(uint64_t)size - footer.index_offset != footer.chunks * sizeof(struct v2_chunk) + sizeof(footer))
+		v2_fail(NULL, "Invalid file; the footer doesn't match the chunks.");
+
+	unsigned char *out = map_output(outpath, footer.plain_size);
+	st->created = outpath;
+	st->pool = ctr_pool_create(opts->threads);
+
+	off_t offset = V2_PAGE;
+	struct v2_chunk chunk;
+	do {
+		if (offset + V2_PAGE > (off_t)footer.index_offset)
+			v2_fail(outpath, "Invalid file; truncated (chunk header missing).");
+		v2_check_chunk(st, in + offset, &chunk);
+		size_t padded = v2_page_align(chunk.length);
+		if (offset + V2_PAGE + padded > footer.index_offset || st->plain_size + chunk.length > footer.plain_size)
+			v2_fail(outpath, "Invalid file; the footer doesn't match the chunks.");
+
+		const unsigned char *src = in + offset + V2_PAGE;
+		unsigned char *dst = out + st->plain_size;
+		uint64_t counter[2] = { chunk.nonce, chunk.counter_base };
+		timed_xor(st->pool, st->aes_ctr, src, dst, chunk.length / 16, counter, st->expanded_keys);
+		if (chunk.length % 16 != 0) {
+			// The last partial block: the file has it whole (zero filled), the output only has room for the data
+			size_t whole = chunk.length & ~(size_t)15;
+			unsigned char block[16];
+			st->aes_ctr(src + whole, block, 1, counter, st->expanded_keys);
+			memcpy(dst + whole, block, chunk.length - whole);
+		}
+
+		st->chunks++;
+		st->plain_size += chunk.length;
+		offset += V2_PAGE + padded;
+	} while (!(chunk.flags & V2_CHUNK_LAST));
+	v2_check_footer(st, in + size - sizeof(footer), size - offset);
+
+	ctr_pool_destroy(st->pool);
+	munmap((void *)in, size);
+	if (munmap(out, footer.plain_size) != 0) {
+		perror(outpath);
+		exit(1);
+	}
 
-	assert(ftell(infile) == 0);
-	assert(ftell(outfile) == 9);
+	return true;
+}
 
-	unsigned char *in_buf = malloc(BUFSIZE);
-	if (!in_buf) {
-		fprintf(stderr, "Failed to allocate memory for the input buffer!\n");
+static void v2_decrypt_file(struct direct_file *in, const unsigned char *start, size_t start_len, const char *outpath,
+		aes_ctr_func aes_ctr, const unsigned char *expanded_keys, const struct ctr_options *opts) {
+	// start holds what decrypt_file has already read: the first 9 bytes (as a v1 header), or with --direct, the first page
+	unsigned char page[V2_PAGE];
+	memcpy(page, start, start_len);
+	if (start_len < V2_PAGE && direct_read(in, page + start_len, V2_PAGE - start_len) != V2_PAGE - start_len) {
+		fprintf(stderr, "Invalid file; the v2 header is incomplete.\n");
 		exit(1);
 	}
 
-	unsigned char *out_buf = malloc(BUFSIZE);
-	if (!out_buf) {
-		fprintf(stderr, "Failed to allocate memory for the output buffer!\n");
+	struct v2_header header;
+	memcpy(&header, page, sizeof(header));
+	if (!v2_header_valid(&header)) {
+		fprintf(stderr, "Invalid file; unsupported version or corrupt v2 header.\n");
+		exit(1);
+	}
+	if (header.key_bits != (uint32_t)opts->key_len * 8) {
+		fprintf(stderr, "This file was encrypted with a %u-bit key; use -k %u.\n", header.key_bits, header.key_bits);
 		exit(1);
 	}
 
-	// How many bytes we read this chunk
-	size_t b = 0;
+	struct v2_stream stream = { .aes_ctr = aes_ctr, .expanded_keys = expanded_keys, .chunk_size = header.chunk_size };
+	struct stat st;
+	bool regular = fstat(in->fd, &st) == 0 && S_ISREG(st.st_mode);
+	if (opts->use_mmap && regular && v2_decrypt_mmap(in->path, outpath, st.st_size, &stream, opts))
+		return;
+
+	struct direct_file out;
+	direct_open_output(&out, outpath, opts->direct);
+	stream.created = (out.fd == STDOUT_FILENO) ? NULL : outpath;
+	stream.pool = ctr_pool_create(opts->threads);
+	struct pipeline_framing framing = { .headroom = 0, .tailroom = 0, .process = v2_decrypt_chunk, .arg = &stream };
 
-	// The main loop.
-	while(!feof(infile)) {
+	if (opts->direct) {
+		// O_DIRECT reads have to be whole pages into aligned buffers, so the chunk header and data are read
+		// separately, and the index and footer (which aren't aligned) after switching back to normal reads
+		unsigned char *buf = arena_alloc(V2_PAGE + header.chunk_size);
+		unsigned char *data = buf + V2_PAGE;
+		struct v2_chunk chunk;
+		do {
+			if (direct_read(in, buf, V2_PAGE) != V2_PAGE)
+				v2_fail(stream.created, "Invalid file; truncated (chunk header missing).");
+			v2_check_chunk(&stream, buf, &chunk);
 
-		b = fread(in_buf, 1, BUFSIZE, infile);
-		if (b != BUFSIZE && !feof(infile)) {
-			fprintf(stderr, "Read error! Aborting!\n");
-			unlink(outpath); // Since we've already truncated it, and it's probably useless incomplete, let's delete it.
-			exit(1);
+			size_t padded = v2_page_align(chunk.length);
+			if (direct_read(in, data, padded) != padded)
+				v2_fail(stream.created, "Invalid file; truncated (chunk data missing).");
+
+			uint64_t counter[2] = { chunk.nonce, chunk.counter_base };
+			timed_xor(stream.pool, aes_ctr, data, data, (chunk.length + 15) / 16, counter, expanded_keys);
+			direct_write(&out, data, chunk.length);
+
+			stream.chunks++;
+			stream.plain_size += chunk.length;
+		} while (!(chunk.flags & V2_CHUNK_LAST));
+		arena_free(buf);
+
+		struct v2_chunk entry;
+		struct v2_footer footer;
+		direct_end(in);
+		for (uint64_t i = 0; i < stream.chunks; i++) {
+			if (read_full(in->fd, (unsigned char *)&entry, sizeof(entry)) != sizeof(entry))
+				v2_fail(stream.created, "Invalid file; truncated (index missing).");
 		}
+		if (read_full(in->fd, (unsigned char *)&footer, sizeof(footer)) != sizeof(footer))
+			v2_fail(stream.created, "Invalid file; the footer doesn't match the chunks.");
+		v2_check_footer(&stream, (unsigned char *)&footer, stream.chunks * sizeof(entry) + sizeof(footer));
+	}
+	else if (!(opts->use_uring && regular && uring_run_framed(in->fd, V2_PAGE, st.st_size - V2_PAGE, out.fd, 0,
+			V2_PAGE + header.chunk_size, &framing)))
+		pipeline_run_framed(in->fd, out.fd, stream.created, V2_PAGE + header.chunk_size, &framing);
+
+	ctr_pool_destroy(stream.pool);
+	direct_close(&out);
+}
+
+/*
+ * CBC files (--cbc) use the layout most other tools expect:
+ * [IV, 16 bytes]
+ * [ciphertext, PKCS#7 padded: 1 - 16 padding bytes, each holding the number of padding bytes]
+ * so the data after the IV is exactly what e.g. openssl enc -aes-128-cbc -K <key> -iv <IV> produces.
+ */
+
+struct cbc_stream {
+	const unsigned char *keys; // encryption or decryption keys, depending on the direction
+	int key_len;
+	unsigned char iv[16];      // the previous ciphertext block
+	uint64_t total_in;         // bytes seen so far
+};
+
+static size_t cbc_encrypt_chunk(void *arg, unsigned char *buf, size_t len, bool final) {
+	struct cbc_stream *st = arg;
+
+	if (final) {
+		// Pad up to the next block boundary; a whole block of padding if we're already on one
+		uint8_t padding = 16 - (len % 16);
+		memset(buf + len, padding, padding);
+		len += padding;
+	}
+
+	aes_cbc_encrypt(buf, buf, len/16, st->iv, st->keys, st->key_len);
+	return len;
+}
+
+static size_t cbc_decrypt_chunk(void *arg, unsigned char *buf, size_t len, bool final) {
+	struct cbc_stream *st = arg;
+	st->total_in += len;
+
+	if (final && (len % 16 != 0 || st->total_in < 16)) {
+		fprintf(stderr, "Invalid file size; file is either not CBC encrypted, or corrupt.\n");
+		exit(1);
+	}
+
+	aes_cbc_decrypt(buf, buf, len/16, st->iv, st->keys, st->key_len);
+	if (!final)
+		return len;
+
+	// Check and strip the padding. A mismatch here usually means a wrong key (or key size).
+	uint8_t padding = buf[len - 1];
+	bool valid = (padding >= 1 && padding <= 16);
+	for (int i = 1; valid && i <= padding; i++) {
+		valid = (buf[len - i] == padding);
+	}
+	if (!valid) {
+		fprintf(stderr, "Invalid padding; wrong key, or the file is either not CBC encrypted or corrupt.\n");
+		exit(1);
+	}
+
+	return len - padding;
+}
+
+static void cbc_encrypt_file(const char *inpath, const char *outpath, const unsigned char *key, const struct ctr_options *opts) {
+	unsigned char expanded_keys[AES_MAX_EXPANDED_KEY];
+	aes_expand_key_len(key, opts->key_len, expanded_keys);
+
+	struct cbc_stream stream = { .keys = expanded_keys, .key_len = opts->key_len };
+	get_random_bytes(stream.iv, 16);
+
+	int infd = open_input(inpath);
+	struct stat st;
+	if (fstat(infd, &st) != 0) {
+		perror(inpath);
+		exit(1);
+	}
+
+	int outfd = open_output(outpath);
+	write_full(outfd, stream.iv, 16);
+
+	// CBC encryption is serial, so -j doesn't apply; --mmap falls back to the pipeline
+	if (!(opts->use_uring && S_ISREG(st.st_mode) && uring_run(infd, 0, st.st_size, outfd, 16, 0, cbc_encrypt_chunk, &stream)))
+		pipeline_run(infd, outfd, (outfd == STDOUT_FILENO) ? NULL : outpath, input_chunk(&st), 0, cbc_encrypt_chunk, &stream);
+
+	close(infd);
+	if (close(outfd) != 0) {
+		perror(outpath);
+		exit(1);
+	}
+}
+
+static void cbc_decrypt_file(const char *inpath, const char *outpath, const unsigned char *key, const struct ctr_options *opts) {
+	unsigned char expanded_keys[AES_MAX_EXPANDED_KEY], decryption_keys[AES_MAX_EXPANDED_KEY];
+	aes_expand_keys(key, opts->key_len, 1, expanded_keys, decryption_keys);
+
+	struct cbc_stream stream = { .keys = decryption_keys, .key_len = opts->key_len };
+
+	int infd = open_input(inpath);
+	if (read_full(infd, stream.iv, 16) != 16) {
+		fprintf(stderr, "Invalid file; CBC files are at least 32 bytes long.\n");
+		exit(1);
+	}
 
-		// Encrypt all the "whole" blocks in this chunk; if there's a partial block at the end, we
-		// take care of that after this loop.
-		int cur_block = 0; // this is needed (well, it makes things easy) in the if statement just outside the loop
-		for (cur_block = 0; cur_block < b/16; cur_block++) {
-			// TODO: we don't need to copy the data to the "block" array, do we? why not use the output array?
-			memcpy(block, in_buf + (cur_block * 16), 16);
-			aes_encrypt((unsigned char *)counter, enc_block, expanded_keys);
-			counter[1]++;
-			AddRoundKey(enc_block, block);
-			memcpy(out_buf + cur_block*16, enc_block, 16);
+	struct stat st;
+	if (fstat(infd, &st) != 0) {
+		perror(inpath);
+		exit(1);
+	}
+	if (S_ISREG(st.st_mode) && (st.st_size < 32 || st.st_size % 16 != 0)) {
+		fprintf(stderr, "Invalid file size; file is either not CBC encrypted, or corrupt.\n");
+		exit(1);
+	}
+
+	int outfd = open_output(outpath);
+
+	// The padding is in the last block, so that has to be in the last chunk
+	if (!(opts->use_uring && S_ISREG(st.st_mode) && uring_run(infd, 16, st.st_size - 16, outfd, 0, 16, cbc_decrypt_chunk, &stream)))
+		pipeline_run(infd, outfd, (outfd == STDOUT_FILENO) ? NULL : outpath, input_chunk(&st), 16, cbc_decrypt_chunk, &stream);
+
+	close(infd);
+	if (close(outfd) != 0) {
+		perror(outpath);
+		exit(1);
+	}
+}
+
+/*
+ * GCM files (--gcm) are authenticated:
+ * [IV, 12 bytes]
+ * [ciphertext, same length as the plaintext]
+ * [tag, 16 bytes]
+ * which is also the layout most libraries use for a sealed GCM message, with the IV prepended.
+ * The tag can only be checked once the whole file has been decrypted, so a file that fails the check has already had
+ * all but its last chunk written out; decrypt_file deletes the output in that case (unless it's stdout).
+ */
+
+struct gcm_stream {
+	struct aes_gcm ctx;
+	const char *outpath; // deleted if the tag doesn't match; NULL for stdout
+	uint64_t total_in;
+};
+
+static size_t gcm_encrypt_chunk(void *arg, unsigned char *buf, size_t len, bool final) {
+	struct gcm_stream *st = arg;
+
+	aes_gcm_encrypt(&st->ctx, buf, buf, len);
+	if (!final)
+		return len;
+
+	// The tag goes in the buffer's slack space
+	aes_gcm_final(&st->ctx, buf + len);
+	return len + 16;
+}
+
+static size_t gcm_decrypt_chunk(void *arg, unsigned char *buf, size_t len, bool final) {
+	struct gcm_stream *st = arg;
+	st->total_in += len;
+
+	if (!final) {
+		aes_gcm_decrypt(&st->ctx, buf, buf, len);
+		return len;
+	}
+
+	if (len < 16) {
+		fprintf(stderr, "Invalid file; GCM files are at least 28 bytes long.\n");
+		exit(1);
+	}
+
+	unsigned char tag[16];
+	aes_gcm_decrypt(&st->ctx, buf, buf, len - 16);
+	aes_gcm_final(&st->ctx, tag);
+	if (!aes_gcm_tag_equal(tag, buf + len - 16, 16)) {
+		fprintf(stderr, "Authentication failed; wrong key, or the file has been modified or is not GCM encrypted.\n");
+		if (st->outpath)
+			unlink(st->outpath);
+		exit(1);
+	}
+
+	return len - 16;
+}
+
+static void gcm_encrypt_file(const char *inpath, const char *outpath, const unsigned char *key, const struct ctr_options *opts) {
+	unsigned char expanded_keys[AES_MAX_EXPANDED_KEY], iv[12];
+	aes_expand_key_len(key, opts->key_len, expanded_keys);
+	get_random_bytes(iv, 12);
+
+	struct gcm_stream stream = { 0 };
+	aes_gcm_init(&stream.ctx, expanded_keys, opts->key_len, iv, 12);
+
+	int infd = open_input(inpath);
+	struct stat st;
+	if (fstat(infd, &st) != 0) {
+		perror(inpath);
+		exit(1);
+	}
+
+	int outfd = open_output(outpath);
+	write_full(outfd, iv, 12);
+
+	// GHASH is serial too, so the same restrictions as for CBC apply
+	if (!(opts->use_uring && S_ISREG(st.st_mode) && uring_run(infd, 0, st.st_size, outfd, 12, 0, gcm_encrypt_chunk, &stream)))
+		pipeline_run(infd, outfd, (outfd == STDOUT_FILENO) ? NULL : outpath, input_chunk(&st), 0, gcm_encrypt_chunk, &stream);
+
+	close(infd);
+	if (close(outfd) != 0) {
+		perror(outpath);
+		exit(1);
+	}
+}
+
+static void gcm_decrypt_file(const char *inpath, const char *outpath, const unsigned char *key, const struct ctr_options *opts) {
+	unsigned char expanded_keys[AES_MAX_EXPANDED_KEY], iv[12];
+	aes_expand_key_len(key, opts->key_len, expanded_keys);
+
+	int infd = open_input(inpath);
+	if (read_full(infd, iv, 12) != 12) {
+		fprintf(stderr, "Invalid file; GCM files are at least 28 bytes long.\n");
+		exit(1);
+	}
+
+	struct stat st;
+	if (fstat(infd, &st) != 0) {
+		perror(inpath);
+		exit(1);
+	}
+	if (S_ISREG(st.st_mode) && st.st_size < 28) {
+		fprintf(stderr, "Invalid file; GCM files are at least 28 bytes long.\n");
+		exit(1);
+	}
+
+	int outfd = open_output(outpath);
+
+	struct gcm_stream stream = { .outpath = (outfd == STDOUT_FILENO) ? NULL : outpath };
+	aes_gcm_init(&stream.ctx, expanded_keys, opts->key_len, iv, 12);
+
+	// The tag is the last 16 bytes, so that has to be in the last chunk
+	if (!(opts->use_uring && S_ISREG(st.st_mode) && uring_run(infd, 12, st.st_size - 12, outfd, 0, 16, gcm_decrypt_chunk, &stream)))
+		pipeline_run(infd, outfd, stream.outpath, input_chunk(&st), 16, gcm_decrypt_chunk, &stream);
+
+	close(infd);
+	if (close(outfd) != 0) {
+		perror(outpath);
+		exit(1);
+	}
+}
+
+static bool pread_full(int fd, unsigned char *buf, size_t len, off_t offset) {
+	// pread until len bytes have been read; false on EOF or error
+	STATS_START(mark);
+	size_t total = len;
+	while (len > 0) {
+		ssize_t n = pread(fd, buf, len, offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		buf += n;
+		len -= n;
+		offset += n;
+	}
+	STATS_STOP(mark, STATS_READ, total);
+	return true;
+}
+
+static bool decrypt_span(int fd, aes_ctr_func aes_ctr, const unsigned char *expanded_keys, uint64_t nonce, uint64_t counter_base,
+		off_t data_offset, uint64_t offset, size_t length, unsigned char *out) {
+	// Bytes [offset, offset + length) of a run of ciphertext that starts at data_offset in the file,
+	// and whose first block uses counter (nonce, counter_base)
+	uint64_t first_block = offset / 16;
+	uint64_t counter[2] = { nonce, counter_base + first_block };
+
+	// Whole blocks in chunks, so that a large range doesn't need a buffer of its own size
+	size_t skip = offset % 16, done = 0;
+	size_t blocks = (skip + length + 15) / 16;
+	size_t bufsize = arena_chunk_size(blocks*16);
+	unsigned char *buf = arena_alloc(bufsize);
+
+	for (size_t block = 0; block < blocks; block += bufsize/16) {
+		size_t n = blocks - block;
+		if (n > bufsize/16)
+			n = bufsize/16;
+		if (!pread_full(fd, buf, n*16, data_offset + (first_block + block)*16)) {
+			arena_free(buf);
+			return false;
 		}
+		STATS_START(mark);
+		aes_ctr(buf, buf, n, counter, expanded_keys);
+		STATS_STOP(mark, STATS_CRYPT, n*16);
+
+		size_t take = n*16 - skip;
+		if (take > length - done)
+			take = length - done;
+		memcpy(out + done, buf + skip, take);
+		done += take;
+		skip = 0;
+	}
+
+	arena_free(buf);
+	return true;
+}
+
+static ssize_t v2_decrypt_range(int fd, off_t file_size, const unsigned char *expanded_keys, int key_len, aes_ctr_func aes_ctr,
+		uint64_t offset, size_t length, unsigned char *out) {
+	// The v2 part of decrypt_range: the footer gives the size, the index each chunk's counter
+	struct v2_header header;
+	struct v2_footer footer;
+	if (!pread_full(fd, (unsigned char *)&header, sizeof(header), 0) || !v2_header_valid(&header) ||
+			header.key_bits != (uint32_t)key_len * 8 || file_size < V2_PAGE + (off_t)sizeof(footer) ||
+			!pread_full(fd, (unsigned char *)&footer, sizeof(footer), file_size - sizeof(footer)) ||
+			memcmp(footer.magic, V2_INDEX_MAGIC, 8) != 0)
+		return -1;
+
+	if (offset >= footer.plain_size || length == 0)
+		return 0;
+	if (length > footer.plain_size - offset)
+		length = footer.plain_size - offset;
 
-		// Used in fwrite, below
-		size_t outsize = (b/16)*16;
-
-		// This goes AFTER the inside loop, since the loop will encrypt all "full" blocks but never partial ones.
-		if (b % 16 != 0 && feof(infile)) {
-			// Pad + encrypt the last block
-			memcpy(block, in_buf + (cur_block * 16), 16-padding); // the last block should be 16-padding bytes long
-
-			// TODO: use random bytes here; since the padding byte is unencrypted, info about the last block leaks out,
-			// namely that the last *padding* bytes are 'A' characters.
-			// Using urandom bytes should help in all cases where the attacked can't control urandom.
-			// The BEST solution is probably to encrypt the padding byte, though!
-			memset(block + (16-padding), 'A', padding);
-			aes_encrypt((unsigned char *)counter, enc_block, expanded_keys);
-			counter[1]++;
-			AddRoundKey(enc_block, block);
-			memcpy(out_buf + (cur_block * 16), enc_block, 16);
-
-			outsize += 16; // make sure to write the padded block out, too
+	size_t done = 0;
+	while (done < length) {
+		uint64_t chunk_number = (offset + done) / header.chunk_size;
+		uint64_t in_chunk = (offset + done) % header.chunk_size;
+		struct v2_chunk chunk;
+		if (chunk_number >= footer.chunks ||
+				!pread_full(fd, (unsigned char *)&chunk, sizeof(chunk), footer.index_offset + chunk_number * sizeof(chunk)) ||
+				chunk.length <= in_chunk)
+			return -1;
+
+		size_t n = chunk.length - in_chunk;
+		if (n > length - done)
+			n = length - done;
+		if (!decrypt_span(fd, aes_ctr, expanded_keys, chunk.nonce, chunk.counter_base,
+				v2_chunk_offset(header.chunk_size, chunk_number) + V2_PAGE, in_chunk, n, out + done))
+			return -1;
+		done += n;
+	}
+
+	return done;
+}
+
+/*
+ * In-place files (-e/-d --in-place) keep the data where it is: the ciphertext is at the same offsets as the plaintext
+ * was, and everything else goes in a trailer appended to the end (and truncated off again on decryption):
+ * [ciphertext, same length as the plaintext; block i uses counter (nonce, 1 + i), as in v1]
+ * [struct inplace_trailer, 64 bytes]
+ * The trailer is written (and synced) before the first byte is touched, with state saying what is in progress;
+ * it only says INPLACE_COMPLETE once all the data has been synced. A file whose trailer says INPLACE_ENCRYPTING or
+ * INPLACE_DECRYPTING was interrupted: everything below progress has been transformed, everything from
+ * progress + INPLACE_CHECKPOINT on hasn't, and what's in between is unknown.
+ */
+
+#define INPLACE_MAGIC "AESCTRv3"
+#define INPLACE_CHECKPOINT (256 << 20)
+
+enum inplace_state {
+	INPLACE_ENCRYPTING = 1,
+	INPLACE_COMPLETE = 2,
+	INPLACE_DECRYPTING = 3
+};
+
+struct inplace_trailer {
+	char magic[8];       // INPLACE_MAGIC
+	uint32_t version;    // 3
+	uint32_t key_bits;
+	uint64_t nonce;
+	uint64_t plain_size; // the trailer starts here
+	uint32_t state;      // enum inplace_state
+	uint32_t flags;      // none defined yet
+	uint64_t progress;   // bytes known to be done, while in progress
+	uint64_t reserved[2];
+};
+
+static bool read_inplace_trailer(int fd, off_t file_size, struct inplace_trailer *trailer) {
+	// True if the file ends with an in-place trailer (in any state)
+	return file_size >= (off_t)sizeof(*trailer) &&
+		pread_full(fd, (unsigned char *)trailer, sizeof(*trailer), file_size - sizeof(*trailer)) &&
+		memcmp(trailer->magic, INPLACE_MAGIC, 8) == 0 && trailer->version == 3 &&
+		trailer->plain_size == (uint64_t)file_size - sizeof(*trailer);
+}
+
+static void write_inplace_trailer(int fd, const char *path, const struct inplace_trailer *trailer) {
+	// Data first, then the trailer that describes it
+	if (fdatasync(fd) != 0 || pwrite(fd, trailer, sizeof(*trailer), trailer->plain_size) != sizeof(*trailer) || fdatasync(fd) != 0) {
+		perror(path);
+		exit(1);
+	}
+}
+
+static void inplace_xor(int fd, const char *path, struct inplace_trailer *trailer, aes_ctr_func aes_ctr,
+		const unsigned char *expanded_keys, const struct ctr_options *opts) {
+	// XORs the keystream over the whole data part, a chunk at a time, checkpointing progress in the trailer
+	size_t chunk = arena_chunk_size(trailer->plain_size);
+	unsigned char *buf = arena_alloc(chunk);
+	struct ctr_pool *pool = ctr_pool_create(opts->threads);
+	uint64_t counter[2] = { trailer->nonce, 1 };
+	uint64_t since_checkpoint = 0;
+
+	for (uint64_t offset = 0; offset < trailer->plain_size; offset += chunk) {
+		size_t len = (trailer->plain_size - offset < chunk) ? trailer->plain_size - offset : chunk;
+		if (!pread_full(fd, buf, len, offset)) {
+			perror(path);
+			exit(1);
 		}
 
-		// Write the encrypted chunk
-		if (fwrite(out_buf, 1, outsize, outfile) != outsize) {
-			fprintf(stderr, "*** Write error!\n");
+		// A partial last block is padded with zeroes in the buffer, and only len bytes are written back
+		memset(buf + len, 0, (16 - len % 16) % 16);
+		timed_xor(pool, aes_ctr, buf, buf, (len + 15) / 16, counter, expanded_keys);
+		STATS_START(mark);
+		if (pwrite(fd, buf, len, offset) != (ssize_t)len) {
+			perror(path);
 			exit(1);
 		}
+		STATS_STOP(mark, STATS_WRITE, len);
+
+		since_checkpoint += len;
+		if (since_checkpoint >= INPLACE_CHECKPOINT) {
+			trailer->progress = offset + len;
+			write_inplace_trailer(fd, path, trailer);
+			since_checkpoint = 0;
+		}
 	}
 
-	fclose(infile);
-	fclose(outfile);
-	free(in_buf); in_buf = NULL;
-	free(out_buf); out_buf = NULL;
+	ctr_pool_destroy(pool);
+	arena_free(buf);
 }
 
-void decrypt_file(const char *inpath, const char *outpath, const unsigned char *key) {
-	// Create a pointer to the correct function to use for this CPU
-	// [sic] on the aes_ENcrypt - CTR mode uses encryption for both ways (thanks to the fact that a XOR b XOR b == a)
-	void (*aes_encrypt)(const unsigned char *, unsigned char *, const unsigned char *);
-	if (test_aesni_support()) {
-		aes_encrypt = aes_encrypt_aesni;
+static void check_inplace_state(const struct inplace_trailer *trailer, const char *path) {
+	if (trailer->state == INPLACE_COMPLETE)
+		return;
+	fprintf(stderr, "%s: in-place %s was interrupted; only the first %llu of %llu bytes are known to be done. The file can't be recovered automatically.\n",
+			path, (trailer->state == INPLACE_ENCRYPTING) ? "encryption" : "decryption",
+			(unsigned long long)trailer->progress, (unsigned long long)trailer->plain_size);
+	exit(1);
+}
+
+static void encrypt_inplace(const char *path, aes_ctr_func aes_ctr, const unsigned char *expanded_keys, const struct ctr_options *opts) {
+	int fd = open(path, O_RDWR);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		perror(path);
+		exit(1);
 	}
-	else {
-		aes_encrypt = aes_encrypt_c;
+	if (!S_ISREG(st.st_mode)) {
+		fprintf(stderr, "%s: --in-place needs a regular file.\n", path);
+		exit(1);
 	}
 
-	// Perform key expansion (AES needs 11 keys; one for whitening and one per round - AES-128 has 10 rounds)
-	unsigned char expanded_keys[176] = {0};
-	aes_expand_key(key, expanded_keys);
-	// Note to self: no need to call aes_prepare_decryption_keys since we use aes_ENcrypt for decryption as well
+	struct inplace_trailer trailer;
+	if (read_inplace_trailer(fd, st.st_size, &trailer)) {
+		check_inplace_state(&trailer, path);
+		fprintf(stderr, "%s is already encrypted in place.\n", path);
+		exit(1);
+	}
 
-	// Perform some size sanity checking: the smallest possible encryption length is 1 byte, which is padded to 16 bytes; after that,
-	// the nonce (8 bytes) and padding byte (1 byte) is added, making the smallest possible ciphertext file 25 bytes.
-	off_t size = file_size(inpath);
-	if (size < 25) {
-		fprintf(stderr, "Invalid file; all files encrypted with this program are 25 bytes or longer.\n");
+	trailer = (struct inplace_trailer){ .version = 3, .key_bits = opts->key_len * 8, .nonce = get_nonce(),
+		.plain_size = st.st_size, .state = INPLACE_ENCRYPTING };
+	memcpy(trailer.magic, INPLACE_MAGIC, 8);
+	write_inplace_trailer(fd, path, &trailer);
+
+	inplace_xor(fd, path, &trailer, aes_ctr, expanded_keys, opts);
+
+	trailer.state = INPLACE_COMPLETE;
+	trailer.progress = trailer.plain_size;
+	write_inplace_trailer(fd, path, &trailer);
+	close(fd);
+}
+
+static void decrypt_inplace(const char *path, aes_ctr_func aes_ctr, const unsigned char *expanded_keys, const struct ctr_options *opts) {
+	int fd = open(path, O_RDWR);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		perror(path);
 		exit(1);
 	}
-	
-	// Since all ciphertext comes in blocks of 16, and there are 9 extra bytes, size-9 must be divisible by the block length (16)
-	// for this file to have been encrypted with this program.
-	if (! ( (size-1-8) % 16 == 0)) {
-		fprintf(stderr, "Invalid file size; file is either not encrypted by this program, or corrupt.\n");
+
+	struct inplace_trailer trailer;
+	if (!S_ISREG(st.st_mode) || !read_inplace_trailer(fd, st.st_size, &trailer)) {
+		fprintf(stderr, "%s was not encrypted in place (--in-place only decrypts files encrypted with --in-place).\n", path);
+		exit(1);
+	}
+	check_inplace_state(&trailer, path);
+	if (trailer.key_bits != (uint32_t)opts->key_len * 8) {
+		fprintf(stderr, "This file was encrypted with a %u-bit key; use -k %u.\n", trailer.key_bits, trailer.key_bits);
 		exit(1);
 	}
 
-	FILE *infile = fopen(inpath, "r");
-	if (!infile) {
-		perror(inpath);
+	trailer.state = INPLACE_DECRYPTING;
+	trailer.progress = 0;
+	write_inplace_trailer(fd, path, &trailer);
+
+	inplace_xor(fd, path, &trailer, aes_ctr, expanded_keys, opts);
+
+	// Only drop the trailer once the plaintext is on disk
+	if (fdatasync(fd) != 0 || ftruncate(fd, trailer.plain_size) != 0 || fsync(fd) != 0) {
+		perror(path);
+		exit(1);
+	}
+	close(fd);
+}
+
+static void decrypt_inplace_copy(int infd, const struct inplace_trailer *trailer, const char *outpath, aes_ctr_func aes_ctr,
+		const unsigned char *expanded_keys, const struct ctr_options *opts) {
+	// Plain -d of a file that was encrypted in place: same as decrypt_inplace, but into a new file
+	if (trailer->key_bits != (uint32_t)opts->key_len * 8) {
+		fprintf(stderr, "This file was encrypted with a %u-bit key; use -k %u.\n", trailer->key_bits, trailer->key_bits);
 		exit(1);
 	}
 
-	FILE *outfile = fopen(outpath, "w");
-	if (!outfile) {
+	int outfd = open_output(outpath);
+	size_t chunk = arena_chunk_size(trailer->plain_size);
+	unsigned char *buf = arena_alloc(chunk);
+	struct ctr_pool *pool = ctr_pool_create(opts->threads);
+	uint64_t counter[2] = { trailer->nonce, 1 };
+
+	for (uint64_t offset = 0; offset < trailer->plain_size; offset += chunk) {
+		size_t len = (trailer->plain_size - offset < chunk) ? trailer->plain_size - offset : chunk;
+		if (!pread_full(infd, buf, len, offset)) {
+			perror(NULL);
+			exit(1);
+		}
+		memset(buf + len, 0, (16 - len % 16) % 16);
+		timed_xor(pool, aes_ctr, buf, buf, (len + 15) / 16, counter, expanded_keys);
+		write_full(outfd, buf, len);
+	}
+
+	ctr_pool_destroy(pool);
+	arena_free(buf);
+	if (close(outfd) != 0) {
 		perror(outpath);
 		exit(1);
 	}
+}
 
-	uint64_t counter[2];
-	fread((void *)&(counter[0]), 8, 1, infile); // read nonce from file
-	counter[1] = 1; // initialize counter
+ssize_t decrypt_range(int fd, const unsigned char *expanded_keys, int key_len, uint64_t offset, size_t length, unsigned char *out) {
+	//
+	// Random access into a CTR file: plaintext byte i lives in block i/16, whose counter is (nonce, 1 + i/16)
+	// (for v2, counted from the start of its chunk), so only the blocks covering [offset, offset + length) need
+	// to be read and decrypted. Works for streamed v1 files (padding byte in the trailer) too. Returns the number
+	// of bytes written to out, which is less than length if the range runs past the end of the plaintext
+	// (0 if it starts there), or -1 if fd isn't a readable CTR file.
+	//
+	aes_ctr_func aes_ctr = aes_select_ctr(key_len);
+	struct stat st;
+	unsigned char header[9] = {0};
+	if (aes_ctr == NULL || fstat(fd, &st) != 0 || (st.st_size >= 9 && !pread_full(fd, header, 9, 0)))
+		return -1;
 
-	// Read the padding byte
-	uint8_t padding;
-	fread(&padding, 1, 1, infile);
+	if (memcmp(header, V2_MAGIC, 8) == 0)
+		return v2_decrypt_range(fd, st.st_size, expanded_keys, key_len, aes_ctr, offset, length, out);
 
-	unsigned char block[16] = {0};
-	unsigned char enc_block[16] = {0};
+	struct inplace_trailer trailer;
+	if (read_inplace_trailer(fd, st.st_size, &trailer)) {
+		if (trailer.state != INPLACE_COMPLETE || trailer.key_bits != (uint32_t)key_len * 8)
+			return -1;
+		if (offset >= trailer.plain_size || length == 0)
+			return 0;
+		if (length > trailer.plain_size - offset)
+			length = trailer.plain_size - offset;
+		return decrypt_span(fd, aes_ctr, expanded_keys, trailer.nonce, 1, 0, offset, length, out) ? (ssize_t)length : -1;
+	}
 
-	unsigned char *in_buf = malloc(BUFSIZE);
-	if (!in_buf) {
-		fprintf(stderr, "Failed to allocate memory for the input buffer!\n");
+	uint8_t padding = header[8];
+	off_t data_size = st.st_size - 9;
+	if (padding == PADDING_IN_TRAILER) {
+		if (data_size < 1 || !pread_full(fd, &padding, 1, st.st_size - 1))
+			return -1;
+		data_size--;
+	}
+	if (padding > 15 || data_size < 16 || data_size % 16 != 0)
+		return -1;
+
+	uint64_t plain_size = data_size - padding;
+	if (offset >= plain_size || length == 0)
+		return 0;
+	if (length > plain_size - offset)
+		length = plain_size - offset;
+
+	uint64_t nonce;
+	memcpy(&nonce, header, 8);
+	if (!decrypt_span(fd, aes_ctr, expanded_keys, nonce, 1, 9, offset, length, out))
+		return -1;
+	return length;
+}
+
+static void decrypt_range_file(const char *inpath, const char *outpath, const unsigned char *key, const struct ctr_options *opts) {
+	// --offset/--length: decrypt part of a file, without reading (or decrypting) the rest
+	unsigned char expanded_keys[AES_MAX_EXPANDED_KEY];
+	aes_expand_key_len(key, opts->key_len, expanded_keys);
+
+	int infd = open_input(inpath);
+	struct stat st;
+	if (fstat(infd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		fprintf(stderr, "%s: --offset and --length need a regular file to read from.\n", inpath);
 		exit(1);
 	}
 
-	unsigned char *out_buf = malloc(BUFSIZE);
-	if (!out_buf) {
-		fprintf(stderr, "Failed to allocate memory for the output buffer!\n");
+	// Never more than the file holds, however large --length is
+	uint64_t length = opts->range_length;
+	if (length > (uint64_t)st.st_size)
+		length = st.st_size;
+
+	unsigned char *out = malloc(length ? length : 1);
+	if (out == NULL) {
+		fprintf(stderr, "Failed to allocate memory!\n");
 		exit(1);
 	}
 
-	// How many bytes we read this chunk
-	size_t b = 0;
+	ssize_t n = decrypt_range(infd, expanded_keys, opts->key_len, opts->range_offset, length, out);
+	if (n < 0) {
+		fprintf(stderr, "Invalid file; file is either not encrypted by this program, or corrupt.\n");
+		exit(1);
+	}
 
-	size_t to_write = size - 9 - padding;
-	size_t bytes_read = 9; // nonce + padding
+	int outfd = open_output(outpath);
+	write_full(outfd, out, n);
+	free(out);
+	close(infd);
+	if (close(outfd) != 0) {
+		perror(outpath);
+		exit(1);
+	}
+}
 
-	// The main loop.
-	while(bytes_read < size) {
-		b = fread(in_buf, 1, BUFSIZE, infile);
-		bytes_read += b;
-		if (b != BUFSIZE && !feof(infile)) {
-			fprintf(stderr, "Read error! Aborting!\n");
-			unlink(outpath); // Since we've already truncated it, and it's probably useless incomplete, let's delete it.
+void encrypt_file(const char *inpath, const char *outpath, const unsigned char *key, const struct ctr_options *opts) {
+	if (opts->mode == MODE_CBC) {
+		cbc_encrypt_file(inpath, outpath, key, opts);
+		return;
+	}
+	if (opts->mode == MODE_GCM) {
+		gcm_encrypt_file(inpath, outpath, key, opts);
+		return;
+	}
+
+	// Pick the CTR kernel for this CPU and key size (AES-NI, or bitsliced constant-time software AES)
+	aes_ctr_func aes_ctr = aes_select_ctr(opts->key_len);
+
+	// Expand the keys; AES uses one round key per round plus one before the rounds,
+	// so 11 keys (176 bytes) for AES-128, up to 15 (240 bytes) for AES-256
+	unsigned char expanded_keys[AES_MAX_EXPANDED_KEY] = {0};
+	aes_expand_key_len(key, opts->key_len, expanded_keys);
+
+	if (opts->in_place) {
+		encrypt_inplace(inpath, aes_ctr, expanded_keys, opts);
+		return;
+	}
+	if (!opts->v1) {
+		v2_encrypt_file(inpath, outpath, aes_ctr, expanded_keys, opts);
+		return;
+	}
+
+	int infd = open_input(inpath);
+	struct stat st;
+	if (fstat(infd, &st) != 0) {
+		perror(inpath);
+		exit(1);
+	}
+
+	// If the input is a regular file, we know its size (and thus the padding) up front, and can write a regular header.
+	// If not (e.g. a pipe), the padding byte goes at the end of the file instead.
+	uint8_t padding = PADDING_IN_TRAILER;
+	if (S_ISREG(st.st_mode)) {
+		// Sanity check: don't try to encrypt nothingness (or weird errors stemming from the signed type)
+		off_t size = st.st_size;
+		if (size <= 0) {
+			fprintf(stderr, "Cannot encrypt a file of size zero!\n");
 			exit(1);
 		}
 
-		int cur_block = 0;
-		for (cur_block = 0; cur_block < b/16; cur_block++) {
-			// TODO: we don't need to copy the data to the "block" array, do we? why not use the output array?
-			memcpy(enc_block, in_buf + (cur_block * 16), 16);
-			aes_encrypt((unsigned char *)counter, block, expanded_keys);
-			counter[1]++;
-			AddRoundKey(block, enc_block);
-
-			if (bytes_read == size && cur_block == (b/16)-1) {
-				// This is the last block; don't copy the padding, if any
-				memcpy(out_buf + cur_block*16, block, 16-padding);
-			}
-			else {
-				// Just a normal block
-				memcpy(out_buf + cur_block*16, block, 16);
-			}
+		// Since we can only encrypt full 16-byte blocks, we need to add padding to the last block
+		// if its length isn't divisble by 16. This calculates how many padding bytes are needed
+		// (in the range 0 - 15).
+		padding = 16 - (size % 16);
+		if (padding == 16)
+			padding = 0;
+
+		if (opts->use_mmap && encrypt_mmap(inpath, outpath, size, padding, aes_ctr, expanded_keys, opts)) {
+			close(infd);
+			return;
 		}
+	}
+
+	int outfd = open_output(outpath);
+
+	// The counter (since this is CTR mode)
+	// The layout is simple: the first 64 bits is the nonce, and the second 64 bits is a simple counter.
+	// This should work for a maximum 2^64-1 blocks, which is 256 exabytes, so there's no need for a 128-bit counter.
+	struct ctr_stream stream = { .aes_ctr = aes_ctr, .expanded_keys = expanded_keys, .padding = padding };
+	stream.counter[0] = get_nonce();
+	stream.counter[1] = 1;
+
+	// Prepend the nonce to the output file; it's needed for decryption, and doesn't need to be a secret
+	// Also prepend the padding byte, so that EOF is the end of data
+	unsigned char header[9];
+	memcpy(header, &stream.counter[0], 8);
+	header[8] = padding;
+	write_full(outfd, header, 9);
+
+	// With -j N, each chunk is split across N threads
+	stream.pool = ctr_pool_create(opts->threads);
+
+	// io_uring needs to know where the input ends, so it's only an option for regular files
+	if (!(opts->use_uring && S_ISREG(st.st_mode) && uring_run(infd, 0, st.st_size, outfd, 9, 0, encrypt_chunk, &stream)))
+		pipeline_run(infd, outfd, (outfd == STDOUT_FILENO) ? NULL : outpath, input_chunk(&st), 0, encrypt_chunk, &stream);
+
+	ctr_pool_destroy(stream.pool);
+	close(infd);
+	if (close(outfd) != 0) {
+		perror(outpath);
+		exit(1);
+	}
+}
+
+void decrypt_file(const char *inpath, const char *outpath, const unsigned char *key, const struct ctr_options *opts) {
+	if (opts->mode == MODE_CBC) {
+		cbc_decrypt_file(inpath, outpath, key, opts);
+		return;
+	}
+	if (opts->mode == MODE_GCM) {
+		gcm_decrypt_file(inpath, outpath, key, opts);
+		return;
+	}
+	if (opts->range) {
+		decrypt_range_file(inpath, outpath, key, opts);
+		return;
+	}
+
+	// Create a pointer to the correct CTR kernel to use for this CPU
+	// CTR mode uses encryption for both ways (thanks to the fact that a XOR b XOR b == a)
+	aes_ctr_func aes_ctr = aes_select_ctr(opts->key_len);
+
+	// Perform key expansion (one key for whitening and one per round - AES-128 has 10 rounds, AES-256 has 14)
+	unsigned char expanded_keys[AES_MAX_EXPANDED_KEY] = {0};
+	aes_expand_key_len(key, opts->key_len, expanded_keys);
+	// Note to self: no need to call aes_prepare_decryption_keys since we use aes_ENcrypt for decryption as well
+
+	if (opts->in_place) {
+		decrypt_inplace(inpath, aes_ctr, expanded_keys, opts);
+		return;
+	}
 
-		size_t outsize;
-		// Used in fwrite, below
-		if (to_write > BUFSIZE) {
-			outsize = b;
+	if (opts->direct) {
+		// The first read has to be a whole page as well; only v2 files are laid out for O_DIRECT
+		struct direct_file in;
+		direct_open_input(&in, inpath, true);
+		unsigned char *page = arena_alloc(V2_PAGE);
+		if (direct_read(&in, page, V2_PAGE) != V2_PAGE || memcmp(page, V2_MAGIC, 8) != 0) {
+			fprintf(stderr, "--direct only reads v2 files (the default format), and this isn't one.\n");
+			exit(1);
 		}
-		else {
-			outsize = b - padding;
+		v2_decrypt_file(&in, page, V2_PAGE, outpath, aes_ctr, expanded_keys, opts);
+		arena_free(page);
+		direct_close(&in);
+		return;
+	}
+
+	int infd = open_input(inpath);
+
+	// Files encrypted in place can only be recognised by their end, so that needs a regular file
+	struct stat in_st;
+	struct inplace_trailer trailer;
+	if (fstat(infd, &in_st) == 0 && S_ISREG(in_st.st_mode) && read_inplace_trailer(infd, in_st.st_size, &trailer)) {
+		check_inplace_state(&trailer, inpath);
+		decrypt_inplace_copy(infd, &trailer, outpath, aes_ctr, expanded_keys, opts);
+		close(infd);
+		return;
+	}
+
+	// Read the nonce and the padding byte
+	unsigned char header[9];
+	if (read_full(infd, header, 9) != 9) {
+		fprintf(stderr, "Invalid file; all files encrypted with this program are 25 bytes or longer.\n");
+		exit(1);
+	}
+
+	if (memcmp(header, V2_MAGIC, 8) == 0) {
+		struct direct_file in;
+		direct_wrap(&in, infd, inpath);
+		v2_decrypt_file(&in, header, 9, outpath, aes_ctr, expanded_keys, opts);
+		close(infd);
+		return;
+	}
+
+	struct ctr_stream stream = { .aes_ctr = aes_ctr, .expanded_keys = expanded_keys };
+	memcpy(&stream.counter[0], header, 8); // read nonce from file
+	stream.counter[1] = 1; // initialize counter
+	stream.padding = header[8];
+
+	if (stream.padding > 15 && stream.padding != PADDING_IN_TRAILER) {
+		fprintf(stderr, "Invalid padding byte; file is either not encrypted by this program, or corrupt.\n");
+		exit(1);
+	}
+
+	struct stat st;
+	if (fstat(infd, &st) != 0) {
+		perror(inpath);
+		exit(1);
+	}
+
+	if (S_ISREG(st.st_mode)) {
+		// Perform some size sanity checking: the smallest possible encryption length is 1 byte, which is padded to 16 bytes; after that,
+		// the nonce (8 bytes) and padding byte (1 byte) is added, making the smallest possible ciphertext file 25 bytes.
+		// (Streamed files have their padding byte at the end instead, making them one byte longer.)
+		off_t size = st.st_size;
+		off_t extra = (stream.padding == PADDING_IN_TRAILER) ? 10 : 9;
+		if (size < 16 + extra) {
+			fprintf(stderr, "Invalid file; all files encrypted with this program are 25 bytes or longer.\n");
+			exit(1);
 		}
 
-		// Write the decrypted chunk
-		if (fwrite(out_buf, 1, outsize, outfile) != outsize) {
-			fprintf(stderr, "*** Write error!\n");
+		// Since all ciphertext comes in blocks of 16, size-9 (or size-10) must be divisible by the block length (16)
+		// for this file to have been encrypted with this program.
+		if (! ( (size-extra) % 16 == 0)) {
+			fprintf(stderr, "Invalid file size; file is either not encrypted by this program, or corrupt.\n");
 			exit(1);
 		}
-		to_write -= outsize;
+
+		if (opts->use_mmap && stream.padding != PADDING_IN_TRAILER &&
+				decrypt_mmap(inpath, outpath, size, aes_ctr, expanded_keys, opts)) {
+			close(infd);
+			return;
+		}
 	}
 
-	fclose(infile);
-	fclose(outfile);
-	free(in_buf); in_buf = NULL;
-	free(out_buf); out_buf = NULL;
+	int outfd = open_output(outpath);
+
+	// With -j N, each chunk is split across N threads
+	stream.pool = ctr_pool_create(opts->threads);
+
+	// The last chunk has to contain the whole last block (and the trailing padding byte, if any),
+	// since that's where the padding is trimmed off.
+	size_t holdback = (stream.padding == PADDING_IN_TRAILER) ? 17 : 16;
+	if (!(opts->use_uring && S_ISREG(st.st_mode) && uring_run(infd, 9, st.st_size - 9, outfd, 0, holdback, decrypt_chunk, &stream)))
+		pipeline_run(infd, outfd, (outfd == STDOUT_FILENO) ? NULL : outpath, input_chunk(&st), holdback, decrypt_chunk, &stream);
+
+	ctr_pool_destroy(stream.pool);
+	close(infd);
+	if (close(outfd) != 0) {
+		perror(outpath);
+		exit(1);
+	}
+}
+
+static void usage(void) {
+	fprintf(stderr, "The arguments MUST be in the form of -d <infile> -o <outfile> *OR* -e <infile> -o <outfile>\n");
+	fprintf(stderr, "(or -e/-d <file> --in-place)\n");
+	fprintf(stderr, "Use - as <infile> or <outfile> to read from stdin or write to stdout.\n");
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "  -k <bits>      key size: 128, 192 or 256 (default 128); decryption must use the same size\n");
+	fprintf(stderr, "  --cbc          CBC mode with a 16-byte IV header and PKCS#7 padding, for data from/to other tools\n");
+	fprintf(stderr, "                 (instead of this program's own CTR format; -j and --mmap don't apply)\n");
+	fprintf(stderr, "  --gcm          authenticated GCM mode: 12-byte IV, ciphertext, 16-byte tag; decryption fails\n");
+	fprintf(stderr, "                 (and deletes the output) if the file was modified; -j and --mmap don't apply\n");
+	fprintf(stderr, "  --v1           with -e: write the original 9-byte-header format instead of v2 (chunked, page aligned);\n");
+	fprintf(stderr, "                 -d reads both.\n");
+	fprintf(stderr, "  --in-place     encrypt/decrypt the file itself instead of writing a new one (no -o); the data stays\n");
+	fprintf(stderr, "                 where it is and a 64-byte trailer is appended. -d reads such files without --in-place, too.\n");
+	fprintf(stderr, "  --offset <n>   with -d: only decrypt the plaintext from byte n on (reads only the blocks needed)\n");
+	fprintf(stderr, "  --length <n>   with -d: only decrypt n bytes (default: up to the end of the file)\n");
+	fprintf(stderr, "  -j <threads>   split the encryption/decryption across this many threads (default 1)\n");
+	fprintf(stderr, "  --mmap         memory-map the input and output files instead of using read/write\n");
+	fprintf(stderr, "                 (falls back to read/write for pipes and other special files)\n");
+	fprintf(stderr, "  --uring        use io_uring to keep several reads and writes in flight\n");
+	fprintf(stderr, "                 (falls back to read/write if the kernel lacks io_uring, or for pipes)\n");
+	fprintf(stderr, "  --direct       with v2 files: bypass the page cache (O_DIRECT), for huge files that would otherwise\n");
+	fprintf(stderr, "                 push everything else out of it; where O_DIRECT isn't supported, drop the pages right after use\n");
+	fprintf(stderr, "  --batch        with -e: <infile> is a directory, or a list of files (one per line; - for stdin),\n");
+	fprintf(stderr, "                 and -o a directory to write them to (the same relative paths), as v2 files; files that\n");
+	fprintf(stderr, "                 fail are reported and skipped. -j sets the number of workers (default: one per core)\n");
+	fprintf(stderr, "  --stats[=json] print where the time went to stderr when done: per-stage wall/CPU time, chunk latencies,\n");
+	fprintf(stderr, "                 page faults and (if perf_event_open is allowed) cycles, instructions and cache misses\n");
+	fprintf(stderr, "Environment:\n");
+	fprintf(stderr, "  AES_KERNEL     force a CTR kernel (vaes-avx512, vaes-avx2, aesni, aesni1, bitslice, vperm, c), or\n");
+	fprintf(stderr, "                 \"tune\" to time the ones this CPU supports at startup and use the fastest\n");
+	exit(1);
 }
 
 int main(int argc, char *argv[]) {
-	unsigned char key[] = {0x2d, 0x7e, 0x86, 0xa3, 0x39, 0xd9, 0x39, 0x3e, 0xe6, 0x57, 0x0a, 0x11, 0x01, 0x90, 0x4e, 0x16};
+	// AES-128 uses the first 16 bytes, AES-192 the first 24
+	unsigned char key[] = {0x2d, 0x7e, 0x86, 0xa3, 0x39, 0xd9, 0x39, 0x3e, 0xe6, 0x57, 0x0a, 0x11, 0x01, 0x90, 0x4e, 0x16,
+	                       0x5c, 0xb2, 0x0f, 0x41, 0x9a, 0xe3, 0x77, 0xc8, 0x14, 0x6d, 0xf0, 0x2b, 0x83, 0x58, 0xa9, 0x3c};
+
+	struct ctr_options opts = { .threads = 1, .use_mmap = false, .use_uring = false, .key_len = 16, .mode = MODE_CTR,
+		.range_length = UINT64_MAX };
+	const char *inpath = NULL, *outpath = NULL;
+	int mode = 0; // 'e' or 'd'
+	int stats = 0; // 't' or 'j' with --stats
+	bool batch = false, threads_set = false;
+
+	static const struct option long_options[] = {
+		{ "mmap", no_argument, NULL, 'm' },
+		{ "uring", no_argument, NULL, 'u' },
+		{ "key-size", required_argument, NULL, 'k' },
+		{ "cbc", no_argument, NULL, 'c' },
+		{ "gcm", no_argument, NULL, 'g' },
+		{ "v1", no_argument, NULL, '1' },
+		{ "in-place", no_argument, NULL, 'i' },
+		{ "offset", required_argument, NULL, 'O' },
+		{ "length", required_argument, NULL, 'L' },
+		{ "stats", optional_argument, NULL, 's' },
+		{ "direct", no_argument, NULL, 'D' },
+		{ "batch", no_argument, NULL, 'B' },
+		{ NULL, 0, NULL, 0 }
+	};
 
-	if (argc != 5 || strcmp(argv[3], "-o") != 0) {
-		fprintf(stderr, "The arguments MUST be in the form of -d <infile> -o <outfile> *OR* -e <infile> -o <outfile>");
+	int c;
+	while ((c = getopt_long(argc, argv, "e:d:o:j:k:", long_options, NULL)) != -1) {
+		switch (c) {
+			case 'e':
+			case 'd':
+				if (mode != 0)
+					usage();
+				mode = c;
+				inpath = optarg;
+				break;
+			case 'o':
+				outpath = optarg;
+				break;
+			case 'j':
+				opts.threads = atoi(optarg);
+				if (opts.threads < 1) {
+					fprintf(stderr, "Invalid thread count: %s\n", optarg);
+					exit(1);
+				}
+				threads_set = true;
+				break;
+			case 'k':
+				opts.key_len = atoi(optarg) / 8;
+				if (aes_rounds(opts.key_len) < 0 || atoi(optarg) % 8 != 0) {
+					fprintf(stderr, "Invalid key size: %s (must be 128, 192 or 256)\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'c':
+				opts.mode = MODE_CBC;
+				break;
+			case 'g':
+				opts.mode = MODE_GCM;
+				break;
+			case '1':
+				opts.v1 = true;
+				break;
+			case 'i':
+				opts.in_place = true;
+				break;
+			case 'O':
+			case 'L': {
+				char *end;
+				errno = 0;
+				unsigned long long value = strtoull(optarg, &end, 10);
+				if (errno != 0 || *end != '\0' || end == optarg || optarg[0] == '-') {
+					fprintf(stderr, "Invalid %s: %s\n", (c == 'O') ? "offset" : "length", optarg);
+					exit(1);
+				}
+				if (c == 'O')
+					opts.range_offset = value;
+				else
+					opts.range_length = value;
+				opts.range = true;
+				break;
+			}
+			case 'm':
+				opts.use_mmap = true;
+				break;
+			case 'u':
+				opts.use_uring = true;
+				break;
+			case 'D':
+				opts.direct = true;
+				break;
+			case 'B':
+				batch = true;
+				break;
+			case 's':
+				if (optarg == NULL || strcmp(optarg, "text") == 0)
+					stats = 't';
+				else if (strcmp(optarg, "json") == 0)
+					stats = 'j';
+				else {
+					fprintf(stderr, "Invalid --stats format: %s (must be text or json)\n", optarg);
+					exit(1);
+				}
+				break;
+			default:
+				usage();
+		}
+	}
+
+	if (optind != argc || (outpath == NULL) != opts.in_place)
+		usage();
+	if (opts.in_place && (opts.mode != MODE_CTR || opts.range)) {
+		fprintf(stderr, "--in-place only works with the default CTR mode, and not with --offset/--length.\n");
+		exit(1);
+	}
+	if (opts.direct && (opts.mode != MODE_CTR || opts.v1 || opts.in_place || opts.range || opts.use_mmap || opts.use_uring)) {
+		fprintf(stderr, "--direct only works with v2 CTR files, and not with --v1, --in-place, --offset/--length, --mmap or --uring.\n");
+		exit(1);
+	}
+	if (opts.range && (mode != 'd' || opts.mode != MODE_CTR)) {
+		fprintf(stderr, "--offset and --length only apply to decrypting CTR files (-d).\n");
 		exit(1);
 	}
-	if (strcmp(argv[1], "-e") == 0)
-		encrypt_file(argv[2], argv[4], key);
-	else if (strcmp(argv[1], "-d") == 0)
-		decrypt_file(argv[2], argv[4], key);
+	if (batch && (mode != 'e' || opts.mode != MODE_CTR || opts.v1 || opts.in_place || opts.direct || opts.use_mmap ||
+			opts.use_uring || stats)) {
+		fprintf(stderr, "--batch only encrypts (-e) to v2 CTR files, and doesn't go with --cbc, --gcm, --v1, --in-place,\n");
+		fprintf(stderr, "--direct, --mmap, --uring or --stats.\n");
+		exit(1);
+	}
+	if (batch) {
+		// One worker per core unless -j says otherwise; each file is encrypted by one thread at a time (or, for big
+		// files, one thread per range), so -j is the number of workers here rather than threads per chunk
+		if (!threads_set) {
+			long cores = sysconf(_SC_NPROCESSORS_ONLN);
+			opts.threads = (cores > 0) ? cores : 1;
+		}
+		return batch_encrypt(inpath, outpath, key, &opts) ? 1 : 0;
+	}
+#ifdef NO_STATS
+	if (stats) {
+		fprintf(stderr, "--stats isn't available: this build was compiled with NO_STATS.\n");
+		exit(1);
+	}
+#endif
+	// Before any threads are started, so that the hardware counters cover them too
+	if (stats)
+		stats_init(stats == 'j');
+
+	if (mode == 'e')
+		encrypt_file(inpath, outpath, key, &opts);
+	else if (mode == 'd')
+		decrypt_file(inpath, outpath, key, &opts);
 	else {
 		fprintf(stderr, "Need an argument: either -e or -d\n");
 		exit(1);
 	}
 
+	stats_report();
 	return 0;
 }
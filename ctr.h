@@ -1,2 +1,28 @@
-void encrypt_file(const char *inpath, const char *outpath, const unsigned char *key);
-void decrypt_file(const char *inpath, const char *outpath, const unsigned char *key);
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h> /* ssize_t */
+
+enum ctr_mode {
+	MODE_CTR, // this program's own CTR format (the default)
+	MODE_CBC, // IV + PKCS#7-padded CBC (--cbc)
+	MODE_GCM  // IV + GCM ciphertext + tag (--gcm)
+};
+
+struct ctr_options {
+	int threads;    // number of threads running the CTR kernel (-j); 1 = do everything in the calling thread
+	bool use_mmap;  // map the input and output files instead of going through stdio (--mmap)
+	bool use_uring; // use the io_uring backend for regular files (--uring)
+	int key_len;    // AES key length in bytes: 16, 24 or 32 (-k 128/192/256)
+	enum ctr_mode mode; // file format and cipher mode (--cbc, --gcm)
+	bool v1;            // write the original CTR format instead of v2 (--v1)
+	bool in_place;      // transform the input file itself, with a trailer (--in-place)
+	bool direct;        // keep v2 files out of the page cache (--direct)
+	bool range;            // decrypt only part of the file (--offset, --length)
+	uint64_t range_offset; // in plaintext bytes
+	uint64_t range_length; // UINT64_MAX = to the end
+};
+
+void encrypt_file(const char *inpath, const char *outpath, const unsigned char *key, const struct ctr_options *opts);
+void decrypt_file(const char *inpath, const char *outpath, const unsigned char *key, const struct ctr_options *opts);
+ssize_t decrypt_range(int fd, const unsigned char *expanded_keys, int key_len, uint64_t offset, size_t length, unsigned char *out);
+uint64_t get_nonce(void); // 64 random bits from /dev/urandom; exits if that fails
@@ -0,0 +1,562 @@
+#define _GNU_SOURCE /* accept4, pthread_setaffinity_np */
+#include <stdio.h>
+#include <stdlib.h> /* exit */
+#include <string.h> /* memcmp, memmove */
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/stat.h> /* chmod */
+#include <sys/un.h>
+
+#include "ctrd.h"
+#include "ctx.h"
+#include "mb.h"
+#include "arena.h"
+
+/*
+ * bin/ctrd: AES-CTR as a service, for callers that would otherwise start bin/ctr (and pay for the process, the CPU
+ * detection and the key schedule) once per object. See ctrd.h for the protocol.
+ *
+ * There's one event loop per core, each with its own epoll instance and pinned to its core; they all watch the
+ * listening socket (EPOLLEXCLUSIVE, so a new connection wakes one of them), and a connection stays with the loop that
+ * accepted it. The key schedules are set up once, at startup, and shared read-only by all the loops.
+ *
+ * Every connection has an input buffer of IN_SIZE and an output buffer of OUT_SIZE. Data is transformed from the one
+ * into the other, so when a client doesn't read its answers, the output buffer fills up, then the input buffer, and
+ * then the loop stops reading from that client until it catches up. The client is left blocked in write(), and the
+ * memory a connection can hold on to stays bounded, however slow it is.
+ *
+ * Each time round, a loop collects what all its ready connections have to encrypt, and sends the small pieces
+ * (interactive traffic: a few hundred bytes per request) through the multi-buffer kernel together, so that they fill
+ * its lanes instead of each running a few blocks through the bulk kernel on its own. Bigger pieces go through the
+ * bulk kernel (aes_ctx_ctr_xor) directly.
+ */
+
+#define IN_SIZE (64 << 10)
+#define OUT_SIZE (256 << 10)
+#define MAX_EVENTS 64
+#define MB_MAX 4096 // pieces up to this size go through aes_mb_ctr
+
+struct loop;
+
+struct conn {
+	int fd;
+	struct loop *loop;
+	unsigned char *in, *out;
+	size_t in_start, in_end;   // input not yet transformed
+	size_t out_start, out_end; // output not yet sent
+	uint32_t events;           // what epoll is watching for
+
+	// The request being streamed, if any
+	bool in_request;
+	const struct aes_ctx *ctx;
+	uint64_t counter[2];
+	uint64_t remaining;
+
+	bool eof;     // the client has shut down its end
+	bool closing; // a bad request was answered; close once that's sent
+	bool dead;    // a read or write failed
+};
+
+struct loop {
+	int index;
+	int epfd;
+	pthread_t thread;
+	uint64_t nonce, next; // the counter range for CTRD_ENCRYPT
+	uint64_t connections, requests, bytes;
+};
+
+static struct {
+	int listen_fd;
+	int stop_fd; // an eventfd, written once on SIGINT/SIGTERM
+	struct aes_ctx ctx[3]; // 128, 192 and 256-bit keys
+} daemon_state;
+
+// epoll_event.data for the two fds that aren't connections
+static char listen_marker, stop_marker;
+
+static void new_nonce(struct loop *loop) {
+	if (getrandom(&loop->nonce, sizeof(loop->nonce), 0) != sizeof(loop->nonce)) {
+		perror("getrandom");
+		exit(1);
+	}
+	loop->next = 1;
+}
+
+static void watch(struct conn *c, uint32_t events) {
+	if (events == c->events)
+		return;
+	struct epoll_event ev = { .events = events, .data.ptr = c };
+	epoll_ctl(c->loop->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+	c->events = events;
+}
+
+static void accept_conn(struct loop *loop) {
+	// One connection per wakeup, so that a burst of them is spread over the loops
+	int fd = accept4(daemon_state.listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0)
+		return; // another loop got it, or the client has given up already
+
+	struct conn *c = calloc(1, sizeof(*c));
+	if (c == NULL) {
+		close(fd);
+		return;
+	}
+	c->fd = fd;
+	c->loop = loop;
+	c->in = arena_alloc(IN_SIZE);
+	c->out = arena_alloc(OUT_SIZE);
+	c->events = EPOLLIN;
+
+	struct epoll_event ev = { .events = c->events, .data.ptr = c };
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+		arena_free(c->in);
+		arena_free(c->out);
+		free(c);
+		close(fd);
+		return;
+	}
+	loop->connections++;
+}
+
+static void close_conn(struct conn *c) {
+	epoll_ctl(c->loop->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	// Plaintext and ciphertext both go through these buffers; don't hand them to the next connection as they are
+	memset(c->in, 0, IN_SIZE);
+	memset(c->out, 0, OUT_SIZE);
+	arena_free(c->in);
+	arena_free(c->out);
+	free(c);
+}
+
+static void read_input(struct conn *c) {
+	if (c->in_start > 0) {
+		memmove(c->in, c->in + c->in_start, c->in_end - c->in_start);
+		c->in_end -= c->in_start;
+		c->in_start = 0;
+	}
+	if (c->in_end == IN_SIZE)
+		return;
+
+	ssize_t r = read(c->fd, c->in + c->in_end, IN_SIZE - c->in_end);
+	if (r > 0)
+		c->in_end += r;
+	else if (r == 0)
+		c->eof = true;
+	else if (errno != EAGAIN && errno != EINTR)
+		c->dead = true;
+}
+
+static bool flush_output(struct conn *c) {
+	// Returns whether anything was sent
+	if (c->out_start == c->out_end || c->dead)
+		return false;
+	ssize_t w = write(c->fd, c->out + c->out_start, c->out_end - c->out_start);
+	if (w < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			c->dead = true;
+		return false;
+	}
+	c->out_start += w;
+	if (c->out_start == c->out_end)
+		c->out_start = c->out_end = 0;
+	return true;
+}
+
+static size_t out_space(struct conn *c) {
+	// Free space at the end of the output buffer, after moving what's left to the front if that's worth it
+	if (c->out_start > 0 && OUT_SIZE - c->out_end < OUT_SIZE / 2) {
+		memmove(c->out, c->out + c->out_start, c->out_end - c->out_start);
+		c->out_end -= c->out_start;
+		c->out_start = 0;
+	}
+	return OUT_SIZE - c->out_end;
+}
+
+static void answer(struct conn *c, const struct ctrd_header *request, enum ctrd_status status) {
+	// Queues the answer's header; out_space has been checked
+	struct ctrd_header header = { .op = request->op, .status = status, .key_bits = request->key_bits };
+	memcpy(header.magic, CTRD_MAGIC, 4);
+	if (status == CTRD_OK) {
+		header.counter[0] = c->counter[0];
+		header.counter[1] = c->counter[1];
+		header.length = request->length;
+	}
+	memcpy(c->out + c->out_end, &header, sizeof(header));
+	c->out_end += sizeof(header);
+}
+
+static bool start_request(struct conn *c) {
+	// Takes the next request header off the input, if it's all there and there's room for the answer's
+	if (c->in_end - c->in_start < sizeof(struct ctrd_header) || out_space(c) < sizeof(struct ctrd_header))
+		return false;
+
+	struct ctrd_header request;
+	memcpy(&request, c->in + c->in_start, sizeof(request));
+	c->in_start += sizeof(request);
+
+	enum ctrd_status status = CTRD_OK;
+	if (memcmp(request.magic, CTRD_MAGIC, 4) != 0)
+		status = CTRD_BAD_MAGIC;
+	else if (request.op != CTRD_ENCRYPT && request.op != CTRD_DECRYPT)
+		status = CTRD_BAD_OP;
+	else if (request.key_bits != 128 && request.key_bits != 192 && request.key_bits != 256)
+		status = CTRD_BAD_KEY;
+	if (status != CTRD_OK) {
+		answer(c, &request, status);
+		c->in_start = c->in_end; // whatever follows can't be trusted to be a request either
+		c->closing = true;
+		return true;
+	}
+
+	c->ctx = &daemon_state.ctx[request.key_bits / 64 - 2];
+	if (request.op == CTRD_ENCRYPT) {
+		struct loop *loop = c->loop;
+		uint64_t blocks = request.length / 16 + 1;
+		if (blocks > UINT64_MAX - loop->next)
+			new_nonce(loop);
+		c->counter[0] = loop->nonce;
+		c->counter[1] = loop->next;
+		loop->next += blocks;
+	}
+	else {
+		c->counter[0] = request.counter[0];
+		c->counter[1] = request.counter[1];
+	}
+	answer(c, &request, CTRD_OK);
+	c->remaining = request.length;
+	c->in_request = c->remaining > 0;
+	c->loop->requests++;
+	return true;
+}
+
+// What one connection has to encrypt this time round
+struct piece {
+	struct conn *conn;
+	struct aes_mb_job job;
+};
+
+static bool next_piece(struct conn *c, struct piece *piece) {
+	// As much of the current request as has come in and fits in the output buffer; whole blocks only, except at the
+	// end of the message, since the counter moves on a whole block for a partial one
+	if (!c->in_request || c->closing)
+		return false;
+	size_t len = c->in_end - c->in_start;
+	size_t space = out_space(c);
+	if (len > space)
+		len = space;
+	if (len >= c->remaining)
+		len = c->remaining;
+	else
+		len &= ~(size_t)15;
+	if (len == 0)
+		return false;
+
+	piece->conn = c;
+	piece->job = (struct aes_mb_job){ .keys = c->ctx->enc_keys, .counter = { c->counter[0], c->counter[1] },
+		.in = c->in + c->in_start, .out = c->out + c->out_end, .len = len };
+	return true;
+}
+
+static void finish_piece(struct piece *piece) {
+	struct conn *c = piece->conn;
+	c->counter[0] = piece->job.counter[0];
+	c->counter[1] = piece->job.counter[1];
+	c->in_start += piece->job.len;
+	c->out_end += piece->job.len;
+	c->remaining -= piece->job.len;
+	c->loop->bytes += piece->job.len;
+	if (c->remaining == 0)
+		c->in_request = false;
+}
+
+static bool transform(struct conn **active, int count) {
+	// One round over the connections that had events: start the requests whose headers are in, then encrypt what
+	// can be encrypted. Returns whether anything happened.
+	struct piece pieces[MAX_EVENTS];
+	struct aes_mb_job small[3][MAX_EVENTS]; // by key size
+	int npieces = 0, nsmall[3] = { 0, 0, 0 };
+	bool progress = false;
+
+	for (int i = 0; i < count; i++) {
+		struct conn *c = active[i];
+		if (c->dead)
+			continue;
+		while (!c->in_request && !c->closing && start_request(c))
+			progress = true;
+		if (next_piece(c, &pieces[npieces]))
+			npieces++;
+	}
+
+	for (int i = 0; i < npieces; i++) {
+		struct aes_mb_job *job = &pieces[i].job;
+		if (job->len <= MB_MAX) {
+			int k = pieces[i].conn->ctx->key_len / 8 - 2;
+			small[k][nsmall[k]++] = *job;
+		}
+		else
+			aes_ctx_ctr_xor(pieces[i].conn->ctx, job->counter, job->in, job->out, job->len);
+	}
+	for (int k = 0; k < 3; k++) {
+		if (nsmall[k] > 0)
+			aes_mb_ctr(small[k], nsmall[k], 16 + 8*k);
+	}
+
+	// The small jobs were copied; take their counters back, in the same order
+	int next[3] = { 0, 0, 0 };
+	for (int i = 0; i < npieces; i++) {
+		if (pieces[i].job.len <= MB_MAX) {
+			int k = pieces[i].conn->ctx->key_len / 8 - 2;
+			pieces[i].job.counter[0] = small[k][next[k]].counter[0];
+			pieces[i].job.counter[1] = small[k][next[k]].counter[1];
+			next[k]++;
+		}
+		finish_piece(&pieces[i]);
+		progress = true;
+	}
+	return progress;
+}
+
+static void settle(struct conn *c) {
+	// After a batch of events: close the connection if it's done, otherwise watch for what it's waiting on.
+	// With output pending and the buffers full, EPOLLIN is left out; that's the backpressure.
+	bool pending_out = c->out_start != c->out_end;
+	if (c->dead || ((c->eof || c->closing) && !pending_out)) {
+		close_conn(c);
+		return;
+	}
+	uint32_t events = 0;
+	if (!c->eof && !c->closing && (c->in_start > 0 || c->in_end < IN_SIZE))
+		events |= EPOLLIN;
+	if (pending_out)
+		events |= EPOLLOUT;
+	watch(c, events);
+}
+
+static void *run_loop(void *arg) {
+	struct loop *loop = arg;
+	struct epoll_event events[MAX_EVENTS];
+	struct conn *active[MAX_EVENTS];
+	bool stop = false;
+
+	while (!stop) {
+		int n = epoll_wait(loop->epfd, events, MAX_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			exit(1);
+		}
+
+		int count = 0;
+		for (int i = 0; i < n; i++) {
+			if (events[i].data.ptr == &stop_marker)
+				stop = true;
+			else if (events[i].data.ptr == &listen_marker)
+				accept_conn(loop);
+			else {
+				struct conn *c = events[i].data.ptr;
+				if (events[i].events & EPOLLOUT)
+					flush_output(c);
+				if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+					read_input(c);
+				active[count++] = c;
+			}
+		}
+
+		// Encrypt and send until no connection can go any further without another event
+		bool progress = true;
+		while (progress) {
+			progress = transform(active, count);
+			for (int i = 0; i < count; i++) {
+				if (flush_output(active[i]))
+					progress = true;
+			}
+		}
+		for (int i = 0; i < count; i++) {
+			settle(active[i]);
+		}
+	}
+	return NULL;
+}
+
+static void start_loop(struct loop *loop, int index, int ncpus) {
+	loop->index = index;
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epfd < 0) {
+		perror("epoll_create1");
+		exit(1);
+	}
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = &listen_marker };
+	struct epoll_event stop = { .events = EPOLLIN, .data.ptr = &stop_marker };
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, daemon_state.listen_fd, &ev) != 0 ||
+			epoll_ctl(loop->epfd, EPOLL_CTL_ADD, daemon_state.stop_fd, &stop) != 0) {
+		perror("epoll_ctl");
+		exit(1);
+	}
+	new_nonce(loop);
+
+	if (pthread_create(&loop->thread, NULL, run_loop, loop) != 0) {
+		fprintf(stderr, "Failed to start event loop thread!\n");
+		exit(1);
+	}
+	// Best effort; with more loops than cores, they double up
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(index % ncpus, &cpus);
+	pthread_setaffinity_np(loop->thread, sizeof(cpus), &cpus);
+}
+
+static int listen_on(const char *path) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long: %s\n", path);
+		exit(1);
+	}
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("socket");
+		exit(1);
+	}
+	int r = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	if (r != 0 && errno == EADDRINUSE) {
+		// A socket file left behind by a daemon that's gone is replaced; one that's still answering isn't
+		int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+		bool alive = probe >= 0 && connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+		if (probe >= 0)
+			close(probe);
+		if (alive) {
+			fprintf(stderr, "%s: another daemon is already listening there.\n", path);
+			exit(1);
+		}
+		unlink(path);
+		r = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	}
+	// Anyone who can connect can use the key, and decrypting chosen data hands out keystream, so only the user running
+	// the daemon gets to. Done before listen(), so nobody can connect in between with the umask's permissions.
+	if (r != 0 || chmod(path, 0600) != 0 || listen(fd, SOMAXCONN) != 0) {
+		perror(path);
+		exit(1);
+	}
+	return fd;
+}
+
+static void usage(void) {
+	fprintf(stderr, "Usage: ctrd --socket <path> [-j <loops>]\n");
+	fprintf(stderr, "Serves AES-CTR encryption and decryption on a Unix domain socket (protocol: see ctrd.h) until\n");
+	fprintf(stderr, "SIGINT or SIGTERM, then prints totals to stderr.\n");
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "  --socket <path>  where to listen; a stale socket file there is replaced. Only the user running\n");
+	fprintf(stderr, "                   ctrd can connect (mode 0600): any client can encrypt and decrypt with its key\n");
+	fprintf(stderr, "  -j <loops>       number of event loops, each pinned to a core (default: one per core)\n");
+	fprintf(stderr, "Environment:\n");
+	fprintf(stderr, "  AES_KERNEL       force a CTR kernel, as for bin/ctr\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	static const struct option long_options[] = {
+		{ "socket", required_argument, NULL, 's' },
+		{ NULL, 0, NULL, 0 }
+	};
+	const char *path = NULL;
+	int ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpus < 1)
+		ncpus = 1;
+	int nloops = ncpus;
+
+	int c;
+	while ((c = getopt_long(argc, argv, "s:j:", long_options, NULL)) != -1) {
+		switch (c) {
+			case 's':
+				path = optarg;
+				break;
+			case 'j':
+				nloops = atoi(optarg);
+				if (nloops < 1) {
+					fprintf(stderr, "Invalid loop count: %s\n", optarg);
+					exit(1);
+				}
+				break;
+			default:
+				usage();
+		}
+	}
+	if (path == NULL || optind != argc)
+		usage();
+
+	for (int k = 0; k < 3; k++) {
+		aes_ctx_init(&daemon_state.ctx[k], ctrd_key, 16 + 8*k);
+	}
+
+	// The loops (and every other thread) leave SIGINT/SIGTERM to sigwait below; a client that hangs up mid-answer
+	// shows up as EPIPE, not as a signal
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	daemon_state.listen_fd = listen_on(path);
+	daemon_state.stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (daemon_state.stop_fd < 0) {
+		perror("eventfd");
+		exit(1);
+	}
+
+	struct timespec started, stopped;
+	clock_gettime(CLOCK_MONOTONIC, &started);
+	struct loop *loops = calloc(nloops, sizeof(*loops));
+	if (loops == NULL) {
+		fprintf(stderr, "Failed to allocate memory!\n");
+		exit(1);
+	}
+	for (int i = 0; i < nloops; i++) {
+		start_loop(&loops[i], i, ncpus);
+	}
+	fprintf(stderr, "ctrd: listening on %s with %d event loop%s\n", path, nloops, (nloops == 1) ? "" : "s");
+
+	int sig;
+	sigwait(&signals, &sig);
+
+	// The eventfd stays readable, so every loop sees it
+	uint64_t one = 1;
+	if (write(daemon_state.stop_fd, &one, sizeof(one)) != sizeof(one)) {
+		perror("eventfd");
+		exit(1);
+	}
+	uint64_t connections = 0, requests = 0, bytes = 0;
+	for (int i = 0; i < nloops; i++) {
+		pthread_join(loops[i].thread, NULL);
+		close(loops[i].epfd);
+		connections += loops[i].connections;
+		requests += loops[i].requests;
+		bytes += loops[i].bytes;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stopped);
+	close(daemon_state.listen_fd);
+	unlink(path);
+	for (int k = 0; k < 3; k++) {
+		aes_ctx_clear(&daemon_state.ctx[k]);
+	}
+
+	double seconds = (stopped.tv_sec - started.tv_sec) + (stopped.tv_nsec - started.tv_nsec) / 1e9;
+	fprintf(stderr, "ctrd: %llu connections, %llu requests, %.1f MiB in %.1f s\n", (unsigned long long)connections,
+			(unsigned long long)requests, bytes / 1048576.0, seconds);
+	free(loops);
+	return 0;
+}
@@ -0,0 +1,55 @@
+#ifndef _CTRD_H
+#define _CTRD_H
+
+#include <stdint.h>
+
+/*
+ * The protocol spoken by bin/ctrd over its Unix domain socket (and by bin/ctrload, which puts load on it).
+ *
+ * A connection carries any number of requests, one after the other. Each is a header followed by length bytes of
+ * data; the answer is a header with the same op and length, followed by the data run through AES-CTR. The data is
+ * streamed: ctrd starts sending the answer as soon as the first blocks of a request come in, so a client has to read
+ * while it writes, or a large request will stall (ctrd stops reading from a client that doesn't read its answers).
+ *
+ * CTRD_ENCRYPT picks a fresh counter range for the message and returns it in the answer's counter; CTRD_DECRYPT
+ * (which is the same operation) uses the counter in the request. The counter is laid out as everywhere else in this
+ * program: nonce, then block number. key_bits picks one of the daemon's keys: 128, 192 or 256.
+ *
+ * A request ctrd can't make sense of gets an answer with a non-zero status and no data, and the connection is closed.
+ * All fields are in host byte order; this is a local socket.
+ *
+ * The socket is created with mode 0600, so only the user running ctrd can connect. Every client gets to use the
+ * daemon's keys, and CTRD_DECRYPT with a chosen counter hands out keystream, so access to the socket is access to
+ * the keys.
+ */
+
+#define CTRD_MAGIC "CTRD"
+
+enum ctrd_op {
+	CTRD_ENCRYPT = 1,
+	CTRD_DECRYPT = 2,
+};
+
+enum ctrd_status {
+	CTRD_OK = 0,
+	CTRD_BAD_MAGIC = 1,
+	CTRD_BAD_OP = 2,
+	CTRD_BAD_KEY = 3,
+};
+
+struct ctrd_header {
+	char magic[4];        // CTRD_MAGIC, without the terminating zero
+	uint8_t op;           // enum ctrd_op
+	uint8_t status;       // answers only: enum ctrd_status
+	uint16_t key_bits;
+	uint64_t counter[2];
+	uint64_t length;      // bytes of data following the header
+};
+
+// The key the daemon (and bin/ctr) uses; AES-128 uses the first 16 bytes, AES-192 the first 24
+static const unsigned char ctrd_key[32] = {
+	0x2d, 0x7e, 0x86, 0xa3, 0x39, 0xd9, 0x39, 0x3e, 0xe6, 0x57, 0x0a, 0x11, 0x01, 0x90, 0x4e, 0x16,
+	0x5c, 0xb2, 0x0f, 0x41, 0x9a, 0xe3, 0x77, 0xc8, 0x14, 0x6d, 0xf0, 0x2b, 0x83, 0x58, 0xa9, 0x3c
+};
+
+#endif
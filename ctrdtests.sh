@@ -0,0 +1,56 @@
+#!/bin/bash
+
+# Automated tests for the daemon: starts bin/ctrd on a socket of its own, puts load on it with bin/ctrload --verify
+# (which checks every answer against the same message encrypted locally), then stops it and checks that it shuts
+# down cleanly. Sizes around the multi-buffer cutoff (4096) and the buffer sizes (64 KiB in, 256 KiB out) are covered,
+# as well as messages much bigger than the buffers, which only get through if backpressure works both ways.
+
+SOCKET="${TMPDIR:-/tmp}/ctrd_test_$$.sock"
+LOG="${TMPDIR:-/tmp}/ctrd_test_$$.log"
+LOADS=("-c 1 --size 0" "-c 1 --size 1" "-c 4 --size 15" "-c 8 --size 16" "-c 8 --size 100" "-c 16 --size 4095"
+	"-c 16 --size 4096" "-c 16 --size 4097" "-c 4 --size 65536" "-c 4 --size 262145" "-c 2 --size $((5*1024*1024+3))"
+	"-c 8 --size 1000 --decrypt" "-c 8 --size 1000 -k 192" "-c 8 --size 70000 -k 256 --decrypt")
+
+for LOOPS in "-j 1" "-j 4"
+do
+	bin/ctrd --socket "$SOCKET" $LOOPS 2> "$LOG" &
+	PID=$!
+	for i in {1..50}; do
+		[[ -S "$SOCKET" ]] && break
+		sleep 0.1
+	done
+
+	if [[ "$(stat -c %a "$SOCKET")" != 600 ]]; then
+		echo "ctrd $LOOPS: FAILED, socket is mode $(stat -c %a "$SOCKET"), not 600"
+		kill $PID
+		exit 1
+	fi
+
+	for LOAD in "${LOADS[@]}"
+	do
+		if ! bin/ctrload --socket "$SOCKET" $LOAD --requests 20 --verify > /dev/null; then
+			echo "ctrd $LOOPS: FAILED with ctrload $LOAD"
+			kill $PID
+			exit 1
+		fi
+	done
+	# And some timed load, many connections at once
+	if ! bin/ctrload --socket "$SOCKET" -c 64 --size 512 --seconds 1 --verify > /dev/null; then
+		echo "ctrd $LOOPS: FAILED with 64 connections"
+		kill $PID
+		exit 1
+	fi
+
+	kill -TERM $PID
+	if ! wait $PID; then
+		echo "ctrd $LOOPS: FAILED to shut down cleanly"
+		cat "$LOG"
+		exit 1
+	fi
+	if [[ -e "$SOCKET" ]] || ! grep -q "requests" "$LOG"; then
+		echo "ctrd $LOOPS: FAILED to remove its socket or print its totals"
+		exit 1
+	fi
+	echo "ctrd $LOOPS: OK"
+done
+rm -f "$LOG"
@@ -0,0 +1,320 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h> /* exit, qsort */
+#include <string.h> /* memcmp */
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "ctrd.h"
+#include "ctx.h"
+
+/*
+ * bin/ctrload: puts load on bin/ctrd. Each of -c connections sends requests of --size bytes one after the other
+ * (a closed loop: the next request goes out once the whole answer is in) for --seconds, or --requests per connection,
+ * then the totals are printed: requests per second, MiB/s of data encrypted, and latency percentiles, where a request's
+ * latency is from its first byte going out to the last byte of its answer coming in.
+ *
+ * With --verify, every answer is checked against the same message encrypted here with the counter the daemon
+ * reports. Any failure (a connection that breaks, an error status, a mismatch) is counted, and makes the exit status 1.
+ */
+
+struct client {
+	pthread_t thread;
+	int index;
+	uint64_t *latencies; // in ns, one per request
+	size_t count, capacity;
+	uint64_t errors;
+};
+
+static struct {
+	const char *path;
+	size_t size;
+	uint8_t op;
+	uint16_t key_bits;
+	bool verify;
+	uint64_t requests;      // per connection; 0 = until the time is up
+	struct timespec until;
+	struct aes_ctx ctx;
+} load;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int connect_to(const char *path) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || fcntl(fd, F_SETFL, O_NONBLOCK) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static bool exchange(int fd, const unsigned char *request, unsigned char *reply, size_t len) {
+	// Sends len bytes and receives len bytes at the same time: the daemon streams its answer, and stops reading
+	// from us if we don't keep up with it
+	size_t sent = 0, received = 0;
+	while (received < len) {
+		struct pollfd pfd = { .fd = fd, .events = POLLIN | ((sent < len) ? POLLOUT : 0) };
+		if (poll(&pfd, 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		if (sent < len && (pfd.revents & POLLOUT)) {
+			ssize_t w = write(fd, request + sent, len - sent);
+			if (w < 0 && errno != EAGAIN)
+				return false;
+			if (w > 0)
+				sent += w;
+		}
+		if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+			ssize_t r = read(fd, reply + received, len - received);
+			if (r == 0 || (r < 0 && errno != EAGAIN))
+				return false;
+			if (r > 0)
+				received += r;
+		}
+	}
+	return true;
+}
+
+static bool time_is_up(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec > load.until.tv_sec || (ts.tv_sec == load.until.tv_sec && ts.tv_nsec >= load.until.tv_nsec);
+}
+
+static void record(struct client *cl, uint64_t ns) {
+	if (cl->count == cl->capacity) {
+		cl->capacity = cl->capacity ? 2 * cl->capacity : 4096;
+		cl->latencies = realloc(cl->latencies, cl->capacity * sizeof(*cl->latencies));
+		if (cl->latencies == NULL) {
+			fprintf(stderr, "Failed to allocate memory!\n");
+			exit(1);
+		}
+	}
+	cl->latencies[cl->count++] = ns;
+}
+
+static void *run_client(void *arg) {
+	struct client *cl = arg;
+	size_t len = sizeof(struct ctrd_header) + load.size;
+	unsigned char *request = malloc(len), *reply = malloc(len), *expected = malloc(load.size + 1);
+	if (request == NULL || reply == NULL || expected == NULL) {
+		fprintf(stderr, "Failed to allocate memory!\n");
+		exit(1);
+	}
+	// The message doesn't change; only the counter does
+	unsigned char *message = request + sizeof(struct ctrd_header);
+	for (size_t i = 0; i < load.size; i++) {
+		message[i] = (unsigned char)(i * 7 + cl->index);
+	}
+	struct ctrd_header header = { .op = load.op, .key_bits = load.key_bits, .length = load.size };
+	memcpy(header.magic, CTRD_MAGIC, 4);
+
+	int fd = connect_to(load.path);
+	if (fd < 0) {
+		perror(load.path);
+		cl->errors++;
+		goto out;
+	}
+
+	for (uint64_t n = 0; load.requests ? n < load.requests : !time_is_up(); n++) {
+		if (load.op == CTRD_DECRYPT) {
+			header.counter[0] = ((uint64_t)cl->index << 32) | n;
+			header.counter[1] = 1;
+		}
+		memcpy(request, &header, sizeof(header));
+
+		uint64_t start = now_ns();
+		if (!exchange(fd, request, reply, len)) {
+			cl->errors++;
+			break;
+		}
+		record(cl, now_ns() - start);
+
+		struct ctrd_header answer;
+		memcpy(&answer, reply, sizeof(answer));
+		if (memcmp(answer.magic, CTRD_MAGIC, 4) != 0 || answer.status != CTRD_OK || answer.length != load.size) {
+			fprintf(stderr, "Bad answer from the daemon (status %u)\n", answer.status);
+			cl->errors++;
+			break;
+		}
+		if (load.verify) {
+			uint64_t counter[2] = { answer.counter[0], answer.counter[1] };
+			aes_ctx_ctr_xor(&load.ctx, counter, message, expected, load.size);
+			if ((load.op == CTRD_DECRYPT && (answer.counter[0] != header.counter[0] || answer.counter[1] != header.counter[1])) ||
+					memcmp(reply + sizeof(answer), expected, load.size) != 0) {
+				fprintf(stderr, "Mismatch in the answer to request %llu on connection %d\n", (unsigned long long)n, cl->index);
+				cl->errors++;
+			}
+		}
+	}
+	close(fd);
+
+out:
+	free(request);
+	free(reply);
+	free(expected);
+	return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static double percentile(const uint64_t *sorted, size_t count, double p) {
+	// In microseconds
+	if (count == 0)
+		return 0;
+	size_t i = (size_t)(p / 100 * (count - 1) + 0.5);
+	return sorted[i] / 1000.0;
+}
+
+static void usage(void) {
+	fprintf(stderr, "Usage: ctrload --socket <path> [options]\n");
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "  --socket <path>   the daemon's socket (see ctrd)\n");
+	fprintf(stderr, "  -c <connections>  concurrent connections, each with its own thread (default 8)\n");
+	fprintf(stderr, "  --size <bytes>    data per request (default 4096)\n");
+	fprintf(stderr, "  --seconds <n>     how long to run (default 5)\n");
+	fprintf(stderr, "  --requests <n>    instead: send n requests per connection\n");
+	fprintf(stderr, "  --decrypt         send decryption requests (with a counter of our own) instead of encryption\n");
+	fprintf(stderr, "  -k <bits>         key size: 128, 192 or 256 (default 128)\n");
+	fprintf(stderr, "  --verify          check every answer against the same message encrypted here\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	static const struct option long_options[] = {
+		{ "socket", required_argument, NULL, 's' },
+		{ "size", required_argument, NULL, 'b' },
+		{ "seconds", required_argument, NULL, 't' },
+		{ "requests", required_argument, NULL, 'n' },
+		{ "decrypt", no_argument, NULL, 'd' },
+		{ "verify", no_argument, NULL, 'v' },
+		{ NULL, 0, NULL, 0 }
+	};
+	int nclients = 8;
+	double seconds = 5;
+	load.size = 4096;
+	load.op = CTRD_ENCRYPT;
+	load.key_bits = 128;
+
+	int c;
+	while ((c = getopt_long(argc, argv, "s:c:k:", long_options, NULL)) != -1) {
+		switch (c) {
+			case 's':
+				load.path = optarg;
+				break;
+			case 'c':
+				nclients = atoi(optarg);
+				if (nclients < 1) {
+					fprintf(stderr, "Invalid connection count: %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'b':
+				load.size = strtoull(optarg, NULL, 10);
+				break;
+			case 't':
+				seconds = atof(optarg);
+				break;
+			case 'n':
+				load.requests = strtoull(optarg, NULL, 10);
+				break;
+			case 'd':
+				load.op = CTRD_DECRYPT;
+				break;
+			case 'k':
+				load.key_bits = atoi(optarg);
+				if (load.key_bits != 128 && load.key_bits != 192 && load.key_bits != 256) {
+					fprintf(stderr, "Invalid key size: %s (must be 128, 192 or 256)\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'v':
+				load.verify = true;
+				break;
+			default:
+				usage();
+		}
+	}
+	if (load.path == NULL || optind != argc)
+		usage();
+
+	aes_ctx_init(&load.ctx, ctrd_key, load.key_bits / 8);
+	clock_gettime(CLOCK_MONOTONIC, &load.until);
+	load.until.tv_sec += (time_t)seconds;
+	load.until.tv_nsec += (long)((seconds - (time_t)seconds) * 1e9);
+	if (load.until.tv_nsec >= 1000000000) {
+		load.until.tv_sec++;
+		load.until.tv_nsec -= 1000000000;
+	}
+
+	struct client *clients = calloc(nclients, sizeof(*clients));
+	if (clients == NULL) {
+		fprintf(stderr, "Failed to allocate memory!\n");
+		exit(1);
+	}
+	uint64_t start = now_ns();
+	for (int i = 0; i < nclients; i++) {
+		clients[i].index = i;
+		if (pthread_create(&clients[i].thread, NULL, run_client, &clients[i]) != 0) {
+			fprintf(stderr, "Failed to start client thread!\n");
+			exit(1);
+		}
+	}
+
+	size_t total = 0;
+	uint64_t errors = 0;
+	for (int i = 0; i < nclients; i++) {
+		pthread_join(clients[i].thread, NULL);
+		total += clients[i].count;
+		errors += clients[i].errors;
+	}
+	double elapsed = (now_ns() - start) / 1e9;
+
+	uint64_t *all = malloc((total ? total : 1) * sizeof(*all));
+	if (all == NULL) {
+		fprintf(stderr, "Failed to allocate memory!\n");
+		exit(1);
+	}
+	size_t at = 0;
+	for (int i = 0; i < nclients; i++) {
+		memcpy(all + at, clients[i].latencies, clients[i].count * sizeof(*all));
+		at += clients[i].count;
+		free(clients[i].latencies);
+	}
+	qsort(all, total, sizeof(*all), compare_u64);
+
+	printf("%d connections, %zu-byte %s requests, %.2f s\n", nclients, load.size,
+			(load.op == CTRD_ENCRYPT) ? "encrypt" : "decrypt", elapsed);
+	printf("requests: %zu (%.0f/s), %.1f MiB/s\n", total, total / elapsed, total * (double)load.size / 1048576.0 / elapsed);
+	printf("latency (us): p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n", percentile(all, total, 50),
+			percentile(all, total, 90), percentile(all, total, 99), percentile(all, total, 99.9), percentile(all, total, 100));
+	if (errors)
+		printf("errors: %llu\n", (unsigned long long)errors);
+
+	free(all);
+	free(clients);
+	aes_ctx_clear(&load.ctx);
+	return errors ? 1 : 0;
+}
@@ -2,25 +2,346 @@
 
 # Automated tests that encrypts and decrypts a few files, then checks
 # if the decrypted files match the original files.
+# Every file is run through each of the option sets in MODES; files encrypted
+# with one set of options are decrypted with the default options (and vice versa),
+# since the output format must not depend on them.
 
 #SIZES="$(echo {1..129})"
 SIZES="$(echo {1..129}) 304 494928 5949285 39821 393827 847427 9284 1024 1025 $((5*1024*1024)) $((8*1024*1024)) $((8*1024*1024+3)) $((13*1024*1024+10))"
+MODES=("" "-j 4" "--mmap" "--mmap -j 4" "--uring" "--uring -j 4" "--v1" "--v1 -j 4" "--v1 --mmap" "--v1 --mmap -j 4" "--v1 --uring" "--v1 --uring -j 4")
 
 cd ctrtests
 
-for SIZE in $SIZES; 
-	do 
+for MODE in "${MODES[@]}";
+do
+	for SIZE in $SIZES; 
+		do 
+			if [[ ! -f "plain_${SIZE}" ]]; then
+				dd if=/dev/urandom of=./plain_${SIZE} bs=$SIZE count=1 > /dev/null
+			fi
+			../bin/ctr $MODE -e plain_${SIZE} -o cipher_${SIZE};
+			../bin/ctr -d cipher_${SIZE} -o decrypted_${SIZE};
+			diff -q plain_${SIZE} decrypted_${SIZE} >/dev/null
+			RESULT=$?
+			../bin/ctr -e plain_${SIZE} -o cipher_${SIZE};
+			../bin/ctr $MODE -d cipher_${SIZE} -o decrypted_${SIZE};
+			diff -q plain_${SIZE} decrypted_${SIZE} >/dev/null
+			if [[ "$?" == "1" || "$RESULT" == "1" ]]; then
+				echo "ERROR: $SIZE bytes ${MODE:+($MODE)}"
+			else
+				echo "PASS: $SIZE bytes ${MODE:+($MODE)}"
+			fi
+		done
+done
+
+# v2 layout: an empty file works, a 1-byte file takes header + chunk header + one data page + index + footer,
+# and a truncated file must fail to decrypt (and leave no output behind)
+head -c 0 /dev/null > plain_0
+../bin/ctr -e plain_0 -o cipher_0 && ../bin/ctr -d cipher_0 -o decrypted_0 && cmp -s plain_0 decrypted_0
+RESULT=$?
+../bin/ctr -e plain_1 -o cipher_1
+[[ "$(head -c 8 cipher_1)" == "AESCTRv2" && $(stat -c %s cipher_1) == $((3*4096 + 32 + 32)) ]]
+RESULT2=$?
+../bin/ctr -e plain_$((5*1024*1024)) -o cipher_truncated
+truncate -s -40 cipher_truncated
+RESULT3=0
+for OPTS in "" "--mmap" "--uring" "--direct"
+do
+	rm -f decrypted_truncated
+	../bin/ctr $OPTS -d cipher_truncated -o decrypted_truncated 2>/dev/null && RESULT3=1
+	[[ -e decrypted_truncated ]] && RESULT3=1
+	# and the empty file, which has nothing to map
+	../bin/ctr $OPTS -e plain_0 -o cipher_0 && ../bin/ctr $OPTS -d cipher_0 -o decrypted_0 && cmp -s plain_0 decrypted_0 || RESULT=1
+done
+if [[ "$RESULT" != "0" || "$RESULT2" != "0" || "$RESULT3" != "0" ]]; then
+	echo "ERROR: v2 format (empty file, layout, truncation)"
+else
+	echo "PASS: v2 format (empty file, layout, truncation)"
+fi
+rm -f cipher_truncated
+
+# Other key sizes: these can't be cross-checked against the defaults, since the key differs.
+# v2 files record the key size, so decrypting one with the wrong size must fail;
+# v1 files don't, and decrypting them with the wrong key size must give garbage instead.
+for KEYSIZE in 192 256;
+do
+	for SIZE in $SIZES;
+		do
+			../bin/ctr -k $KEYSIZE -e plain_${SIZE} -o cipher_${SIZE};
+			../bin/ctr -k $KEYSIZE -d cipher_${SIZE} -o decrypted_${SIZE};
+			diff -q plain_${SIZE} decrypted_${SIZE} >/dev/null
+			RESULT=$?
+			../bin/ctr -d cipher_${SIZE} -o decrypted_${SIZE} 2>/dev/null
+			RESULT3=$?
+			../bin/ctr -k $KEYSIZE --v1 -e plain_${SIZE} -o cipher_${SIZE};
+			../bin/ctr -k $KEYSIZE --uring -j 4 -d cipher_${SIZE} -o decrypted_${SIZE};
+			diff -q plain_${SIZE} decrypted_${SIZE} >/dev/null
+			RESULT2=$?
+			../bin/ctr -d cipher_${SIZE} -o decrypted_${SIZE};
+			diff -q plain_${SIZE} decrypted_${SIZE} >/dev/null
+			if [[ "$?" == "0" || "$RESULT" == "1" || "$RESULT2" == "1" || "$RESULT3" == "0" ]]; then
+				echo "ERROR: $SIZE bytes (-k $KEYSIZE)"
+			else
+				echo "PASS: $SIZE bytes (-k $KEYSIZE)"
+			fi
+		done
+done
+
+# CBC: round trips through the buffered, io_uring and stdin/stdout paths, and (if openssl is around)
+# a check that the data after the IV is standard PKCS#7-padded CBC
+KEY_HEX="2d7e86a339d9393ee6570a1101904e16"
+for SIZE in 0 $SIZES;
+	do
 		if [[ ! -f "plain_${SIZE}" ]]; then
-			dd if=/dev/urandom of=./plain_${SIZE} bs=$SIZE count=1 > /dev/null
+			head -c $SIZE /dev/urandom > plain_${SIZE}
+		fi
+		../bin/ctr --cbc -e plain_${SIZE} -o cipher_${SIZE};
+		../bin/ctr --cbc --uring -d cipher_${SIZE} -o decrypted_${SIZE};
+		diff -q plain_${SIZE} decrypted_${SIZE} >/dev/null
+		RESULT=$?
+		cat plain_${SIZE} | ../bin/ctr --cbc --uring -e - -o cipher_${SIZE}
+		cat cipher_${SIZE} | ../bin/ctr --cbc -d - -o - > decrypted_${SIZE}
+		diff -q plain_${SIZE} decrypted_${SIZE} >/dev/null
+		RESULT2=$?
+		RESULT3=0
+		if command -v openssl >/dev/null; then
+			IV_HEX=$(head -c 16 cipher_${SIZE} | od -An -tx1 | tr -d ' \n')
+			tail -c +17 cipher_${SIZE} | openssl enc -d -aes-128-cbc -K $KEY_HEX -iv $IV_HEX > decrypted_${SIZE}
+			diff -q plain_${SIZE} decrypted_${SIZE} >/dev/null
+			RESULT3=$?
+		fi
+		if [[ "$RESULT" != "0" || "$RESULT2" != "0" || "$RESULT3" != "0" ]]; then
+			echo "ERROR: $SIZE bytes (--cbc)"
+		else
+			echo "PASS: $SIZE bytes (--cbc)"
 		fi
-		../bin/ctr -e plain_${SIZE} -o cipher_${SIZE};
-		../bin/ctr -d cipher_${SIZE} -o decrypted_${SIZE};
+	done
+
+# GCM: round trips (128 and 256-bit keys), then a file with one flipped byte must fail to decrypt and leave no output
+for SIZE in 0 $SIZES;
+	do
+		../bin/ctr --gcm -e plain_${SIZE} -o cipher_${SIZE};
+		../bin/ctr --gcm --uring -d cipher_${SIZE} -o decrypted_${SIZE};
 		diff -q plain_${SIZE} decrypted_${SIZE} >/dev/null
-		if [[ "$?" == "1" ]]; then
-			echo "ERROR: $SIZE bytes"
+		RESULT=$?
+		cat plain_${SIZE} | ../bin/ctr --gcm -k 256 --uring -e - -o cipher_${SIZE}
+		cat cipher_${SIZE} | ../bin/ctr --gcm -k 256 -d - -o - > decrypted_${SIZE}
+		diff -q plain_${SIZE} decrypted_${SIZE} >/dev/null
+		RESULT2=$?
+		OFFSET=$(( (SIZE + 28) / 2 ))
+		BYTE=$(od -An -tu1 -j $OFFSET -N 1 cipher_${SIZE})
+		printf "\\x$(printf %02x $(( BYTE ^ 1 )))" | dd of=cipher_${SIZE} bs=1 seek=$OFFSET conv=notrunc status=none
+		rm -f decrypted_${SIZE}
+		../bin/ctr --gcm -k 256 -d cipher_${SIZE} -o decrypted_${SIZE} 2>/dev/null
+		RESULT3=$?
+		if [[ "$RESULT" != "0" || "$RESULT2" != "0" || "$RESULT3" == "0" || -e decrypted_${SIZE} ]]; then
+			echo "ERROR: $SIZE bytes (--gcm)"
+		else
+			echo "PASS: $SIZE bytes (--gcm)"
+		fi
+	done
+
+# Range decryption (--offset/--length): block-aligned and unaligned slices, slices running past the end,
+# in v2 files and v1 files, including a streamed v1 file (padding byte in the trailer)
+for SIZE in $SIZES;
+	do
+		../bin/ctr -e plain_${SIZE} -o cipher_${SIZE}
+		../bin/ctr --v1 -e plain_${SIZE} -o cipher_v1_${SIZE}
+		cat plain_${SIZE} | ../bin/ctr --v1 -e - -o streamed_${SIZE}
+		RESULT=0
+		for RANGE in "0 1" "15 2" "16 16" "17 100" "$((SIZE / 2)) $((SIZE / 3 + 1))" "$((SIZE - 1)) 5" "$SIZE 1" "$((SIZE / 2))";
+			do
+				set -- $RANGE
+				LENGTH_ARG=""
+				if [[ -n "$2" ]]; then
+					LENGTH_ARG="--length $2"
+				fi
+				tail -c +$(( $1 + 1 )) plain_${SIZE} | head -c ${2:-$SIZE} > expected_${SIZE}
+				for FILE in cipher_${SIZE} cipher_v1_${SIZE} streamed_${SIZE};
+					do
+						../bin/ctr -d $FILE --offset $1 $LENGTH_ARG -o decrypted_${SIZE}
+						if ! cmp -s expected_${SIZE} decrypted_${SIZE}; then
+							RESULT=1
+						fi
+					done
+			done
+		rm -f cipher_v1_${SIZE} streamed_${SIZE} expected_${SIZE}
+		if [[ "$RESULT" != "0" ]]; then
+			echo "ERROR: $SIZE bytes (--offset/--length)"
 		else
-			echo "PASS: $SIZE bytes"
+			echo "PASS: $SIZE bytes (--offset/--length)"
 		fi
 	done
 
+# In place: the file itself is encrypted (growing by the 64-byte trailer) and decrypted again; in between, it must
+# also decrypt to a new file, and by range. Encrypting it twice, or decrypting one that was interrupted, must fail.
+for SIZE in 0 $SIZES;
+	do
+		cp plain_${SIZE} inplace_${SIZE}
+		../bin/ctr -e inplace_${SIZE} --in-place -j 4
+		[[ $(stat -c %s inplace_${SIZE}) == $((SIZE + 64)) ]] && ! cmp -s -n $SIZE plain_${SIZE} inplace_${SIZE} || [[ $SIZE == 0 ]]
+		RESULT=$?
+		../bin/ctr -d inplace_${SIZE} -o decrypted_${SIZE}
+		cmp -s plain_${SIZE} decrypted_${SIZE}
+		RESULT2=$?
+		../bin/ctr -d inplace_${SIZE} --offset $((SIZE / 3)) --length 100 -o decrypted_${SIZE}
+		tail -c +$((SIZE / 3 + 1)) plain_${SIZE} | head -c 100 | cmp -s - decrypted_${SIZE}
+		RESULT2=$(( RESULT2 | $? ))
+		../bin/ctr -e inplace_${SIZE} --in-place 2>/dev/null
+		RESULT3=$?
+		../bin/ctr -d inplace_${SIZE} --in-place
+		cmp -s plain_${SIZE} inplace_${SIZE}
+		RESULT4=$?
+		if [[ "$RESULT" != "0" || "$RESULT2" != "0" || "$RESULT3" == "0" || "$RESULT4" != "0" ]]; then
+			echo "ERROR: $SIZE bytes (--in-place)"
+		else
+			echo "PASS: $SIZE bytes (--in-place)"
+		fi
+		rm -f inplace_${SIZE}
+	done
+
+# An in-place encryption that never finished (trailer state 1 = encrypting) must be refused by both ways of decrypting
+cp plain_1025 inplace_1025
+../bin/ctr -k 256 -e inplace_1025 --in-place
+printf '\x01' | dd of=inplace_1025 bs=1 seek=$((1025 + 32)) conv=notrunc status=none
+if ../bin/ctr -k 256 -d inplace_1025 --in-place 2>/dev/null || ../bin/ctr -k 256 -d inplace_1025 -o decrypted_1025 2>/dev/null; then
+	echo "ERROR: interrupted in-place file detected"
+else
+	echo "PASS: interrupted in-place file detected"
+fi
+rm -f inplace_1025
+
+# Streaming: stdin -> stdout in both directions, and streamed files decrypted from disk (and vice versa)
+for SIZE in $SIZES;
+	do
+		cat plain_${SIZE} | ../bin/ctr -e - -o - | ../bin/ctr -d - -o - > decrypted_${SIZE}
+		diff -q plain_${SIZE} decrypted_${SIZE} >/dev/null
+		RESULT=$?
+		cat plain_${SIZE} | ../bin/ctr -e - -o cipher_${SIZE}
+		../bin/ctr --mmap -d cipher_${SIZE} -o decrypted_${SIZE}
+		diff -q plain_${SIZE} decrypted_${SIZE} >/dev/null
+		RESULT2=$?
+		cat plain_${SIZE} | ../bin/ctr --v1 -e - -o cipher_${SIZE}
+		../bin/ctr --mmap -d cipher_${SIZE} -o decrypted_${SIZE}
+		diff -q plain_${SIZE} decrypted_${SIZE} >/dev/null
+		RESULT2=$(( RESULT2 | $? ))
+		../bin/ctr -e plain_${SIZE} -o cipher_${SIZE}
+		cat cipher_${SIZE} | ../bin/ctr -d - -o - > decrypted_${SIZE}
+		diff -q plain_${SIZE} decrypted_${SIZE} >/dev/null
+		if [[ "$?" == "1" || "$RESULT" == "1" || "$RESULT2" == "1" ]]; then
+			echo "ERROR: $SIZE bytes (stdin/stdout)"
+		else
+			echo "PASS: $SIZE bytes (stdin/stdout)"
+		fi
+	done
+
+# --direct (O_DIRECT, or dropping the pages where the filesystem can't): round trips, files that both ways of reading
+# agree on, and a v1 file refused
+for SIZE in 0 1 16 17 129 1024 1025 494928 5949285 $((8*1024*1024)) $((13*1024*1024+10));
+	do
+		../bin/ctr --direct -e plain_${SIZE} -o cipher_${SIZE}
+		../bin/ctr --direct -d cipher_${SIZE} -o decrypted_${SIZE}
+		cmp -s plain_${SIZE} decrypted_${SIZE}
+		RESULT=$?
+		../bin/ctr -d cipher_${SIZE} -o decrypted_${SIZE}
+		cmp -s plain_${SIZE} decrypted_${SIZE}
+		RESULT2=$?
+		../bin/ctr -e plain_${SIZE} -o cipher_${SIZE}
+		../bin/ctr --direct -d cipher_${SIZE} -o - > decrypted_${SIZE}
+		cmp -s plain_${SIZE} decrypted_${SIZE}
+		if [[ "$?" != "0" || "$RESULT" != "0" || "$RESULT2" != "0" ]]; then
+			echo "ERROR: $SIZE bytes (--direct)"
+		else
+			echo "PASS: $SIZE bytes (--direct)"
+		fi
+	done
+../bin/ctr --v1 -e plain_1025 -o cipher_1025
+if ../bin/ctr --direct -d cipher_1025 -o decrypted_1025 2>/dev/null || ../bin/ctr --direct --v1 -e plain_1025 -o cipher_1025 2>/dev/null; then
+	echo "ERROR: --direct with v1 files refused"
+else
+	echo "PASS: --direct with v1 files refused"
+fi
+
+# Chunk size: a small file gets a single chunk of its own (page-rounded) size instead of 4 MiB; a big one gets
+# the cache-sized default, a multiple of 4096 between 64 KiB and 4 MiB
+../bin/ctr -e plain_1025 -o cipher_1025
+../bin/ctr -e plain_$((13*1024*1024+10)) -o cipher_big
+SMALL_CHUNK=$(od -An -tu4 -j 16 -N 4 cipher_1025 | tr -d ' ')
+BIG_CHUNK=$(od -An -tu4 -j 16 -N 4 cipher_big | tr -d ' ')
+if [[ "$SMALL_CHUNK" != "4096" || $(( BIG_CHUNK % 4096 )) != 0 || $BIG_CHUNK -lt 65536 || $BIG_CHUNK -gt 4194304 ]]; then
+	echo "ERROR: adaptive chunk size ($SMALL_CHUNK, $BIG_CHUNK)"
+else
+	echo "PASS: adaptive chunk size ($SMALL_CHUNK bytes for 1025 bytes, $BIG_CHUNK for 13 MiB)"
+fi
+rm -f cipher_big
+
+# --stats: the report goes to stderr and must not change the output, with any I/O path
+SIZE=5949285
+if ../bin/ctr --stats -e plain_1 -o stats_cipher 2>&1 | grep -q NO_STATS; then
+	echo "PASS: --stats refused (built with NO_STATS)"
+	STATS_OPTS=""
+else
+	STATS_OPTS='"" "--v1" "--v1 --mmap" "--v1 --uring" "-j 3"'
+fi
+eval "set -- $STATS_OPTS"
+for OPTS in "$@";
+	do
+		../bin/ctr $OPTS --stats -e plain_${SIZE} -o stats_cipher 2>stats_text
+		../bin/ctr $OPTS --stats=json -d stats_cipher -o decrypted_${SIZE} 2>stats_json
+		RESULT=0
+		cmp -s plain_${SIZE} decrypted_${SIZE} || RESULT=1
+		grep -q 'MiB/s' stats_text && grep -q '^crypt ' stats_text || RESULT=1
+		grep -q '"stages": {"read"' stats_json || RESULT=1
+		if [[ "$RESULT" == "1" ]]; then
+			echo "ERROR: --stats $OPTS"
+		else
+			echo "PASS: --stats $OPTS"
+		fi
+	done
+rm -f stats_cipher stats_text stats_json
+
+# --batch: a tree in one go (with a file big enough to be split into ranges), every output decrypted with plain -d;
+# then a list with a file missing from it, which is reported while the others still get encrypted
+BIG=$((70*1024*1024+3))
+if [[ ! -f "plain_${BIG}" ]]; then
+	dd if=/dev/urandom of=./plain_${BIG} bs=$BIG count=1 > /dev/null 2>&1
+fi
+BATCH_SIZES="0 1 16 17 1025 494928 $((8*1024*1024)) $BIG"
+rm -rf batch_in batch_out batch_list
+mkdir -p batch_in/sub
+for SIZE in $BATCH_SIZES; do ln plain_${SIZE} batch_in/sub/; done
+../bin/ctr --batch -j 3 -e batch_in -o batch_out 2>/dev/null
+RESULT=$?
+for SIZE in $BATCH_SIZES;
+	do
+		../bin/ctr -d batch_out/sub/plain_${SIZE} -o decrypted_${SIZE} && cmp -s plain_${SIZE} decrypted_${SIZE} || RESULT=1
+	done
+if [[ "$RESULT" != "0" ]]; then
+	echo "ERROR: --batch (directory)"
+else
+	echo "PASS: --batch (directory)"
+fi
+printf 'batch_in/sub/plain_1\nbatch_in/missing\nbatch_in/sub/plain_1025\n' | ../bin/ctr --batch -e - -o batch_list 2>batch_log
+RESULT=$?
+../bin/ctr -d batch_list/batch_in/sub/plain_1025 -o decrypted_1025 && cmp -s plain_1025 decrypted_1025
+if [[ "$?" != "0" || "$RESULT" != "1" || -e batch_list/batch_in/missing ]] || ! grep -q "^FAILED batch_in/missing" batch_log; then
+	echo "ERROR: --batch (list with a missing file)"
+else
+	echo "PASS: --batch (list with a missing file)"
+fi
+# Big files listed slowly, so that new ones come in while earlier ones are still being encrypted: with only a few
+# descriptors to spare, a worker must finish the files it has open before it opens more
+rm -rf batch_list
+for i in {1..10}; do ln plain_${BIG} batch_in/big_$i; done
+(for i in {1..10}; do echo batch_in/big_$i; sleep 0.05; done) | (ulimit -n 16; ../bin/ctr --batch -j 1 -e - -o batch_list 2>batch_log)
+RESULT=$?
+../bin/ctr -d batch_list/batch_in/big_10 -o decrypted_${BIG} && cmp -s plain_${BIG} decrypted_${BIG}
+if [[ "$?" != "0" || "$RESULT" != "0" ]]; then
+	echo "ERROR: --batch (slow list, ulimit -n 16)"
+	cat batch_log
+else
+	echo "PASS: --batch (slow list, ulimit -n 16)"
+fi
+rm -rf batch_in batch_out batch_list batch_log
+
 cd ..
@@ -0,0 +1,154 @@
+#include <string.h> /* memset */
+
+#include "ctx.h"
+#include "cbc.h"
+
+//
+// The embeddable API. aes_ctx_init does the one-time work (cpuid, through aes_select_*, and both key expansions);
+// everything after that works on caller-owned memory with no allocations, so it's safe to call per request.
+//
+
+static void wipe(void *buf, size_t len) {
+	// memset that the compiler can't drop just because buf is never read again
+	memset(buf, 0, len);
+	__asm__ __volatile__("" : : "r"(buf) : "memory");
+}
+
+const char *aes_strerror(int error) {
+	switch (error) {
+		case AES_OK: return "success";
+		case AES_ERR_KEY_LENGTH: return "invalid key length (must be 16, 24 or 32 bytes)";
+		case AES_ERR_ARGUMENT: return "invalid argument";
+		case AES_ERR_STATE: return "context not initialised";
+		case AES_ERR_LENGTH: return "length must be a multiple of 16 bytes";
+		case AES_ERR_EXHAUSTED: return "counter space exhausted";
+		default: return "unknown error";
+	}
+}
+
+int aes_ctx_init(struct aes_ctx *ctx, const unsigned char *key, int key_len) {
+	if (ctx == NULL || key == NULL)
+		return AES_ERR_ARGUMENT;
+	if (aes_rounds(key_len) < 0)
+		return AES_ERR_KEY_LENGTH;
+
+	aes_expand_keys(key, key_len, 1, ctx->enc_keys, ctx->dec_keys);
+	ctx->key_len = key_len;
+	ctx->ctr = aes_select_ctr(key_len);
+	ctx->encrypt = aes_select_encrypt(key_len);
+	ctx->decrypt = aes_select_decrypt(key_len);
+	return AES_OK;
+}
+
+void aes_ctx_clear(struct aes_ctx *ctx) {
+	// Wipes the key schedules; the context has to be initialised again before further use
+	if (ctx != NULL)
+		wipe(ctx, sizeof(*ctx));
+}
+
+static void ctr_xor(const struct aes_ctx *ctx, uint64_t *counter, const unsigned char *in, unsigned char *out, size_t len) {
+	size_t blocks = len / 16, tail = len % 16;
+	ctx->ctr(in, out, blocks, counter, ctx->enc_keys);
+
+	if (tail) {
+		// The kernel only does whole blocks, so run one over zeroes to get the keystream
+		unsigned char keystream[16] = {0};
+		ctx->ctr(keystream, keystream, 1, counter, ctx->enc_keys);
+		for (size_t i = 0; i < tail; i++) {
+			out[blocks*16 + i] = in[blocks*16 + i] ^ keystream[i];
+		}
+		wipe(keystream, 16);
+	}
+}
+
+int aes_ctx_ctr_xor(const struct aes_ctx *ctx, uint64_t *counter, const unsigned char *in, unsigned char *out, size_t len) {
+	if (ctx == NULL || counter == NULL || (len > 0 && (in == NULL || out == NULL)))
+		return AES_ERR_ARGUMENT;
+	if (ctx->ctr == NULL)
+		return AES_ERR_STATE;
+
+	ctr_xor(ctx, counter, in, out, len);
+	return AES_OK;
+}
+
+static int check_cbc_args(const struct aes_ctx *ctx, const unsigned char *iv, const unsigned char *in, const unsigned char *out, size_t len) {
+	if (ctx == NULL || iv == NULL || (len > 0 && (in == NULL || out == NULL)))
+		return AES_ERR_ARGUMENT;
+	if (ctx->ctr == NULL)
+		return AES_ERR_STATE;
+	if (len % 16 != 0)
+		return AES_ERR_LENGTH;
+	return AES_OK;
+}
+
+int aes_ctx_cbc_encrypt(const struct aes_ctx *ctx, unsigned char *iv, const unsigned char *in, unsigned char *out, size_t len) {
+	int err = check_cbc_args(ctx, iv, in, out, len);
+	if (err != AES_OK)
+		return err;
+
+	aes_cbc_encrypt(in, out, len / 16, iv, ctx->enc_keys, ctx->key_len);
+	return AES_OK;
+}
+
+int aes_ctx_cbc_decrypt(const struct aes_ctx *ctx, unsigned char *iv, const unsigned char *in, unsigned char *out, size_t len) {
+	int err = check_cbc_args(ctx, iv, in, out, len);
+	if (err != AES_OK)
+		return err;
+
+	aes_cbc_decrypt(in, out, len / 16, iv, ctx->dec_keys, ctx->key_len);
+	return AES_OK;
+}
+
+int aes_ctr_stream_init(struct aes_ctr_stream *stream, const struct aes_ctx *ctx, const uint64_t *counter) {
+	if (stream == NULL || ctx == NULL || counter == NULL)
+		return AES_ERR_ARGUMENT;
+	if (ctx->ctr == NULL)
+		return AES_ERR_STATE;
+
+	stream->ctx = ctx;
+	stream->counter[0] = counter[0];
+	stream->counter[1] = counter[1];
+	stream->used = 16;
+	return AES_OK;
+}
+
+int aes_ctr_stream_update(struct aes_ctr_stream *stream, const unsigned char *in, unsigned char *out, size_t len) {
+	if (stream == NULL || (len > 0 && (in == NULL || out == NULL)))
+		return AES_ERR_ARGUMENT;
+	if (stream->ctx == NULL)
+		return AES_ERR_STATE;
+
+	// Use up the keystream left over from a partial block first...
+	while (len > 0 && stream->used < 16) {
+		*out++ = *in++ ^ stream->keystream[stream->used++];
+		len--;
+	}
+
+	// ... then whole blocks straight through the kernel, and keep the keystream of a partial last block for next time
+	size_t blocks = len / 16, tail = len % 16;
+	stream->ctx->ctr(in, out, blocks, stream->counter, stream->ctx->enc_keys);
+	if (tail) {
+		memset(stream->keystream, 0, 16);
+		stream->ctx->ctr(stream->keystream, stream->keystream, 1, stream->counter, stream->ctx->enc_keys);
+		for (size_t i = 0; i < tail; i++) {
+			out[blocks*16 + i] = in[blocks*16 + i] ^ stream->keystream[i];
+		}
+		stream->used = tail;
+	}
+
+	return AES_OK;
+}
+
+int aes_ctr_stream_final(struct aes_ctr_stream *stream, uint64_t *counter) {
+	if (stream == NULL)
+		return AES_ERR_ARGUMENT;
+	if (stream->ctx == NULL)
+		return AES_ERR_STATE;
+
+	if (counter != NULL) {
+		counter[0] = stream->counter[0];
+		counter[1] = stream->counter[1];
+	}
+	wipe(stream, sizeof(*stream));
+	return AES_OK;
+}
@@ -0,0 +1,57 @@
+#ifndef _CTX_H
+#define _CTX_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "aes.h"         /* aes_ctr_func, aes_block_func */
+#include "keyschedule.h" /* AES_MAX_EXPANDED_KEY */
+
+// Library entry points (bin/libaes.a, bin/libaes.so). Unlike encrypt_file/decrypt_file, nothing here touches files,
+// allocates memory or exits; errors come back as one of these (negative) codes.
+enum aes_error {
+	AES_OK = 0,
+	AES_ERR_KEY_LENGTH = -1, // key length isn't 16, 24 or 32 bytes
+	AES_ERR_ARGUMENT = -2,   // NULL pointer
+	AES_ERR_STATE = -3,      // context not initialised (or already cleared)
+	AES_ERR_LENGTH = -4,     // length isn't a multiple of 16 where it has to be
+	AES_ERR_EXHAUSTED = -5,  // a keystream ring (keystream.h) has used up every counter value
+};
+
+const char *aes_strerror(int error);
+
+// A key, set up once: both key schedules and the kernels picked for this CPU. It isn't modified after aes_ctx_init,
+// so one context can be shared by any number of threads.
+struct aes_ctx {
+	unsigned char enc_keys[AES_MAX_EXPANDED_KEY];
+	unsigned char dec_keys[AES_MAX_EXPANDED_KEY];
+	int key_len;
+	aes_ctr_func ctr;
+	aes_block_func encrypt, decrypt;
+};
+
+int aes_ctx_init(struct aes_ctx *ctx, const unsigned char *key, int key_len);
+void aes_ctx_clear(struct aes_ctx *ctx);
+
+// CTR over len bytes (any length); counter is nonce, block number as in ctr.c, and is advanced past the data
+// (a partial last block counts as a whole one). in and out may be the same buffer.
+int aes_ctx_ctr_xor(const struct aes_ctx *ctx, uint64_t *counter, const unsigned char *in, unsigned char *out, size_t len);
+
+// CBC over len bytes, a multiple of 16; iv is updated so that the next call continues the message
+int aes_ctx_cbc_encrypt(const struct aes_ctx *ctx, unsigned char *iv, const unsigned char *in, unsigned char *out, size_t len);
+int aes_ctx_cbc_decrypt(const struct aes_ctx *ctx, unsigned char *iv, const unsigned char *in, unsigned char *out, size_t len);
+
+// Streaming CTR: the message can be passed in pieces of any size, and comes out the same as one aes_ctx_ctr_xor call.
+// aes_ctr_stream_final returns the counter of the next unused block and wipes the leftover keystream.
+struct aes_ctr_stream {
+	const struct aes_ctx *ctx;
+	uint64_t counter[2];
+	unsigned char keystream[16]; // for the current partial block
+	unsigned int used;           // bytes of keystream used up; 16 = none left
+};
+
+int aes_ctr_stream_init(struct aes_ctr_stream *stream, const struct aes_ctx *ctx, const uint64_t *counter);
+int aes_ctr_stream_update(struct aes_ctr_stream *stream, const unsigned char *in, unsigned char *out, size_t len);
+int aes_ctr_stream_final(struct aes_ctr_stream *stream, uint64_t *counter);
+
+#endif
@@ -0,0 +1,148 @@
+#define _GNU_SOURCE /* O_DIRECT, sync_file_range */
+#include <stdio.h>
+#include <stdlib.h> /* exit */
+#include <string.h> /* strcmp */
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "direct.h"
+#include "pipeline.h" /* read_full, write_full */
+#include "stats.h"
+
+#define DIRECT_ALIGN 4096 // covers 512-byte and 4K logical sectors alike
+
+static bool aligned(const void *buf, size_t len) {
+	return (uintptr_t)buf % DIRECT_ALIGN == 0 && len % DIRECT_ALIGN == 0;
+}
+
+static void direct_open(struct direct_file *f, const char *path, bool direct, bool output) {
+	*f = (struct direct_file){ .fd = -1, .mode = DIRECT_OFF, .path = path };
+	if (strcmp(path, "-") == 0) {
+		f->fd = output ? STDOUT_FILENO : STDIN_FILENO;
+		return;
+	}
+
+	int flags = output ? (O_WRONLY | O_CREAT | O_TRUNC) : O_RDONLY;
+	if (direct) {
+		f->fd = open(path, flags | O_DIRECT, 0666);
+		f->mode = DIRECT_ON;
+		if (f->fd < 0 && errno == EINVAL) {
+			// The filesystem doesn't do O_DIRECT; go through the cache, but don't leave anything behind in it
+			f->fd = open(path, flags, 0666);
+			f->mode = DIRECT_FALLBACK;
+			if (f->fd >= 0 && !output)
+				posix_fadvise(f->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		}
+	}
+	else
+		f->fd = open(path, flags, 0666);
+
+	if (f->fd < 0) {
+		perror(path);
+		exit(1);
+	}
+}
+
+void direct_open_input(struct direct_file *f, const char *path, bool direct) {
+	direct_open(f, path, direct, false);
+}
+
+void direct_open_output(struct direct_file *f, const char *path, bool direct) {
+	direct_open(f, path, direct, true);
+}
+
+void direct_wrap(struct direct_file *f, int fd, const char *path) {
+	*f = (struct direct_file){ .fd = fd, .mode = DIRECT_OFF, .path = path };
+}
+
+void direct_end(struct direct_file *f) {
+	if (f->mode != DIRECT_ON)
+		return;
+	int flags = fcntl(f->fd, F_GETFL);
+	if (flags < 0 || fcntl(f->fd, F_SETFL, flags & ~O_DIRECT) != 0) {
+		perror(f->path);
+		exit(1);
+	}
+	f->mode = DIRECT_OFF;
+}
+
+size_t direct_read(struct direct_file *f, unsigned char *buf, size_t len) {
+	if (f->mode == DIRECT_ON && !aligned(buf, len))
+		direct_end(f);
+
+	size_t done;
+	if (f->mode == DIRECT_ON) {
+		// read_full would retry after a short read at the end of the file, from an unaligned offset, which O_DIRECT
+		// refuses; a short read that isn't a whole number of pages can only be the end, though
+		STATS_START(mark);
+		done = 0;
+		while (done < len && done % DIRECT_ALIGN == 0) {
+			ssize_t r = read(f->fd, buf + done, len - done);
+			if (r == 0)
+				break;
+			if (r < 0) {
+				if (errno == EINTR)
+					continue;
+				return (size_t)-1;
+			}
+			done += r;
+		}
+		STATS_STOP(mark, STATS_READ, done);
+	}
+	else
+		done = read_full(f->fd, buf, len);
+
+	if (done != (size_t)-1) {
+		if (f->mode == DIRECT_FALLBACK && done > 0)
+			posix_fadvise(f->fd, f->pos, done, POSIX_FADV_DONTNEED);
+		f->pos += done;
+	}
+	return done;
+}
+
+static void write_back(struct direct_file *f, bool all) {
+	// Starts writeback of what's been written since last time, then waits for the previous batch (which has had
+	// a chunk's worth of time to get to disk) and drops it from the cache. With all, waits for everything.
+	sync_file_range(f->fd, f->written_back, f->pos - f->written_back, SYNC_FILE_RANGE_WRITE);
+	off_t until = all ? f->pos : f->written_back;
+	if (until > f->dropped) {
+		sync_file_range(f->fd, f->dropped, until - f->dropped,
+				SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+		posix_fadvise(f->fd, f->dropped, until - f->dropped, POSIX_FADV_DONTNEED);
+		f->dropped = until;
+	}
+	f->written_back = f->pos;
+}
+
+void direct_write(struct direct_file *f, const unsigned char *buf, size_t len) {
+	if (f->mode == DIRECT_ON && (uintptr_t)buf % DIRECT_ALIGN != 0)
+		direct_end(f);
+
+	if (f->mode == DIRECT_ON) {
+		// Whole pages straight to the disk; anything after that (the end of the file) through the cache
+		size_t whole = len & ~(size_t)(DIRECT_ALIGN - 1);
+		write_full(f->fd, buf, whole);
+		if (whole < len) {
+			direct_end(f);
+			write_full(f->fd, buf + whole, len - whole);
+		}
+	}
+	else
+		write_full(f->fd, buf, len);
+
+	f->pos += len;
+	if (f->mode == DIRECT_FALLBACK)
+		write_back(f, false);
+}
+
+void direct_close(struct direct_file *f) {
+	if (f->mode == DIRECT_FALLBACK && f->pos > 0)
+		write_back(f, true);
+	if (close(f->fd) != 0) {
+		perror(f->path);
+		exit(1);
+	}
+}
@@ -0,0 +1,38 @@
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+// Files for --direct, which keeps bulk encryption out of the page cache. Where the filesystem supports it they're
+// opened with O_DIRECT; reads and writes then have to be page aligned, which the v2 format is, up to its index at the
+// very end (and the last, partial chunk of a decrypted file), so an unaligned write or read switches the file back to
+// normal I/O for the rest of it. On filesystems without O_DIRECT (tmpfs), the data goes through the cache as usual
+// but is dropped from it right behind us: posix_fadvise(DONTNEED) on what's been read, and sync_file_range, then
+// DONTNEED, on what's been written.
+//
+// Without --direct (DIRECT_OFF) these are just read_full and write_full, so the v2 code can use them unconditionally.
+enum direct_mode { DIRECT_OFF, DIRECT_ON, DIRECT_FALLBACK };
+
+struct direct_file {
+	int fd;
+	enum direct_mode mode;
+	const char *path;   // for error messages
+	off_t pos;          // bytes read or written so far
+	off_t written_back; // output, DIRECT_FALLBACK: writeback has been started up to here...
+	off_t dropped;      // ... and finished, and the pages dropped from the cache, up to here
+};
+
+// "-" is stdin/stdout (never direct); both exit on errors, like open_input/open_output
+void direct_open_input(struct direct_file *f, const char *path, bool direct);
+void direct_open_output(struct direct_file *f, const char *path, bool direct);
+void direct_wrap(struct direct_file *f, int fd, const char *path); // an fd that's already open, DIRECT_OFF
+
+// Like read_full: the number of bytes read (short only at the end of the file), or (size_t)-1 on errors.
+// With O_DIRECT, buf and len have to be multiples of 4096 unless direct_end has been called.
+size_t direct_read(struct direct_file *f, unsigned char *buf, size_t len);
+// Like write_full (exits on errors); the unaligned end of a write goes through the page cache
+void direct_write(struct direct_file *f, const unsigned char *buf, size_t len);
+
+// Back to normal I/O, for the unaligned bits at the end of a file
+void direct_end(struct direct_file *f);
+// Flushes what's left (for output files) and closes the file; exits if that fails
+void direct_close(struct direct_file *f);
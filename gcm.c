@@ -0,0 +1,460 @@
+#include <stdio.h>
+#include <string.h> /* memcpy */
+#include <wmmintrin.h> /* AES-NI and PCLMULQDQ intrinsics */
+#include <tmmintrin.h> /* pshufb */
+
+#include "gcm.h"
+#include "aes.h"
+#include "keyschedule.h" /* aes_rounds */
+#include "misc.h" /* test_*_support */
+
+//
+// AES-GCM (NIST SP 800-38D): CTR encryption with a 32-bit big-endian block counter, plus GHASH, a polynomial
+// MAC over GF(2^128), over the AAD and the ciphertext.
+//
+// The fast path follows Intel's white paper on carry-less multiplication: blocks are byte-reflected with pshufb,
+// multiplied with four PCLMULQDQs, and reduced modulo x^128 + x^7 + x^2 + x + 1. Reduction is linear, so eight
+// blocks are hashed with H^8 ... H^1 (precomputed in aes_gcm_init) and their products summed before a single
+// reduction. The GHASH of each group of 8 ciphertext blocks happens in the same loop iteration as the AES rounds
+// for the next 8 counter blocks, so the data is read once and the multiplier and AES units work side by side.
+//
+
+#define GCM_NI __attribute__((target("aes,pclmul,ssse3")))
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+static void inc32(unsigned char *block) {
+	// Increments the last 32 bits of block as a big-endian integer, wrapping around
+	for (int i = 15; i >= 12; i--) {
+		if (++block[i] != 0)
+			break;
+	}
+}
+
+static void put_be64(unsigned char *out, uint64_t value) {
+	for (int i = 7; i >= 0; i--) {
+		out[i] = value & 0xff;
+		value >>= 8;
+	}
+}
+
+//
+// Portable GHASH: the bit-at-a-time multiplication from SP 800-38D (algorithm 1), on big-endian halves
+//
+
+static uint64_t get_be64(const unsigned char *in) {
+	uint64_t value = 0;
+	for (int i = 0; i < 8; i++) {
+		value = (value << 8) | in[i];
+	}
+	return value;
+}
+
+static void gf_mult_c(unsigned char *x, const unsigned char *h) {
+	// x = x * h in GF(2^128)
+	uint64_t z_hi = 0, z_lo = 0;
+	uint64_t v_hi = get_be64(h), v_lo = get_be64(h + 8);
+
+	for (int i = 0; i < 128; i++) {
+		if ((x[i / 8] >> (7 - i % 8)) & 1) {
+			z_hi ^= v_hi;
+			z_lo ^= v_lo;
+		}
+		bool lsb = v_lo & 1;
+		v_lo = (v_lo >> 1) | (v_hi << 63);
+		v_hi >>= 1;
+		if (lsb)
+			v_hi ^= 0xe100000000000000ULL;
+	}
+
+	put_be64(x, z_hi);
+	put_be64(x + 8, z_lo);
+}
+
+static void ghash_blocks_c(struct aes_gcm *ctx, const unsigned char *data, size_t blocks) {
+	for (size_t i = 0; i < blocks; i++) {
+		for (int j = 0; j < 16; j++) {
+			ctx->x[j] ^= data[i*16 + j];
+		}
+		gf_mult_c(ctx->x, ctx->h);
+	}
+}
+
+//
+// PCLMULQDQ GHASH
+//
+
+GCM_NI static ALWAYS_INLINE __m128i bswap128(__m128i a) {
+	return _mm_shuffle_epi8(a, _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+}
+
+GCM_NI static ALWAYS_INLINE void clmul_acc(__m128i a, __m128i b, __m128i *lo, __m128i *mid, __m128i *hi) {
+	// Adds the unreduced 256-bit product a*b to lo/mid/hi
+	*lo = _mm_xor_si128(*lo, _mm_clmulepi64_si128(a, b, 0x00));
+	*hi = _mm_xor_si128(*hi, _mm_clmulepi64_si128(a, b, 0x11));
+	*mid = _mm_xor_si128(*mid, _mm_clmulepi64_si128(a, b, 0x01));
+	*mid = _mm_xor_si128(*mid, _mm_clmulepi64_si128(a, b, 0x10));
+}
+
+GCM_NI static ALWAYS_INLINE __m128i ghash_reduce(__m128i lo, __m128i mid, __m128i hi) {
+	// Reduces a (sum of) 256-bit product(s) modulo the GCM polynomial. Since the operands are bit-reflected,
+	// the product is first shifted left one bit; see algorithm 5 of Intel's white paper.
+	lo = _mm_xor_si128(lo, _mm_slli_si128(mid, 8));
+	hi = _mm_xor_si128(hi, _mm_srli_si128(mid, 8));
+
+	__m128i carry_lo = _mm_srli_epi32(lo, 31);
+	__m128i carry_hi = _mm_srli_epi32(hi, 31);
+	lo = _mm_slli_epi32(lo, 1);
+	hi = _mm_slli_epi32(hi, 1);
+	__m128i carry_mid = _mm_srli_si128(carry_lo, 12);
+	carry_hi = _mm_slli_si128(carry_hi, 4);
+	carry_lo = _mm_slli_si128(carry_lo, 4);
+	lo = _mm_or_si128(lo, carry_lo);
+	hi = _mm_or_si128(hi, carry_hi);
+	hi = _mm_or_si128(hi, carry_mid);
+
+	__m128i a = _mm_slli_epi32(lo, 31);
+	__m128i b = _mm_slli_epi32(lo, 30);
+	__m128i c = _mm_slli_epi32(lo, 25);
+	a = _mm_xor_si128(a, b);
+	a = _mm_xor_si128(a, c);
+	b = _mm_srli_si128(a, 4);
+	a = _mm_slli_si128(a, 12);
+	lo = _mm_xor_si128(lo, a);
+
+	__m128i d = _mm_srli_epi32(lo, 1);
+	__m128i e = _mm_srli_epi32(lo, 2);
+	__m128i f = _mm_srli_epi32(lo, 7);
+	d = _mm_xor_si128(d, e);
+	d = _mm_xor_si128(d, f);
+	d = _mm_xor_si128(d, b);
+	lo = _mm_xor_si128(lo, d);
+
+	return _mm_xor_si128(hi, lo);
+}
+
+GCM_NI static ALWAYS_INLINE __m128i gf_mult_clmul(__m128i a, __m128i b) {
+	__m128i lo = _mm_setzero_si128(), mid = _mm_setzero_si128(), hi = _mm_setzero_si128();
+	clmul_acc(a, b, &lo, &mid, &hi);
+	return ghash_reduce(lo, mid, hi);
+}
+
+GCM_NI static ALWAYS_INLINE __m128i ghash8(__m128i x, const unsigned char *data, const unsigned char (*h_powers)[16]) {
+	// x = (((x ^ C0)*H ^ C1)*H ^ ... ^ C7)*H, as (x ^ C0)*H^8 ^ C1*H^7 ^ ... ^ C7*H with one reduction
+	__m128i lo = _mm_setzero_si128(), mid = _mm_setzero_si128(), hi = _mm_setzero_si128();
+	#pragma GCC unroll 8
+	for (int j = 0; j < 8; j++) {
+		__m128i block = bswap128(_mm_loadu_si128((const __m128i *)(data + j*16)));
+		if (j == 0)
+			block = _mm_xor_si128(block, x);
+		clmul_acc(block, _mm_loadu_si128((const __m128i *)h_powers[7 - j]), &lo, &mid, &hi);
+	}
+	return ghash_reduce(lo, mid, hi);
+}
+
+GCM_NI static void ghash_blocks_clmul(struct aes_gcm *ctx, const unsigned char *data, size_t blocks) {
+	__m128i x = _mm_loadu_si128((const __m128i *)ctx->x);
+	__m128i h = _mm_loadu_si128((const __m128i *)ctx->h_powers[0]);
+
+	size_t i = 0;
+	for (; i + 8 <= blocks; i += 8) {
+		x = ghash8(x, data + i*16, (const unsigned char (*)[16])ctx->h_powers);
+	}
+	for (; i < blocks; i++) {
+		x = gf_mult_clmul(_mm_xor_si128(x, bswap128(_mm_loadu_si128((const __m128i *)(data + i*16)))), h);
+	}
+
+	_mm_storeu_si128((__m128i *)ctx->x, x);
+}
+
+GCM_NI static void clmul_setup(struct aes_gcm *ctx) {
+	// H^1 ... H^8 for ghash8
+	__m128i h = bswap128(_mm_loadu_si128((const __m128i *)ctx->h));
+	__m128i power = h;
+	_mm_storeu_si128((__m128i *)ctx->h_powers[0], h);
+	for (int i = 1; i < 8; i++) {
+		power = gf_mult_clmul(power, h);
+		_mm_storeu_si128((__m128i *)ctx->h_powers[i], power);
+	}
+}
+
+GCM_NI static void x_to_bytes(const struct aes_gcm *ctx, unsigned char *out) {
+	_mm_storeu_si128((__m128i *)out, bswap128(_mm_loadu_si128((const __m128i *)ctx->x)));
+}
+
+//
+// The stitched CTR + GHASH kernel; whole blocks only
+//
+
+GCM_NI static ALWAYS_INLINE void gcm_crypt_clmul(struct aes_gcm *ctx, const unsigned char *in, unsigned char *out, size_t blocks,
+		const bool encrypt, const int rounds) {
+	const unsigned char (*h_powers)[16] = (const unsigned char (*)[16])ctx->h_powers;
+	__m128i rk[15];
+	#pragma GCC unroll 15
+	for (int i = 0; i <= rounds; i++) {
+		rk[i] = _mm_loadu_si128((const __m128i *)(ctx->keys + i*16));
+	}
+
+	// The counter is kept byte-reflected, so that its big-endian low 32 bits are the low dword
+	const __m128i one = _mm_set_epi32(0, 0, 0, 1);
+	__m128i ctr = bswap128(_mm_loadu_si128((const __m128i *)ctx->ctr));
+	__m128i x = _mm_loadu_si128((const __m128i *)ctx->x);
+	__m128i h = _mm_loadu_si128((const __m128i *)h_powers[0]);
+
+	size_t i = 0;
+	for (; i + 8 <= blocks; i += 8) {
+		__m128i b[8];
+		#pragma GCC unroll 8
+		for (int j = 0; j < 8; j++) {
+			b[j] = _mm_xor_si128(bswap128(ctr), rk[0]);
+			ctr = _mm_add_epi32(ctr, one);
+		}
+
+		// Hash the ciphertext while the AES rounds run: when decrypting, that's this iteration's input (hashed before
+		// anything is written, in case in == out); when encrypting, it's the previous iteration's output.
+		if (!encrypt)
+			x = ghash8(x, in + i*16, h_powers);
+		else if (i > 0)
+			x = ghash8(x, out + (i-8)*16, h_powers);
+
+		#pragma GCC unroll 14
+		for (int round = 1; round < rounds; round++) {
+			#pragma GCC unroll 8
+			for (int j = 0; j < 8; j++) {
+				b[j] = _mm_aesenc_si128(b[j], rk[round]);
+			}
+		}
+		#pragma GCC unroll 8
+		for (int j = 0; j < 8; j++) {
+			b[j] = _mm_aesenclast_si128(b[j], rk[rounds]);
+			b[j] = _mm_xor_si128(b[j], _mm_loadu_si128((const __m128i *)(in + (i+j)*16)));
+			_mm_storeu_si128((__m128i *)(out + (i+j)*16), b[j]);
+		}
+	}
+	if (encrypt && i > 0)
+		x = ghash8(x, out + (i-8)*16, h_powers);
+
+	for (; i < blocks; i++) {
+		__m128i b = _mm_xor_si128(bswap128(ctr), rk[0]);
+		ctr = _mm_add_epi32(ctr, one);
+		#pragma GCC unroll 14
+		for (int round = 1; round < rounds; round++) {
+			b = _mm_aesenc_si128(b, rk[round]);
+		}
+		b = _mm_aesenclast_si128(b, rk[rounds]);
+
+		__m128i c = _mm_loadu_si128((const __m128i *)(in + i*16));
+		b = _mm_xor_si128(b, c);
+		if (encrypt)
+			c = b;
+		x = gf_mult_clmul(_mm_xor_si128(x, bswap128(c)), h);
+		_mm_storeu_si128((__m128i *)(out + i*16), b);
+	}
+
+	_mm_storeu_si128((__m128i *)ctx->ctr, bswap128(ctr));
+	_mm_storeu_si128((__m128i *)ctx->x, x);
+}
+
+GCM_NI static void gcm_encrypt_128(struct aes_gcm *ctx, const unsigned char *in, unsigned char *out, size_t blocks) {
+	gcm_crypt_clmul(ctx, in, out, blocks, true, 10);
+}
+
+GCM_NI static void gcm_encrypt_192(struct aes_gcm *ctx, const unsigned char *in, unsigned char *out, size_t blocks) {
+	gcm_crypt_clmul(ctx, in, out, blocks, true, 12);
+}
+
+GCM_NI static void gcm_encrypt_256(struct aes_gcm *ctx, const unsigned char *in, unsigned char *out, size_t blocks) {
+	gcm_crypt_clmul(ctx, in, out, blocks, true, 14);
+}
+
+GCM_NI static void gcm_decrypt_128(struct aes_gcm *ctx, const unsigned char *in, unsigned char *out, size_t blocks) {
+	gcm_crypt_clmul(ctx, in, out, blocks, false, 10);
+}
+
+GCM_NI static void gcm_decrypt_192(struct aes_gcm *ctx, const unsigned char *in, unsigned char *out, size_t blocks) {
+	gcm_crypt_clmul(ctx, in, out, blocks, false, 12);
+}
+
+GCM_NI static void gcm_decrypt_256(struct aes_gcm *ctx, const unsigned char *in, unsigned char *out, size_t blocks) {
+	gcm_crypt_clmul(ctx, in, out, blocks, false, 14);
+}
+
+//
+// Everything else works the same on both paths
+//
+
+static void ghash(struct aes_gcm *ctx, const unsigned char *data, size_t len) {
+	// Hashes len bytes; a partial last block is padded with zeroes
+	size_t blocks = len / 16;
+	unsigned char last[16] = {0};
+	memcpy(last, data + blocks*16, len % 16);
+
+	if (ctx->clmul) {
+		ghash_blocks_clmul(ctx, data, blocks);
+		if (len % 16)
+			ghash_blocks_clmul(ctx, last, 1);
+	}
+	else {
+		ghash_blocks_c(ctx, data, blocks);
+		if (len % 16)
+			ghash_blocks_c(ctx, last, 1);
+	}
+}
+
+static void gcm_crypt(struct aes_gcm *ctx, const unsigned char *in, unsigned char *out, size_t len, bool encrypt) {
+	size_t blocks = len / 16;
+	ctx->text_len += len;
+
+	if (ctx->clmul) {
+		static void (*const kernels[2][3])(struct aes_gcm *, const unsigned char *, unsigned char *, size_t) = {
+			{ gcm_decrypt_128, gcm_decrypt_192, gcm_decrypt_256 },
+			{ gcm_encrypt_128, gcm_encrypt_192, gcm_encrypt_256 },
+		};
+		kernels[encrypt][(ctx->key_len - 16) / 8](ctx, in, out, blocks);
+	}
+	else {
+		for (size_t i = 0; i < blocks; i++) {
+			unsigned char keystream[16];
+			ctx->encrypt(ctx->ctr, keystream, ctx->keys);
+			inc32(ctx->ctr);
+			if (!encrypt)
+				ghash_blocks_c(ctx, in + i*16, 1);
+			for (int j = 0; j < 16; j++) {
+				out[i*16 + j] = in[i*16 + j] ^ keystream[j];
+			}
+			if (encrypt)
+				ghash_blocks_c(ctx, out + i*16, 1);
+		}
+	}
+
+	size_t tail = len % 16;
+	if (tail) {
+		// The partial last block: the ciphertext is hashed as if zero padded
+		unsigned char keystream[16];
+		in += blocks*16;
+		out += blocks*16;
+		ctx->encrypt(ctx->ctr, keystream, ctx->keys);
+		inc32(ctx->ctr);
+		if (!encrypt)
+			ghash(ctx, in, tail);
+		for (size_t j = 0; j < tail; j++) {
+			out[j] = in[j] ^ keystream[j];
+		}
+		if (encrypt)
+			ghash(ctx, out, tail);
+	}
+}
+
+int aes_gcm_init(struct aes_gcm *ctx, const unsigned char *keys, int key_len, const unsigned char *iv, size_t iv_len) {
+	//
+	// keys is the expanded encryption key (aes_expand_key_len). Any IV length but 0 works; 12 bytes is the
+	// standard (and fast) one. Returns -1 for an invalid key or IV length.
+	//
+	if (aes_rounds(key_len) < 0 || iv_len == 0)
+		return -1;
+
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->keys = keys;
+	ctx->key_len = key_len;
+	ctx->clmul = test_aesni_support() && test_pclmul_support() && test_ssse3_support();
+	ctx->encrypt = aes_select_encrypt(key_len);
+
+	const unsigned char zero[16] = {0};
+	ctx->encrypt(zero, ctx->h, keys);
+	if (ctx->clmul)
+		clmul_setup(ctx);
+
+	if (iv_len == 12) {
+		// J0 = IV || 0^31 || 1
+		memcpy(ctx->j0, iv, 12);
+		ctx->j0[15] = 1;
+	}
+	else {
+		// J0 = GHASH(IV, zero padded, then a block with the IV's length in bits)
+		unsigned char lengths[16] = {0};
+		put_be64(lengths + 8, (uint64_t)iv_len * 8);
+		ghash(ctx, iv, iv_len);
+		ghash(ctx, lengths, 16);
+		if (ctx->clmul)
+			x_to_bytes(ctx, ctx->j0);
+		else
+			memcpy(ctx->j0, ctx->x, 16);
+		memset(ctx->x, 0, 16);
+	}
+
+	memcpy(ctx->ctr, ctx->j0, 16);
+	inc32(ctx->ctr);
+
+	return 0;
+}
+
+void aes_gcm_aad(struct aes_gcm *ctx, const unsigned char *aad, size_t len) {
+	// Additional authenticated data: hashed, but not encrypted. Must come before the data.
+	ghash(ctx, aad, len);
+	ctx->aad_len += len;
+}
+
+void aes_gcm_encrypt(struct aes_gcm *ctx, const unsigned char *in, unsigned char *out, size_t len) {
+	gcm_crypt(ctx, in, out, len, true);
+}
+
+void aes_gcm_decrypt(struct aes_gcm *ctx, const unsigned char *in, unsigned char *out, size_t len) {
+	// The plaintext isn't authentic until aes_gcm_final's tag has been checked!
+	gcm_crypt(ctx, in, out, len, false);
+}
+
+void aes_gcm_final(struct aes_gcm *ctx, unsigned char *tag) {
+	// Writes the 16-byte tag: E(K, J0) ^ GHASH(AAD, ciphertext, lengths)
+	unsigned char lengths[16], s[16], mask[16];
+	put_be64(lengths, ctx->aad_len * 8);
+	put_be64(lengths + 8, ctx->text_len * 8);
+	ghash(ctx, lengths, 16);
+
+	if (ctx->clmul)
+		x_to_bytes(ctx, s);
+	else
+		memcpy(s, ctx->x, 16);
+
+	ctx->encrypt(ctx->j0, mask, ctx->keys);
+	for (int i = 0; i < 16; i++) {
+		tag[i] = s[i] ^ mask[i];
+	}
+}
+
+bool aes_gcm_tag_equal(const unsigned char *a, const unsigned char *b, size_t len) {
+	// Constant-time comparison, so that a forger can't learn how many leading bytes were right
+	unsigned char diff = 0;
+	for (size_t i = 0; i < len; i++) {
+		diff |= a[i] ^ b[i];
+	}
+	return diff == 0;
+}
+
+int aes_gcm_seal(const unsigned char *keys, int key_len, const unsigned char *iv, size_t iv_len,
+		const unsigned char *aad, size_t aad_len, const unsigned char *in, unsigned char *out, size_t len, unsigned char *tag) {
+	struct aes_gcm ctx;
+	if (aes_gcm_init(&ctx, keys, key_len, iv, iv_len) != 0)
+		return -1;
+
+	aes_gcm_aad(&ctx, aad, aad_len);
+	aes_gcm_encrypt(&ctx, in, out, len);
+	aes_gcm_final(&ctx, tag);
+	return 0;
+}
+
+int aes_gcm_open(const unsigned char *keys, int key_len, const unsigned char *iv, size_t iv_len,
+		const unsigned char *aad, size_t aad_len, const unsigned char *in, unsigned char *out, size_t len, const unsigned char *tag) {
+	struct aes_gcm ctx;
+	unsigned char expected[16];
+	if (aes_gcm_init(&ctx, keys, key_len, iv, iv_len) != 0)
+		return -1;
+
+	aes_gcm_aad(&ctx, aad, aad_len);
+	aes_gcm_decrypt(&ctx, in, out, len);
+	aes_gcm_final(&ctx, expected);
+
+	if (!aes_gcm_tag_equal(expected, tag, 16)) {
+		memset(out, 0, len);
+		return -1;
+	}
+	return 0;
+}
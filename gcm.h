@@ -0,0 +1,39 @@
+#ifndef _GCM_H
+#define _GCM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "aes.h" /* aes_block_func */
+
+// State for one GCM message. Set up with aes_gcm_init, then aes_gcm_aad (optional), then any number of
+// aes_gcm_encrypt or aes_gcm_decrypt calls, then aes_gcm_final. Every aes_gcm_aad/encrypt/decrypt call but the
+// last of its kind must pass a multiple of 16 bytes.
+struct aes_gcm {
+	const unsigned char *keys;    // expanded encryption keys (GCM never uses the decryption keys)
+	int key_len;
+	bool clmul;                   // GHASH with PCLMULQDQ and the CTR part with AES-NI; set by aes_gcm_init
+	aes_block_func encrypt;       // single-block kernel for the portable path
+	unsigned char h[16];          // the hash key, E(K, 0)
+	unsigned char h_powers[8][16];// H^1 ... H^8, byte-reflected, for the PCLMULQDQ path
+	unsigned char j0[16];         // pre-counter block; E(K, J0) masks the tag
+	unsigned char ctr[16];        // next counter block
+	unsigned char x[16];          // running GHASH value (byte-reflected on the PCLMULQDQ path)
+	uint64_t aad_len, text_len;   // in bytes
+};
+
+int aes_gcm_init(struct aes_gcm *ctx, const unsigned char *keys, int key_len, const unsigned char *iv, size_t iv_len);
+void aes_gcm_aad(struct aes_gcm *ctx, const unsigned char *aad, size_t len);
+void aes_gcm_encrypt(struct aes_gcm *ctx, const unsigned char *in, unsigned char *out, size_t len);
+void aes_gcm_decrypt(struct aes_gcm *ctx, const unsigned char *in, unsigned char *out, size_t len);
+void aes_gcm_final(struct aes_gcm *ctx, unsigned char *tag);
+bool aes_gcm_tag_equal(const unsigned char *a, const unsigned char *b, size_t len);
+
+// One-shot versions. aes_gcm_open returns 0 if the tag matched, and -1 (with out zeroed) if not.
+int aes_gcm_seal(const unsigned char *keys, int key_len, const unsigned char *iv, size_t iv_len,
+		const unsigned char *aad, size_t aad_len, const unsigned char *in, unsigned char *out, size_t len, unsigned char *tag);
+int aes_gcm_open(const unsigned char *keys, int key_len, const unsigned char *iv, size_t iv_len,
+		const unsigned char *aad, size_t aad_len, const unsigned char *in, unsigned char *out, size_t len, const unsigned char *tag);
+
+#endif
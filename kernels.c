@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <stdlib.h> /* getenv */
+#include <string.h> /* strcmp, memcmp */
+#include <time.h>
+
+#include "kernels.h"
+#include "keyschedule.h" /* aes_expand_key_c */
+#include "misc.h"        /* test_*_support */
+
+//
+// The CTR kernel registry. Each kernel is built with its own target attributes (aes.c, vaes.c, bitslice.c, ...),
+// so nothing here assumes more than the nocona baseline; a kernel is only handed out after its cpuid check.
+//
+// The choice is made once, by a constructor, when the program or libaes.so is loaded. (An ifunc resolver would
+// run while relocations are still being applied, which rules out running, let alone timing, the kernels there.)
+//
+
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+static ALWAYS_INLINE void block_ctr(const unsigned char *in, unsigned char *out, size_t blocks, uint64_t *counter, const unsigned char *keys, aes_block_func encrypt) {
+	// CTR on top of a single-block kernel: one block at a time, no interleaving
+	unsigned char keystream[16];
+
+	for (size_t i = 0; i < blocks; i++) {
+		encrypt((const unsigned char *)counter, keystream, keys);
+		counter[1]++;
+		for (int j = 0; j < 16; j++) {
+			out[i*16 + j] = in[i*16 + j] ^ keystream[j];
+		}
+	}
+}
+
+#define BLOCK_CTR(name, encrypt) \
+	static void name(const unsigned char *in, unsigned char *out, size_t blocks, uint64_t *counter, const unsigned char *keys) { \
+		block_ctr(in, out, blocks, counter, keys, encrypt); \
+	}
+
+BLOCK_CTR(ctr_c_192, aes_encrypt_c_192)
+BLOCK_CTR(ctr_c_256, aes_encrypt_c_256)
+BLOCK_CTR(ctr_vperm, aes_encrypt_vperm)
+BLOCK_CTR(ctr_vperm_192, aes_encrypt_vperm_192)
+BLOCK_CTR(ctr_vperm_256, aes_encrypt_vperm_256)
+BLOCK_CTR(ctr_aesni1, aes_encrypt_aesni)
+BLOCK_CTR(ctr_aesni1_192, aes_encrypt_aesni_192)
+BLOCK_CTR(ctr_aesni1_256, aes_encrypt_aesni_256)
+
+static bool vaes_avx512_support(void) {
+	return test_vaes_support() && test_avx512_support();
+}
+
+static bool vaes_avx2_support(void) {
+	return test_vaes_support() && test_avx2_support();
+}
+
+static const struct aes_kernel kernels[] = {
+	{ "vaes-avx512", "VAES, 32 blocks in 8 zmm registers", vaes_avx512_support,
+		{ aes_ctr_vaes_avx512, aes_ctr_vaes_avx512_192, aes_ctr_vaes_avx512_256 } },
+	{ "vaes-avx2", "VAES, 16 blocks in 8 ymm registers", vaes_avx2_support,
+		{ aes_ctr_vaes_avx2, aes_ctr_vaes_avx2_192, aes_ctr_vaes_avx2_256 } },
+	{ "aesni", "AES-NI, 8 blocks interleaved", test_aesni_support,
+		{ aes_ctr_aesni, aes_ctr_aesni_192, aes_ctr_aesni_256 } },
+	{ "aesni1", "AES-NI, one block at a time", test_aesni_support,
+		{ ctr_aesni1, ctr_aesni1_192, ctr_aesni1_256 } },
+	{ "bitslice", "constant-time bitsliced SSE2, 8 blocks", NULL,
+		{ aes_ctr_bitslice, aes_ctr_bitslice_192, aes_ctr_bitslice_256 } },
+	{ "vperm", "SSSE3 vector permute (no tables), one block at a time", test_ssse3_support,
+		{ ctr_vperm, ctr_vperm_192, ctr_vperm_256 } },
+	{ "c", "portable C with lookup tables, one block at a time", NULL,
+		{ aes_ctr_c, ctr_c_192, ctr_c_256 } },
+};
+#define NUM_KERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+const struct aes_kernel *aes_kernel_list(size_t *count) {
+	*count = NUM_KERNELS;
+	return kernels;
+}
+
+const struct aes_kernel *aes_kernel_find(const char *name) {
+	for (size_t i = 0; i < NUM_KERNELS; i++) {
+		if (strcmp(kernels[i].name, name) == 0)
+			return &kernels[i];
+	}
+	return NULL;
+}
+
+bool aes_kernel_supported(const struct aes_kernel *kernel) {
+	return kernel->supported == NULL || kernel->supported();
+}
+
+static const struct aes_kernel *default_kernel(void) {
+	// "c" runs anywhere, so this always finds one
+	size_t i = 0;
+	while (!aes_kernel_supported(&kernels[i]))
+		i++;
+	return &kernels[i];
+}
+
+#define CHECK_BLOCKS 77 // two 32-block steps, three 4-block steps and a single block for the widest kernel
+static bool kernel_correct(const struct aes_kernel *kernel) {
+	// Against the C kernels, for all three key sizes, split over two calls so that the counter update is checked too
+	static const aes_block_func reference[3] = { aes_encrypt_c, aes_encrypt_c_192, aes_encrypt_c_256 };
+	unsigned char key[32], keys[AES_MAX_EXPANDED_KEY], in[CHECK_BLOCKS*16], out[CHECK_BLOCKS*16], expected[CHECK_BLOCKS*16];
+	for (int i = 0; i < 32; i++) {
+		key[i] = 17 * i + 3;
+	}
+	for (int i = 0; i < CHECK_BLOCKS*16; i++) {
+		in[i] = i;
+	}
+
+	for (int k = 0; k < 3; k++) {
+		aes_expand_key_c(key, 16 + 8*k, keys);
+
+		uint64_t ref_counter[2] = {0x0011223344556677ULL, 0xfffffffffffffff0ULL};
+		block_ctr(in, expected, CHECK_BLOCKS, ref_counter, keys, reference[k]);
+
+		uint64_t counter[2] = {0x0011223344556677ULL, 0xfffffffffffffff0ULL};
+		kernel->ctr[k](in, out, 35, counter, keys);
+		kernel->ctr[k](in + 35*16, out + 35*16, CHECK_BLOCKS - 35, counter, keys);
+		if (memcmp(out, expected, sizeof(out)) != 0 || counter[1] != ref_counter[1])
+			return false;
+	}
+	return true;
+}
+
+static double seconds(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define TUNE_BYTES (16*1024)
+#define TUNE_SECONDS 0.002
+static double kernel_speed(const struct aes_kernel *kernel) {
+	// Bytes per second for AES-128 over a buffer that stays in L1, best of a few runs of TUNE_SECONDS each.
+	// Small enough that tuning every kernel costs a few tens of milliseconds at startup.
+	static unsigned char buf[TUNE_BYTES];
+	unsigned char key[16] = {0}, keys[AES_MAX_EXPANDED_KEY];
+	uint64_t counter[2] = {0, 1};
+	aes_expand_key_c(key, 16, keys);
+
+	double best = 0;
+	for (int run = 0; run < 3; run++) {
+		size_t bytes = 0;
+		double start = seconds(), elapsed;
+		do {
+			kernel->ctr[0](buf, buf, TUNE_BYTES / 16, counter, keys);
+			bytes += TUNE_BYTES;
+			elapsed = seconds() - start;
+		} while (elapsed < TUNE_SECONDS);
+
+		if (bytes / elapsed > best)
+			best = bytes / elapsed;
+	}
+	return best;
+}
+
+static const struct aes_kernel *tune(void) {
+	const struct aes_kernel *fastest = NULL;
+	double fastest_speed = 0;
+
+	for (size_t i = 0; i < NUM_KERNELS; i++) {
+		if (!aes_kernel_supported(&kernels[i]) || !kernel_correct(&kernels[i]))
+			continue;
+
+		double speed = kernel_speed(&kernels[i]);
+		if (speed > fastest_speed) {
+			fastest = &kernels[i];
+			fastest_speed = speed;
+		}
+	}
+
+	return fastest != NULL ? fastest : default_kernel();
+}
+
+const struct aes_kernel *aes_kernel_choose(const char *spec) {
+	if (spec != NULL && strcmp(spec, "tune") == 0)
+		return tune();
+
+	if (spec == NULL || spec[0] == '\0')
+		return default_kernel();
+
+	// A forced kernel the CPU can't run would just crash with SIGILL, so that falls back to the default as well.
+	// Either way it says so, or a typo would quietly get benchmarked as the kernel that was asked for.
+	const struct aes_kernel *kernel = aes_kernel_find(spec);
+	if (kernel != NULL && aes_kernel_supported(kernel))
+		return kernel;
+
+	fprintf(stderr, "AES_KERNEL=%s: %s, using %s\n", spec, kernel == NULL ? "no such kernel" : "not supported by this CPU",
+			default_kernel()->name);
+	return default_kernel();
+}
+
+static const struct aes_kernel *active;
+
+__attribute__((constructor))
+static void choose_at_load(void) {
+	active = aes_kernel_choose(getenv("AES_KERNEL"));
+}
+
+const struct aes_kernel *aes_kernel_active(void) {
+	// Normally set by now; this only matters if another constructor gets here first
+	if (active == NULL)
+		choose_at_load();
+	return active;
+}
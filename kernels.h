@@ -0,0 +1,31 @@
+#ifndef _KERNELS_H
+#define _KERNELS_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "aes.h" /* aes_ctr_func */
+
+// Every CTR kernel in the tree, with what it needs from the CPU. One is picked when the program (or libaes.so) is
+// loaded, and aes_select_ctr hands out that one from then on.
+struct aes_kernel {
+	const char *name;         // for AES_KERNEL and the benchmarks
+	const char *description;
+	bool (*supported)(void);  // cpuid check; NULL if it runs anywhere
+	aes_ctr_func ctr[3];      // AES-128, -192, -256
+};
+
+// All kernels, most preferred first; the default is the first one this CPU supports
+const struct aes_kernel *aes_kernel_list(size_t *count);
+const struct aes_kernel *aes_kernel_find(const char *name); // NULL if there's no such kernel
+bool aes_kernel_supported(const struct aes_kernel *kernel);
+
+// The selection itself. spec is what AES_KERNEL holds: a kernel name forces that kernel (if this CPU supports it),
+// "tune" checks every supported kernel against the C reference and times them, keeping the fastest correct one;
+// NULL or "" gives the default, and so does anything else, after a warning on stderr naming the kernel used instead.
+const struct aes_kernel *aes_kernel_choose(const char *spec);
+
+// The kernel chosen at load time, from $AES_KERNEL
+const struct aes_kernel *aes_kernel_active(void);
+
+#endif
@@ -2,9 +2,11 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <string.h> /* memcpy */
+#include <wmmintrin.h> /* AES-NI intrinsics */
 #include "tables.h"
 #include "debug.h" 
 
+#include "keyschedule.h"
 #include "aes.h" /* InvMixColumns */
 #include "misc.h" /* test_aesni_support */
 
@@ -18,11 +20,9 @@ void RotWord(unsigned char *s) {
 }
 
 void key_schedule_core(unsigned char *word, int i/*teration*/) {
-	// This function appears to exist in newer Intel CPUs as AESKEYGENASSIST.
-	// However, that instruction requires the RCON value as an immediate value,
-	// which makes a loop impossible. Since this isn't really performance critical
-	// (unlike aes_{en,de}crypt, this isn't called over and over), I'll just ignore that.
-	// My laptop can perform 2 million key expansions per second, and since only ONE is needed per key (aka per session)...
+	// This function exists in newer Intel CPUs as AESKEYGENASSIST.
+	// That instruction requires the RCON value as an immediate value, which makes a loop impossible,
+	// so the AES-NI version (aes_expand_key_aesni, below) is unrolled instead; this is the fallback.
 
 	// Rotate
 	RotWord(word);
@@ -36,58 +36,229 @@ void key_schedule_core(unsigned char *word, int i/*teration*/) {
 	word[0] ^= Rcon[i];
 }
 
-int aes_expand_key(const unsigned char *in_key, unsigned char *out_keys) {
+int aes_rounds(int key_len) {
+	// AES-128, AES-192 and AES-256 use 10, 12 and 14 rounds; returns -1 for other key lengths (in bytes)
+	if (key_len != 16 && key_len != 24 && key_len != 32)
+		return -1;
+
+	return key_len/4 + 6;
+}
+
+int aes_expand_key_c(const unsigned char *in_key, int key_len, unsigned char *out_keys) {
 	//
 	// Creates the round keys needed for encryption and decryption.
-	// in_key is the 16-byte key
-	// out_key needs to be a 176-byte char array; 11 16-byte keys will be stored in sequential order.
+	// in_key is the 16, 24 or 32-byte key (key_len)
+	// out_keys needs room for (rounds+1) 16-byte keys, i.e. 176, 208 or 240 bytes (AES_MAX_EXPANDED_KEY is always enough);
+	// they will be stored in sequential order.
 	//
-	#define n 16
+	int rounds = aes_rounds(key_len);
+	if (rounds < 0)
+		return -1;
+
+	const int n = key_len;
 	memcpy(out_keys, in_key, n); // The first n bytes of the expanded key are simply the encryption key
 
 	int rcon_int = 1;
-	int bytes_done = 16;
+	int bytes_done = n;
 
-	while (bytes_done < 11*16) { // 11 keys, 16 bytes each
+	while (bytes_done < (rounds+1)*16) {
 		unsigned char tmp[4];
 
 		// Assign the value of the previous four bytes in the expanded key to tmp
 		memcpy(tmp, out_keys + bytes_done - 4, 4);
 
-		// Perform the key schedule core, and increase the iteration value
-		key_schedule_core(tmp, rcon_int);
-		rcon_int++;
+		if (bytes_done % n == 0) {
+			// Perform the key schedule core, and increase the iteration value
+			key_schedule_core(tmp, rcon_int);
+			rcon_int++;
+		}
+		else if (n == 32 && bytes_done % n == 16) {
+			// AES-256 applies the S-box once more, halfway through each 32 bytes
+			for (int j=0; j<4; j++) {
+				tmp[j] = sbox[ tmp[j] ];
+			}
+		}
 
-		// XOR tmp with the 4-byte block n bytes before the new expanded key... (1)
+		// XOR tmp with the 4-byte block n bytes before the new expanded key...
 		for (int i=0; i<4; i++) {
 			tmp[i] ^= out_keys[bytes_done - n + i];
 		}
 
-		// ... this becomes the next 4 bytes in the expanded key. (2)
+		// ... this becomes the next 4 bytes in the expanded key.
 		memcpy(out_keys + bytes_done, tmp, 4);
 		bytes_done += 4;
+	} // main loop
 
-		// We then do {the following} three times to create the next 12 bytes of expanded key:
-		for (int i=0; i<3; i++) {
-			// XOR tmp with the 4-byte block n bytes before the new expanded key... (1) 
-			memcpy(tmp, out_keys + bytes_done - 4, 4);
-			for (int j=0; j<4; j++) {
-				tmp[j] ^= out_keys[bytes_done - n + j];
-			}
+	return 0;
+}
 
-			// ... this becomes the next 4 bytes in the expanded key. (2)
-			memcpy(out_keys + bytes_done, tmp, 4);
-			bytes_done += 4;
-		} // 12-byte-key-loop
+//
+// AES-NI key expansion, after Intel's AES-NI white paper. AESKEYGENASSIST does RotWord/SubWord/Rcon on
+// a whole round key at once; the rest of each step is the running XOR of the previous round key's words.
+// Each key size is fully unrolled, since the Rcon value must be an immediate.
+//
+#define AESNI __attribute__((target("aes")))
+#define ALWAYS_INLINE inline __attribute__((always_inline))
 
-	} // main loop
+AESNI static ALWAYS_INLINE __m128i prefix_xor(__m128i key) {
+	// Word i becomes w0 ^ ... ^ wi
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	return _mm_xor_si128(key, _mm_slli_si128(key, 4));
+}
+
+#define EXPAND_128(i, rcon) \
+	k[i] = _mm_xor_si128(prefix_xor(k[i-1]), _mm_shuffle_epi32(_mm_aeskeygenassist_si128(k[i-1], rcon), 0xff))
+
+AESNI static ALWAYS_INLINE void aesni_expand_128(const unsigned char *in_key, __m128i *k) {
+	k[0] = _mm_loadu_si128((const __m128i *)in_key);
+	EXPAND_128(1, 0x01); EXPAND_128(2, 0x02); EXPAND_128(3, 0x04); EXPAND_128(4, 0x08); EXPAND_128(5, 0x10);
+	EXPAND_128(6, 0x20); EXPAND_128(7, 0x40); EXPAND_128(8, 0x80); EXPAND_128(9, 0x1b); EXPAND_128(10, 0x36);
+}
+
+AESNI static ALWAYS_INLINE void expand_192_step(__m128i *lo, __m128i *hi, __m128i assist) {
+	// lo holds words 0-3 of the 24-byte window, the low half of hi words 4-5; both move 24 bytes forward
+	*lo = _mm_xor_si128(prefix_xor(*lo), _mm_shuffle_epi32(assist, 0x55));
+	*hi = _mm_xor_si128(*hi, _mm_slli_si128(*hi, 4));
+	*hi = _mm_xor_si128(*hi, _mm_shuffle_epi32(*lo, 0xff));
+}
+
+// Three round keys per two steps, since the 24-byte windows straddle them
+#define EXPAND_192(i, rcon1, rcon2) \
+	expand_192_step(&lo, &hi, _mm_aeskeygenassist_si128(hi, rcon1)); \
+	k[i] = _mm_castpd_si128(_mm_shuffle_pd(_mm_castsi128_pd(k[i]), _mm_castsi128_pd(lo), 0)); \
+	k[i+1] = _mm_castpd_si128(_mm_shuffle_pd(_mm_castsi128_pd(lo), _mm_castsi128_pd(hi), 1)); \
+	expand_192_step(&lo, &hi, _mm_aeskeygenassist_si128(hi, rcon2)); \
+	k[i+2] = lo; \
+	k[i+3] = hi
+
+AESNI static ALWAYS_INLINE void aesni_expand_192(const unsigned char *in_key, __m128i *k) {
+	__m128i lo = _mm_loadu_si128((const __m128i *)in_key);
+	__m128i hi = _mm_loadl_epi64((const __m128i *)(in_key + 16)); // don't read past the 24-byte key
+	k[0] = lo;
+	k[1] = hi;
+	EXPAND_192(1, 0x01, 0x02);
+	EXPAND_192(4, 0x04, 0x08);
+	EXPAND_192(7, 0x10, 0x20);
+	expand_192_step(&lo, &hi, _mm_aeskeygenassist_si128(hi, 0x40));
+	k[10] = _mm_castpd_si128(_mm_shuffle_pd(_mm_castsi128_pd(k[10]), _mm_castsi128_pd(lo), 0));
+	k[11] = _mm_castpd_si128(_mm_shuffle_pd(_mm_castsi128_pd(lo), _mm_castsi128_pd(hi), 1));
+	expand_192_step(&lo, &hi, _mm_aeskeygenassist_si128(hi, 0x80));
+	k[12] = lo;
+}
+
+// Even round keys get RotWord/SubWord/Rcon from the previous key's last word; odd ones only SubWord
+#define EXPAND_256(i, rcon) \
+	k[i] = _mm_xor_si128(prefix_xor(k[i-2]), _mm_shuffle_epi32(_mm_aeskeygenassist_si128(k[i-1], rcon), 0xff)); \
+	k[i+1] = _mm_xor_si128(prefix_xor(k[i-1]), _mm_shuffle_epi32(_mm_aeskeygenassist_si128(k[i], 0), 0xaa))
+
+AESNI static ALWAYS_INLINE void aesni_expand_256(const unsigned char *in_key, __m128i *k) {
+	k[0] = _mm_loadu_si128((const __m128i *)in_key);
+	k[1] = _mm_loadu_si128((const __m128i *)(in_key + 16));
+	EXPAND_256(2, 0x01); EXPAND_256(4, 0x02); EXPAND_256(6, 0x04);
+	EXPAND_256(8, 0x08); EXPAND_256(10, 0x10); EXPAND_256(12, 0x20);
+	k[14] = _mm_xor_si128(prefix_xor(k[12]), _mm_shuffle_epi32(_mm_aeskeygenassist_si128(k[13], 0x40), 0xff));
+}
+
+AESNI static ALWAYS_INLINE void aesni_expand(const unsigned char *in_key, unsigned char *enc_keys, unsigned char *dec_keys, const int key_len) {
+	// Writes the encryption keys and, if dec_keys isn't NULL, the decryption keys (as aes_prepare_decryption_keys_len
+	// would make them) in the same pass, while the round keys are still in registers
+	__m128i k[15];
+	const int rounds = key_len/4 + 6;
+
+	if (key_len == 16)
+		aesni_expand_128(in_key, k);
+	else if (key_len == 24)
+		aesni_expand_192(in_key, k);
+	else
+		aesni_expand_256(in_key, k);
+
+	for (int i = 0; i <= rounds; i++) {
+		_mm_storeu_si128((__m128i *)(enc_keys + i*16), k[i]);
+	}
+
+	if (dec_keys != NULL) {
+		_mm_storeu_si128((__m128i *)dec_keys, k[0]);
+		for (int i = 1; i < rounds; i++) {
+			_mm_storeu_si128((__m128i *)(dec_keys + i*16), _mm_aesimc_si128(k[i]));
+		}
+		_mm_storeu_si128((__m128i *)(dec_keys + rounds*16), k[rounds]);
+	}
+}
+
+AESNI int aes_expand_key_aesni(const unsigned char *in_key, int key_len, unsigned char *out_keys) {
+	// Same output as aes_expand_key_c; the caller must make sure the CPU supports AES-NI
+	switch (key_len) {
+		case 16: aesni_expand(in_key, out_keys, NULL, 16); return 0;
+		case 24: aesni_expand(in_key, out_keys, NULL, 24); return 0;
+		case 32: aesni_expand(in_key, out_keys, NULL, 32); return 0;
+		default: return -1;
+	}
+}
+
+int aes_expand_key_len(const unsigned char *in_key, int key_len, unsigned char *out_keys) {
+	if (test_aesni_support())
+		return aes_expand_key_aesni(in_key, key_len, out_keys);
+	else if (test_ssse3_support())
+		return aes_expand_key_vperm(in_key, key_len, out_keys);
+	else
+		return aes_expand_key_c(in_key, key_len, out_keys);
+}
+
+AESNI static void expand_keys_aesni(const unsigned char *in_keys, size_t count, unsigned char *enc_keys, unsigned char *dec_keys, const int key_len) {
+	const size_t stride = AES_SCHEDULE_SIZE(key_len);
+	for (size_t i = 0; i < count; i++) {
+		aesni_expand(in_keys + i*key_len, enc_keys + i*stride, dec_keys ? dec_keys + i*stride : NULL, key_len);
+	}
+}
+
+int aes_expand_keys(const unsigned char *in_keys, int key_len, size_t count, unsigned char *enc_keys, unsigned char *dec_keys) {
+	//
+	// Batch version of aes_expand_key_len: expands count keys of key_len bytes each, stored back to back in in_keys.
+	// Schedule i is written to enc_keys + i*AES_SCHEDULE_SIZE(key_len), and likewise for dec_keys, which
+	// receives decryption keys ready for aes_decrypt_* (or may be NULL if they aren't needed).
+	// The CPU is only checked once per batch, and the decryption keys are made in the same pass as the encryption keys.
+	//
+	int rounds = aes_rounds(key_len);
+	if (rounds < 0)
+		return -1;
+
+	if (test_aesni_support()) {
+		// One copy of the loop per key size, so that aesni_expand is fully specialized
+		if (key_len == 16)
+			expand_keys_aesni(in_keys, count, enc_keys, dec_keys, 16);
+		else if (key_len == 24)
+			expand_keys_aesni(in_keys, count, enc_keys, dec_keys, 24);
+		else
+			expand_keys_aesni(in_keys, count, enc_keys, dec_keys, 32);
+		return 0;
+	}
+
+	const size_t stride = AES_SCHEDULE_SIZE(key_len);
+	bool ssse3 = test_ssse3_support();
+	for (size_t i = 0; i < count; i++) {
+		if (ssse3)
+			aes_expand_key_vperm(in_keys + i*key_len, key_len, enc_keys + i*stride);
+		else
+			aes_expand_key_c(in_keys + i*key_len, key_len, enc_keys + i*stride);
+		if (dec_keys != NULL) {
+			memcpy(dec_keys + i*stride, enc_keys + i*stride, stride);
+			aes_prepare_decryption_keys_len(dec_keys + i*stride, key_len);
+		}
+	}
 
 	return 0;
 }
 
-void aes_prepare_decryption_keys(unsigned char *keys) {
-	// This function is called after aes_expand_key, to prepare the keys for decryption
+int aes_expand_key(const unsigned char *in_key, unsigned char *out_keys) {
+	// AES-128: in_key is the 16-byte key, out_keys needs to be a 176-byte char array.
+	return aes_expand_key_len(in_key, 16, out_keys);
+}
+
+void aes_prepare_decryption_keys_len(unsigned char *keys, int key_len) {
+	// This function is called after aes_expand_key_len, to prepare the keys for decryption
 	// DO NOT call this function on the keys prior to encryption, or the encryption will fail!
+	int rounds = aes_rounds(key_len);
 	bool aesni = test_aesni_support();
 
 	// Use the AESIMC instruction if CPU support is available.
@@ -95,21 +266,32 @@ void aes_prepare_decryption_keys(unsigned char *keys) {
 		asm __volatile__ (
 		"movq %[keys], %%r15;"    // save the keys pointer for easy pointer arithmetic
 		"movl $1, %%ecx;"         // set loop counter (int round=1)
-		"_loop:"                  
+		"1:"                      
 		"addq $16, %%r15;"        // move pointer to keys + (round*16)
 		"aesimc (%%r15), %%xmm0;" // perform InverseMixColumns
 		"movdqa %%xmm0, (%%r15);" // save result back to memory
 		"inc %%ecx;"
-		"cmp $9, %%ecx;"          
-		"jle _loop;"              // loop while round <= 9
+		"cmp %[last], %%ecx;"
+		"jle 1b;"                 // loop while round <= rounds-1
 		:[keys] "=m"(keys)
-		:
+		:[last] "r"(rounds - 1)
 		: "%r15", "%ecx", "%xmm0", "cc", "memory"
 		);
 	}
+	else if (test_ssse3_support()) {
+		// No AES-NI, but we can still do it without the gmul tables
+		for (int round=1; round <= rounds-1; round++) {
+			aes_inv_mix_columns_vperm(keys + (round * 16));
+		}
+	}
 	else {
-		for (int round=1; round <= 9; round++) {
+		for (int round=1; round <= rounds-1; round++) {
 			InvMixColumns(keys + (round * 16));
 		}
 	}
 }
+
+void aes_prepare_decryption_keys(unsigned char *keys) {
+	// AES-128 version of the above
+	aes_prepare_decryption_keys_len(keys, 16);
+}
@@ -1,2 +1,15 @@
+#include <stddef.h> /* size_t */
+
+// The largest expanded key (AES-256: 15 round keys of 16 bytes)
+#define AES_MAX_EXPANDED_KEY (15*16)
+// Bytes in one expanded key for a 16, 24 or 32-byte key: 176, 208 or 240
+#define AES_SCHEDULE_SIZE(key_len) (((key_len)/4 + 7) * 16)
+
+int aes_rounds(int key_len);
 int aes_expand_key(const unsigned char *in_key, unsigned char *out_keys);
-void aes_prepare_decryption_keys(const unsigned char *keys);
+int aes_expand_key_len(const unsigned char *in_key, int key_len, unsigned char *out_keys);
+int aes_expand_key_c(const unsigned char *in_key, int key_len, unsigned char *out_keys);
+int aes_expand_key_aesni(const unsigned char *in_key, int key_len, unsigned char *out_keys);
+int aes_expand_keys(const unsigned char *in_keys, int key_len, size_t count, unsigned char *enc_keys, unsigned char *dec_keys);
+void aes_prepare_decryption_keys(unsigned char *keys);
+void aes_prepare_decryption_keys_len(unsigned char *keys, int key_len);
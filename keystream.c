@@ -0,0 +1,233 @@
+#define _GNU_SOURCE /* SCHED_IDLE */
+#include <stdlib.h> /* posix_memalign */
+#include <string.h> /* memset */
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <emmintrin.h>
+
+#include "keystream.h"
+
+/*
+ * The ring is filled and emptied in order: the filler thread writes slots[fill], callers take slots[take], and the
+ * slots from take up to fill are ready. A slot that a caller is still XORing with can't be refilled, so the filler
+ * waits for that one slot rather than skipping it; that keeps the ready slots contiguous.
+ *
+ * Callers that get a segment don't wake the filler: on this path a futex wake costs more than the XOR itself.
+ * The filler looks for freed slots every REFILL_NS instead, and a caller that finds the ring empty (and so is on
+ * the slow path anyway) wakes it straight away.
+ *
+ * All counter ranges, the filler's and those of messages that miss the ring, come from reserve() under the lock,
+ * so they never overlap, whichever order the slots end up being used in.
+ */
+
+#define REFILL_NS 1000000
+
+enum slot_state { SLOT_FREE, SLOT_FILLING, SLOT_READY, SLOT_IN_USE };
+
+struct slot {
+	unsigned char *keystream;
+	uint64_t counter[2];
+	enum slot_state state;
+};
+
+struct aes_keystream {
+	const struct aes_ctx *ctx;
+	size_t segment_bytes;
+	int nslots;
+	struct slot *slots;
+	unsigned char *memory;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t space_cond; // signalled when a caller finds the ring empty (or on shutdown)
+
+	// Protected by lock
+	int fill, take;
+	uint64_t nonce, next;      // the next unreserved block
+	uint64_t remaining;        // blocks left before the 64-bit block counter wraps
+	uint64_t hits, misses;
+	bool shutdown;
+};
+
+static void wipe(void *buf, size_t len) {
+	memset(buf, 0, len);
+	__asm__ __volatile__("" : : "r"(buf) : "memory");
+}
+
+static bool reserve(struct aes_keystream *ks, size_t blocks, uint64_t *counter) {
+	// Called with the lock held
+	if (blocks > ks->remaining)
+		return false;
+	counter[0] = ks->nonce;
+	counter[1] = ks->next;
+	ks->next += blocks;
+	ks->remaining -= blocks;
+	return true;
+}
+
+static void *filler(void *arg) {
+	struct aes_keystream *ks = arg;
+
+	// Only run when the CPU would otherwise be idle; if that's not allowed, run at normal priority
+	struct sched_param param = { .sched_priority = 0 };
+	pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+	size_t blocks = ks->segment_bytes / 16;
+	pthread_mutex_lock(&ks->lock);
+	while (true) {
+		struct slot *slot = &ks->slots[ks->fill];
+		while (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != SLOT_FREE && !ks->shutdown) {
+			struct timespec until;
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_nsec += REFILL_NS;
+			if (until.tv_nsec >= 1000000000) {
+				until.tv_sec++;
+				until.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&ks->space_cond, &ks->lock, &until);
+		}
+		if (ks->shutdown || !reserve(ks, blocks, slot->counter))
+			break;
+		slot->state = SLOT_FILLING;
+		ks->fill = (ks->fill + 1) % ks->nslots;
+		pthread_mutex_unlock(&ks->lock);
+
+		// Keystream is the kernel run over zeroes; it advances a copy of the counter, the slot keeps the start
+		uint64_t counter[2] = { slot->counter[0], slot->counter[1] };
+		memset(slot->keystream, 0, ks->segment_bytes);
+		ks->ctx->ctr(slot->keystream, slot->keystream, blocks, counter, ks->ctx->enc_keys);
+
+		pthread_mutex_lock(&ks->lock);
+		slot->state = SLOT_READY;
+	}
+	pthread_mutex_unlock(&ks->lock);
+	return NULL;
+}
+
+struct aes_keystream *aes_keystream_create(const struct aes_ctx *ctx, const uint64_t *counter, size_t segment_bytes, int segments) {
+	if (ctx == NULL || ctx->ctr == NULL || counter == NULL || segment_bytes == 0 || segments < 1)
+		return NULL;
+
+	struct aes_keystream *ks = calloc(1, sizeof(*ks));
+	if (ks == NULL)
+		return NULL;
+	ks->ctx = ctx;
+	ks->segment_bytes = (segment_bytes + 15) & ~(size_t)15;
+	ks->nslots = segments;
+	ks->nonce = counter[0];
+	ks->next = counter[1];
+	// Blocks counter[1] .. UINT64_MAX; one short when starting from 0, since 2^64 doesn't fit (and won't be reached)
+	ks->remaining = counter[1] == 0 ? UINT64_MAX : UINT64_MAX - counter[1] + 1;
+
+	// One allocation for all the segments, each starting on a cache line
+	size_t stride = (ks->segment_bytes + 63) & ~(size_t)63;
+	ks->slots = calloc(segments, sizeof(*ks->slots));
+	if (ks->slots == NULL || posix_memalign((void **)&ks->memory, 64, stride * segments) != 0) {
+		free(ks->slots);
+		free(ks->memory);
+		free(ks);
+		return NULL;
+	}
+	for (int i = 0; i < segments; i++) {
+		ks->slots[i].keystream = ks->memory + i * stride;
+	}
+
+	pthread_mutex_init(&ks->lock, NULL);
+	pthread_cond_init(&ks->space_cond, NULL);
+	if (pthread_create(&ks->thread, NULL, filler, ks) != 0) {
+		pthread_mutex_destroy(&ks->lock);
+		pthread_cond_destroy(&ks->space_cond);
+		free(ks->slots);
+		free(ks->memory);
+		free(ks);
+		return NULL;
+	}
+	return ks;
+}
+
+static void xor_keystream(const unsigned char *in, unsigned char *out, const unsigned char *keystream, size_t len) {
+	size_t i = 0;
+	for (; i + 64 <= len; i += 64) {
+		__m128i a = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(in + i)), _mm_load_si128((const __m128i *)(keystream + i)));
+		__m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(in + i + 16)), _mm_load_si128((const __m128i *)(keystream + i + 16)));
+		__m128i c = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(in + i + 32)), _mm_load_si128((const __m128i *)(keystream + i + 32)));
+		__m128i d = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(in + i + 48)), _mm_load_si128((const __m128i *)(keystream + i + 48)));
+		_mm_storeu_si128((__m128i *)(out + i), a);
+		_mm_storeu_si128((__m128i *)(out + i + 16), b);
+		_mm_storeu_si128((__m128i *)(out + i + 32), c);
+		_mm_storeu_si128((__m128i *)(out + i + 48), d);
+	}
+	for (; i + 16 <= len; i += 16) {
+		_mm_storeu_si128((__m128i *)(out + i),
+				_mm_xor_si128(_mm_loadu_si128((const __m128i *)(in + i)), _mm_load_si128((const __m128i *)(keystream + i))));
+	}
+	for (; i < len; i++) {
+		out[i] = in[i] ^ keystream[i];
+	}
+}
+
+int aes_keystream_xor(struct aes_keystream *ks, const unsigned char *in, unsigned char *out, size_t len, uint64_t *counter) {
+	if (ks == NULL || counter == NULL || (len > 0 && (in == NULL || out == NULL)))
+		return AES_ERR_ARGUMENT;
+
+	pthread_mutex_lock(&ks->lock);
+	struct slot *slot = &ks->slots[ks->take];
+	if (len <= ks->segment_bytes && slot->state == SLOT_READY) {
+		slot->state = SLOT_IN_USE;
+		ks->take = (ks->take + 1) % ks->nslots;
+		ks->hits++;
+		pthread_mutex_unlock(&ks->lock);
+
+		counter[0] = slot->counter[0];
+		counter[1] = slot->counter[1];
+		xor_keystream(in, out, slot->keystream, len);
+		// Only the keystream that was used says anything about the message; the rest of the segment is simply dropped,
+		// and its counters are never handed out again
+		wipe(slot->keystream, len);
+
+		// Without the lock: the filler is the only one that looks at a slot that's in use
+		__atomic_store_n(&slot->state, SLOT_FREE, __ATOMIC_RELEASE);
+		return AES_OK;
+	}
+
+	// Nothing ready (or too long for a segment): encrypt it here, from a range of its own
+	bool reserved = reserve(ks, (len + 15) / 16, counter);
+	if (reserved)
+		ks->misses++;
+	pthread_cond_signal(&ks->space_cond);
+	pthread_mutex_unlock(&ks->lock);
+	if (!reserved)
+		return AES_ERR_EXHAUSTED;
+
+	uint64_t next[2] = { counter[0], counter[1] };
+	return aes_ctx_ctr_xor(ks->ctx, next, in, out, len);
+}
+
+void aes_keystream_counts(struct aes_keystream *ks, uint64_t *hits, uint64_t *misses) {
+	pthread_mutex_lock(&ks->lock);
+	*hits = ks->hits;
+	*misses = ks->misses;
+	pthread_mutex_unlock(&ks->lock);
+}
+
+void aes_keystream_destroy(struct aes_keystream *ks) {
+	if (ks == NULL)
+		return;
+
+	pthread_mutex_lock(&ks->lock);
+	ks->shutdown = true;
+	pthread_cond_signal(&ks->space_cond);
+	pthread_mutex_unlock(&ks->lock);
+	pthread_join(ks->thread, NULL);
+
+	size_t stride = (ks->segment_bytes + 63) & ~(size_t)63;
+	wipe(ks->memory, stride * ks->nslots);
+	pthread_mutex_destroy(&ks->lock);
+	pthread_cond_destroy(&ks->space_cond);
+	free(ks->slots);
+	free(ks->memory);
+	free(ks);
+}
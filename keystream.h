@@ -0,0 +1,37 @@
+#ifndef _KEYSTREAM_H
+#define _KEYSTREAM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "ctx.h"
+
+// Precomputed CTR keystream for latency-sensitive small messages. A background thread (at SCHED_IDLE priority, so it
+// only runs when nothing else wants the CPU) keeps a ring of keystream segments filled, and a message is then
+// encrypted with a single XOR against the next ready segment, instead of running the cipher while the caller waits.
+//
+// Every message gets a counter range of its own: each segment's range is taken from one counter that only ever goes
+// up, and a segment is wiped as soon as it's used, so no keystream is ever handed out twice. The counter a message
+// was encrypted at comes back to the caller; the receiver decrypts with aes_ctx_ctr_xor from there.
+//
+// Unlike the rest of the library API this allocates memory and starts a thread, hence create/destroy.
+struct aes_keystream;
+
+// counter: the nonce, and the first block to use. Segments are segment_bytes each (rounded up to whole blocks), and
+// the ring holds segments of them. ctx has to stay valid (and unchanged) until aes_keystream_destroy.
+// NULL if the arguments are invalid or memory/the thread can't be had.
+struct aes_keystream *aes_keystream_create(const struct aes_ctx *ctx, const uint64_t *counter, size_t segment_bytes, int segments);
+
+// Encrypts (or decrypts) one message, and sets counter to where its keystream started. A message of up to
+// segment_bytes uses up a whole segment; if none is ready, or the message is longer, it's encrypted directly from a
+// freshly reserved counter range instead, which is what aes_ctx_ctr_xor would have cost. in and out may be the same.
+// Safe to call from several threads at once. AES_ERR_EXHAUSTED once the 64-bit block counter would wrap.
+int aes_keystream_xor(struct aes_keystream *ks, const unsigned char *in, unsigned char *out, size_t len, uint64_t *counter);
+
+// How many messages were served from the ring, and how many had to be encrypted directly
+void aes_keystream_counts(struct aes_keystream *ks, uint64_t *hits, uint64_t *misses);
+
+// Stops the thread and wipes the ring
+void aes_keystream_destroy(struct aes_keystream *ks);
+
+#endif
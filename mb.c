@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h> /* memcpy */
+#include <wmmintrin.h> /* AES-NI intrinsics */
+
+#include "mb.h"
+#include "aes.h"
+#include "keyschedule.h" /* aes_rounds */
+#include "misc.h" /* test_aesni_support */
+
+//
+// Multi-buffer CTR: many short, independent messages (each with its own key and counter) at once.
+//
+// Encrypting one short message at a time leaves AES-NI mostly idle: a message of a few blocks never has enough
+// blocks in flight to hide AESENC's latency, which is what aes_ctr_aesni relies on. Here each of MB_LANES lanes
+// holds a different message, and every step encrypts one block from each lane, so there are always MB_LANES
+// independent blocks going through the pipeline. Whenever a lane's message runs out, the lane is refilled with
+// the next job; once there are no jobs left, the remaining messages are finished one by one with the bulk kernel.
+//
+
+#define MB_LANES 8
+#define AESNI __attribute__((target("aes")))
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+static void finish_job(struct aes_mb_job *job, const unsigned char *in, unsigned char *out, size_t blocks, aes_ctr_func ctr, aes_block_func encrypt) {
+	// The rest of a message, one message at a time: blocks full blocks from in/out, then the partial last block (if any)
+	ctr(in, out, blocks, job->counter, job->keys);
+
+	size_t tail = job->len % 16;
+	if (tail) {
+		unsigned char keystream[16];
+		encrypt((const unsigned char *)job->counter, keystream, job->keys);
+		job->counter[1]++;
+		for (size_t i = 0; i < tail; i++) {
+			out[blocks*16 + i] = in[blocks*16 + i] ^ keystream[i];
+		}
+	}
+}
+
+AESNI static ALWAYS_INLINE void mb_run(struct aes_mb_job *jobs, size_t count, aes_ctr_func ctr, aes_block_func encrypt, const int rounds) {
+	// The lanes, one array per field so that the unrolled loops below index them with constants
+	struct aes_mb_job *job[MB_LANES];
+	const unsigned char *keys[MB_LANES]; // job->keys, kept here to save an indirection per round
+	const unsigned char *in[MB_LANES];
+	unsigned char *out[MB_LANES];
+	size_t blocks[MB_LANES];             // blocks left before the lane needs attention
+	bool in_tail[MB_LANES];              // the lane is on its message's partial last block
+	__m128i counters[MB_LANES];
+	// A message's partial last block goes through its lane as a whole block of keystream, written to keystream[lane]
+	static const unsigned char zero[16];
+	unsigned char keystream[MB_LANES][16];
+	const __m128i one = _mm_set_epi64x(1, 0);
+	size_t next = 0;
+
+	for (int l = 0; l < MB_LANES; l++) {
+		job[l] = NULL;
+		blocks[l] = 0;
+		in_tail[l] = false;
+	}
+
+	for (;;) {
+		// Every lane with blocks == 0 needs attention: start its message's partial block, finish its message, or refill it
+		for (int l = 0; l < MB_LANES; l++) {
+			if (blocks[l] != 0)
+				continue;
+
+			if (job[l] != NULL) {
+				size_t tail = job[l]->len % 16;
+				if (tail != 0 && !in_tail[l]) {
+					// Full blocks done; one more for the partial block
+					in[l] = zero;
+					out[l] = keystream[l];
+					blocks[l] = 1;
+					in_tail[l] = true;
+					continue;
+				}
+				if (in_tail[l]) {
+					size_t done = job[l]->len - tail;
+					for (size_t i = 0; i < tail; i++) {
+						job[l]->out[done + i] = job[l]->in[done + i] ^ keystream[l][i];
+					}
+				}
+				_mm_storeu_si128((__m128i *)job[l]->counter, counters[l]);
+				job[l] = NULL;
+				in_tail[l] = false;
+			}
+
+			while (next < count && jobs[next].len == 0) {
+				next++;
+			}
+			if (next == count)
+				break;
+
+			job[l] = &jobs[next++];
+			keys[l] = job[l]->keys;
+			in[l] = job[l]->in;
+			out[l] = job[l]->out;
+			blocks[l] = job[l]->len / 16;
+			counters[l] = _mm_loadu_si128((const __m128i *)job[l]->counter);
+			if (blocks[l] == 0)
+				l--; // shorter than one block; go straight to the partial block
+		}
+
+		if (next == count) {
+			// Nothing left to refill the lanes with. Rather than run part-empty lanes, finish the remaining messages
+			// one by one with the bulk kernel, which interleaves blocks from the same message instead.
+			for (int l = 0; l < MB_LANES; l++) {
+				if (job[l] == NULL)
+					continue;
+				_mm_storeu_si128((__m128i *)job[l]->counter, counters[l]);
+				size_t done = job[l]->len / 16 * 16;
+				if (in_tail[l] && blocks[l] == 0) {
+					// The partial block's keystream has been made already (the loop above stopped before this lane
+					// came up); the counter is past it, so it mustn't be made again
+					for (size_t i = 0; i < job[l]->len - done; i++) {
+						job[l]->out[done + i] = job[l]->in[done + i] ^ keystream[l][i];
+					}
+				}
+				else if (in_tail[l]) {
+					// Only the partial block was left
+					finish_job(job[l], job[l]->in + done, job[l]->out + done, 0, ctr, encrypt);
+				}
+				else {
+					finish_job(job[l], in[l], out[l], blocks[l], ctr, encrypt);
+				}
+			}
+			return;
+		}
+
+		// Run every lane until the shortest message in them needs attention
+		size_t steps = blocks[0];
+		for (int l = 1; l < MB_LANES; l++) {
+			if (blocks[l] < steps)
+				steps = blocks[l];
+		}
+
+		for (size_t s = 0; s < steps; s++) {
+			__m128i b[MB_LANES];
+			#pragma GCC unroll 8
+			for (int l = 0; l < MB_LANES; l++) {
+				b[l] = _mm_xor_si128(counters[l], _mm_loadu_si128((const __m128i *)keys[l]));
+				counters[l] = _mm_add_epi64(counters[l], one);
+			}
+			#pragma GCC unroll 14
+			for (int round = 1; round < rounds; round++) {
+				#pragma GCC unroll 8
+				for (int l = 0; l < MB_LANES; l++) {
+					b[l] = _mm_aesenc_si128(b[l], _mm_loadu_si128((const __m128i *)(keys[l] + round*16)));
+				}
+			}
+			#pragma GCC unroll 8
+			for (int l = 0; l < MB_LANES; l++) {
+				b[l] = _mm_aesenclast_si128(b[l], _mm_loadu_si128((const __m128i *)(keys[l] + rounds*16)));
+				b[l] = _mm_xor_si128(b[l], _mm_loadu_si128((const __m128i *)(in[l] + s*16)));
+				_mm_storeu_si128((__m128i *)(out[l] + s*16), b[l]);
+			}
+		}
+
+		for (int l = 0; l < MB_LANES; l++) {
+			in[l] += steps*16;
+			out[l] += steps*16;
+			blocks[l] -= steps;
+		}
+	}
+}
+
+AESNI static void mb_run_128(struct aes_mb_job *jobs, size_t count) {
+	mb_run(jobs, count, aes_ctr_aesni, aes_encrypt_aesni, 10);
+}
+
+AESNI static void mb_run_192(struct aes_mb_job *jobs, size_t count) {
+	mb_run(jobs, count, aes_ctr_aesni_192, aes_encrypt_aesni_192, 12);
+}
+
+AESNI static void mb_run_256(struct aes_mb_job *jobs, size_t count) {
+	mb_run(jobs, count, aes_ctr_aesni_256, aes_encrypt_aesni_256, 14);
+}
+
+int aes_mb_ctr(struct aes_mb_job *jobs, size_t count, int key_len) {
+	//
+	// CTR-encrypts (or decrypts) count independent messages. All of them must use the same key size (key_len bytes),
+	// but each has its own key schedule and counter. Returns -1 for an invalid key length.
+	//
+	if (aes_rounds(key_len) < 0)
+		return -1;
+
+	if (!test_aesni_support()) {
+		// Without AES-NI there's no latency to hide; the bitsliced kernel already does 8 blocks at a time per message
+		aes_ctr_func ctr = aes_select_ctr(key_len);
+		aes_block_func encrypt = aes_select_encrypt(key_len);
+		for (size_t i = 0; i < count; i++) {
+			finish_job(&jobs[i], jobs[i].in, jobs[i].out, jobs[i].len / 16, ctr, encrypt);
+		}
+		return 0;
+	}
+
+	if (key_len == 16)
+		mb_run_128(jobs, count);
+	else if (key_len == 24)
+		mb_run_192(jobs, count);
+	else
+		mb_run_256(jobs, count);
+
+	return 0;
+}
@@ -0,0 +1,18 @@
+#ifndef _MB_H
+#define _MB_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// One message for aes_mb_ctr: its own key schedule, counter and buffers
+struct aes_mb_job {
+	const unsigned char *keys; // expanded encryption keys (aes_expand_key_len / aes_expand_keys)
+	uint64_t counter[2];       // same layout as ctr.c: nonce, then block number; advanced past the message
+	const unsigned char *in;
+	unsigned char *out;        // may be the same as in
+	size_t len;                // in bytes; doesn't have to be a multiple of 16
+};
+
+int aes_mb_ctr(struct aes_mb_job *jobs, size_t count, int key_len);
+
+#endif
@@ -1,6 +1,15 @@
 #include <stdbool.h>
 
+// cpuid is slow (and serializing), so each feature is only tested once and then remembered.
+// Racing threads at worst both run cpuid and store the same answer.
+static signed char aesni_support = -1;
+static signed char ssse3_support = -1;
+static signed char pclmul_support = -1;
+
 bool test_aesni_support(void) {
+	if (aesni_support >= 0)
+		return aesni_support;
+
 	bool support;
 	asm(
 			"movl $1, %%eax;"
@@ -12,5 +21,105 @@ bool test_aesni_support(void) {
 			: : "%eax", "%ebx", "%ecx", "%edx", "cc"
 		);
 
+	aesni_support = support;
+	return support;
+}
+
+bool test_ssse3_support(void) {
+	// CPUID.01H:ECX bit 9
+	if (ssse3_support >= 0)
+		return ssse3_support;
+
+	bool support;
+	asm(
+			"movl $1, %%eax;"
+			"cpuid;"
+			"andl $0x200, %%ecx;"
+			"shrl $9, %%ecx;"
+			"movb %%cl, %[support];"
+			: [support] "=m"(support)
+			: : "%eax", "%ebx", "%ecx", "%edx", "cc"
+		);
+
+	ssse3_support = support;
 	return support;
 }
+
+bool test_pclmul_support(void) {
+	// CPUID.01H:ECX bit 1 (PCLMULQDQ, for GHASH)
+	if (pclmul_support >= 0)
+		return pclmul_support;
+
+	bool support;
+	asm(
+			"movl $1, %%eax;"
+			"cpuid;"
+			"andl $0x2, %%ecx;"
+			"shrl $1, %%ecx;"
+			"movb %%cl, %[support];"
+			: [support] "=m"(support)
+			: : "%eax", "%ebx", "%ecx", "%edx", "cc"
+		);
+
+	pclmul_support = support;
+	return support;
+}
+
+static signed char avx2_support = -1;
+static signed char vaes_support = -1;
+static signed char avx512_support = -1;
+
+static unsigned int os_saved_state(void) {
+	// XCR0: which register state the OS saves on context switches (bits 1-2 for ymm, 5-7 for zmm and the
+	// mask registers). A CPU can report AVX2 or AVX-512 while the OS doesn't enable them, so both are checked.
+	unsigned int leaf = 1, ecx, eax, edx;
+	asm("cpuid" : "+a"(leaf), "=c"(ecx) : : "%ebx", "%edx");
+	if (!(ecx & (1 << 27))) // OSXSAVE; without it, xgetbv is undefined
+		return 0;
+
+	asm("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	return eax;
+}
+
+static void cpuid_leaf7(unsigned int *ebx, unsigned int *ecx) {
+	unsigned int eax = 7, max;
+	asm("cpuid" : "=a"(max) : "a"(0) : "%ebx", "%ecx", "%edx");
+	if (max < 7) {
+		*ebx = *ecx = 0;
+		return;
+	}
+	asm("cpuid" : "+a"(eax), "=b"(*ebx), "=c"(*ecx) : "c"(0) : "%edx");
+}
+
+bool test_avx2_support(void) {
+	// CPUID.07H:EBX bit 5, and ymm state enabled by the OS
+	if (avx2_support >= 0)
+		return avx2_support;
+
+	unsigned int ebx, ecx;
+	cpuid_leaf7(&ebx, &ecx);
+	avx2_support = (ebx & (1 << 5)) && (os_saved_state() & 0x6) == 0x6;
+	return avx2_support;
+}
+
+bool test_vaes_support(void) {
+	// CPUID.07H:ECX bit 9 (AES instructions on ymm/zmm registers); only usable with AVX enabled
+	if (vaes_support >= 0)
+		return vaes_support;
+
+	unsigned int ebx, ecx;
+	cpuid_leaf7(&ebx, &ecx);
+	vaes_support = (ecx & (1 << 9)) && test_aesni_support() && (os_saved_state() & 0x6) == 0x6;
+	return vaes_support;
+}
+
+bool test_avx512_support(void) {
+	// CPUID.07H:EBX bit 16 (AVX-512 Foundation), and zmm and opmask state enabled by the OS
+	if (avx512_support >= 0)
+		return avx512_support;
+
+	unsigned int ebx, ecx;
+	cpuid_leaf7(&ebx, &ecx);
+	avx512_support = (ebx & (1 << 16)) && (os_saved_state() & 0xe6) == 0xe6;
+	return avx512_support;
+}
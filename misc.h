@@ -1 +1,6 @@
 bool test_aesni_support(void);
+bool test_ssse3_support(void);
+bool test_pclmul_support(void);
+bool test_avx2_support(void);
+bool test_vaes_support(void);
+bool test_avx512_support(void);
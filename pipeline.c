@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <stdlib.h> /* exit */
+#include <string.h> /* memcpy */
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "pipeline.h"
+#include "arena.h"
+#include "stats.h"
+
+#define NUM_SLOTS 4
+
+/*
+ * A three-stage read -> encrypt -> write pipeline.
+ * A reader thread fills a ring of NUM_SLOTS buffers from the input, the calling thread runs the crypto
+ * callback on each filled buffer (in place), and a writer thread drains them to the output. While one chunk
+ * is being encrypted, the next one is being read and the previous one written, so the CPU doesn't sit idle
+ * during I/O, and the disk doesn't sit idle during crypto.
+ *
+ * Nothing here depends on the size of the input (it doesn't even have to be seekable), so pipes work just fine.
+ * Every chunk except the last one is a multiple of 16 bytes, and the last holdback bytes of the input
+ * are always part of the final chunk; the reader only knows it has reached the end after a read returns 0,
+ * so it holds back that many bytes from each chunk until it knows whether more data follows.
+ *
+ * pipeline_run is pipeline_run_framed with no headroom, PIPELINE_SLACK bytes of tailroom, and output that starts
+ * where the input did.
+ */
+
+enum slot_state { SLOT_FREE, SLOT_READ, SLOT_DONE };
+
+struct slot {
+	unsigned char *mem; // headroom, then buf
+	unsigned char *buf;
+	unsigned char *out; // what the writer writes: len bytes from here
+	size_t len;
+	bool final;
+	enum slot_state state;
+};
+
+struct pipeline {
+	struct slot slots[NUM_SLOTS];
+	pthread_mutex_t lock;
+	pthread_cond_t cond; // broadcast on every state change; there are only three threads
+
+	int infd, outfd;
+	const char *outpath;
+	size_t chunk;
+	size_t holdback;
+};
+
+size_t read_full(int fd, unsigned char *buf, size_t len) {
+	// Reads until len bytes have been read, or EOF is reached; returns the number of bytes read.
+	STATS_START(mark);
+	size_t done = 0;
+	while (done < len) {
+		ssize_t r = read(fd, buf + done, len - done);
+		if (r == 0)
+			break;
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return (size_t)-1;
+		}
+		done += r;
+	}
+
+	STATS_STOP(mark, STATS_READ, done);
+	return done;
+}
+
+void write_full(int fd, const unsigned char *buf, size_t len) {
+	STATS_START(mark);
+	size_t total = len;
+	while (len > 0) {
+		ssize_t w = write(fd, buf, len);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("*** Write error");
+			exit(1);
+		}
+		buf += w;
+		len -= w;
+	}
+	STATS_STOP(mark, STATS_WRITE, total);
+}
+
+static struct slot *wait_for(struct pipeline *p, int index, enum slot_state state) {
+	struct slot *slot = &p->slots[index % NUM_SLOTS];
+
+	pthread_mutex_lock(&p->lock);
+	while (slot->state != state)
+		pthread_cond_wait(&p->cond, &p->lock);
+	pthread_mutex_unlock(&p->lock);
+
+	return slot;
+}
+
+static void publish(struct pipeline *p, struct slot *slot, enum slot_state state) {
+	pthread_mutex_lock(&p->lock);
+	slot->state = state;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+}
+
+static void *reader_thread(void *arg) {
+	struct pipeline *p = arg;
+
+	// Bytes held back from the previous chunk, to be placed first in the next one
+	unsigned char carry[PIPELINE_SLACK];
+	size_t carry_len = 0;
+
+	for (int i = 0; ; i++) {
+		struct slot *slot = wait_for(p, i, SLOT_FREE);
+
+		memcpy(slot->buf, carry, carry_len);
+		size_t b = read_full(p->infd, slot->buf + carry_len, p->chunk - carry_len);
+		if (b == (size_t)-1) {
+			fprintf(stderr, "Read error! Aborting!\n");
+			if (p->outpath)
+				unlink(p->outpath); // Since we've already truncated it, and it's probably useless incomplete, let's delete it.
+			exit(1);
+		}
+
+		size_t filled = carry_len + b;
+		if (filled < p->chunk) {
+			// Short read == EOF
+			slot->len = filled;
+			slot->final = true;
+			publish(p, slot, SLOT_READ);
+			break;
+		}
+
+		// Full buffer; there may or may not be more data. Keep a whole number of blocks,
+		// leaving at least holdback bytes for the next chunk.
+		slot->len = ((filled - p->holdback) / 16) * 16;
+		slot->final = false;
+		carry_len = filled - slot->len;
+		memcpy(carry, slot->buf + slot->len, carry_len);
+		publish(p, slot, SLOT_READ);
+	}
+
+	return NULL;
+}
+
+static void *writer_thread(void *arg) {
+	struct pipeline *p = arg;
+
+	for (int i = 0; ; i++) {
+		struct slot *slot = wait_for(p, i, SLOT_DONE);
+		bool final = slot->final;
+
+		write_full(p->outfd, slot->out, slot->len);
+		publish(p, slot, SLOT_FREE);
+
+		if (final)
+			break;
+	}
+
+	return NULL;
+}
+
+static void run(int infd, int outfd, const char *outpath, size_t chunk, size_t holdback, const struct pipeline_framing *framing) {
+	struct pipeline p = { .infd = infd, .outfd = outfd, .outpath = outpath, .chunk = chunk, .holdback = holdback };
+
+	if (holdback + 16 > PIPELINE_SLACK || chunk % 16 != 0 || chunk < PIPELINE_SLACK) {
+		fprintf(stderr, "pipeline_run: holdback too large, or bad chunk size\n");
+		exit(1);
+	}
+
+	for (int i = 0; i < NUM_SLOTS; i++) {
+		p.slots[i].mem = arena_alloc(framing->headroom + chunk + framing->tailroom);
+		p.slots[i].buf = p.slots[i].mem + framing->headroom;
+		p.slots[i].state = SLOT_FREE;
+	}
+
+	pthread_mutex_init(&p.lock, NULL);
+	pthread_cond_init(&p.cond, NULL);
+
+	pthread_t reader, writer;
+	if (pthread_create(&reader, NULL, reader_thread, &p) != 0 || pthread_create(&writer, NULL, writer_thread, &p) != 0) {
+		fprintf(stderr, "Failed to create pipeline threads!\n");
+		exit(1);
+	}
+
+	// The crypto stage runs in the calling thread (and, through the callback, in its thread pool)
+	for (int i = 0; ; i++) {
+		STATS_START(wait);
+		struct slot *slot = wait_for(&p, i, SLOT_READ);
+		STATS_STOP(wait, STATS_WAIT, 0);
+		bool final = slot->final;
+
+		STATS_START(crypt);
+		size_t len = slot->len;
+		slot->out = slot->buf;
+		slot->len = framing->process(framing->arg, slot->buf, len, final, &slot->out);
+		STATS_STOP(crypt, STATS_CRYPT, len);
+		publish(&p, slot, SLOT_DONE);
+
+		if (final)
+			break;
+	}
+
+	pthread_join(reader, NULL);
+	pthread_join(writer, NULL);
+
+	pthread_mutex_destroy(&p.lock);
+	pthread_cond_destroy(&p.cond);
+	for (int i = 0; i < NUM_SLOTS; i++) {
+		arena_free(p.slots[i].mem);
+	}
+}
+
+struct unframed {
+	pipeline_func process;
+	void *arg;
+};
+
+static size_t process_unframed(void *arg, unsigned char *buf, size_t len, bool final, unsigned char **out) {
+	(void)out; // stays at buf
+	struct unframed *u = arg;
+	return u->process(u->arg, buf, len, final);
+}
+
+void pipeline_run(int infd, int outfd, const char *outpath, size_t chunk, size_t holdback, pipeline_func process, void *arg) {
+	//
+	// Runs the whole input through process(), chunk bytes at a time (see arena_chunk_size), and writes the result to
+	// outfd. Returns when everything has been written. outpath (if not NULL) is deleted if reading fails halfway through.
+	//
+	struct unframed u = { .process = process, .arg = arg };
+	struct pipeline_framing framing = { .headroom = 0, .tailroom = PIPELINE_SLACK, .process = process_unframed, .arg = &u };
+	run(infd, outfd, outpath, chunk, holdback, &framing);
+}
+
+void pipeline_run_framed(int infd, int outfd, const char *outpath, size_t chunk, const struct pipeline_framing *framing) {
+	run(infd, outfd, outpath, chunk, 0, framing);
+}
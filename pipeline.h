@@ -0,0 +1,31 @@
+#ifndef _PIPELINE_H
+#define _PIPELINE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// Called by the crypto stage for each chunk, in order. The chunk is transformed in place;
+// buf has room for PIPELINE_SLACK bytes past len (for padding and such), and the return value
+// is the number of bytes to write out. final is set on the last chunk only (which may be empty).
+typedef size_t (*pipeline_func)(void *arg, unsigned char *buf, size_t len, bool final);
+
+#define PIPELINE_SLACK 64
+
+void pipeline_run(int infd, int outfd, const char *outpath, size_t chunk, size_t holdback, pipeline_func process, void *arg);
+
+// For formats whose output isn't just the input transformed in place (v2, with a header page per chunk): buf has
+// headroom bytes in front of it and tailroom bytes past the chunk, and the callback points *out at what's to be
+// written, which can be anywhere in that space. Chunks are exactly chunk bytes but for the last, as with holdback 0.
+typedef size_t (*pipeline_frame_func)(void *arg, unsigned char *buf, size_t len, bool final, unsigned char **out);
+
+struct pipeline_framing {
+	size_t headroom, tailroom;
+	pipeline_frame_func process;
+	void *arg;
+};
+
+void pipeline_run_framed(int infd, int outfd, const char *outpath, size_t chunk, const struct pipeline_framing *framing);
+size_t read_full(int fd, unsigned char *buf, size_t len);
+void write_full(int fd, const unsigned char *buf, size_t len);
+
+#endif
@@ -0,0 +1,227 @@
+#include <stdio.h>
+#include <stdlib.h> /* exit */
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "aes.h"
+#include "pool.h"
+
+/*
+ * A tiny fixed-size thread pool for the CTR kernels.
+ * In CTR mode, block i of a chunk is encrypted with the counter (nonce, first + i), and nothing else;
+ * that means a chunk can be cut into N contiguous slices, and each slice handed to a thread together
+ * with its starting counter. The output is byte-for-byte identical to running the kernel on the whole chunk.
+ *
+ * The calling thread processes the first slice itself, so a pool of N threads only spawns N-1 workers.
+ *
+ * ctr_pool_run hands the same threads an arbitrary function instead, for modes that split up differently
+ * (XTS splits on sector boundaries).
+ */
+
+struct ctr_slice {
+	const unsigned char *in;
+	unsigned char *out;
+	size_t blocks;
+	uint64_t counter[2];
+};
+
+struct ctr_pool {
+	int nthreads;
+	pthread_t *threads;
+
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;  // signalled when a new generation of work is available (or on shutdown)
+	pthread_cond_t done_cond;  // signalled when the last worker finishes its slice
+
+	// The current job; protected by lock
+	unsigned long generation;
+	int pending;
+	bool shutdown;
+	aes_ctr_func kernel;
+	const unsigned char *keys;
+	ctr_pool_job job;         // if set, run instead of the kernel (ctr_pool_run)
+	void *job_arg;
+	struct ctr_slice *slices; // one per thread; slices[0] belongs to the caller
+};
+
+struct worker_arg {
+	struct ctr_pool *pool;
+	int id;
+};
+
+static void *ctr_pool_worker(void *arg) {
+	struct ctr_pool *pool = ((struct worker_arg *)arg)->pool;
+	int id = ((struct worker_arg *)arg)->id;
+	free(arg);
+
+	unsigned long seen = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	while (true) {
+		while (pool->generation == seen && !pool->shutdown)
+			pthread_cond_wait(&pool->work_cond, &pool->lock);
+		if (pool->shutdown)
+			break;
+		seen = pool->generation;
+
+		struct ctr_slice *slice = &pool->slices[id];
+		aes_ctr_func kernel = pool->kernel;
+		const unsigned char *keys = pool->keys;
+		ctr_pool_job job = pool->job;
+		void *job_arg = pool->job_arg;
+		pthread_mutex_unlock(&pool->lock);
+
+		if (job)
+			job(job_arg, id, pool->nthreads);
+		else
+			kernel(slice->in, slice->out, slice->blocks, slice->counter, keys);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->pending == 0)
+			pthread_cond_signal(&pool->done_cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+struct ctr_pool *ctr_pool_create(int nthreads) {
+	// Returns a pool that splits each ctr_pool_xor call across nthreads threads (including the caller).
+	if (nthreads < 1)
+		nthreads = 1;
+
+	struct ctr_pool *pool = calloc(1, sizeof(struct ctr_pool));
+	if (!pool) {
+		fprintf(stderr, "Failed to allocate memory for the thread pool!\n");
+		exit(1);
+	}
+
+	pool->nthreads = nthreads;
+	pool->slices = calloc(nthreads, sizeof(struct ctr_slice));
+	pool->threads = calloc(nthreads, sizeof(pthread_t));
+	if (!pool->slices || !pool->threads) {
+		fprintf(stderr, "Failed to allocate memory for the thread pool!\n");
+		exit(1);
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+
+	for (int i = 1; i < nthreads; i++) {
+		struct worker_arg *arg = malloc(sizeof(struct worker_arg));
+		if (!arg) {
+			fprintf(stderr, "Failed to allocate memory for the thread pool!\n");
+			exit(1);
+		}
+		arg->pool = pool;
+		arg->id = i;
+		if (pthread_create(&pool->threads[i], NULL, ctr_pool_worker, arg) != 0) {
+			fprintf(stderr, "Failed to create worker thread!\n");
+			exit(1);
+		}
+	}
+
+	return pool;
+}
+
+void ctr_pool_xor(struct ctr_pool *pool, aes_ctr_func kernel, const unsigned char *in, unsigned char *out, size_t blocks, uint64_t *counter, const unsigned char *keys) {
+	//
+	// Same contract as the aes_ctr_* kernels (counter[1] is advanced by blocks), but the work is spread
+	// across the pool. Small jobs aren't worth waking anyone up for, so they run in the calling thread.
+	//
+	#define MIN_BLOCKS_PER_THREAD 1024 // 16 KiB
+
+	if (pool == NULL || pool->nthreads == 1 || blocks < 2 * MIN_BLOCKS_PER_THREAD) {
+		kernel(in, out, blocks, counter, keys);
+		return;
+	}
+
+	int nslices = pool->nthreads;
+	if (blocks / MIN_BLOCKS_PER_THREAD < nslices)
+		nslices = blocks / MIN_BLOCKS_PER_THREAD;
+
+	// Round each slice to a multiple of 8 blocks, so that every thread stays in the kernel's 8-wide loop;
+	// the last slice takes whatever is left.
+	size_t per_slice = (blocks / nslices) & ~(size_t)7;
+
+	pthread_mutex_lock(&pool->lock);
+	for (int i = 0; i < pool->nthreads; i++) {
+		struct ctr_slice *slice = &pool->slices[i];
+		size_t first = i * per_slice;
+
+		if (i >= nslices) {
+			slice->blocks = 0;
+			continue;
+		}
+
+		slice->in = in + first*16;
+		slice->out = out + first*16;
+		slice->blocks = (i == nslices - 1) ? blocks - first : per_slice;
+		slice->counter[0] = counter[0];
+		slice->counter[1] = counter[1] + first;
+	}
+	pool->kernel = kernel;
+	pool->keys = keys;
+	pool->job = NULL;
+	pool->pending = pool->nthreads - 1;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	// Do our share while the workers do theirs
+	kernel(pool->slices[0].in, pool->slices[0].out, pool->slices[0].blocks, pool->slices[0].counter, keys);
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->pending > 0)
+		pthread_cond_wait(&pool->done_cond, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+
+	counter[1] += blocks;
+}
+
+void ctr_pool_run(struct ctr_pool *pool, ctr_pool_job job, void *arg) {
+	// Calls job(arg, i, n) once for each i in 0 ... n-1, where n is the number of threads, and waits for all of them.
+	// The caller runs i = 0.
+	if (pool == NULL || pool->nthreads == 1) {
+		job(arg, 0, 1);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->job = job;
+	pool->job_arg = arg;
+	pool->pending = pool->nthreads - 1;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	job(arg, 0, pool->nthreads);
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->pending > 0)
+		pthread_cond_wait(&pool->done_cond, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void ctr_pool_destroy(struct ctr_pool *pool) {
+	if (pool == NULL)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = true;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (int i = 1; i < pool->nthreads; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_cond_destroy(&pool->done_cond);
+	free(pool->threads);
+	free(pool->slices);
+	free(pool);
+}
@@ -0,0 +1,12 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include "aes.h" /* aes_ctr_func */
+
+struct ctr_pool;
+typedef void (*ctr_pool_job)(void *arg, int index, int count);
+
+struct ctr_pool *ctr_pool_create(int nthreads);
+void ctr_pool_xor(struct ctr_pool *pool, aes_ctr_func kernel, const unsigned char *in, unsigned char *out, size_t blocks, uint64_t *counter, const unsigned char *keys);
+void ctr_pool_run(struct ctr_pool *pool, ctr_pool_job job, void *arg);
+void ctr_pool_destroy(struct ctr_pool *pool);
@@ -0,0 +1,50 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Where bin/ctr's time goes, for --stats. Each stage is only ever updated by one thread at a time (the pipeline's
+// reader, the calling thread, the writer), so the counters need no locking.
+enum stats_stage {
+	STATS_READ,   // read()/pread() of the input, or io_uring read completions
+	STATS_CRYPT,  // one chunk through the cipher (the histogram is of these)
+	STATS_WRITE,  // write()/pwrite() of the output, or io_uring write completions
+	STATS_WAIT,   // the crypto thread blocked on I/O: waiting for the reader, or for io_uring completions
+	STATS_STAGES
+};
+
+struct stats_mark {
+	uint64_t wall_ns, cpu_ns;
+};
+
+#ifdef NO_STATS
+
+// Compiled out: the macros expand to nothing (but still use the byte count, so it isn't an unused variable), and
+// --stats is rejected
+#define STATS_START(mark)
+#define STATS_STOP(mark, stage, bytes) do { (void)(bytes); } while (0)
+#define STATS_COUNT(stage, bytes) do { (void)(bytes); } while (0)
+
+#else
+
+extern bool stats_enabled;
+
+void stats_start(struct stats_mark *mark);
+void stats_stop(const struct stats_mark *mark, enum stats_stage stage, size_t bytes);
+void stats_count(enum stats_stage stage, size_t bytes);
+
+// Costs one predictable branch each when --stats isn't given
+#define STATS_START(mark) struct stats_mark mark = {0, 0}; if (stats_enabled) stats_start(&mark)
+#define STATS_STOP(mark, stage, bytes) do { if (stats_enabled) stats_stop(&mark, stage, bytes); } while (0)
+#define STATS_COUNT(stage, bytes) do { if (stats_enabled) stats_count(stage, bytes); } while (0)
+
+#endif
+
+// Both are no-ops when built with NO_STATS. stats_init opens the hardware counters (where perf_event_paranoid
+// allows it) before any threads are started, so that they're inherited; stats_report prints to stderr.
+void stats_init(bool json);
+void stats_report(void);
+
+#endif
@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include <stdlib.h> /* exit */
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "steal.h"
+
+/*
+ * Tasks from outside (submit) go into the inbox, which is a deque like the workers' own but only ever taken from at
+ * the front, and only by a worker that has found nothing in any deque: everything spawned by the tasks already
+ * started goes first. For --batch that means a worker finishes (or helps finish) the files that are open before it
+ * opens another one, so the number of open files stays around the number of workers, however the files are listed.
+ *
+ * Every deque is a growable ring under a lock of its own; the owner and thieves only meet on the same lock when one
+ * is stealing from the other, and tasks are coarse enough (a file, or megabytes of one) that an uncontended lock per
+ * task doesn't show.
+ *
+ * queued (tasks in deques) and pending (queued or running) are atomics, so that the common path doesn't touch the
+ * pool's lock. The lock is only for sleeping: a worker that finds nothing to do registers as idle and checks queued
+ * again, under the lock, before it waits; whoever adds a task increments queued first and then looks for idle workers.
+ * Both sides use sequentially consistent atomics, so one of them always sees the other and no wakeup is lost.
+ * The producer waiting for room in submit works the same way, with producer_waiting.
+ */
+
+struct deque {
+	pthread_mutex_t lock;
+	void **tasks;
+	size_t capacity; // a power of two
+	size_t head, tail; // tasks[head % capacity] .. tasks[(tail - 1) % capacity]
+};
+
+struct steal_pool {
+	int nthreads;
+	size_t max_queued;
+	steal_func run;
+	void *arg;
+	pthread_t *threads;
+	struct deque *deques;
+	struct deque inbox; // from submit
+
+	size_t queued, pending;
+	int idle;
+	bool producer_waiting;
+	bool finishing;
+
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;  // idle workers
+	pthread_cond_t space_cond; // the producer, in submit
+};
+
+static void push_back(struct deque *d, void *task) {
+	pthread_mutex_lock(&d->lock);
+	if (d->tail - d->head == d->capacity) {
+		size_t capacity = d->capacity ? 2 * d->capacity : 64;
+		void **tasks = malloc(capacity * sizeof(*tasks));
+		if (tasks == NULL) {
+			fprintf(stderr, "Failed to allocate memory!\n");
+			exit(1);
+		}
+		for (size_t i = d->head; i < d->tail; i++) {
+			tasks[i % capacity] = d->tasks[i % d->capacity];
+		}
+		free(d->tasks);
+		d->tasks = tasks;
+		d->capacity = capacity;
+	}
+	d->tasks[d->tail++ % d->capacity] = task;
+	pthread_mutex_unlock(&d->lock);
+}
+
+static void *take(struct deque *d, bool back) {
+	void *task = NULL;
+	pthread_mutex_lock(&d->lock);
+	if (d->head != d->tail)
+		task = back ? d->tasks[--d->tail % d->capacity] : d->tasks[d->head++ % d->capacity];
+	pthread_mutex_unlock(&d->lock);
+	return task;
+}
+
+static void add(struct steal_pool *pool, struct deque *d, void *task) {
+	// Counted before it's in the deque, so that a thief never takes a task that queued doesn't know about yet
+	__atomic_add_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+	push_back(d, task);
+	if (__atomic_load_n(&pool->idle, __ATOMIC_SEQ_CST) > 0) {
+		pthread_mutex_lock(&pool->lock);
+		pthread_cond_signal(&pool->work_cond);
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+static void *find_task(struct steal_pool *pool, int worker) {
+	void *task = take(&pool->deques[worker], true);
+	for (int i = 1; task == NULL && i < pool->nthreads; i++) {
+		task = take(&pool->deques[(worker + i) % pool->nthreads], false);
+	}
+	if (task == NULL)
+		task = take(&pool->inbox, false);
+	if (task != NULL) {
+		__atomic_sub_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&pool->producer_waiting, __ATOMIC_SEQ_CST)) {
+			pthread_mutex_lock(&pool->lock);
+			pthread_cond_signal(&pool->space_cond);
+			pthread_mutex_unlock(&pool->lock);
+		}
+	}
+	return task;
+}
+
+struct worker_arg {
+	struct steal_pool *pool;
+	int index;
+};
+
+static void *worker_main(void *arg) {
+	struct steal_pool *pool = ((struct worker_arg *)arg)->pool;
+	int index = ((struct worker_arg *)arg)->index;
+	free(arg);
+
+	for (;;) {
+		void *task = find_task(pool, index);
+		if (task != NULL) {
+			pool->run(pool, index, task, pool->arg);
+			if (__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+				// Maybe the last one; finish (or a worker waiting for it) has to hear about that
+				pthread_mutex_lock(&pool->lock);
+				pthread_cond_broadcast(&pool->work_cond);
+				pthread_mutex_unlock(&pool->lock);
+			}
+			continue;
+		}
+
+		pthread_mutex_lock(&pool->lock);
+		__atomic_add_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+		bool done = false;
+		while (__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) == 0) {
+			if (pool->finishing && __atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) == 0) {
+				done = true;
+				break;
+			}
+			pthread_cond_wait(&pool->work_cond, &pool->lock);
+		}
+		__atomic_sub_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&pool->lock);
+		if (done)
+			return NULL;
+	}
+}
+
+struct steal_pool *steal_pool_create(int nthreads, size_t max_queued, steal_func run, void *arg) {
+	struct steal_pool *pool = calloc(1, sizeof(*pool));
+	if (pool == NULL) {
+		fprintf(stderr, "Failed to allocate memory!\n");
+		exit(1);
+	}
+	pool->nthreads = nthreads;
+	pool->max_queued = max_queued;
+	pool->run = run;
+	pool->arg = arg;
+	pool->threads = calloc(nthreads, sizeof(*pool->threads));
+	pool->deques = calloc(nthreads, sizeof(*pool->deques));
+	if (pool->threads == NULL || pool->deques == NULL) {
+		fprintf(stderr, "Failed to allocate memory!\n");
+		exit(1);
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->space_cond, NULL);
+
+	for (int i = 0; i < nthreads; i++) {
+		pthread_mutex_init(&pool->deques[i].lock, NULL);
+	}
+	pthread_mutex_init(&pool->inbox.lock, NULL);
+	for (int i = 0; i < nthreads; i++) {
+		struct worker_arg *wa = malloc(sizeof(*wa));
+		if (wa == NULL) {
+			fprintf(stderr, "Failed to allocate memory!\n");
+			exit(1);
+		}
+		*wa = (struct worker_arg){ .pool = pool, .index = i };
+		if (pthread_create(&pool->threads[i], NULL, worker_main, wa) != 0) {
+			fprintf(stderr, "Failed to create worker thread!\n");
+			exit(1);
+		}
+	}
+	return pool;
+}
+
+void steal_pool_submit(struct steal_pool *pool, void *task) {
+	if (__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) >= pool->max_queued) {
+		pthread_mutex_lock(&pool->lock);
+		__atomic_store_n(&pool->producer_waiting, true, __ATOMIC_SEQ_CST);
+		while (__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) >= pool->max_queued) {
+			pthread_cond_wait(&pool->space_cond, &pool->lock);
+		}
+		__atomic_store_n(&pool->producer_waiting, false, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	add(pool, &pool->inbox, task);
+}
+
+void steal_pool_spawn(struct steal_pool *pool, int worker, void *task) {
+	add(pool, &pool->deques[worker], task);
+}
+
+void steal_pool_finish(struct steal_pool *pool) {
+	pthread_mutex_lock(&pool->lock);
+	pool->finishing = true;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (int i = 0; i < pool->nthreads; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+	for (int i = 0; i < pool->nthreads; i++) {
+		pthread_mutex_destroy(&pool->deques[i].lock);
+		free(pool->deques[i].tasks);
+	}
+	pthread_mutex_destroy(&pool->inbox.lock);
+	free(pool->inbox.tasks);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_cond_destroy(&pool->space_cond);
+	free(pool->deques);
+	free(pool->threads);
+	free(pool);
+}
@@ -0,0 +1,30 @@
+#ifndef _STEAL_H
+#define _STEAL_H
+
+#include <stddef.h>
+
+// A work-stealing thread pool for --batch, where tasks are whole files or ranges of one, and take anything from
+// microseconds to seconds. Each worker has a deque of its own: it takes its newest task from the back (so a task's
+// sub-tasks run while their data is still fresh), and a worker that runs out steals the oldest from another's front,
+// and only then takes a new task from outside.
+//
+// task is opaque to the pool; run gets it back, together with the index (0..nthreads-1) of the worker running it,
+// for per-worker state like buffers. Creating the pool exits if the threads can't be started.
+struct steal_pool;
+typedef void (*steal_func)(struct steal_pool *pool, int worker, void *task, void *arg);
+
+struct steal_pool *steal_pool_create(int nthreads, size_t max_queued, steal_func run, void *arg);
+
+// From outside the pool: adds a task to the pool's inbox. Tasks from there run in the order they were submitted, and
+// only when no worker has a sub-task left to run or steal. Blocks while max_queued tasks are waiting to run, which is
+// what keeps a producer that lists millions of files from running ahead of the workers.
+void steal_pool_submit(struct steal_pool *pool, void *task);
+
+// From inside a task: adds a sub-task to the running worker's own deque. Never blocks (a worker that waited for
+// room would be waiting for itself).
+void steal_pool_spawn(struct steal_pool *pool, int worker, void *task);
+
+// Waits until every task, sub-tasks included, has run, then stops the workers and frees the pool
+void steal_pool_finish(struct steal_pool *pool);
+
+#endif
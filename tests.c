@@ -2,10 +2,71 @@
 #include <stdlib.h> /* exit */
 #include <string.h> /* memcmp */
 #include <assert.h>
+#include <unistd.h>  /* usleep */
+#include <pthread.h>
 #include "keyschedule.h"
 #include "debug.h"
 #include "aes.h"
 #include "misc.h"
+#include "mb.h"
+#include "cbc.h"
+#include "gcm.h"
+#include "xts.h"
+#include "ctx.h"
+#include "kernels.h"
+#include "keystream.h"
+
+static size_t from_hex(const char *hex, unsigned char *out) {
+	// For the longer test vectors; returns the number of bytes written
+	size_t len = 0;
+	for (; hex[0] && hex[1]; hex += 2) {
+		unsigned int byte;
+		sscanf(hex, "%2x", &byte);
+		out[len++] = byte;
+	}
+	return len;
+}
+
+// For the keystream ring tests: each thread encrypts messages and records where their counter ranges started
+#define KEYSTREAM_MESSAGES 400
+struct keystream_thread {
+	struct aes_keystream *ks;
+	const struct aes_ctx *ctx;
+	uint64_t starts[KEYSTREAM_MESSAGES], blocks[KEYSTREAM_MESSAGES];
+	bool ok;
+};
+
+static void *keystream_thread(void *arg) {
+	// Encrypts messages of 0 to 599 bytes (so some are longer than the 256-byte segments) and checks that each
+	// decrypts with aes_ctx_ctr_xor from the counter it came back with
+	struct keystream_thread *t = arg;
+	unsigned char plain[600], cipher[600];
+	t->ok = true;
+	for (int i = 0; i < KEYSTREAM_MESSAGES; i++) {
+		size_t len = (i * 37) % 600;
+		for (size_t j = 0; j < len; j++) {
+			plain[j] = (unsigned char)(i + j);
+		}
+		uint64_t counter[2];
+		if (aes_keystream_xor(t->ks, plain, cipher, len, counter) != AES_OK) {
+			t->ok = false;
+			break;
+		}
+		t->starts[i] = counter[1];
+		t->blocks[i] = (len + 15) / 16;
+		aes_ctx_ctr_xor(t->ctx, counter, cipher, cipher, len);
+		if (memcmp(plain, cipher, len) != 0 || counter[0] != 0x1122334455667788ULL)
+			t->ok = false;
+		if (i % 16 == 0)
+			usleep(200); // idle now and then, so that the ring gets refilled
+	}
+	return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
 
 int main() {
 
@@ -114,6 +175,24 @@ int main() {
 		printf("PASS: expanded_keys_random\n");
 	}
 
+	if (test_ssse3_support()) {
+		aes_expand_key_vperm(in_key_random, 16, out_keys);
+		if (memcmp(expanded_keys_random, out_keys, 11*16) != 0) {
+			fprintf(stderr, "ERROR: expanded_keys_random did not match expected output (vperm)\n");
+		}
+		else {
+			printf("PASS: expanded_keys_random (vperm)\n");
+		}
+
+		aes_expand_key_vperm(in_key_ff, 16, out_keys);
+		if (memcmp(expanded_keys_ff, out_keys, 11*16) != 0) {
+			fprintf(stderr, "ERROR: expanded_keys_ff did not match expected output (vperm)\n");
+		}
+		else {
+			printf("PASS: expanded_keys_ff (vperm)\n");
+		}
+	}
+
 	printf("\n");
 	printf("---------------------------------------\n");
 	printf("TESTING MAIN FUNCTIONS\n");
@@ -235,6 +314,21 @@ int main() {
     else {
         printf("PASS: encryption (AES-NI)\n");
     }
+	if (test_ssse3_support()) {
+		memset(ciphertext, 0, 16);
+		aes_encrypt_vperm((const unsigned char *)original_plaintext, ciphertext, out_keys);
+
+		if (memcmp(ciphertext, expected_ciphertext, 16) != 0) {
+			fprintf(stderr, "ERROR: ciphertext didn't match expected ciphertext (vperm)\n");
+
+			printf("expected:"); print_hex(expected_ciphertext, 16);
+			printf("got: "); print_hex(ciphertext, 16);
+		}
+		else {
+			printf("PASS: encryption (vperm)\n");
+		}
+	}
+
 	unsigned char plaintext[16] = {0};
 	aes_prepare_decryption_keys(out_keys);
 
@@ -263,6 +357,907 @@ int main() {
 		printf("PASS: decryption (AES-NI)\n");
 	}
 
+	if (test_ssse3_support()) {
+		memset(plaintext, 0, 16);
+		aes_decrypt_vperm(expected_ciphertext, plaintext, out_keys);
+
+		if (memcmp(plaintext, original_plaintext, 16) != 0) {
+			fprintf(stderr, "ERROR: decrypted plaintext didn't match original plaintext (vperm)\n");
+
+			printf("expected:"); print_hex(original_plaintext, 16);
+			printf("got:"); print_hex(plaintext, 16);
+		}
+		else {
+			printf("PASS: decryption (vperm)\n");
+		}
+
+		// The decryption keys prepared with aes_inv_mix_columns_vperm must match the C ones
+		unsigned char c_keys[176], vperm_keys[176];
+		aes_expand_key(key, c_keys);
+		memcpy(vperm_keys, c_keys, 176);
+		for (int round = 1; round <= 9; round++) {
+			InvMixColumns(c_keys + round*16);
+			aes_inv_mix_columns_vperm(vperm_keys + round*16);
+		}
+		if (memcmp(c_keys, vperm_keys, 176) != 0) {
+			fprintf(stderr, "ERROR: decryption keys didn't match (vperm)\n");
+		}
+		else {
+			printf("PASS: decryption key preparation (vperm)\n");
+		}
+	}
+
+	printf("\n");
+	printf("---------------------------------------\n");
+	printf("CTR KERNEL TESTS\n");
+	printf("---------------------------------------\n");
+
+	// 37 blocks: four passes through the 8-block loop, plus a 5-block tail
+	#define CTR_TEST_BLOCKS 37
+	unsigned char ctr_in[CTR_TEST_BLOCKS * 16];
+	unsigned char ctr_expected[CTR_TEST_BLOCKS * 16];
+	unsigned char ctr_out[CTR_TEST_BLOCKS * 16];
+	for (int i = 0; i < CTR_TEST_BLOCKS * 16; i++) {
+		ctr_in[i] = (unsigned char)(i * 7 + 3);
+	}
+
+	aes_expand_key(key, out_keys);
+
+	// Reference: one aes_encrypt_c call per counter block
+	uint64_t ref_counter[2] = {0x0123456789abcdefULL, 1};
+	for (int i = 0; i < CTR_TEST_BLOCKS; i++) {
+		unsigned char keystream[16];
+		aes_encrypt_c((unsigned char *)ref_counter, keystream, out_keys);
+		ref_counter[1]++;
+		for (int j = 0; j < 16; j++) {
+			ctr_expected[i*16 + j] = ctr_in[i*16 + j] ^ keystream[j];
+		}
+	}
+
+	uint64_t ctr_counter[2] = {0x0123456789abcdefULL, 1};
+	aes_ctr_c(ctr_in, ctr_out, CTR_TEST_BLOCKS, ctr_counter, out_keys);
+	if (memcmp(ctr_out, ctr_expected, sizeof(ctr_out)) != 0 || ctr_counter[1] != ref_counter[1]) {
+		fprintf(stderr, "ERROR: CTR kernel output didn't match expected output (C)\n");
+	}
+	else {
+		printf("PASS: CTR kernel (C)\n");
+	}
+
+	ctr_counter[1] = 1;
+	aes_ctr_bitslice(ctr_in, ctr_out, 3, ctr_counter, out_keys);
+	aes_ctr_bitslice(ctr_in + 3*16, ctr_out + 3*16, CTR_TEST_BLOCKS - 3, ctr_counter, out_keys);
+	if (memcmp(ctr_out, ctr_expected, sizeof(ctr_out)) != 0 || ctr_counter[1] != ref_counter[1]) {
+		fprintf(stderr, "ERROR: CTR kernel output didn't match expected output (bitsliced)\n");
+	}
+	else {
+		printf("PASS: CTR kernel (bitsliced)\n");
+	}
+
+	if (test_aesni_support()) {
+		// Split the run in two to make sure the counter carries over between calls
+		ctr_counter[1] = 1;
+		aes_ctr_aesni(ctr_in, ctr_out, 11, ctr_counter, out_keys);
+		aes_ctr_aesni(ctr_in + 11*16, ctr_out + 11*16, CTR_TEST_BLOCKS - 11, ctr_counter, out_keys);
+		if (memcmp(ctr_out, ctr_expected, sizeof(ctr_out)) != 0 || ctr_counter[1] != ref_counter[1]) {
+			fprintf(stderr, "ERROR: CTR kernel output didn't match expected output (AES-NI)\n");
+		}
+		else {
+			printf("PASS: CTR kernel (AES-NI)\n");
+		}
+
+		// In-place operation
+		memcpy(ctr_out, ctr_in, sizeof(ctr_out));
+		ctr_counter[1] = 1;
+		aes_ctr_aesni(ctr_out, ctr_out, CTR_TEST_BLOCKS, ctr_counter, out_keys);
+		if (memcmp(ctr_out, ctr_expected, sizeof(ctr_out)) != 0) {
+			fprintf(stderr, "ERROR: in-place CTR kernel output didn't match expected output (AES-NI)\n");
+		}
+		else {
+			printf("PASS: in-place CTR kernel (AES-NI)\n");
+		}
+	}
+
+	printf("\n");
+	printf("---------------------------------------\n");
+	printf("AES-192 / AES-256 TESTS\n");
+	printf("---------------------------------------\n");
+
+	// FIPS-197 appendix A.2/A.3 (key expansion) and C.2/C.3 (cipher) test vectors
+	const unsigned char key_192[] = {
+		0x8e, 0x73, 0xb0, 0xf7, 0xda, 0x0e, 0x64, 0x52, 0xc8, 0x10, 0xf3, 0x2b,
+		0x80, 0x90, 0x79, 0xe5, 0x62, 0xf8, 0xea, 0xd2, 0x52, 0x2c, 0x6b, 0x7b};
+	const unsigned char last_key_192[] = {0xe9, 0x8b, 0xa0, 0x6f, 0x44, 0x8c, 0x77, 0x3c, 0x8e, 0xcc, 0x72, 0x04, 0x01, 0x00, 0x22, 0x02};
+	const unsigned char key_256[] = {
+		0x60, 0x3d, 0xeb, 0x10, 0x15, 0xca, 0x71, 0xbe, 0x2b, 0x73, 0xae, 0xf0, 0x85, 0x7d, 0x77, 0x81,
+		0x1f, 0x35, 0x2c, 0x07, 0x3b, 0x61, 0x08, 0xd7, 0x2d, 0x98, 0x10, 0xa3, 0x09, 0x14, 0xdf, 0xf4};
+	const unsigned char last_key_256[] = {0xfe, 0x48, 0x90, 0xd1, 0xe6, 0x18, 0x8d, 0x0b, 0x04, 0x6d, 0xf3, 0x44, 0x70, 0x6c, 0x63, 0x1e};
+
+	unsigned char big_keys[AES_MAX_EXPANDED_KEY];
+
+	aes_expand_key_len(key_192, 24, big_keys);
+	if (memcmp(big_keys, key_192, 24) != 0 || memcmp(big_keys + 12*16, last_key_192, 16) != 0) {
+		fprintf(stderr, "ERROR: key expansion didn't match expected output (AES-192)\n");
+	}
+	else {
+		printf("PASS: key expansion (AES-192)\n");
+	}
+
+	aes_expand_key_len(key_256, 32, big_keys);
+	if (memcmp(big_keys, key_256, 32) != 0 || memcmp(big_keys + 14*16, last_key_256, 16) != 0) {
+		fprintf(stderr, "ERROR: key expansion didn't match expected output (AES-256)\n");
+	}
+	else {
+		printf("PASS: key expansion (AES-256)\n");
+	}
+
+	if (aes_expand_key_len(key_256, 20, big_keys) == 0 || aes_select_encrypt(20) != NULL || aes_select_ctr(20) != NULL) {
+		fprintf(stderr, "ERROR: invalid key length was accepted\n");
+	}
+	else {
+		printf("PASS: invalid key length rejected\n");
+	}
+
+	// AES-NI, vperm and C key expansion must agree, and the batch API must match one-at-a-time expansion
+	#define BATCH_KEYS 5
+	unsigned char batch_in[BATCH_KEYS * 32];
+	unsigned char batch_enc[BATCH_KEYS * AES_MAX_EXPANDED_KEY], batch_dec[BATCH_KEYS * AES_MAX_EXPANDED_KEY];
+	for (int i = 0; i < BATCH_KEYS * 32; i++) {
+		batch_in[i] = (unsigned char)(i * 37 + 11);
+	}
+	for (int key_len = 16; key_len <= 32; key_len += 8) {
+		const size_t stride = AES_SCHEDULE_SIZE(key_len);
+		bool ok = true;
+
+		if (test_aesni_support()) {
+			for (int i = 0; i < BATCH_KEYS; i++) {
+				unsigned char c_keys[AES_MAX_EXPANDED_KEY], ni_keys[AES_MAX_EXPANDED_KEY];
+				aes_expand_key_c(batch_in + i*key_len, key_len, c_keys);
+				aes_expand_key_aesni(batch_in + i*key_len, key_len, ni_keys);
+				if (memcmp(c_keys, ni_keys, stride) != 0)
+					ok = false;
+			}
+			if (!ok) {
+				fprintf(stderr, "ERROR: AES-NI key expansion didn't match C key expansion (AES-%d)\n", key_len * 8);
+			}
+			else {
+				printf("PASS: AES-NI key expansion (AES-%d)\n", key_len * 8);
+			}
+		}
+
+		if (test_ssse3_support()) {
+			ok = true;
+			for (int i = 0; i < BATCH_KEYS; i++) {
+				unsigned char c_keys[AES_MAX_EXPANDED_KEY], vperm_keys[AES_MAX_EXPANDED_KEY];
+				aes_expand_key_c(batch_in + i*key_len, key_len, c_keys);
+				aes_expand_key_vperm(batch_in + i*key_len, key_len, vperm_keys);
+				if (memcmp(c_keys, vperm_keys, stride) != 0)
+					ok = false;
+			}
+			if (!ok) {
+				fprintf(stderr, "ERROR: vperm key expansion didn't match C key expansion (AES-%d)\n", key_len * 8);
+			}
+			else {
+				printf("PASS: vperm key expansion (AES-%d)\n", key_len * 8);
+			}
+		}
+
+		ok = true;
+		aes_expand_keys(batch_in, key_len, BATCH_KEYS, batch_enc, batch_dec);
+		for (int i = 0; i < BATCH_KEYS; i++) {
+			unsigned char one_keys[AES_MAX_EXPANDED_KEY];
+			aes_expand_key_c(batch_in + i*key_len, key_len, one_keys);
+			if (memcmp(batch_enc + i*stride, one_keys, stride) != 0)
+				ok = false;
+			aes_prepare_decryption_keys_len(one_keys, key_len);
+			if (memcmp(batch_dec + i*stride, one_keys, stride) != 0)
+				ok = false;
+		}
+		if (!ok) {
+			fprintf(stderr, "ERROR: batch key expansion didn't match single key expansion (AES-%d)\n", key_len * 8);
+		}
+		else {
+			printf("PASS: batch key expansion (AES-%d)\n", key_len * 8);
+		}
+	}
+
+	const unsigned char fips_plaintext[] = {0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff};
+	const unsigned char fips_ciphertext_192[] = {0xdd, 0xa9, 0x7c, 0xa4, 0x86, 0x4c, 0xdf, 0xe0, 0x6e, 0xaf, 0x70, 0xa0, 0xec, 0x0d, 0x71, 0x91};
+	const unsigned char fips_ciphertext_256[] = {0x8e, 0xa2, 0xb7, 0xca, 0x51, 0x67, 0x45, 0xbf, 0xea, 0xfc, 0x49, 0x90, 0x4b, 0x49, 0x60, 0x89};
+
+	struct {
+		const char *name;
+		int key_len;
+		const unsigned char *expected;
+		aes_block_func encrypt[3], decrypt[3];
+		aes_ctr_func ctr[2];
+	} sizes[] = {
+		{ "AES-192", 24, fips_ciphertext_192,
+			{ aes_encrypt_c_192, aes_encrypt_vperm_192, aes_encrypt_aesni_192 },
+			{ aes_decrypt_c_192, aes_decrypt_vperm_192, aes_decrypt_aesni_192 },
+			{ aes_ctr_bitslice_192, aes_ctr_aesni_192 } },
+		{ "AES-256", 32, fips_ciphertext_256,
+			{ aes_encrypt_c_256, aes_encrypt_vperm_256, aes_encrypt_aesni_256 },
+			{ aes_decrypt_c_256, aes_decrypt_vperm_256, aes_decrypt_aesni_256 },
+			{ aes_ctr_bitslice_256, aes_ctr_aesni_256 } },
+	};
+	const char *impl_names[] = { "C", "vperm", "AES-NI" };
+	bool impl_supported[] = { true, test_ssse3_support(), test_aesni_support() };
+
+	for (int s = 0; s < 2; s++) {
+		// The key is 00 01 02 ... 1f, truncated to the key size
+		unsigned char fips_key[32], enc_keys[AES_MAX_EXPANDED_KEY], dec_keys[AES_MAX_EXPANDED_KEY];
+		for (int i = 0; i < 32; i++) {
+			fips_key[i] = i;
+		}
+		aes_expand_key_len(fips_key, sizes[s].key_len, enc_keys);
+		memcpy(dec_keys, enc_keys, sizeof(enc_keys));
+		aes_prepare_decryption_keys_len(dec_keys, sizes[s].key_len);
+
+		for (int impl = 0; impl < 3; impl++) {
+			if (!impl_supported[impl])
+				continue;
+
+			unsigned char block[16];
+			sizes[s].encrypt[impl](fips_plaintext, block, enc_keys);
+			if (memcmp(block, sizes[s].expected, 16) != 0) {
+				fprintf(stderr, "ERROR: encryption didn't match expected ciphertext (%s, %s)\n", sizes[s].name, impl_names[impl]);
+				printf("expected:"); print_hex(sizes[s].expected, 16);
+				printf("got:"); print_hex(block, 16);
+			}
+			else {
+				printf("PASS: encryption (%s, %s)\n", sizes[s].name, impl_names[impl]);
+			}
+
+			sizes[s].decrypt[impl](sizes[s].expected, block, dec_keys);
+			if (memcmp(block, fips_plaintext, 16) != 0) {
+				fprintf(stderr, "ERROR: decryption didn't match original plaintext (%s, %s)\n", sizes[s].name, impl_names[impl]);
+			}
+			else {
+				printf("PASS: decryption (%s, %s)\n", sizes[s].name, impl_names[impl]);
+			}
+		}
+
+		// CTR kernels against one aes_encrypt_c_* call per counter block
+		uint64_t ref_counter[2] = {0x0123456789abcdefULL, 1};
+		for (int i = 0; i < CTR_TEST_BLOCKS; i++) {
+			unsigned char keystream[16];
+			sizes[s].encrypt[0]((unsigned char *)ref_counter, keystream, enc_keys);
+			ref_counter[1]++;
+			for (int j = 0; j < 16; j++) {
+				ctr_expected[i*16 + j] = ctr_in[i*16 + j] ^ keystream[j];
+			}
+		}
+
+		const char *ctr_names[] = { "bitsliced", "AES-NI" };
+		for (int impl = 0; impl < 2; impl++) {
+			if (impl == 1 && !test_aesni_support())
+				continue;
+
+			uint64_t counter[2] = {0x0123456789abcdefULL, 1};
+			sizes[s].ctr[impl](ctr_in, ctr_out, 11, counter, enc_keys);
+			sizes[s].ctr[impl](ctr_in + 11*16, ctr_out + 11*16, CTR_TEST_BLOCKS - 11, counter, enc_keys);
+			if (memcmp(ctr_out, ctr_expected, sizeof(ctr_out)) != 0 || counter[1] != ref_counter[1]) {
+				fprintf(stderr, "ERROR: CTR kernel output didn't match expected output (%s, %s)\n", sizes[s].name, ctr_names[impl]);
+			}
+			else {
+				printf("PASS: CTR kernel (%s, %s)\n", sizes[s].name, ctr_names[impl]);
+			}
+		}
+	}
+
+	printf("\n");
+	printf("---------------------------------------\n");
+	printf("KERNEL REGISTRY TESTS\n");
+	printf("---------------------------------------\n");
+
+	// Every kernel this CPU can run, for every key size, against aes_encrypt_c_* one block at a time. The message
+	// is split over three calls (1, 100 and 199 blocks) so that each kernel's tail handling and counter updates get used.
+	#define REGISTRY_TEST_BLOCKS 300
+	{
+		static unsigned char reg_in[REGISTRY_TEST_BLOCKS * 16], reg_out[REGISTRY_TEST_BLOCKS * 16], reg_expected[REGISTRY_TEST_BLOCKS * 16];
+		const aes_block_func encrypt_c[3] = { aes_encrypt_c, aes_encrypt_c_192, aes_encrypt_c_256 };
+		unsigned char reg_key[32], reg_keys[AES_MAX_EXPANDED_KEY];
+		for (int i = 0; i < 32; i++) {
+			reg_key[i] = 0xa0 + i;
+		}
+		for (int i = 0; i < REGISTRY_TEST_BLOCKS * 16; i++) {
+			reg_in[i] = (unsigned char)(i * 13 + 5);
+		}
+
+		size_t count;
+		const struct aes_kernel *kernels = aes_kernel_list(&count);
+		for (size_t n = 0; n < count; n++) {
+			if (!aes_kernel_supported(&kernels[n])) {
+				printf("(skipping kernel %s: not supported by this CPU)\n", kernels[n].name);
+				continue;
+			}
+
+			bool ok = true;
+			for (int k = 0; k < 3; k++) {
+				aes_expand_key_len(reg_key, 16 + 8*k, reg_keys);
+				uint64_t ref_counter[2] = {0xfedcba9876543210ULL, 1000};
+				for (int i = 0; i < REGISTRY_TEST_BLOCKS; i++) {
+					unsigned char keystream[16];
+					encrypt_c[k]((unsigned char *)ref_counter, keystream, reg_keys);
+					ref_counter[1]++;
+					for (int j = 0; j < 16; j++) {
+						reg_expected[i*16 + j] = reg_in[i*16 + j] ^ keystream[j];
+					}
+				}
+
+				uint64_t counter[2] = {0xfedcba9876543210ULL, 1000};
+				kernels[n].ctr[k](reg_in, reg_out, 1, counter, reg_keys);
+				kernels[n].ctr[k](reg_in + 16, reg_out + 16, 100, counter, reg_keys);
+				kernels[n].ctr[k](reg_in + 101*16, reg_out + 101*16, REGISTRY_TEST_BLOCKS - 101, counter, reg_keys);
+				if (memcmp(reg_out, reg_expected, sizeof(reg_out)) != 0 || counter[1] != ref_counter[1])
+					ok = false;
+			}
+
+			if (ok)
+				printf("PASS: kernel %s, all key sizes\n", kernels[n].name);
+			else
+				fprintf(stderr, "ERROR: kernel %s didn't match the C reference\n", kernels[n].name);
+		}
+
+		// Selection: by name, by tuning, and the fallbacks
+		if (aes_kernel_choose("c") != aes_kernel_find("c") || aes_kernel_choose("bitslice") != aes_kernel_find("bitslice"))
+			fprintf(stderr, "ERROR: forcing a kernel by name\n");
+		else
+			printf("PASS: forcing a kernel by name\n");
+
+		// ... with a warning, which is caught here by pointing stderr at a temporary file for the call
+		char warning[256] = "";
+		FILE *caught = tmpfile();
+		int saved_stderr = dup(STDERR_FILENO);
+		fflush(stderr);
+		dup2(fileno(caught), STDERR_FILENO);
+		const struct aes_kernel *fallback = aes_kernel_choose("no-such-kernel");
+		fflush(stderr);
+		dup2(saved_stderr, STDERR_FILENO);
+		close(saved_stderr);
+		rewind(caught);
+		if (fgets(warning, sizeof(warning), caught) == NULL)
+			warning[0] = '\0';
+		fclose(caught);
+		if (fallback != aes_kernel_choose(NULL) || !aes_kernel_supported(fallback) ||
+				strstr(warning, "no-such-kernel") == NULL || strstr(warning, fallback->name) == NULL)
+			fprintf(stderr, "ERROR: unknown kernel names fall back to the default, with a warning (got: %s)\n", warning);
+		else
+			printf("PASS: unknown kernel names fall back to the default, with a warning\n");
+
+		const struct aes_kernel *tuned = aes_kernel_choose("tune");
+		if (tuned == NULL || !aes_kernel_supported(tuned))
+			fprintf(stderr, "ERROR: tuning picked an unsupported kernel\n");
+		else
+			printf("PASS: tuning picked %s\n", tuned->name);
+
+		if (aes_select_ctr(16) != aes_kernel_active()->ctr[0] || aes_select_ctr(32) != aes_kernel_active()->ctr[2])
+			fprintf(stderr, "ERROR: aes_select_ctr doesn't return the active kernel\n");
+		else
+			printf("PASS: aes_select_ctr returns the active kernel (%s)\n", aes_kernel_active()->name);
+	}
+
+	printf("\n");
+	printf("---------------------------------------\n");
+	printf("MULTI-BUFFER CTR TESTS\n");
+	printf("---------------------------------------\n");
+
+	// Many messages of different lengths (including empty, sub-block and partial-block ones),
+	// each with its own key and nonce, against the C reference one block at a time.
+	// The second layout is one long message and a lane's worth of sub-block ones after it: those run out of jobs
+	// to refill the lanes with while some of the lanes are done with their partial block, but not yet finished.
+	#define MB_TEST_JOBS 50
+	#define MB_TEST_MAX 700
+	for (int layout = 0; layout < 2; layout++)
+	for (int key_len = 16; key_len <= 32; key_len += 8) {
+		int njobs = (layout == 0) ? MB_TEST_JOBS : 9;
+		static unsigned char mb_in[MB_TEST_JOBS][MB_TEST_MAX], mb_out[MB_TEST_JOBS][MB_TEST_MAX];
+		static unsigned char mb_keys[MB_TEST_JOBS][AES_MAX_EXPANDED_KEY];
+		struct aes_mb_job jobs[MB_TEST_JOBS];
+		aes_block_func encrypt_c = (key_len == 16) ? aes_encrypt_c : (key_len == 24) ? aes_encrypt_c_192 : aes_encrypt_c_256;
+		bool ok = true;
+
+		for (int j = 0; j < njobs; j++) {
+			unsigned char raw_key[32];
+			for (int i = 0; i < 32; i++) {
+				raw_key[i] = (unsigned char)(j * 13 + i * 5);
+			}
+			aes_expand_key_len(raw_key, key_len, mb_keys[j]);
+			for (int i = 0; i < MB_TEST_MAX; i++) {
+				mb_in[j][i] = (unsigned char)(i * 3 + j);
+			}
+			jobs[j] = (struct aes_mb_job){ .keys = mb_keys[j], .counter = {0x1000 + j, 1 + j}, .in = mb_in[j], .out = mb_out[j],
+			                               .len = (layout == 0) ? (j * 97 + j * j) % MB_TEST_MAX : (j == 0) ? MB_TEST_MAX : 15 };
+		}
+
+		aes_mb_ctr(jobs, njobs, key_len);
+
+		for (int j = 0; j < njobs; j++) {
+			uint64_t counter[2] = {0x1000 + j, 1 + j};
+			for (size_t i = 0; i < jobs[j].len; i += 16) {
+				unsigned char keystream[16];
+				encrypt_c((unsigned char *)counter, keystream, mb_keys[j]);
+				counter[1]++;
+				for (size_t k = i; k < i + 16 && k < jobs[j].len; k++) {
+					if (mb_out[j][k] != (mb_in[j][k] ^ keystream[k - i]))
+						ok = false;
+				}
+			}
+			if (jobs[j].counter[1] != counter[1])
+				ok = false;
+		}
+
+		if (!ok) {
+			fprintf(stderr, "ERROR: multi-buffer CTR output didn't match expected output (AES-%d, layout %d)\n", key_len * 8, layout);
+		}
+		else {
+			printf("PASS: multi-buffer CTR (AES-%d, layout %d)\n", key_len * 8, layout);
+		}
+	}
+
+	printf("\n");
+	printf("---------------------------------------\n");
+	printf("CBC TESTS\n");
+	printf("---------------------------------------\n");
+
+	// NIST SP 800-38A F.2.1 and F.2.5 (CBC-AES128 and CBC-AES256)
+	const unsigned char cbc_iv[] = {0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f};
+	const unsigned char cbc_plaintext[] = {
+		0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+		0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c, 0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+		0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11, 0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+		0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17, 0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10};
+	const unsigned char cbc_key_128[] = {0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c};
+	const unsigned char cbc_ciphertext_128[] = {
+		0x76, 0x49, 0xab, 0xac, 0x81, 0x19, 0xb2, 0x46, 0xce, 0xe9, 0x8e, 0x9b, 0x12, 0xe9, 0x19, 0x7d,
+		0x50, 0x86, 0xcb, 0x9b, 0x50, 0x72, 0x19, 0xee, 0x95, 0xdb, 0x11, 0x3a, 0x91, 0x76, 0x78, 0xb2,
+		0x73, 0xbe, 0xd6, 0xb8, 0xe3, 0xc1, 0x74, 0x3b, 0x71, 0x16, 0xe6, 0x9e, 0x22, 0x22, 0x95, 0x16,
+		0x3f, 0xf1, 0xca, 0xa1, 0x68, 0x1f, 0xac, 0x09, 0x12, 0x0e, 0xca, 0x30, 0x75, 0x86, 0xe1, 0xa7};
+	const unsigned char cbc_ciphertext_256[] = {
+		0xf5, 0x8c, 0x4c, 0x04, 0xd6, 0xe5, 0xf1, 0xba, 0x77, 0x9e, 0xab, 0xfb, 0x5f, 0x7b, 0xfb, 0xd6,
+		0x9c, 0xfc, 0x4e, 0x96, 0x7e, 0xdb, 0x80, 0x8d, 0x67, 0x9f, 0x77, 0x7b, 0xc6, 0x70, 0x2c, 0x7d,
+		0x39, 0xf2, 0x33, 0x69, 0xa9, 0xd9, 0xba, 0xcf, 0xa5, 0x30, 0xe2, 0x63, 0x04, 0x23, 0x14, 0x61,
+		0xb2, 0xeb, 0x05, 0xe2, 0xc3, 0x9b, 0xe9, 0xfc, 0xda, 0x6c, 0x19, 0x07, 0x8c, 0x6a, 0x9d, 0x1b};
+
+	for (int key_len = 16; key_len <= 32; key_len += 16) {
+		const unsigned char *cbc_key = (key_len == 16) ? cbc_key_128 : key_256;
+		const unsigned char *expected = (key_len == 16) ? cbc_ciphertext_128 : cbc_ciphertext_256;
+		unsigned char enc_keys[AES_MAX_EXPANDED_KEY], dec_keys[AES_MAX_EXPANDED_KEY];
+		unsigned char iv[16], result[64];
+		aes_expand_keys(cbc_key, key_len, 1, enc_keys, dec_keys);
+
+		memcpy(iv, cbc_iv, 16);
+		aes_cbc_encrypt(cbc_plaintext, result, 4, iv, enc_keys, key_len);
+		if (memcmp(result, expected, 64) != 0 || memcmp(iv, expected + 48, 16) != 0) {
+			fprintf(stderr, "ERROR: CBC encryption didn't match expected ciphertext (AES-%d)\n", key_len * 8);
+		}
+		else {
+			printf("PASS: CBC encryption (AES-%d)\n", key_len * 8);
+		}
+
+		memcpy(iv, cbc_iv, 16);
+		aes_cbc_decrypt(expected, result, 4, iv, dec_keys, key_len);
+		if (memcmp(result, cbc_plaintext, 64) != 0) {
+			fprintf(stderr, "ERROR: CBC decryption didn't match expected plaintext (AES-%d)\n", key_len * 8);
+		}
+		else {
+			printf("PASS: CBC decryption (AES-%d)\n", key_len * 8);
+		}
+	}
+
+	// A longer message, to go through the 8-block decryption loop and its tail: encrypt in one call,
+	// then decrypt in place in two calls, which must carry the IV over
+	{
+		unsigned char enc_keys[AES_MAX_EXPANDED_KEY], dec_keys[AES_MAX_EXPANDED_KEY];
+		unsigned char iv[16], reference[CTR_TEST_BLOCKS * 16];
+		aes_expand_keys(key_192, 24, 1, enc_keys, dec_keys);
+
+		memcpy(iv, cbc_iv, 16);
+		for (int i = 0; i < CTR_TEST_BLOCKS; i++) {
+			unsigned char block[16];
+			for (int j = 0; j < 16; j++) {
+				block[j] = ctr_in[i*16 + j] ^ (i ? reference[(i-1)*16 + j] : iv[j]);
+			}
+			aes_encrypt_c_192(block, reference + i*16, enc_keys);
+		}
+
+		aes_cbc_encrypt(ctr_in, ctr_out, CTR_TEST_BLOCKS, iv, enc_keys, 24);
+		bool ok = (memcmp(ctr_out, reference, sizeof(reference)) == 0);
+
+		memcpy(iv, cbc_iv, 16);
+		aes_cbc_decrypt(ctr_out, ctr_out, 19, iv, dec_keys, 24);
+		aes_cbc_decrypt(ctr_out + 19*16, ctr_out + 19*16, CTR_TEST_BLOCKS - 19, iv, dec_keys, 24);
+		if (!ok || memcmp(ctr_out, ctr_in, sizeof(ctr_out)) != 0) {
+			fprintf(stderr, "ERROR: CBC round trip failed (%d blocks)\n", CTR_TEST_BLOCKS);
+		}
+		else {
+			printf("PASS: CBC round trip, in place (%d blocks)\n", CTR_TEST_BLOCKS);
+		}
+	}
+
+	printf("\n");
+	printf("---------------------------------------\n");
+	printf("GCM TESTS\n");
+	printf("---------------------------------------\n");
+
+	// Test cases 1-6 and 13-16 from the GCM specification (McGrew & Viega), also used in NIST's validation suite
+	const char *gcm_p60 = "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a721c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39";
+	const char *gcm_aad = "feedfacedeadbeeffeedfacedeadbeefabaddad2";
+	const struct {
+		const char *name, *key, *iv, *plaintext, *aad, *ciphertext, *tag;
+	} gcm_vectors[] = {
+		{ "1", "00000000000000000000000000000000", "000000000000000000000000", "", "", "", "58e2fccefa7e3061367f1d57a4e7455a" },
+		{ "2", "00000000000000000000000000000000", "000000000000000000000000", "00000000000000000000000000000000", "",
+			"0388dace60b6a392f328c2b971b2fe78", "ab6e47d42cec13bdf53a67b21257bddf" },
+		{ "3", "feffe9928665731c6d6a8f9467308308", "cafebabefacedbaddecaf888",
+			"d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a721c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b391aafd255", "",
+			"42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091473f5985",
+			"4d5c2af327cd64a62cf35abd2ba6fab4" },
+		{ "4", "feffe9928665731c6d6a8f9467308308", "cafebabefacedbaddecaf888", gcm_p60, gcm_aad,
+			"42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091",
+			"5bc94fbc3221a5db94fae95ae7121a47" },
+		{ "5", "feffe9928665731c6d6a8f9467308308", "cafebabefacedbad", gcm_p60, gcm_aad,
+			"61353b4c2806934a777ff51fa22a4755699b2a714fcdc6f83766e5f97b6c742373806900e49f24b22b097544d4896b424989b5e1ebac0f07c23f4598",
+			"3612d2e79e3b0785561be14aaca2fccb" },
+		{ "6", "feffe9928665731c6d6a8f9467308308",
+			"9313225df88406e555909c5aff5269aa6a7a9538534f7da1e4c303d2a318a728c3c0c95156809539fcf0e2429a6b525416aedbf5a0de6a57a637b39b",
+			gcm_p60, gcm_aad,
+			"8ce24998625615b603a033aca13fb894be9112a5c3a211a8ba262a3cca7e2ca701e4a9a4fba43c90ccdcb281d48c7c6fd62875d2aca417034c34aee5",
+			"619cc5aefffe0bfa462af43c1699d050" },
+		{ "13", "0000000000000000000000000000000000000000000000000000000000000000", "000000000000000000000000", "", "", "",
+			"530f8afbc74536b9a963b4f1c4cb738b" },
+		{ "14", "0000000000000000000000000000000000000000000000000000000000000000", "000000000000000000000000",
+			"00000000000000000000000000000000", "", "cea7403d4d606b6e074ec5d3baf39d18", "d0d1c8a799996bf0265b98b5d48ab919" },
+		{ "15", "feffe9928665731c6d6a8f9467308308feffe9928665731c6d6a8f9467308308", "cafebabefacedbaddecaf888",
+			"d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a721c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b391aafd255", "",
+			"522dc1f099567d07f47f37a32a84427d643a8cdcbfe5c0c97598a2bd2555d1aa8cb08e48590dbb3da7b08b1056828838c5f61e6393ba7a0abcc9f662898015ad",
+			"b094dac5d93471bdec1a502270e3cc6c" },
+		{ "16", "feffe9928665731c6d6a8f9467308308feffe9928665731c6d6a8f9467308308", "cafebabefacedbaddecaf888", gcm_p60, gcm_aad,
+			"522dc1f099567d07f47f37a32a84427d643a8cdcbfe5c0c97598a2bd2555d1aa8cb08e48590dbb3da7b08b1056828838c5f61e6393ba7a0abcc9f662",
+			"76fc6ece0f4e1768cddf8853bb2d551b" },
+	};
+
+	for (size_t v = 0; v < sizeof(gcm_vectors) / sizeof(gcm_vectors[0]); v++) {
+		unsigned char gcm_key[32], iv[64], plaintext[64], aad[32], expected[64], expected_tag[16];
+		unsigned char enc_keys[AES_MAX_EXPANDED_KEY], result[64], tag[16];
+		int key_len = from_hex(gcm_vectors[v].key, gcm_key);
+		size_t iv_len = from_hex(gcm_vectors[v].iv, iv);
+		size_t len = from_hex(gcm_vectors[v].plaintext, plaintext);
+		size_t aad_len = from_hex(gcm_vectors[v].aad, aad);
+		from_hex(gcm_vectors[v].ciphertext, expected);
+		from_hex(gcm_vectors[v].tag, expected_tag);
+		aes_expand_key_len(gcm_key, key_len, enc_keys);
+
+		// Both the PCLMULQDQ path (where supported) and the portable one
+		for (int portable = 0; portable <= 1; portable++) {
+			struct aes_gcm ctx;
+			aes_gcm_init(&ctx, enc_keys, key_len, iv, iv_len);
+			if (portable)
+				ctx.clmul = false;
+			else if (!ctx.clmul)
+				continue;
+			aes_gcm_aad(&ctx, aad, aad_len);
+			aes_gcm_encrypt(&ctx, plaintext, result, len);
+			aes_gcm_final(&ctx, tag);
+
+			bool ok = (memcmp(result, expected, len) == 0 && memcmp(tag, expected_tag, 16) == 0);
+
+			aes_gcm_init(&ctx, enc_keys, key_len, iv, iv_len);
+			if (portable)
+				ctx.clmul = false;
+			aes_gcm_aad(&ctx, aad, aad_len);
+			aes_gcm_decrypt(&ctx, expected, result, len);
+			aes_gcm_final(&ctx, tag);
+			ok = ok && memcmp(result, plaintext, len) == 0 && memcmp(tag, expected_tag, 16) == 0;
+
+			if (!ok) {
+				fprintf(stderr, "ERROR: GCM test case %s didn't match (%s)\n", gcm_vectors[v].name, portable ? "C" : "PCLMULQDQ");
+				printf("expected tag:"); print_hex(expected_tag, 16);
+				printf("got:"); print_hex(tag, 16);
+			}
+			else {
+				printf("PASS: GCM test case %s (%s)\n", gcm_vectors[v].name, portable ? "C" : "PCLMULQDQ");
+			}
+		}
+	}
+
+	// A longer message through the 8-block kernel, in uneven pieces, against the portable path in one piece;
+	// then a flipped ciphertext bit must make aes_gcm_open fail
+	{
+		#define GCM_LONG (CTR_TEST_BLOCKS * 16 - 5)
+		unsigned char enc_keys[AES_MAX_EXPANDED_KEY], fast[GCM_LONG], portable[GCM_LONG], fast_tag[16], portable_tag[16];
+		const unsigned char iv[12] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12};
+		aes_expand_key_len(key_256, 32, enc_keys);
+
+		struct aes_gcm ctx;
+		aes_gcm_init(&ctx, enc_keys, 32, iv, 12);
+		aes_gcm_aad(&ctx, cbc_plaintext, 48);
+		aes_gcm_aad(&ctx, cbc_plaintext + 48, 7);
+		aes_gcm_encrypt(&ctx, ctr_in, fast, 9*16);
+		aes_gcm_encrypt(&ctx, ctr_in + 9*16, fast + 9*16, 20*16);
+		aes_gcm_encrypt(&ctx, ctr_in + 29*16, fast + 29*16, GCM_LONG - 29*16);
+		aes_gcm_final(&ctx, fast_tag);
+
+		aes_gcm_init(&ctx, enc_keys, 32, iv, 12);
+		ctx.clmul = false;
+		aes_gcm_aad(&ctx, cbc_plaintext, 55);
+		aes_gcm_encrypt(&ctx, ctr_in, portable, GCM_LONG);
+		aes_gcm_final(&ctx, portable_tag);
+
+		if (memcmp(fast, portable, GCM_LONG) != 0 || memcmp(fast_tag, portable_tag, 16) != 0) {
+			fprintf(stderr, "ERROR: GCM streamed encryption didn't match one-shot encryption\n");
+		}
+		else {
+			printf("PASS: GCM streamed encryption (%d bytes)\n", GCM_LONG);
+		}
+
+		unsigned char opened[GCM_LONG];
+		int good = aes_gcm_open(enc_keys, 32, iv, 12, cbc_plaintext, 55, fast, opened, GCM_LONG, fast_tag);
+		bool good_ok = (good == 0 && memcmp(opened, ctr_in, GCM_LONG) == 0);
+		fast[100] ^= 0x04;
+		int bad = aes_gcm_open(enc_keys, 32, iv, 12, cbc_plaintext, 55, fast, opened, GCM_LONG, fast_tag);
+		if (!good_ok || bad != -1) {
+			fprintf(stderr, "ERROR: GCM tag verification\n");
+		}
+		else {
+			printf("PASS: GCM tag verification (genuine and tampered)\n");
+		}
+	}
+
+	printf("\n");
+	printf("---------------------------------------\n");
+	printf("XTS TESTS\n");
+	printf("---------------------------------------\n");
+
+	// IEEE 1619 vectors 2 and 10 (of vector 10, only the first and last 32 bytes are checked), and two short ones
+	// that exercise ciphertext stealing, cross-checked against OpenSSL
+	unsigned char xts_plaintext[512];
+	for (int i = 0; i < 512; i++) {
+		xts_plaintext[i] = i;
+	}
+	const struct {
+		const char *name, *key;
+		uint64_t sector;
+		const unsigned char *plaintext;
+		size_t len;
+		const char *head, *tail; // expected first and last 32 bytes (or fewer, for short sectors)
+	} xts_vectors[] = {
+		{ "vector 2", "1111111111111111111111111111111122222222222222222222222222222222", 0x3333333333,
+			(const unsigned char *)"DDDDDDDDDDDDDDDDDDDDDDDDDDDDDDDD", 32,
+			"c454185e6a16936e39334038acef838bfb186fff7480adc4289382ecd6d394f0", NULL },
+		{ "vector 10", "27182818284590452353602874713526624977572470936999595749669676273141592653589793238462643383279502884197169399375105820974944592", 0xff,
+			xts_plaintext, 512, "1c3b3a102f770386e4836c99e370cf9bea00803f5e482357a4ae12d414a3e63b",
+			"773dad38014bd2092fa755c824bb5e54c4f36ffda9fcea70b9c6e693e148c151" },
+		{ "17 bytes", "fffefdfcfbfaf9f8f7f6f5f4f3f2f1f0bfbebdbcbbbab9b8b7b6b5b4b3b2b1b0", 0x9a78563412,
+			xts_plaintext, 17, "641610679dcbf92e505c41333fb06c2a95", NULL },
+		{ "20 bytes", "fffefdfcfbfaf9f8f7f6f5f4f3f2f1f0bfbebdbcbbbab9b8b7b6b5b4b3b2b1b0", 0x9a78563412,
+			xts_plaintext, 20, "a8ba0048d75084603eb8423a09b7bf7595c871f6", NULL },
+	};
+
+	for (size_t v = 0; v < sizeof(xts_vectors) / sizeof(xts_vectors[0]); v++) {
+		unsigned char xts_key_bytes[64], head[32], tail[32], result[512], decrypted[512];
+		struct aes_xts_key xts;
+		size_t key_len = from_hex(xts_vectors[v].key, xts_key_bytes) / 2;
+		size_t len = xts_vectors[v].len;
+		size_t head_len = from_hex(xts_vectors[v].head, head);
+		aes_xts_init(&xts, xts_key_bytes, key_len);
+
+		aes_xts_encrypt(&xts, xts_vectors[v].sector, xts_vectors[v].plaintext, result, len);
+		bool ok = (memcmp(result, head, head_len) == 0);
+		if (xts_vectors[v].tail) {
+			from_hex(xts_vectors[v].tail, tail);
+			ok = ok && memcmp(result + len - 32, tail, 32) == 0;
+		}
+
+		// Decrypt in place
+		memcpy(decrypted, result, len);
+		aes_xts_decrypt(&xts, xts_vectors[v].sector, decrypted, decrypted, len);
+		ok = ok && memcmp(decrypted, xts_vectors[v].plaintext, len) == 0;
+
+		if (!ok) {
+			fprintf(stderr, "ERROR: XTS %s (XTS-AES-%d) didn't match\n", xts_vectors[v].name, (int)key_len * 8);
+			printf("expected:"); print_hex(head, head_len);
+			printf("got:"); print_hex(result, head_len);
+		}
+		else {
+			printf("PASS: XTS %s (XTS-AES-%d)\n", xts_vectors[v].name, (int)key_len * 8);
+		}
+	}
+
+	// The batch API, through a thread pool, against one sector at a time; 4 KiB sectors and odd-sized ones
+	{
+		struct aes_xts_key xts;
+		aes_xts_init(&xts, xts_plaintext, 32); // bytes 0 ... 63 as the two keys
+		struct ctr_pool *pool = ctr_pool_create(4);
+		size_t sector_sizes[] = { 4096, 528 };
+		for (int s = 0; s < 2; s++) {
+			size_t sector_size = sector_sizes[s], count = 37, total = sector_size * count;
+			unsigned char *plain = malloc(total), *batch = malloc(total), *single = malloc(total);
+			for (size_t i = 0; i < total; i++) {
+				plain[i] = i * 7 + (i >> 8);
+			}
+
+			aes_xts_encrypt_sectors(&xts, pool, 1000, plain, batch, sector_size, count);
+			for (size_t i = 0; i < count; i++) {
+				aes_xts_encrypt(&xts, 1000 + i, plain + i*sector_size, single + i*sector_size, sector_size);
+			}
+			bool ok = (memcmp(batch, single, total) == 0);
+			aes_xts_decrypt_sectors(&xts, pool, 1000, batch, batch, sector_size, count);
+			ok = ok && memcmp(batch, plain, total) == 0;
+
+			if (!ok)
+				fprintf(stderr, "ERROR: XTS batch of %zu %zu-byte sectors\n", count, sector_size);
+			else
+				printf("PASS: XTS batch of %zu %zu-byte sectors\n", count, sector_size);
+			free(plain);
+			free(batch);
+			free(single);
+		}
+		ctr_pool_destroy(pool);
+	}
+
+	printf("\n");
+	printf("---------------------------------------\n");
+	printf("CONTEXT API TESTS\n");
+	printf("---------------------------------------\n");
+
+	{
+		struct aes_ctx ctx;
+		aes_ctx_init(&ctx, key, 16);
+
+		// One call, with a partial last block, against the (already tested) C kernel; then the same in place
+		unsigned char reference[CTR_TEST_BLOCKS * 16];
+		uint64_t ref_counter[2] = {0x0123456789abcdefULL, 1};
+		aes_ctr_c(ctr_in, reference, CTR_TEST_BLOCKS, ref_counter, ctx.enc_keys);
+
+		size_t len = CTR_TEST_BLOCKS * 16 - 9;
+		uint64_t counter[2] = {0x0123456789abcdefULL, 1};
+		unsigned char result[CTR_TEST_BLOCKS * 16];
+		aes_ctx_ctr_xor(&ctx, counter, ctr_in, result, len);
+		bool ok = (memcmp(result, reference, len) == 0 && counter[1] == 1 + CTR_TEST_BLOCKS);
+		counter[1] = 1;
+		memcpy(result, ctr_in, len);
+		aes_ctx_ctr_xor(&ctx, counter, result, result, len);
+		ok = ok && memcmp(result, reference, len) == 0;
+		if (!ok)
+			fprintf(stderr, "ERROR: aes_ctx_ctr_xor didn't match the C CTR kernel\n");
+		else
+			printf("PASS: aes_ctx_ctr_xor (%zu bytes, and in place)\n", len);
+
+		// Streaming in awkward pieces must give the same bytes as one call
+		const size_t pieces[] = { 1, 15, 16, 17, 3, 100, 0, 64 };
+		struct aes_ctr_stream stream;
+		uint64_t start[2] = {0x0123456789abcdefULL, 1}, next[2];
+		aes_ctr_stream_init(&stream, &ctx, start);
+		size_t done = 0;
+		for (size_t i = 0; i < sizeof(pieces) / sizeof(pieces[0]); i++) {
+			aes_ctr_stream_update(&stream, ctr_in + done, result + done, pieces[i]);
+			done += pieces[i];
+		}
+		aes_ctr_stream_update(&stream, ctr_in + done, result + done, len - done);
+		aes_ctr_stream_final(&stream, next);
+		if (memcmp(result, reference, len) != 0 || next[1] != 1 + CTR_TEST_BLOCKS)
+			fprintf(stderr, "ERROR: streamed CTR didn't match one-shot CTR\n");
+		else
+			printf("PASS: aes_ctr_stream_update/final\n");
+
+		// CBC through the context's two key schedules (NIST SP 800-38A again)
+		struct aes_ctx cbc_ctx;
+		unsigned char iv[16];
+		aes_ctx_init(&cbc_ctx, cbc_key_128, 16);
+		memcpy(iv, cbc_iv, 16);
+		aes_ctx_cbc_encrypt(&cbc_ctx, iv, cbc_plaintext, result, 64);
+		ok = (memcmp(result, cbc_ciphertext_128, 64) == 0);
+		memcpy(iv, cbc_iv, 16);
+		aes_ctx_cbc_decrypt(&cbc_ctx, iv, result, result, 64);
+		ok = ok && memcmp(result, cbc_plaintext, 64) == 0;
+		if (!ok)
+			fprintf(stderr, "ERROR: aes_ctx_cbc_encrypt/decrypt\n");
+		else
+			printf("PASS: aes_ctx_cbc_encrypt/decrypt\n");
+
+		// Error codes instead of exits
+		struct aes_ctx bad;
+		aes_ctx_clear(&cbc_ctx);
+		ok = aes_ctx_init(&bad, key, 20) == AES_ERR_KEY_LENGTH &&
+			aes_ctx_init(NULL, key, 16) == AES_ERR_ARGUMENT &&
+			aes_ctx_cbc_encrypt(&ctx, iv, result, result, 17) == AES_ERR_LENGTH &&
+			aes_ctx_ctr_xor(&cbc_ctx, counter, result, result, 16) == AES_ERR_STATE &&
+			aes_ctx_ctr_xor(&ctx, counter, NULL, result, 16) == AES_ERR_ARGUMENT &&
+			aes_ctx_ctr_xor(&ctx, counter, NULL, NULL, 0) == AES_OK;
+		if (!ok)
+			fprintf(stderr, "ERROR: context API error codes\n");
+		else
+			printf("PASS: context API error codes\n");
+		aes_ctx_clear(&ctx);
+	}
+
+	printf("\n");
+	printf("---------------------------------------\n");
+	printf("KEYSTREAM RING TESTS\n");
+	printf("---------------------------------------\n");
+
+	{
+		// Four threads at once against one ring of 256-byte segments; every message must decrypt, and no two may
+		// have been given overlapping counter ranges, whether they came from the ring or missed it
+		#define KEYSTREAM_THREADS 4
+		struct aes_ctx ctx;
+		aes_ctx_init(&ctx, key, 16);
+		uint64_t start[2] = {0x1122334455667788ULL, 1};
+		struct aes_keystream *ks = aes_keystream_create(&ctx, start, 256, 8);
+		usleep(10000);
+
+		static struct keystream_thread threads[KEYSTREAM_THREADS];
+		pthread_t ids[KEYSTREAM_THREADS];
+		for (int i = 0; i < KEYSTREAM_THREADS; i++) {
+			threads[i].ks = ks;
+			threads[i].ctx = &ctx;
+			pthread_create(&ids[i], NULL, keystream_thread, &threads[i]);
+		}
+		bool ok = (ks != NULL);
+		for (int i = 0; i < KEYSTREAM_THREADS; i++) {
+			pthread_join(ids[i], NULL);
+			ok = ok && threads[i].ok;
+		}
+		if (!ok)
+			fprintf(stderr, "ERROR: keystream ring messages didn't decrypt\n");
+		else
+			printf("PASS: keystream ring messages decrypt with aes_ctx_ctr_xor (%d threads)\n", KEYSTREAM_THREADS);
+
+		// Sort the (start, blocks) pairs by start and check that each range ends before the next one begins
+		static uint64_t ranges[KEYSTREAM_THREADS * KEYSTREAM_MESSAGES][2];
+		size_t n = 0;
+		for (int i = 0; i < KEYSTREAM_THREADS; i++) {
+			for (int m = 0; m < KEYSTREAM_MESSAGES; m++) {
+				if (threads[i].blocks[m] == 0)
+					continue; // empty messages use up a segment (or nothing) without any keystream
+				ranges[n][0] = threads[i].starts[m];
+				ranges[n][1] = threads[i].blocks[m];
+				n++;
+			}
+		}
+		qsort(ranges, n, sizeof(ranges[0]), compare_u64);
+		bool disjoint = true;
+		for (size_t i = 1; i < n; i++) {
+			if (ranges[i-1][0] + ranges[i-1][1] > ranges[i][0])
+				disjoint = false;
+		}
+		uint64_t hits = 0, misses = 0;
+		if (ks != NULL)
+			aes_keystream_counts(ks, &hits, &misses);
+		if (!disjoint || hits == 0 || misses == 0)
+			fprintf(stderr, "ERROR: keystream ring counter ranges (%llu hits, %llu misses)\n", (unsigned long long)hits, (unsigned long long)misses);
+		else
+			printf("PASS: keystream ring never reuses a counter (%zu ranges, %llu from the ring, %llu direct)\n",
+					n, (unsigned long long)hits, (unsigned long long)misses);
+
+		uint64_t counter[2];
+		unsigned char buf[16];
+		ok = aes_keystream_xor(ks, NULL, buf, 16, counter) == AES_ERR_ARGUMENT &&
+			aes_keystream_xor(ks, buf, buf, 16, NULL) == AES_ERR_ARGUMENT &&
+			aes_keystream_create(NULL, start, 256, 8) == NULL &&
+			aes_keystream_create(&ctx, start, 0, 8) == NULL;
+		if (!ok)
+			fprintf(stderr, "ERROR: keystream ring argument checks\n");
+		else
+			printf("PASS: keystream ring argument checks\n");
+		aes_keystream_destroy(ks);
+
+		// Four blocks before the block counter wraps: too few for a segment, enough for one 64-byte message
+		uint64_t near_end[2] = {0x1122334455667788ULL, UINT64_MAX - 3};
+		ks = aes_keystream_create(&ctx, near_end, 256, 8);
+		unsigned char msg[64] = {0};
+		ok = ks != NULL && aes_keystream_xor(ks, msg, msg, 64, counter) == AES_OK && counter[1] == UINT64_MAX - 3 &&
+			aes_keystream_xor(ks, msg, msg, 16, counter) == AES_ERR_EXHAUSTED &&
+			aes_keystream_xor(ks, msg, msg, 1, counter) == AES_ERR_EXHAUSTED;
+		if (!ok)
+			fprintf(stderr, "ERROR: keystream ring went past the end of the block counter\n");
+		else
+			printf("PASS: keystream ring stops before the block counter wraps\n");
+		aes_keystream_destroy(ks);
+		aes_ctx_clear(&ctx);
+	}
+
 	printf("AES-NI support: ");
 	if (test_aesni_support()) {
 		printf("Yes\n");
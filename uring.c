@@ -0,0 +1,347 @@
+#include <stdio.h>
+#include <stdlib.h> /* exit */
+#include <string.h> /* memset */
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+#include "arena.h"
+#include "stats.h"
+
+#define URING_CHUNK (1 << 20) // at most 1 MiB per read/write; less for small files
+#define URING_DEPTH 16        // buffers, and thus the max number of reads + writes in flight (fewer for big chunks)
+
+/*
+ * An io_uring backend for encrypt_file/decrypt_file.
+ * Instead of one blocking read() or write() at a time, we keep up to URING_DEPTH large reads and writes in flight,
+ * at fixed offsets, using registered buffers and files (so the kernel doesn't have to look up the file or pin the
+ * pages for every request). The calling thread only ever waits for completions; it runs the crypto callback on each
+ * completed read, in file order, and queues the write without waiting for it.
+ *
+ * liburing isn't a dependency of this program, so the ring is set up by hand with the raw system calls.
+ * If the kernel doesn't have io_uring (or it's disabled), uring_run returns false and the caller falls back
+ * to the regular pipeline.
+ *
+ * The chunks are at most URING_CHUNK, unless the caller needs them bigger (uring_run_framed, where a chunk is a whole
+ * v2 chunk); then there are fewer buffers, so that no more than URING_DEPTH * URING_CHUNK bytes are in flight.
+ */
+
+struct uring {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+	unsigned to_submit;
+};
+
+enum buf_state { BUF_FREE, BUF_READING, BUF_READ, BUF_WRITING };
+
+struct uring_buf {
+	unsigned char *data;
+	unsigned char *out; // where the output starts (framed: anywhere in the buffer)
+	enum buf_state state;
+	size_t len;     // bytes in this chunk (input while reading, output while writing)
+	size_t done;    // bytes read/written so far; requests can complete short
+	off_t offset;   // file offset of data[0]
+	bool final;
+};
+
+static bool uring_setup(struct uring *ring, unsigned entries) {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0)
+		return false;
+
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		close(ring->fd);
+		return false;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	}
+	else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) {
+			munmap(ring->sq_ring, ring->sq_ring_size);
+			close(ring->fd);
+			return false;
+		}
+	}
+
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		if (ring->cq_ring != ring->sq_ring)
+			munmap(ring->cq_ring, ring->cq_ring_size);
+		munmap(ring->sq_ring, ring->sq_ring_size);
+		close(ring->fd);
+		return false;
+	}
+
+	unsigned char *sq = ring->sq_ring, *cq = ring->cq_ring;
+	ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+	ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+	ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+	ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	ring->to_submit = 0;
+
+	return true;
+}
+
+static void uring_teardown(struct uring *ring) {
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+}
+
+static void uring_queue(struct uring *ring, int opcode, int file_index, int buf_index, struct uring_buf *buf) {
+	// Queues a read or write of the unfinished part of buf; nothing is submitted until uring_wait
+	unsigned tail = *ring->sq_tail;
+	unsigned index = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->fd = file_index;
+	sqe->addr = (uint64_t)(uintptr_t)((opcode == IORING_OP_READ_FIXED ? buf->data : buf->out) + buf->done);
+	sqe->len = buf->len - buf->done;
+	sqe->off = buf->offset + buf->done;
+	sqe->buf_index = buf_index;
+	sqe->user_data = buf_index;
+
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->to_submit++;
+}
+
+static void uring_wait(struct uring *ring) {
+	// Submits everything queued so far, and waits for at least one completion
+	for (;;) {
+		int ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret >= 0) {
+			ring->to_submit -= ret;
+			return;
+		}
+		if (errno != EINTR) {
+			perror("io_uring_enter");
+			exit(1);
+		}
+	}
+}
+
+static bool positional_io_ok(int fd) {
+	// Reads and writes at fixed offsets don't work on pipes and sockets
+	struct stat st;
+	return (fstat(fd, &st) == 0 && !S_ISFIFO(st.st_mode) && !S_ISSOCK(st.st_mode));
+}
+
+static bool run(int infd, off_t in_off, size_t in_len, int outfd, off_t out_off, size_t chunk, size_t holdback,
+		const struct pipeline_framing *framing) {
+	if (!positional_io_ok(infd) || !positional_io_ok(outfd))
+		return false;
+
+	int depth = URING_DEPTH;
+	if (chunk > URING_CHUNK)
+		depth = (URING_DEPTH * (size_t)URING_CHUNK / chunk < 2) ? 2 : URING_DEPTH * (size_t)URING_CHUNK / chunk;
+
+	struct uring ring;
+	if (!uring_setup(&ring, depth))
+		return false;
+
+	// One allocation for all the buffers; the tailroom is for the final chunk, which can be up to
+	// holdback bytes larger than the others, and grow when padded.
+	size_t buf_size = framing->headroom + chunk + framing->tailroom;
+	unsigned char *mem = arena_alloc(buf_size * depth);
+
+	struct uring_buf bufs[URING_DEPTH];
+	struct iovec iovecs[URING_DEPTH];
+	for (int i = 0; i < depth; i++) {
+		bufs[i].data = mem + i*buf_size + framing->headroom;
+		bufs[i].state = BUF_FREE;
+		iovecs[i].iov_base = mem + i*buf_size;
+		iovecs[i].iov_len = buf_size;
+	}
+
+	int files[2] = { infd, outfd };
+	if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, iovecs, depth) != 0 ||
+			syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_FILES, files, 2) != 0) {
+		uring_teardown(&ring);
+		arena_free(mem);
+		return false;
+	}
+
+	size_t read_pos = 0;      // how much of the input has been queued for reading
+	off_t write_pos = out_off;
+	unsigned long next_read = 0, next_process = 0, chunks_written = 0;
+	unsigned long num_chunks = 0; // known once the final chunk has been queued
+	bool all_queued = false;
+
+	while (!all_queued || chunks_written < num_chunks) {
+		// Queue reads into every free buffer, in order (chunk n always uses buffer n % depth)
+		while (!all_queued && bufs[next_read % depth].state == BUF_FREE) {
+			struct uring_buf *buf = &bufs[next_read % depth];
+			size_t remaining = in_len - read_pos;
+
+			buf->len = chunk;
+			buf->final = false;
+			if (remaining < chunk + holdback) {
+				// Don't leave a runt behind; the last chunk takes everything that's left
+				buf->len = remaining;
+				buf->final = true;
+			}
+			buf->done = 0;
+			buf->offset = in_off + read_pos;
+			buf->state = BUF_READING;
+			read_pos += buf->len;
+
+			if (buf->len > 0)
+				uring_queue(&ring, IORING_OP_READ_FIXED, 0, next_read % depth, buf);
+			else
+				buf->state = BUF_READ; // empty final chunk; nothing to read
+
+			next_read++;
+			if (buf->final) {
+				all_queued = true;
+				num_chunks = next_read;
+			}
+		}
+
+		// Run the crypto on everything that's ready, in order, and queue the writes
+		while (next_process < next_read && bufs[next_process % depth].state == BUF_READ) {
+			struct uring_buf *buf = &bufs[next_process % depth];
+
+			STATS_START(crypt);
+			size_t len = buf->len;
+			buf->out = buf->data;
+			buf->len = framing->process(framing->arg, buf->data, len, buf->final, &buf->out);
+			STATS_STOP(crypt, STATS_CRYPT, len);
+			buf->done = 0;
+			buf->offset = write_pos;
+			buf->state = BUF_WRITING;
+			write_pos += buf->len;
+
+			if (buf->len > 0) {
+				uring_queue(&ring, IORING_OP_WRITE_FIXED, 1, next_process % depth, buf);
+			}
+			else {
+				buf->state = BUF_FREE;
+				chunks_written++;
+			}
+			next_process++;
+		}
+
+		if (all_queued && chunks_written == num_chunks)
+			break;
+
+		STATS_START(wait);
+		uring_wait(&ring);
+		STATS_STOP(wait, STATS_WAIT, 0);
+
+		// Reap completions
+		unsigned head = *ring.cq_head;
+		unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+			int index = cqe->user_data;
+			struct uring_buf *buf = &bufs[index];
+
+			if (cqe->res < 0) {
+				errno = -cqe->res;
+				perror(buf->state == BUF_READING ? "Read error! Aborting" : "*** Write error");
+				exit(1);
+			}
+			if (cqe->res == 0 && buf->state == BUF_READING) {
+				fprintf(stderr, "Read error! Aborting! (file shrunk while reading?)\n");
+				exit(1);
+			}
+			if (cqe->res == 0) {
+				// A write that makes no progress would only make none again when queued for the rest
+				errno = EIO;
+				perror("*** Write error");
+				exit(1);
+			}
+
+			buf->done += cqe->res;
+			if (buf->done < buf->len) {
+				// Short read/write; queue the rest
+				uring_queue(&ring, buf->state == BUF_READING ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED,
+						buf->state == BUF_READING ? 0 : 1, index, buf);
+			}
+			else if (buf->state == BUF_READING) {
+				buf->state = BUF_READ;
+				STATS_COUNT(STATS_READ, buf->len);
+			}
+			else {
+				buf->state = BUF_FREE;
+				chunks_written++;
+				STATS_COUNT(STATS_WRITE, buf->len);
+			}
+		}
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	uring_teardown(&ring);
+	arena_free(mem);
+
+	return true;
+}
+
+struct unframed {
+	pipeline_func process;
+	void *arg;
+};
+
+static size_t process_unframed(void *arg, unsigned char *buf, size_t len, bool final, unsigned char **out) {
+	(void)out; // stays at buf
+	struct unframed *u = arg;
+	return u->process(u->arg, buf, len, final);
+}
+
+bool uring_run(int infd, off_t in_off, size_t in_len, int outfd, off_t out_off, size_t holdback, pipeline_func process, void *arg) {
+	//
+	// Reads in_len bytes from infd (starting at in_off), runs them through process() in file order, and writes the
+	// output sequentially to outfd, starting at out_off. Same chunk contract as pipeline_run: every chunk but the last
+	// is a multiple of 16 bytes, and the last chunk contains at least the final holdback bytes.
+	// Returns false (having done nothing) if io_uring can't be used.
+	//
+	size_t chunk = arena_chunk_size(in_len);
+	if (chunk > URING_CHUNK)
+		chunk = URING_CHUNK;
+	struct unframed u = { .process = process, .arg = arg };
+	struct pipeline_framing framing = { .headroom = 0, .tailroom = 2*PIPELINE_SLACK, .process = process_unframed, .arg = &u };
+	return run(infd, in_off, in_len, outfd, out_off, chunk, holdback, &framing);
+}
+
+bool uring_run_framed(int infd, off_t in_off, size_t in_len, int outfd, off_t out_off, size_t chunk,
+		const struct pipeline_framing *framing) {
+	return run(infd, in_off, in_len, outfd, out_off, chunk, 0, framing);
+}
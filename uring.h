@@ -0,0 +1,10 @@
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "pipeline.h" /* pipeline_func */
+
+bool uring_run(int infd, off_t in_off, size_t in_len, int outfd, off_t out_off, size_t holdback, pipeline_func process, void *arg);
+// The same with framing (see pipeline_run_framed), in chunks of exactly chunk bytes but for the last
+bool uring_run_framed(int infd, off_t in_off, size_t in_len, int outfd, off_t out_off, size_t chunk,
+		const struct pipeline_framing *framing);
@@ -0,0 +1,81 @@
+#ifndef _V2_H
+#define _V2_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h> /* memcmp */
+#include <sys/types.h> /* off_t */
+
+/*
+ * v2 files (written by bin/ctr by default, and by --batch; --v1 writes the format described in ctr.c) are laid out in
+ * 4 KiB pages, so that every ciphertext block sits at the same offset in the file as in a page-aligned buffer (mmap,
+ * O_DIRECT):
+ * [header, 4096 bytes]  struct v2_header, then zeroes
+ * [chunk 0]
+ * [chunk 1]
+ * ...
+ * [chunk n-1]
+ * [index]               struct v2_chunk for each chunk, the same as in the chunk headers
+ * [footer]              struct v2_footer; always the last 32 bytes of the file
+ *
+ * A chunk is a 4096-byte chunk header (V2_CHUNK_MAGIC, then struct v2_chunk, then zeroes) followed by up to
+ * chunk_size bytes of ciphertext, zero filled to the next page. Every chunk but the last holds exactly chunk_size
+ * bytes, so chunk i starts at 4096 + i * (4096 + chunk_size); the last one has V2_CHUNK_LAST set, and may be empty.
+ * The ciphertext is as long as the plaintext: the last block's unused keystream is simply dropped, so no padding
+ * (and no padding byte) is needed.
+ *
+ * Each chunk carries its own nonce and starting counter. The encrypter uses one nonce per file and counts on from
+ * chunk to chunk, so chunk i starts at counter 1 + i * chunk_size/16, but readers take the values from the chunk.
+ *
+ * A streaming reader goes from chunk header to chunk header until it sees V2_CHUNK_LAST, and then checks the footer;
+ * a reader with random access finds chunk i from the header alone, and its length and counter in the index.
+ * v1 files start with a random nonce instead of V2_MAGIC; the chance of one looking like a v2 file is 2^-64.
+ */
+
+#define V2_MAGIC "AESCTRv2"
+#define V2_CHUNK_MAGIC "AESCHNK2"
+#define V2_INDEX_MAGIC "AESIDXv2"
+#define V2_PAGE 4096
+#define V2_CHUNK_SIZE (4 << 20) // the most a writer uses; smaller files get one chunk of their own size
+#define V2_MAX_CHUNK_SIZE (64 << 20)
+#define V2_CHUNK_LAST 1
+
+struct v2_header {
+	char magic[8];       // V2_MAGIC
+	uint32_t version;    // 2
+	uint32_t key_bits;   // 128, 192 or 256; checked on decryption
+	uint32_t chunk_size; // plaintext bytes per chunk; a multiple of V2_PAGE
+	uint32_t flags;      // none defined yet
+	uint64_t nonce;
+};
+
+struct v2_chunk {
+	uint64_t index;        // chunk number, from 0
+	uint64_t nonce;
+	uint64_t counter_base; // counter of the chunk's first block
+	uint32_t length;       // plaintext (= ciphertext) bytes
+	uint32_t flags;        // V2_CHUNK_LAST
+};
+
+struct v2_footer {
+	char magic[8];         // V2_INDEX_MAGIC
+	uint64_t chunks;
+	uint64_t plain_size;
+	uint64_t index_offset; // where the index starts
+};
+
+static inline off_t v2_chunk_offset(uint32_t chunk_size, uint64_t chunk) {
+	// File offset of a chunk's header; its data is one page further
+	return V2_PAGE + chunk * (V2_PAGE + (off_t)chunk_size);
+}
+
+static inline size_t v2_page_align(size_t len) {
+	return (len + V2_PAGE - 1) & ~(size_t)(V2_PAGE - 1);
+}
+
+static inline bool v2_header_valid(const struct v2_header *header) {
+	return memcmp(header->magic, V2_MAGIC, 8) == 0 && header->version == 2 && header->chunk_size > 0 &&
+		header->chunk_size % V2_PAGE == 0 && header->chunk_size <= V2_MAX_CHUNK_SIZE;
+}
+
+#endif
@@ -0,0 +1,158 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include <immintrin.h>
+
+#include "aes.h"
+
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+/*
+ * CTR kernels for CPUs with VAES: the same AESENC round, applied to every 128-bit lane of a ymm (2 blocks) or
+ * zmm (4 blocks) register. Like aes_ctr_aesni, 8 independent registers go through each round, so a step is 16
+ * (AVX2) or 32 (AVX-512) blocks. Each kernel is compiled for its own instruction set through target attributes,
+ * since the rest of the tree is built for nocona; kernels.c only hands them out after checking cpuid.
+ *
+ * Whatever doesn't fill a whole step is passed on to aes_ctr_aesni (VAES implies AES-NI).
+ */
+
+static const aes_ctr_func aesni_tail[3] = { aes_ctr_aesni, aes_ctr_aesni_192, aes_ctr_aesni_256 };
+
+__attribute__((target("vaes,avx2")))
+static ALWAYS_INLINE void vaes_ctr_avx2(const unsigned char *in, unsigned char *out, size_t blocks, uint64_t *counter, const unsigned char *keys, const int rounds) {
+	__m256i rk[15];
+	#pragma GCC unroll 15
+	for (int i = 0; i <= rounds; i++) {
+		rk[i] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(keys + i*16)));
+	}
+
+	// Lane 0 holds block n, lane 1 block n + 1; the block number is the upper quadword of each lane
+	__m256i ctr = _mm256_add_epi64(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)counter)), _mm256_set_epi64x(1, 0, 0, 0));
+	const __m256i two = _mm256_set_epi64x(2, 0, 2, 0);
+	const __m256i sixteen = _mm256_set_epi64x(16, 0, 16, 0);
+
+	size_t i = 0;
+	for (; i + 16 <= blocks; i += 16) {
+		__m256i b[8];
+		b[0] = ctr;
+		#pragma GCC unroll 7
+		for (int j = 1; j < 8; j++) {
+			b[j] = _mm256_add_epi64(b[j-1], two);
+		}
+		ctr = _mm256_add_epi64(ctr, sixteen);
+
+		#pragma GCC unroll 8
+		for (int j = 0; j < 8; j++) {
+			b[j] = _mm256_xor_si256(b[j], rk[0]);
+		}
+		#pragma GCC unroll 14
+		for (int round = 1; round < rounds; round++) {
+			#pragma GCC unroll 8
+			for (int j = 0; j < 8; j++) {
+				b[j] = _mm256_aesenc_epi128(b[j], rk[round]);
+			}
+		}
+
+		const __m256i *src = (const __m256i *)(in + i*16);
+		__m256i *dst = (__m256i *)(out + i*16);
+		#pragma GCC unroll 8
+		for (int j = 0; j < 8; j++) {
+			b[j] = _mm256_aesenclast_epi128(b[j], rk[rounds]);
+			_mm256_storeu_si256(dst + j, _mm256_xor_si256(b[j], _mm256_loadu_si256(src + j)));
+		}
+	}
+
+	counter[1] += i;
+	if (i < blocks)
+		aesni_tail[(rounds - 10) / 2](in + i*16, out + i*16, blocks - i, counter, keys);
+}
+
+__attribute__((target("vaes,avx512f")))
+static ALWAYS_INLINE void vaes_ctr_avx512(const unsigned char *in, unsigned char *out, size_t blocks, uint64_t *counter, const unsigned char *keys, const int rounds) {
+	__m512i rk[15];
+	#pragma GCC unroll 15
+	for (int i = 0; i <= rounds; i++) {
+		rk[i] = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)(keys + i*16)));
+	}
+
+	// Lanes 0-3 hold blocks n to n + 3
+	__m512i ctr = _mm512_add_epi64(_mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)counter)),
+			_mm512_set_epi64(3, 0, 2, 0, 1, 0, 0, 0));
+	const __m512i four = _mm512_set_epi64(4, 0, 4, 0, 4, 0, 4, 0);
+	const __m512i thirty_two = _mm512_set_epi64(32, 0, 32, 0, 32, 0, 32, 0);
+
+	size_t i = 0;
+	for (; i + 32 <= blocks; i += 32) {
+		__m512i b[8];
+		b[0] = ctr;
+		#pragma GCC unroll 7
+		for (int j = 1; j < 8; j++) {
+			b[j] = _mm512_add_epi64(b[j-1], four);
+		}
+		ctr = _mm512_add_epi64(ctr, thirty_two);
+
+		#pragma GCC unroll 8
+		for (int j = 0; j < 8; j++) {
+			b[j] = _mm512_xor_si512(b[j], rk[0]);
+		}
+		#pragma GCC unroll 14
+		for (int round = 1; round < rounds; round++) {
+			#pragma GCC unroll 8
+			for (int j = 0; j < 8; j++) {
+				b[j] = _mm512_aesenc_epi128(b[j], rk[round]);
+			}
+		}
+
+		#pragma GCC unroll 8
+		for (int j = 0; j < 8; j++) {
+			b[j] = _mm512_aesenclast_epi128(b[j], rk[rounds]);
+			_mm512_storeu_si512(out + i*16 + j*64, _mm512_xor_si512(b[j], _mm512_loadu_si512(in + i*16 + j*64)));
+		}
+	}
+
+	// Then 4 blocks at a time, which is still one zmm AESENC per round
+	for (; i + 4 <= blocks; i += 4) {
+		__m512i b0 = _mm512_xor_si512(ctr, rk[0]);
+		ctr = _mm512_add_epi64(ctr, four);
+		#pragma GCC unroll 14
+		for (int round = 1; round < rounds; round++) {
+			b0 = _mm512_aesenc_epi128(b0, rk[round]);
+		}
+		b0 = _mm512_aesenclast_epi128(b0, rk[rounds]);
+		_mm512_storeu_si512(out + i*16, _mm512_xor_si512(b0, _mm512_loadu_si512(in + i*16)));
+	}
+
+	counter[1] += i;
+	if (i < blocks)
+		aesni_tail[(rounds - 10) / 2](in + i*16, out + i*16, blocks - i, counter, keys);
+}
+
+__attribute__((target("vaes,avx2")))
+void aes_ctr_vaes_avx2(const unsigned char *in, unsigned char *out, size_t blocks, uint64_t *counter, const unsigned char *keys) {
+	vaes_ctr_avx2(in, out, blocks, counter, keys, 10);
+}
+
+__attribute__((target("vaes,avx2")))
+void aes_ctr_vaes_avx2_192(const unsigned char *in, unsigned char *out, size_t blocks, uint64_t *counter, const unsigned char *keys) {
+	vaes_ctr_avx2(in, out, blocks, counter, keys, 12);
+}
+
+__attribute__((target("vaes,avx2")))
+void aes_ctr_vaes_avx2_256(const unsigned char *in, unsigned char *out, size_t blocks, uint64_t *counter, const unsigned char *keys) {
+	vaes_ctr_avx2(in, out, blocks, counter, keys, 14);
+}
+
+__attribute__((target("vaes,avx512f")))
+void aes_ctr_vaes_avx512(const unsigned char *in, unsigned char *out, size_t blocks, uint64_t *counter, const unsigned char *keys) {
+	vaes_ctr_avx512(in, out, blocks, counter, keys, 10);
+}
+
+__attribute__((target("vaes,avx512f")))
+void aes_ctr_vaes_avx512_192(const unsigned char *in, unsigned char *out, size_t blocks, uint64_t *counter, const unsigned char *keys) {
+	vaes_ctr_avx512(in, out, blocks, counter, keys, 12);
+}
+
+__attribute__((target("vaes,avx512f")))
+void aes_ctr_vaes_avx512_256(const unsigned char *in, unsigned char *out, size_t blocks, uint64_t *counter, const unsigned char *keys) {
+	vaes_ctr_avx512(in, out, blocks, counter, keys, 14);
+}
@@ -0,0 +1,222 @@
+#include <stdint.h>
+#include <string.h> /* memcpy */
+
+#include <emmintrin.h>
+#include <tmmintrin.h> /* SSSE3: pshufb */
+
+#include "tables.h"
+#include "aes.h"
+
+/*
+ * Table-free single-block AES using SSSE3 vector permutes, for CPUs without AES-NI.
+ *
+ * The C implementation in aes.c looks up every state byte in sbox/invsbox, and MixColumns goes through
+ * the gmul tables (6 KiB in all), one byte at a time. Here the whole state lives in one xmm register:
+ *
+ * - SubBytes splits each byte into nibbles; PSHUFB looks up all 16 low nibbles in one 16-byte row of the S-box
+ *   at a time, and a saturating add turns every byte whose high nibble doesn't match the row into a "zero" index.
+ *   All 16 rows are always used, in the same order, so the memory access pattern is independent of the data.
+ * - ShiftRows is a single byte shuffle.
+ * - MixColumns is byte rotations within each column, plus a SIMD xtime (multiplication by 2 in GF(2^8)).
+ *
+ * The same pieces give decryption and key expansion. The round key layout is the same as aes_expand_key's,
+ * so these are drop-in replacements for aes_encrypt_c, aes_decrypt_c and aes_expand_key_c.
+ * (Encryption and decryption come in one unrolled version per key size.)
+ */
+
+#define VPERM __attribute__((target("ssse3")))
+
+VPERM static inline __m128i vperm_lookup(__m128i x, const unsigned char *table) {
+	// Returns table[x] for each byte of x, where table is 256 bytes
+	const __m128i low_mask = _mm_set1_epi8(0x0f);
+	const __m128i row_step = _mm_set1_epi8(0x10);
+	const __m128i saturate = _mm_set1_epi8(0x70);
+
+	__m128i lo = _mm_and_si128(x, low_mask);
+	__m128i hi = _mm_and_si128(x, _mm_set1_epi8((char)0xf0)); // minus row*16 below; zero when row == high nibble
+	__m128i result = _mm_setzero_si128();
+
+	for (int row = 0; row < 16; row++) {
+		// Bytes whose (remaining) high nibble is nonzero get bit 7 set by the saturating add,
+		// which makes PSHUFB return 0 for them.
+		__m128i index = _mm_or_si128(lo, _mm_adds_epu8(hi, saturate));
+		__m128i t = _mm_loadu_si128((const __m128i *)(table + row*16));
+		result = _mm_xor_si128(result, _mm_shuffle_epi8(t, index));
+		hi = _mm_sub_epi8(hi, row_step);
+	}
+
+	return result;
+}
+
+VPERM static inline __m128i vperm_xtime(__m128i x) {
+	// Multiplication by 2 in GF(2^8): shift left, and reduce by 0x1b where the top bit was set
+	__m128i top = _mm_cmplt_epi8(x, _mm_setzero_si128());
+	return _mm_xor_si128(_mm_add_epi8(x, x), _mm_and_si128(top, _mm_set1_epi8(0x1b)));
+}
+
+VPERM static inline __m128i vperm_shift_rows(__m128i x) {
+	// Byte 4*col + row comes from column (col + row) % 4
+	return _mm_shuffle_epi8(x, _mm_setr_epi8(0, 5, 10, 15, 4, 9, 14, 3, 8, 13, 2, 7, 12, 1, 6, 11));
+}
+
+VPERM static inline __m128i vperm_inv_shift_rows(__m128i x) {
+	return _mm_shuffle_epi8(x, _mm_setr_epi8(0, 13, 10, 7, 4, 1, 14, 11, 8, 5, 2, 15, 12, 9, 6, 3));
+}
+
+VPERM static inline __m128i vperm_mix_columns(__m128i x) {
+	// r[i] = 2a[i] ^ 3a[i+1] ^ a[i+2] ^ a[i+3] (indices within the column, mod 4)
+	//      = 2(a[i] ^ a[i+1]) ^ a[i+1] ^ a[i+2] ^ a[i+3]
+	__m128i rot1 = _mm_shuffle_epi8(x, _mm_setr_epi8(1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12));
+	__m128i rot2 = _mm_shuffle_epi8(x, _mm_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13));
+	__m128i rot3 = _mm_shuffle_epi8(x, _mm_setr_epi8(3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14));
+
+	return _mm_xor_si128(vperm_xtime(_mm_xor_si128(x, rot1)), _mm_xor_si128(rot1, _mm_xor_si128(rot2, rot3)));
+}
+
+VPERM static inline __m128i vperm_inv_mix_columns(__m128i x) {
+	// InvMixColumns = MixColumns after adding 4(a[i] ^ a[i+2]) to every byte
+	__m128i rot2 = _mm_shuffle_epi8(x, _mm_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13));
+	__m128i t = vperm_xtime(vperm_xtime(_mm_xor_si128(x, rot2)));
+
+	return vperm_mix_columns(_mm_xor_si128(x, t));
+}
+
+VPERM static inline __attribute__((always_inline)) void vperm_encrypt(const unsigned char *plaintext, unsigned char *ciphertext, const unsigned char *keys, const int rounds) {
+	__m128i state = _mm_loadu_si128((const __m128i *)plaintext);
+	state = _mm_xor_si128(state, _mm_loadu_si128((const __m128i *)keys));
+
+	#pragma GCC unroll 14
+	for (int round = 1; round < rounds; round++) {
+		state = vperm_lookup(state, sbox);
+		state = vperm_shift_rows(state);
+		state = vperm_mix_columns(state);
+		state = _mm_xor_si128(state, _mm_loadu_si128((const __m128i *)(keys + round*16)));
+	}
+
+	state = vperm_lookup(state, sbox);
+	state = vperm_shift_rows(state);
+	state = _mm_xor_si128(state, _mm_loadu_si128((const __m128i *)(keys + rounds*16)));
+
+	_mm_storeu_si128((__m128i *)ciphertext, state);
+}
+
+VPERM static inline __attribute__((always_inline)) void vperm_decrypt(const unsigned char *ciphertext, unsigned char *plaintext, const unsigned char *keys, const int rounds) {
+	// The Equivalent Inverse Cipher, like aes_decrypt_c; keys must have been through aes_prepare_decryption_keys_len
+	__m128i state = _mm_loadu_si128((const __m128i *)ciphertext);
+	state = _mm_xor_si128(state, _mm_loadu_si128((const __m128i *)(keys + rounds*16)));
+
+	#pragma GCC unroll 14
+	for (int round = rounds - 1; round >= 1; round--) {
+		state = vperm_lookup(state, invsbox);
+		state = vperm_inv_shift_rows(state);
+		state = vperm_inv_mix_columns(state);
+		state = _mm_xor_si128(state, _mm_loadu_si128((const __m128i *)(keys + round*16)));
+	}
+
+	state = vperm_lookup(state, invsbox);
+	state = vperm_inv_shift_rows(state);
+	state = _mm_xor_si128(state, _mm_loadu_si128((const __m128i *)keys));
+
+	_mm_storeu_si128((__m128i *)plaintext, state);
+}
+
+VPERM void aes_encrypt_vperm(const unsigned char *plaintext, unsigned char *ciphertext, const unsigned char *keys) {
+	vperm_encrypt(plaintext, ciphertext, keys, 10);
+}
+
+VPERM void aes_encrypt_vperm_192(const unsigned char *plaintext, unsigned char *ciphertext, const unsigned char *keys) {
+	vperm_encrypt(plaintext, ciphertext, keys, 12);
+}
+
+VPERM void aes_encrypt_vperm_256(const unsigned char *plaintext, unsigned char *ciphertext, const unsigned char *keys) {
+	vperm_encrypt(plaintext, ciphertext, keys, 14);
+}
+
+VPERM void aes_decrypt_vperm(const unsigned char *ciphertext, unsigned char *plaintext, const unsigned char *keys) {
+	vperm_decrypt(ciphertext, plaintext, keys, 10);
+}
+
+VPERM void aes_decrypt_vperm_192(const unsigned char *ciphertext, unsigned char *plaintext, const unsigned char *keys) {
+	vperm_decrypt(ciphertext, plaintext, keys, 12);
+}
+
+VPERM void aes_decrypt_vperm_256(const unsigned char *ciphertext, unsigned char *plaintext, const unsigned char *keys) {
+	vperm_decrypt(ciphertext, plaintext, keys, 14);
+}
+
+VPERM void aes_inv_mix_columns_vperm(unsigned char *state) {
+	// InvMixColumns on a single 16-byte round key, for aes_prepare_decryption_keys
+	__m128i x = _mm_loadu_si128((const __m128i *)state);
+	_mm_storeu_si128((__m128i *)state, vperm_inv_mix_columns(x));
+}
+
+VPERM static inline __m128i vperm_prefix_xor(__m128i key) {
+	// Each word becomes the XOR of itself and all the words before it
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	return _mm_xor_si128(key, _mm_slli_si128(key, 8));
+}
+
+// RotWord on the last word of a round key, or just the last word, broadcast to all four words
+#define ROT_LAST_WORD _mm_setr_epi8(13, 14, 15, 12, 13, 14, 15, 12, 13, 14, 15, 12, 13, 14, 15, 12)
+#define LAST_WORD _mm_setr_epi8(12, 13, 14, 15, 12, 13, 14, 15, 12, 13, 14, 15, 12, 13, 14, 15)
+
+VPERM static void vperm_expand_128(const unsigned char *in_key, unsigned char *out_keys) {
+	__m128i key = _mm_loadu_si128((const __m128i *)in_key);
+	_mm_storeu_si128((__m128i *)out_keys, key);
+
+	for (int round = 1; round <= 10; round++) {
+		__m128i t = vperm_lookup(_mm_shuffle_epi8(key, ROT_LAST_WORD), sbox);
+		t = _mm_xor_si128(t, _mm_set1_epi32(Rcon[round]));
+		key = _mm_xor_si128(vperm_prefix_xor(key), t);
+		_mm_storeu_si128((__m128i *)(out_keys + round*16), key);
+	}
+}
+
+VPERM static void vperm_expand_192(const unsigned char *in_key, unsigned char *out_keys) {
+	// Six words per step don't line up with the 16-byte round keys, so this one goes a word at a time,
+	// with only SubWord done in a register (once per six words)
+	uint32_t w[52];
+	memcpy(w, in_key, 24);
+
+	for (int i = 6; i < 52; i++) {
+		uint32_t t = w[i-1];
+		if (i % 6 == 0) {
+			t = (t >> 8) | (t << 24); // RotWord, on a little-endian word
+			t = (uint32_t)_mm_cvtsi128_si32(vperm_lookup(_mm_cvtsi32_si128((int)t), sbox)) ^ Rcon[i / 6];
+		}
+		w[i] = w[i-6] ^ t;
+	}
+
+	memcpy(out_keys, w, sizeof(w));
+}
+
+VPERM static void vperm_expand_256(const unsigned char *in_key, unsigned char *out_keys) {
+	// Even round keys get RotWord/SubWord/Rcon from the previous key's last word; odd ones only SubWord
+	__m128i even = _mm_loadu_si128((const __m128i *)in_key);
+	__m128i odd = _mm_loadu_si128((const __m128i *)(in_key + 16));
+	_mm_storeu_si128((__m128i *)out_keys, even);
+	_mm_storeu_si128((__m128i *)(out_keys + 16), odd);
+
+	for (int round = 1; round <= 7; round++) {
+		__m128i t = vperm_lookup(_mm_shuffle_epi8(odd, ROT_LAST_WORD), sbox);
+		t = _mm_xor_si128(t, _mm_set1_epi32(Rcon[round]));
+		even = _mm_xor_si128(vperm_prefix_xor(even), t);
+		_mm_storeu_si128((__m128i *)(out_keys + 2*round*16), even);
+		if (round == 7)
+			break;
+
+		t = vperm_lookup(_mm_shuffle_epi8(even, LAST_WORD), sbox);
+		odd = _mm_xor_si128(vperm_prefix_xor(odd), t);
+		_mm_storeu_si128((__m128i *)(out_keys + (2*round + 1)*16), odd);
+	}
+}
+
+VPERM int aes_expand_key_vperm(const unsigned char *in_key, int key_len, unsigned char *out_keys) {
+	// Same output as aes_expand_key_c; the caller must make sure the CPU supports SSSE3
+	switch (key_len) {
+		case 16: vperm_expand_128(in_key, out_keys); return 0;
+		case 24: vperm_expand_192(in_key, out_keys); return 0;
+		case 32: vperm_expand_256(in_key, out_keys); return 0;
+		default: return -1;
+	}
+}
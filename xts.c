@@ -0,0 +1,301 @@
+#include <stdio.h>
+#include <string.h> /* memcpy */
+#include <stdbool.h>
+#include <wmmintrin.h> /* AES-NI intrinsics */
+
+#include "xts.h"
+#include "aes.h"
+#include "keyschedule.h" /* aes_rounds, aes_expand_keys */
+#include "misc.h" /* test_aesni_support */
+
+//
+// XTS-AES (IEEE 1619). Block j of a sector is encrypted as E1(P ^ T_j) ^ T_j, where T_0 = E2(sector number) and
+// T_j+1 = T_j * x in GF(2^128). Unlike CBC, nothing depends on the previous block's output, so (as in CTR) the
+// kernel runs 8 blocks through AESENC/AESDEC side by side. The doubling is a 64-bit shift of both halves plus the
+// two carries, which stays in SSE registers; it only depends on the previous tweak, so the 8 tweaks for the
+// next group are ready long before the AES rounds for this one are done.
+//
+// A sector whose length isn't a multiple of 16 uses ciphertext stealing for the last two blocks.
+//
+
+#define AESNI __attribute__((target("aes")))
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+typedef void (*xts_kernel)(const unsigned char *in, unsigned char *out, size_t blocks, unsigned char *tweak, const unsigned char *keys);
+
+static void double_tweak(unsigned char *tweak) {
+	// Multiply by x; the tweak is little-endian, so the bit that falls off the top of byte 15 becomes 0x87 in byte 0
+	unsigned char carry = tweak[15] >> 7;
+	for (int i = 15; i > 0; i--) {
+		tweak[i] = (tweak[i] << 1) | (tweak[i-1] >> 7);
+	}
+	tweak[0] = (tweak[0] << 1) ^ (carry * 0x87);
+}
+
+AESNI static ALWAYS_INLINE __m128i xts_double(__m128i t) {
+	// Same as double_tweak. _mm_add_epi64 shifts each half left by one; the sign bits of dwords 1 and 3 (the bits
+	// shifted out of each half) are moved to dwords 2 and 0, masked to 1 and 0x87, and XORed back in.
+	__m128i carries = _mm_shuffle_epi32(_mm_srai_epi32(t, 31), 0x13);
+	carries = _mm_and_si128(carries, _mm_set_epi32(0, 1, 0, 0x87));
+	return _mm_xor_si128(_mm_add_epi64(t, t), carries);
+}
+
+AESNI static ALWAYS_INLINE void aesni_xts(const unsigned char *in, unsigned char *out, size_t blocks, unsigned char *tweak, const unsigned char *keys,
+		const int rounds, const bool decrypt) {
+	// keys are decryption keys (aes_prepare_decryption_keys_len) if decrypt is set, and used back to front
+	__m128i rk[15];
+	#pragma GCC unroll 15
+	for (int i = 0; i <= rounds; i++) {
+		rk[i] = _mm_loadu_si128((const __m128i *)(keys + (decrypt ? rounds - i : i)*16));
+	}
+
+	__m128i t = _mm_loadu_si128((const __m128i *)tweak);
+	size_t i = 0;
+	for (; i + 8 <= blocks; i += 8) {
+		__m128i tw[8], b[8];
+		#pragma GCC unroll 8
+		for (int j = 0; j < 8; j++) {
+			tw[j] = t;
+			t = xts_double(t);
+			b[j] = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(in + (i+j)*16)), _mm_xor_si128(tw[j], rk[0]));
+		}
+		#pragma GCC unroll 14
+		for (int round = 1; round < rounds; round++) {
+			#pragma GCC unroll 8
+			for (int j = 0; j < 8; j++) {
+				b[j] = decrypt ? _mm_aesdec_si128(b[j], rk[round]) : _mm_aesenc_si128(b[j], rk[round]);
+			}
+		}
+		#pragma GCC unroll 8
+		for (int j = 0; j < 8; j++) {
+			b[j] = decrypt ? _mm_aesdeclast_si128(b[j], rk[rounds]) : _mm_aesenclast_si128(b[j], rk[rounds]);
+			_mm_storeu_si128((__m128i *)(out + (i+j)*16), _mm_xor_si128(b[j], tw[j]));
+		}
+	}
+
+	for (; i < blocks; i++) {
+		__m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(in + i*16)), _mm_xor_si128(t, rk[0]));
+		#pragma GCC unroll 14
+		for (int round = 1; round < rounds; round++) {
+			b = decrypt ? _mm_aesdec_si128(b, rk[round]) : _mm_aesenc_si128(b, rk[round]);
+		}
+		b = decrypt ? _mm_aesdeclast_si128(b, rk[rounds]) : _mm_aesenclast_si128(b, rk[rounds]);
+		_mm_storeu_si128((__m128i *)(out + i*16), _mm_xor_si128(b, t));
+		t = xts_double(t);
+	}
+	_mm_storeu_si128((__m128i *)tweak, t);
+}
+
+AESNI static ALWAYS_INLINE void aesni_encrypt_tweaks(uint64_t first_sector, size_t count, unsigned char (*tweaks)[16], const unsigned char *keys, const int rounds) {
+	// T_0 for up to 8 consecutive sectors at once. One at a time, each would be a full AES latency chain
+	// in front of its sector, which is a good part of the time for a 512-byte sector.
+	__m128i b[8];
+	#pragma GCC unroll 8
+	for (int j = 0; j < 8; j++) {
+		b[j] = _mm_xor_si128(_mm_set_epi64x(0, first_sector + j), _mm_loadu_si128((const __m128i *)keys));
+	}
+	#pragma GCC unroll 14
+	for (int round = 1; round < rounds; round++) {
+		__m128i rk = _mm_loadu_si128((const __m128i *)(keys + round*16));
+		#pragma GCC unroll 8
+		for (int j = 0; j < 8; j++) {
+			b[j] = _mm_aesenc_si128(b[j], rk);
+		}
+	}
+	__m128i rk = _mm_loadu_si128((const __m128i *)(keys + rounds*16));
+	for (size_t j = 0; j < count; j++) {
+		_mm_storeu_si128((__m128i *)tweaks[j], _mm_aesenclast_si128(b[j], rk));
+	}
+}
+
+AESNI static void aesni_xts_encrypt_128(const unsigned char *in, unsigned char *out, size_t blocks, unsigned char *tweak, const unsigned char *keys) {
+	aesni_xts(in, out, blocks, tweak, keys, 10, false);
+}
+
+AESNI static void aesni_xts_encrypt_192(const unsigned char *in, unsigned char *out, size_t blocks, unsigned char *tweak, const unsigned char *keys) {
+	aesni_xts(in, out, blocks, tweak, keys, 12, false);
+}
+
+AESNI static void aesni_xts_encrypt_256(const unsigned char *in, unsigned char *out, size_t blocks, unsigned char *tweak, const unsigned char *keys) {
+	aesni_xts(in, out, blocks, tweak, keys, 14, false);
+}
+
+AESNI static void aesni_xts_decrypt_128(const unsigned char *in, unsigned char *out, size_t blocks, unsigned char *tweak, const unsigned char *keys) {
+	aesni_xts(in, out, blocks, tweak, keys, 10, true);
+}
+
+AESNI static void aesni_xts_decrypt_192(const unsigned char *in, unsigned char *out, size_t blocks, unsigned char *tweak, const unsigned char *keys) {
+	aesni_xts(in, out, blocks, tweak, keys, 12, true);
+}
+
+AESNI static void aesni_xts_decrypt_256(const unsigned char *in, unsigned char *out, size_t blocks, unsigned char *tweak, const unsigned char *keys) {
+	aesni_xts(in, out, blocks, tweak, keys, 14, true);
+}
+
+AESNI static void aesni_encrypt_tweaks_128(uint64_t first_sector, size_t count, unsigned char (*tweaks)[16], const unsigned char *keys) {
+	aesni_encrypt_tweaks(first_sector, count, tweaks, keys, 10);
+}
+
+AESNI static void aesni_encrypt_tweaks_192(uint64_t first_sector, size_t count, unsigned char (*tweaks)[16], const unsigned char *keys) {
+	aesni_encrypt_tweaks(first_sector, count, tweaks, keys, 12);
+}
+
+AESNI static void aesni_encrypt_tweaks_256(uint64_t first_sector, size_t count, unsigned char (*tweaks)[16], const unsigned char *keys) {
+	aesni_encrypt_tweaks(first_sector, count, tweaks, keys, 14);
+}
+
+static void xts_blocks(const struct aes_xts_key *xts, bool decrypt, const unsigned char *in, unsigned char *out, size_t blocks, unsigned char *tweak) {
+	// Whole blocks; tweak is advanced past them
+	if (test_aesni_support()) {
+		static const xts_kernel kernels[2][3] = {
+			{ aesni_xts_encrypt_128, aesni_xts_encrypt_192, aesni_xts_encrypt_256 },
+			{ aesni_xts_decrypt_128, aesni_xts_decrypt_192, aesni_xts_decrypt_256 },
+		};
+		kernels[decrypt][(xts->key_len - 16) / 8](in, out, blocks, tweak, decrypt ? xts->data_dec_keys : xts->data_keys);
+		return;
+	}
+
+	aes_block_func crypt = decrypt ? aes_select_decrypt(xts->key_len) : aes_select_encrypt(xts->key_len);
+	for (size_t i = 0; i < blocks; i++) {
+		unsigned char block[16], result[16];
+		for (int j = 0; j < 16; j++) {
+			block[j] = in[i*16 + j] ^ tweak[j];
+		}
+		crypt(block, result, decrypt ? xts->data_dec_keys : xts->data_keys);
+		for (int j = 0; j < 16; j++) {
+			out[i*16 + j] = result[j] ^ tweak[j];
+		}
+		double_tweak(tweak);
+	}
+}
+
+static void encrypt_tweaks(const struct aes_xts_key *xts, uint64_t first_sector, size_t count, unsigned char (*tweaks)[16]) {
+	// T_0 for count (at most 8) consecutive sectors: the sector number as a 128-bit little-endian value, encrypted with key 2
+	if (test_aesni_support()) {
+		static void (*const kernels[3])(uint64_t, size_t, unsigned char (*)[16], const unsigned char *) = {
+			aesni_encrypt_tweaks_128, aesni_encrypt_tweaks_192, aesni_encrypt_tweaks_256
+		};
+		kernels[(xts->key_len - 16) / 8](first_sector, count, tweaks, xts->tweak_keys);
+		return;
+	}
+
+	aes_block_func encrypt = aes_select_encrypt(xts->key_len);
+	for (size_t j = 0; j < count; j++) {
+		unsigned char block[16] = {0};
+		uint64_t sector = first_sector + j;
+		for (int k = 0; k < 8; k++) {
+			block[k] = sector >> (8*k);
+		}
+		encrypt(block, tweaks[j], xts->tweak_keys);
+	}
+}
+
+static void xts_sector(const struct aes_xts_key *xts, bool decrypt, unsigned char *tweak, const unsigned char *in, unsigned char *out, size_t len) {
+	// One sector, len >= 16, starting from its encrypted tweak (which is clobbered)
+	size_t blocks = len / 16, partial = len % 16;
+	if (partial == 0) {
+		xts_blocks(xts, decrypt, in, out, blocks, tweak);
+		return;
+	}
+
+	// Ciphertext stealing: everything up to the last whole block as usual; then the last whole block and the partial
+	// one are swapped around, with the partial block padded out by the tail of the other one's ciphertext.
+	// Decryption needs the two tweaks in the opposite order. in == out has to keep working, so the partial
+	// input block is copied out before anything is written over it.
+	unsigned char last_in[16], stolen[16];
+	xts_blocks(xts, decrypt, in, out, blocks - 1, tweak);
+	in += (blocks - 1) * 16;
+	out += (blocks - 1) * 16;
+	memcpy(last_in, in + 16, partial);
+
+	unsigned char first_tweak[16];
+	memcpy(first_tweak, tweak, 16);
+	if (decrypt)
+		double_tweak(tweak);
+
+	xts_blocks(xts, decrypt, in, stolen, 1, tweak);
+	memcpy(out + 16, stolen, partial);
+	memcpy(stolen, last_in, partial);
+	xts_blocks(xts, decrypt, stolen, out, 1, decrypt ? first_tweak : tweak);
+}
+
+int aes_xts_init(struct aes_xts_key *xts, const unsigned char *key, int key_len) {
+	if (aes_rounds(key_len) < 0)
+		return -1;
+
+	xts->key_len = key_len;
+	aes_expand_keys(key, key_len, 1, xts->data_keys, xts->data_dec_keys);
+	aes_expand_key_len(key + key_len, key_len, xts->tweak_keys);
+	return 0;
+}
+
+int aes_xts_encrypt(const struct aes_xts_key *xts, uint64_t sector, const unsigned char *in, unsigned char *out, size_t len) {
+	if (len < 16)
+		return -1;
+
+	unsigned char tweak[1][16];
+	encrypt_tweaks(xts, sector, 1, tweak);
+	xts_sector(xts, false, tweak[0], in, out, len);
+	return 0;
+}
+
+int aes_xts_decrypt(const struct aes_xts_key *xts, uint64_t sector, const unsigned char *in, unsigned char *out, size_t len) {
+	if (len < 16)
+		return -1;
+
+	unsigned char tweak[1][16];
+	encrypt_tweaks(xts, sector, 1, tweak);
+	xts_sector(xts, true, tweak[0], in, out, len);
+	return 0;
+}
+
+struct xts_batch {
+	const struct aes_xts_key *xts;
+	bool decrypt;
+	uint64_t first_sector;
+	const unsigned char *in;
+	unsigned char *out;
+	size_t sector_size, count;
+};
+
+static void xts_batch_job(void *arg, int index, int nthreads) {
+	// Thread index takes a contiguous run of sectors, and goes through it 8 sectors (and tweaks) at a time
+	struct xts_batch *b = arg;
+	size_t first = b->count * index / nthreads, end = b->count * (index + 1) / nthreads;
+
+	for (size_t s = first; s < end; s += 8) {
+		size_t n = (end - s < 8) ? end - s : 8;
+		unsigned char tweaks[8][16];
+		encrypt_tweaks(b->xts, b->first_sector + s, n, tweaks);
+		for (size_t j = 0; j < n; j++) {
+			size_t offset = (s + j) * b->sector_size;
+			xts_sector(b->xts, b->decrypt, tweaks[j], b->in + offset, b->out + offset, b->sector_size);
+		}
+	}
+}
+
+static int xts_batch_run(const struct aes_xts_key *xts, struct ctr_pool *pool, bool decrypt, uint64_t first_sector,
+		const unsigned char *in, unsigned char *out, size_t sector_size, size_t count) {
+	if (sector_size < 16)
+		return -1;
+
+	struct xts_batch batch = { .xts = xts, .decrypt = decrypt, .first_sector = first_sector, .in = in, .out = out,
+		.sector_size = sector_size, .count = count };
+
+	// As with CTR, a few sectors aren't worth waking the other threads for
+	if (count * sector_size < 64*1024)
+		xts_batch_job(&batch, 0, 1);
+	else
+		ctr_pool_run(pool, xts_batch_job, &batch);
+	return 0;
+}
+
+int aes_xts_encrypt_sectors(const struct aes_xts_key *xts, struct ctr_pool *pool, uint64_t first_sector,
+		const unsigned char *in, unsigned char *out, size_t sector_size, size_t count) {
+	return xts_batch_run(xts, pool, false, first_sector, in, out, sector_size, count);
+}
+
+int aes_xts_decrypt_sectors(const struct aes_xts_key *xts, struct ctr_pool *pool, uint64_t first_sector,
+		const unsigned char *in, unsigned char *out, size_t sector_size, size_t count) {
+	return xts_batch_run(xts, pool, true, first_sector, in, out, sector_size, count);
+}
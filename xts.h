@@ -0,0 +1,34 @@
+#ifndef _XTS_H
+#define _XTS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "keyschedule.h" /* AES_MAX_EXPANDED_KEY */
+#include "pool.h"
+
+// XTS-AES (IEEE 1619) for sector-addressed storage. Each sector (data unit) is encrypted on its own, with the tweak
+// derived from its sector number, so any sector can be read or rewritten without touching its neighbours.
+struct aes_xts_key {
+	unsigned char data_keys[AES_MAX_EXPANDED_KEY];     // key 1, encryption schedule
+	unsigned char data_dec_keys[AES_MAX_EXPANDED_KEY]; // key 1, decryption schedule
+	unsigned char tweak_keys[AES_MAX_EXPANDED_KEY];    // key 2; the tweak is only ever encrypted
+	int key_len;                                       // of each half: 16 or 32 (XTS-AES-128/256), or 24
+};
+
+// key is key 1 followed by key 2, 2*key_len bytes, as in IEEE 1619. Returns -1 for an invalid key length.
+int aes_xts_init(struct aes_xts_key *xts, const unsigned char *key, int key_len);
+
+// One sector of len bytes (at least 16; need not be a multiple of 16, thanks to ciphertext stealing).
+// in and out may be the same buffer. Return -1 if len is too short.
+int aes_xts_encrypt(const struct aes_xts_key *xts, uint64_t sector, const unsigned char *in, unsigned char *out, size_t len);
+int aes_xts_decrypt(const struct aes_xts_key *xts, uint64_t sector, const unsigned char *in, unsigned char *out, size_t len);
+
+// count consecutive sectors of sector_size bytes, starting at first_sector, spread across the pool's threads
+// (pool may be NULL to do everything in the calling thread).
+int aes_xts_encrypt_sectors(const struct aes_xts_key *xts, struct ctr_pool *pool, uint64_t first_sector,
+		const unsigned char *in, unsigned char *out, size_t sector_size, size_t count);
+int aes_xts_decrypt_sectors(const struct aes_xts_key *xts, struct ctr_pool *pool, uint64_t first_sector,
+		const unsigned char *in, unsigned char *out, size_t sector_size, size_t count);
+
+#endif